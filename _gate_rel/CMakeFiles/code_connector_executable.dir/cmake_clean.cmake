@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/code_connector_executable.dir/code_connector_executable.c.o"
+  "CMakeFiles/code_connector_executable.dir/code_connector_executable.c.o.d"
+  "plugin/code_connector_executable"
+  "plugin/code_connector_executable.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/code_connector_executable.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/code_connector_shared.dir/code_connector_shared.c.o"
+  "CMakeFiles/code_connector_shared.dir/code_connector_shared.c.o.d"
+  "plugin/libcode_connector_shared.pdb"
+  "plugin/libcode_connector_shared.so"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/code_connector_shared.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -4,15 +4,126 @@
 #include <string.h>
 #include <libgen.h>
 
+// Function to complete through the per-user daemon, falling back to in-process completion
+// When no daemon answers, one is started detached so the next request finds warm caches
+// Set CODE_CONNECTOR_NO_DAEMON to always complete in-process
+static char *complete(const char *self, const char *combinedInput, const char *filename, int line, int column,
+                      long changedtick) {
+  if(getenv("CODE_CONNECTOR_NO_DAEMON") == NULL) {
+    cc_request request = {.filename = filename, .line = line, .column = column, .changedtick = changedtick};
+    cc_result reply;
+
+    if(cc_daemon_complete(&request, &reply) == 0) {
+      // Only an answer about the code itself is final; a crash, timeout or the daemon's own
+      // environment (PATH, CODE_CONNECTOR_*) failing is retried here
+      if(reply.status == CC_STATUS_OK || reply.status == CC_STATUS_NO_COMPLETION || reply.status == CC_STATUS_CANCELLED) {
+        return reply.text;
+      }
+    }
+
+    else {
+      cc_daemon_spawn(self);
+    }
+  }
+
+  return processCompletionDataFromString(combinedInput);
+}
+
+// Function to print one progress message per report of an index job, for Vim's job/channel callbacks
+// user points to an int set once anything was printed
+static void print_index_progress(const cc_index_status *status, void *user) {
+  *(int *)user = 1;
+  printf("%s %d %d\n", status->state == CC_INDEX_RUNNING ? "PROGRESS" : status->state == CC_INDEX_DONE ? "DONE" : "FAILED",
+         status->done, status->total);
+  fflush(stdout);
+}
+
 int main(int argc, char *argv[]) {
-  if(argc != 4) {
-    fprintf(stderr, "Usage: %s <filename> <line> <column>\n", argv[0]);
+  // Serve completion requests of all editors of this user over a Unix socket
+  if((argc == 2 || (argc == 4 && strcmp(argv[2], "--idle-timeout") == 0)) && strcmp(argv[1], "--daemon") == 0) {
+    cc_daemon_options options;
+    memset(&options, 0, sizeof(options));
+    options.idle_timeout = argc == 4 ? atoi(argv[3]) : 0;
+
+    if(argc == 4 && options.idle_timeout == 0) {
+      options.idle_timeout = -1;  // --idle-timeout 0: never exit
+    }
+
+    return cc_daemon_run(&options) == 0 ? 0 : 1;
+  }
+
+  // Index the project above a directory, streaming "PROGRESS|DONE|FAILED <done> <total>" lines
+  if((argc == 3 || (argc == 5 && strcmp(argv[3], "-j") == 0)) && strcmp(argv[1], "--index") == 0) {
+    int reported = 0;
+    int failed = cc_index_run(argv[2], argc == 5 ? atoi(argv[4]) : 0, print_index_progress, &reported);
+
+    if(failed && !reported) {
+      printf("FAILED 0 0\n");  // No project, or an index job for it is already running
+    }
+
+    return failed ? 1 : 0;
+  }
+
+  // Speak LSP over stdio; stdout carries only protocol messages, anything else printed goes to stderr
+  if(argc == 2 && strcmp(argv[1], "--lsp") == 0) {
+    int output_fd = dup(STDOUT_FILENO);
+
+    if(output_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      return 1;
+    }
+
+    return cc_lsp_run(STDIN_FILENO, output_fd);
+  }
+
+  // Complete several positions of one file in-process, grouped into as few clang runs as possible
+  if(argc >= 5 && argc % 2 == 1 && strcmp(argv[1], "--batch") == 0) {
+    size_t size = 1;
+
+    for(int i = 2; i < argc; i++) {
+      size += strlen(argv[i]) + 1;
+    }
+
+    char *batchInput = malloc(size);
+
+    if(batchInput == NULL) {
+      fprintf(stderr, "Memory allocation failed.");
+      return 1;
+    }
+
+    batchInput[0] = '\0';
+
+    for(int i = 2; i < argc; i++) {
+      strcat(batchInput, argv[i]);
+      strcat(batchInput, i + 1 < argc ? " " : "");
+    }
+
+    char *result = processBatchCompletionDataFromString(batchInput);
+    free(batchInput);
+
+    if(!result) {
+      fprintf(stderr, "fn processBatchCompletionDataFromString: Failed to process input string.\n");
+      return 1;
+    }
+
+    printf("%s", result);
+    free(result);
+    return 0;
+  }
+
+  // The optional changedtick lets the daemon coalesce repeated requests for the same buffer state
+  if(argc != 4 && argc != 5) {
+    fprintf(stderr, "Usage: %s <filename> <line> <column> [<changedtick>]\n", argv[0]);
+    fprintf(stderr, "       %s --daemon [--idle-timeout <seconds>]\n", argv[0]);
+    fprintf(stderr, "       %s --index <directory> [-j <jobs>]\n", argv[0]);
+    fprintf(stderr, "       %s --lsp\n", argv[0]);
+    fprintf(stderr, "       %s --batch <filename> <line> <column> [<line> <column>...]\n", argv[0]);
     return 1;
   }
 
   const char *filename = argv[1];
   int line = atoi(argv[2]);
   int column = atoi(argv[3]);
+  long changedtick = argc == 5 ? atol(argv[4]) : 0;
   // Combine the input into a single string in the format "/path/to/file.extension line column"
   const int bufferSize = strlen(filename) + 50; // Assuming line and column will not exceed 10 characters each
   char *combinedInput = malloc(bufferSize);
@@ -27,7 +138,8 @@ int main(int argc, char *argv[]) {
   // printf("Input string for the filename: %s\n", combinedInput); // For Testing.
   // Getting the result of the variable argv[1]
   // printf("Input filename: %s\n", argv[1]); // For Testing.
-  char *result = processCompletionDataFromString(combinedInput);
+  const char *self = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe" : argv[0];
+  char *result = complete(self, combinedInput, filename, line, column, changedtick);
 
   if(!result) {
     fprintf(stderr, "fn processCompletionDataFromString: Failed to process input string.\n");
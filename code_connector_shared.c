@@ -19,6 +19,10 @@
     that shaped the final code. This collaborative effort reflects your leadership and my execution.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE  // SCHED_IDLE, sched_setaffinity, dladdr
+#endif
+
 #include "code_connector_shared.h"
 #include <string.h>
 #include <unistd.h>
@@ -30,6 +34,21 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <dlfcn.h>
+#if defined(__linux__)
+  #include <sys/syscall.h>
+#endif
 
 // Add at the top of the file, after includes
 static CodeCompletionCache completion_cache;
@@ -44,7 +63,7 @@ static CodeCompletionCache completion_cache;
   #define OS_MACOS
 #endif
 
-#if !defined(OS_WINDOWS) && (defined(OS_LINUX) || !defined(OS_MACOS))
+#if !defined(OS_WINDOWS) && !defined(_GNU_SOURCE) && (defined(OS_LINUX) || !defined(OS_MACOS))
   #define  _POSIX_C_SOURCE 200809L
   #define  _XOPEN_SOURCE 500L
 #endif
@@ -686,11 +705,44 @@ int create_default_config_files(const char *directory) {
   return return_value;
 }
 
+// Function to check whether path is listed in CODE_CONNECTOR_CEILING_DIRECTORIES (colon-separated),
+// above which project roots are never searched
+static int is_ceiling_directory(const char *path) {
+  const char *ceilings = getenv("CODE_CONNECTOR_CEILING_DIRECTORIES");
+
+  while(ceilings && *ceilings) {
+    size_t length = strcspn(ceilings, ":");
+    char entry[PATH_MAX];
+    char resolved[PATH_MAX];
+
+    if(length > 0 && length < sizeof(entry)) {
+      memcpy(entry, ceilings, length);
+      entry[length] = '\0';
+
+      if(realpath(entry, resolved) && strcmp(resolved, path) == 0) {
+        return 1;
+      }
+    }
+
+    ceilings += length + (ceilings[length] == ':');
+  }
+
+  return 0;
+}
+
+// Function to probe a directory (by descriptor) for the files marking a project root
+static int has_project_files(int dir_fd) {
+  return (faccessat(dir_fd, ".ccls", F_OK, 0) == 0 && faccessat(dir_fd, "compile_flags.txt", F_OK, 0) == 0) ||
+         faccessat(dir_fd, "compile_commands.json", F_OK, 0) == 0 ||
+         faccessat(dir_fd, "build/compile_commands.json", R_OK, 0) == 0;
+}
+
 /*
   Function Description:
     Searches upward through the directory tree from a given path to find a directory containing
-    both `.ccls` and `compile_flags.txt` files, storing the found directory path in found_at.
-    This function is recursive and UNIX-specific, designed to locate project configuration files.
+    both `.ccls` and `compile_flags.txt` files (or a compile_commands.json), storing the found
+    directory path in found_at. This function is UNIX-specific, designed to locate project
+    configuration files.
 
   Parameters:
     - path (const char *): The starting directory to search from (e.g., "/project/src"), not modified.
@@ -702,83 +754,42 @@ int create_default_config_files(const char *directory) {
 
   Detailed Steps:
     1. Validate Inputs:
-       - Checks if path is NULL; if so, logs an error and returns 1.
-       - Checks if found_at is NULL; if so, logs an error and returns 1.
+       - Checks if path or found_at is NULL; if so, logs an error and returns 1.
     2. Resolve Absolute Path:
        - Uses realpath to convert path to an absolute path (e.g., "/home/user/project/src").
-       - Stores it in currentPath; if realpath fails (e.g., path doesn’t exist), logs and returns 1.
-    3. Open Directory:
-       - Opens currentPath with opendir; if it fails (e.g., no permissions), logs and returns 1.
-    4. Scan for Files:
-       - Reads directory entries with readdir, checking each for ".ccls" or "compile_flags.txt".
-       - Sets flags (cclsFound, compileFlagsFound) to 1 when found.
-       - Closes the directory after scanning.
-    5. Check Results:
-       - If both files are found (cclsFound && compileFlagsFound), copies currentPath to found_at and returns 0.
-    6. Handle Root Case:
-       - If currentPath is "/" (root) and files aren’t found, returns 1—no higher to search.
-    7. Recurse Upward:
-       - Copies currentPath with strdup; if it fails, logs and returns 1.
-       - Gets the parent directory with dirname; if it fails, logs, frees copy, and returns 1.
-       - Builds parentPath and recursively calls findFiles with it, returning the result.
-
-  Flow and Logic:
-    - Steps 1-2: Ensure inputs and path are valid before proceeding.
-    - Steps 3-4: Check the current directory for both files.
-    - Step 5: If found, save the path and stop.
-    - Step 6: If at root and not found, give up.
-    - Step 7: If not found and not at root, move up and try again.
-    - Why this order? Validation first avoids crashes; checking current directory before recursion
-      minimizes unnecessary calls; root check stops infinite loops.
-
-  How It Works (For Novices):
-    - Imagine you’re looking for two special maps (.ccls and compile_flags.txt) in a stack of folders.
-      You start in one folder (path, like "/project/src") and need to find a folder with both maps,
-      writing its name in a notebook (found_at).
-    - findFiles is like this search:
-      - Step 1: Make sure you have a folder to check (path) and a notebook (found_at)—if not, stop.
-      - Step 2: Get the full folder name (e.g., "/home/user/project/src") using realpath.
-      - Step 3: Open the folder; if you can’t, stop.
-      - Step 4: Look inside for both maps; mark if you find ".ccls" or "compile_flags.txt".
-      - Step 5: If both are there, write the folder name in the notebook and say “Found it!” (return 0).
-      - Step 6: If you’re at the top folder ("/") and they’re not there, say “No luck” (return 1).
-      - Step 7: If not found, move up to the parent folder (e.g., "/project") and check again.
-    - It’s like climbing up a ladder of folders until you find the maps or hit the top!
-
-  Why It Works (For Novices):
-    - Safety: Checks for bad inputs and errors stop it from crashing.
-    - Persistence: Keeps going up until it finds the maps or runs out of folders.
-    - Clarity: Puts the answer (folder path) right where you asked (found_at).
+       - Opens it as a directory descriptor and notes the file system (st_dev) it lives on.
+    3. Probe for Files:
+       - has_project_files asks faccessat for ".ccls", "compile_flags.txt", "compile_commands.json"
+         and "build/compile_commands.json" relative to the descriptor: four lookups per level, no
+         matter how many entries the directory holds.
+       - If found, copies the current path to found_at and returns 0.
+    4. Stop Conditions:
+       - "/" was reached, the directory is listed in CODE_CONNECTOR_CEILING_DIRECTORIES, or the
+         parent lives on another file system (a mount point was crossed).
+    5. Climb:
+       - Opens ".." relative to the current descriptor, trims the last component off the path and
+         goes back to step 3.
 
   Why It’s Designed This Way (For Maintainers):
     - UNIX Quirk: Reflects ccls’s UNIX expectation that config files are in a parent directory
-      (e.g., /project, not /project/src), as noted in the function’s comment. Recursion handles this.
-    - Robustness: Extensive error checking (NULL, realpath, opendir, strdup, dirname) ensures it
-      fails gracefully on bad inputs or system issues, common in UNIX (per _POSIX_C_SOURCE).
-    - Recursion: Climbing up the tree is elegant for finding a project root, avoiding complex loops,
-      though it risks stack overflow with very deep paths (rare in practice).
-    - Memory Safety: Frees abs_path and currentPathCopy to prevent leaks; assumes found_at is
-      caller-allocated (PATH_MAX size), aligning with C conventions.
-    - Efficiency: Stops as soon as both files are found, minimizing directory scans.
+      (e.g., /project, not /project/src).
+    - Per-level cost: the previous readdir scan read every entry of every directory on the way up,
+      which took hundreds of milliseconds in generated-output directories with 100k+ entries.
+    - Boundaries: project files are never expected above a mount point, and probing there can mean
+      waking slow network or automount file systems.
 
   Maintenance Notes:
-    - Stack Depth: Deep directory trees could overflow the stack—test with extreme cases or consider
-      an iterative version if this becomes an issue.
-    - Logging: Errors are logged to stderr (e.g., "realpath failed"), but consider log_message for
-      consistency with other functions.
-    - Extensibility: To search for more files, add checks in Step 4 and update the condition in Step 5.
-    - Performance: opendir/readdir per level isn’t fast; cache results (via completion_cache) reduce
-      calls, as seen in collect_code_completion_args.
-    - Debugging: Uncommented printf lines (e.g., "Checking directory") are handy—enable them to trace
-      the search path if issues arise.
+    - To search for more files, extend has_project_files.
+    - Errors are logged to stderr (e.g., "realpath failed"), as before.
 */
 
 /**
    Finds the .ccls and compile_flags.txt files in the directory tree starting from the given path (UNIX-specific).
 
-   This function recursively searches upward through the directory hierarchy starting from the specified
-   path until it finds both .ccls and compile_flags.txt in the same directory, or reaches the root (/).
-   If found, the directory path is stored in found_at. If not found by the root, it returns an error.
+   This function searches upward through the directory hierarchy starting from the specified
+   path until it finds both .ccls and compile_flags.txt in the same directory, or a compile_commands.json
+   (in the directory itself or its build/ subdirectory), or reaches the root (/), a ceiling directory or a
+   file system boundary. If found, the directory path is stored in found_at. If not found, it returns an error.
 
    Note: On UNIX, ccls expects these files to be in a parent directory of the source files (e.g., /project
    for source in /project/src), not alongside them. This is a quirk not present in the Windows version.
@@ -788,11 +799,8 @@ int create_default_config_files(const char *directory) {
    @return          0 if the files are found; non-zero otherwise.
 */
 int findFiles(const char *path, char *found_at) {
-  DIR *dir;                            // Directory stream pointer
-  struct dirent *entry;                // Directory entry structure
   char currentPath[PATH_MAX] = {0};    // Buffer for current directory path
-  int cclsFound = 0;                   // Flag for .ccls
-  int compileFlagsFound = 0;           // Flag for compile_flags.txt
+  struct stat st;
 
   // Validate inputs
   if(path == NULL) {
@@ -816,509 +824,2928 @@ int findFiles(const char *path, char *found_at) {
 
   snprintf(currentPath, PATH_MAX, "%s", abs_path);
   free(abs_path);
-  // Debug: Log the current directory being checked
-  // printf("DEBUG: Checking directory: %s\n", currentPath);
-  // Open the current directory
-  dir = opendir(currentPath);
+  int dir_fd = open(currentPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if(dir_fd < 0 || fstat(dir_fd, &st) != 0) {  // Permission issues or not a directory
+    perror("open");
+
+    if(dir_fd >= 0) {
+      close(dir_fd);
+    }
 
-  if(!dir) {  // opendir fails, could be due to permission issues or non-existent directory
-    perror("opendir"); // Print detailed error message
     return 1; // Return error code
   }
 
-  // Scan for .ccls and compile_flags.txt by reading each entry in the directory
-  while((entry = readdir(dir)) != NULL) {
-    if(strcmp(entry->d_name, ".ccls") == 0) {  // Check if the entry is .ccls
-      cclsFound = 1;
+  dev_t device = st.st_dev;
+
+  for(;;) {
+    // Debug: Log the current directory being checked
+    // printf("DEBUG: Checking directory: %s\n", currentPath);
+    if(has_project_files(dir_fd)) {
+      snprintf(found_at, PATH_MAX, "%s", currentPath);
+      close(dir_fd);
+      return 0; // Success: files found
     }
 
-    else if(strcmp(entry->d_name, "compile_flags.txt") == 0) {    // Check if the entry is compile_flags.txt
-      compileFlagsFound = 1;
+    if(strcmp(currentPath, "/") == 0 || is_ceiling_directory(currentPath)) {
+      break;
+    }
+
+    // Move up to the parent directory unless that crosses into another file system
+    int parent_fd = openat(dir_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(dir_fd);
+    dir_fd = parent_fd;
+
+    if(dir_fd < 0 || fstat(dir_fd, &st) != 0 || st.st_dev != device) {
+      break;
     }
+
+    char *slash = strrchr(currentPath, '/');
+    slash[slash == currentPath] = '\0';
   }
 
-  // Close the directory stream after reading all entries
-  closedir(dir);
+  if(dir_fd >= 0) {
+    close(dir_fd);
+  }
+
+  // printf("DEBUG: Reached the top, files not found\n");
+  return 1;  // Return error code
+}
+
+/*
+  Function Description:
+    Tokenizer for the ccls directive format used by `.ccls` and `compile_flags.txt`. Both files are
+    mapped into memory with mmap and scanned in a single pass; every argument is normalised into one
+    joined token (e.g. "-isystem /usr/include" becomes "-isystem/usr/include"), relative paths are
+    resolved against the project root, and the token is routed into the flag set of every source
+    kind its `%c`/`%cpp`/`%h`/`%hpp` prefix selects. Lines without a prefix apply to every kind.
+
+  Format Recap (ccls):
+    - The first non-empty line of `.ccls` names the compiler driver (usually "clang") and is skipped.
+    - `%c`, `%cpp`, `%h`, `%hpp` prefix an argument that is only used for that language. `%c` also
+      applies to `*.h`, `%cpp` also applies to `*.hpp`, matching how ccls treats header files.
+    - `%objective-c`, `%objective-cpp` and `%cu` are recognised and their arguments are dropped.
+    - `%compile_commands.json` is recognised and otherwise ignored here.
+    - Lines starting with `#` are comments.
+
+  What Is Kept:
+    - Only flags that change how clang parses the file survive: -I, -isystem, -iquote, -idirafter,
+      -isysroot, --sysroot, -include, -imacros, -D, -U, -x, -std=, -stdlib=, --target/-target, -f*,
+      -m*, -nostdinc*, -ansi and -pthread. Warnings, optimisation, debug and output flags are dropped,
+      which keeps the clang command line minimal.
+
+  Maintenance Notes:
+    - Missing or empty files yield empty flag sets instead of terminating the process; this is
+      important because the library is loaded into Vim through libcallnr.
+    - Options that take a separate value may have the value on the next line (one argument per
+      line is the canonical ccls style); the pending option keeps the prefix of its own line.
+*/
 
-  // If both files are found, store the path and return success
-  if(cclsFound && compileFlagsFound) {
-    snprintf(found_at, PATH_MAX, "%s", currentPath);
-    // Debug: Log where files were found
-    // printf("DEBUG: Files found at: %s\n", found_at);
-    return 0; // Success: files found
+#define CC_LANG_MASK_C   (1u << CC_SOURCE_C)
+#define CC_LANG_MASK_CPP (1u << CC_SOURCE_CPP)
+#define CC_LANG_MASK_H   (1u << CC_SOURCE_C_HEADER)
+#define CC_LANG_MASK_HPP (1u << CC_SOURCE_CPP_HEADER)
+#define CC_LANG_MASK_ALL (CC_LANG_MASK_C | CC_LANG_MASK_CPP | CC_LANG_MASK_H | CC_LANG_MASK_HPP)
+
+// Options that take a value, either joined ("-Ifoo") or as the following argument ("-I foo")
+typedef struct {
+  const char *name;
+  int is_path;        // 1 if the value is a path that must be resolved against the project root
+} CCValueOption;
+
+// Longest names first, so "-isysroot" is not mistaken for "-isystem" or "-I"
+static const CCValueOption value_options[] = {
+  {"-idirafter", 1},
+  {"-isysroot", 1},
+  {"-isystem", 1},
+  {"--sysroot", 1},
+  {"-imacros", 1},
+  {"-include", 1},
+  {"-iquote", 1},
+  {"-target", 0},
+  {"-I", 1},
+  {"-D", 0},
+  {"-U", 0},
+  {"-x", 0},
+};
+
+// Tokenizer state carried across lines while scanning one file
+typedef struct {
+  const char *project_dir;
+  CCProjectFlags *project;
+  const CCValueOption *pending;  // Option waiting for its value on a later token
+  unsigned int pending_mask;
+  int driver_seen;               // .ccls only: the compiler driver line was consumed
+  int is_ccls;
+  int failed;
+} CCTokenizer;
+
+// Function to classify a source file by extension, deciding which flag set applies
+CCSourceKind classify_source_file(const char *filename) {
+  const char *dot = filename ? strrchr(filename, '.') : NULL;
+
+  if(!dot || strchr(dot, '/')) {
+    return CC_SOURCE_C;
   }
 
-  // If at root and files not found, fail
-  if(strcmp(currentPath, "/") == 0) {
-    // printf("DEBUG: Reached root, files not found\n");
-    return 1;  // Return error code
+  dot++;
+
+  if(strcmp(dot, "h") == 0) {
+    return CC_SOURCE_C_HEADER;
   }
 
-  // Move up to parent directory and recurse
-  char *currentPathCopy = strdup(currentPath);
+  if(strcmp(dot, "hpp") == 0 || strcmp(dot, "hh") == 0 || strcmp(dot, "hxx") == 0 ||
+      strcmp(dot, "H") == 0 || strcmp(dot, "h++") == 0) {
+    return CC_SOURCE_CPP_HEADER;
+  }
 
-  if(!currentPathCopy) {
-    perror("strdup");
-    return 1; // Return error code: reached root without finding files
+  if(strcmp(dot, "cpp") == 0 || strcmp(dot, "cc") == 0 || strcmp(dot, "cxx") == 0 ||
+      strcmp(dot, "C") == 0 || strcmp(dot, "c++") == 0 || strcmp(dot, "ino") == 0 ||
+      strcmp(dot, "pde") == 0) {
+    return CC_SOURCE_CPP;
   }
 
-  char *parentDir = dirname(currentPathCopy);
+  return CC_SOURCE_C;
+}
+
+// Function to record the identity of a file. Returns 0 on success, 1 if the file does not exist
+int get_file_fingerprint(const char *path, CCFileFingerprint *fingerprint) {
+  struct stat st;
+  memset(fingerprint, 0, sizeof(*fingerprint));
 
-  if(!parentDir) {
-    perror("dirname");
-    free(currentPathCopy);
+  if(stat(path, &st) != 0) {
     return 1;
   }
 
-  char parentPath[PATH_MAX] = {0};
-  snprintf(parentPath, PATH_MAX, "%s", parentDir);
-  free(currentPathCopy);
-  // Recursively search the parent
-  return findFiles(parentPath, found_at);
+  fingerprint->device = (unsigned long long)st.st_dev;
+  fingerprint->inode = (unsigned long long)st.st_ino;
+  fingerprint->size = (long long)st.st_size;
+  fingerprint->mtime_sec = (long long)st.st_mtim.tv_sec;
+  fingerprint->mtime_nsec = st.st_mtim.tv_nsec;
+  fingerprint->exists = 1;
+  return 0;
 }
 
-/*
-  Function Description:
-    Reads lines from two files (.ccls and compile_flags.txt) and stores specific lines containing
-    include flags (-I or -isystem) in a provided array. This function populates the lines array with
-    relevant compiler flags and updates the count of stored lines.
+// Function to compare two fingerprints. Returns 1 if they describe the same unmodified file
+int fingerprints_equal(const CCFileFingerprint *a, const CCFileFingerprint *b) {
+  return a->exists == b->exists && a->device == b->device && a->inode == b->inode &&
+         a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
 
-  Parameters:
-    - file1 (const char *): Path to the first file (typically .ccls), not modified.
-    - file2 (const char *): Path to the second file (typically compile_flags.txt), not modified.
-    - lines (char **): An array of string pointers where matching lines are stored. Caller must
-      ensure it’s at least MAX_LINES in size and free the strings later.
-    - count (int *): Pointer to an integer tracking the number of lines stored; updated by the function.
+// Function to append an argument to a flag list unless it is already present (first occurrence wins)
+// Returns 0 on success, 1 on allocation failure
+int flag_list_append(CCFlagList *list, const char *arg) {
+  for(int i = 0; i < list->count; i++) {
+    if(strcmp(list->args[i], arg) == 0) {
+      return 0;
+    }
+  }
 
-  Return Value: None
-    - Modifies lines and *count in place; exits program on file open failure.
+  if(list->count == list->capacity) {
+    int new_capacity = list->capacity ? list->capacity * 2 : 16;
+    char **grown = (char **)realloc(list->args, (size_t)new_capacity * sizeof(char *));
 
-  Detailed Steps:
-    1. Open Files:
-       - Opens file1 and file2 in read mode using fopen.
-       - If either fails (e.g., file missing), prints an error and exits with EXIT_FAILURE.
-    2. Read file1 Lines:
-       - Uses fgets to read each line into a buffer (line, size MAX_LINE_LENGTH).
-       - Skips lines with "-Iinc" (using strstr).
-       - For lines with "-I" or "-isystem", removes newline (strcspn) and duplicates (strdup) into lines.
-       - Increments *count if space remains (less than MAX_LINES - 1).
-    3. Read file2 Lines:
-       - Repeats the same process for file2: reads lines, skips "-Iinc", stores "-I" or "-isystem" lines.
-    4. Clean Up:
-       - Closes both files with fclose.
+    if(!grown) {
+      return 1;
+    }
 
-  Flow and Logic:
-    - Step 1: Open both files; fail fast if either can’t be read.
-    - Step 2: Process file1, filtering and storing relevant lines.
-    - Step 3: Process file2 similarly, appending to the same array.
-    - Step 4: Close files to free resources.
-    - Why this order? Open first ensures access; sequential reading keeps logic simple; cleanup avoids leaks.
+    list->args = grown;
+    list->capacity = new_capacity;
+  }
 
-  How It Works (For Novices):
-    - Imagine two notebooks (.ccls and compile_flags.txt) with instructions for a tool (clang).
-      You want to copy only the lines about where to find parts (like "-I/project/include") into a
-      list (lines), counting how many you find (count).
-    - read_files is like this copying job:
-      - Step 1: Open both notebooks. If you can’t, yell “Error!” and quit.
-      - Step 2: Read file1 line-by-line. Skip boring lines ("-Iinc"), but if you see "-I" or "-isystem",
-        trim the end (no newline) and copy it to your list, adding to your tally (*count).
-      - Step 3: Do the same for file2, adding more lines to the same list.
-      - Step 4: Close the notebooks when done.
-    - It’s like making a shopping list from two recipe books, picking only the “where to buy” parts!
+  list->args[list->count] = strdup(arg);
 
-  Why It Works (For Novices):
-    - Focus: Only grabs useful lines (-I, -isystem), ignoring junk like "-Iinc".
-    - Safety: Stops at MAX_LINES - 1 so your list doesn’t overflow.
-    - Simplicity: Reads one file, then the next, keeping it easy to follow.
+  if(!list->args[list->count]) {
+    return 1;
+  }
 
-  Why It’s Designed This Way (For Maintainers):
-    - Purpose: Extracts include flags for clang (e.g., in collect_code_completion_args), critical for
-      UNIX builds (per _POSIX_C_SOURCE) where project configs drive compilation.
-    - Hard Exit: Exiting on fopen failure assumes these files are essential—without them, the program
-      can’t proceed. This is aggressive but aligns with a setup where configs are expected (e.g., via findFiles).
-    - Filtering: Skipping "-Iinc" is a specific choice—likely a known irrelevant flag in your context.
-      It’s hardcoded, suggesting a narrow use case.
-    - Memory: Uses strdup to store lines, meaning the caller (e.g., store_lines) must free them later.
-      This delegates memory management upstream, typical in C.
-    - Bounds: Caps at MAX_LINES - 1 (leaving space for a NULL terminator or safety), preventing buffer
-      overflows but limiting total flags.
+  list->count++;
+  return 0;
+}
 
-  Maintenance Notes:
-    - Error Handling: exit(EXIT_FAILURE) is harsh—consider returning an error code (e.g., -1) and letting
-      callers handle it, or logging via log_message for debugging.
-    - Flexibility: Hardcoded "-Iinc" skip and "-I"/"-isystem" filter might miss other flags (e.g., "-D").
-      Add a parameter for custom filters if needed.
-    - Memory Leaks: If strdup fails (rare), it silently skips lines—no crash, but incomplete data.
-      Consider logging or checking allocation success.
-    - Buffer Size: MAX_LINE_LENGTH (assumed from code_connector_shared.h) must fit typical flags—test
-      with long paths to avoid truncation.
-    - Debugging: Add printf or log_message to trace which lines are stored, especially if count grows
-      unexpectedly.
-*/
+// Function to release the arguments held by a flag list
+void flag_list_free(CCFlagList *list) {
+  for(int i = 0; i < list->count; i++) {
+    free(list->args[i]);
+  }
 
-// Function to read the contents of two files and store them in an array
-// Parameters: file1, file2, lines, count
-// Meaning of parameters:
-//   file1: the first file to read, .ccls
-//   file2: the second file to read, compile_flags.txt
-//   lines: the array to store the lines in
-//   count: the number of lines read
-// Return value: none
-void read_files(const char *file1, const char *file2, char **lines, int *count) {
-  FILE *f1 = fopen(file1, "r");
-  FILE *f2 = fopen(file2, "r");
+  free(list->args);
+  list->args = NULL;
+  list->count = 0;
+  list->capacity = 0;
+}
 
-  if(f1 == NULL || f2 == NULL) {
-    printf("Error opening files.\n");
-    exit(EXIT_FAILURE);
+// Function to release every flag set of a project and mark it invalid
+void free_project_flags(CCProjectFlags *project) {
+  for(int kind = 0; kind < CC_SOURCE_KIND_COUNT; kind++) {
+    flag_list_free(&project->flags[kind]);
   }
 
-  char line[MAX_LINE_LENGTH];
+  project->is_valid = 0;
+}
 
-  while(fgets(line, sizeof(line), f1) != NULL) {
-    // Skip lines that contain "-Iinc"
-    if(strstr(line, "-Iinc")) {
-      continue;
+// Function to map a language directive (without the leading '%') to the source kinds it selects
+static unsigned int directive_mask(const char *name, size_t len) {
+  if(len == 1 && name[0] == 'c') {
+    return CC_LANG_MASK_C | CC_LANG_MASK_H;
+  }
+
+  if(len == 3 && strncmp(name, "cpp", 3) == 0) {
+    return CC_LANG_MASK_CPP | CC_LANG_MASK_HPP;
+  }
+
+  if(len == 1 && name[0] == 'h') {
+    return CC_LANG_MASK_H;
+  }
+
+  if(len == 3 && strncmp(name, "hpp", 3) == 0) {
+    return CC_LANG_MASK_HPP;
+  }
+
+  // %objective-c, %objective-cpp, %cu and %compile_commands.json select none of our kinds
+  return 0;
+}
+
+// Function to decide whether a flag without a value is relevant for code completion
+static int is_completion_flag(const char *arg) {
+  return strncmp(arg, "-std=", 5) == 0 || strncmp(arg, "-stdlib=", 8) == 0 ||
+         strncmp(arg, "--target=", 9) == 0 || strncmp(arg, "--sysroot=", 10) == 0 ||
+         strncmp(arg, "-nostdinc", 9) == 0 || strcmp(arg, "-ansi") == 0 ||
+         strcmp(arg, "-pthread") == 0 ||
+         (arg[0] == '-' && arg[1] == 'f' && arg[2] != '\0' && strcmp(arg, "-fsyntax-only") != 0) ||
+         (arg[0] == '-' && arg[1] == 'm' && arg[2] != '\0');
+}
+
+// Function to add a normalised argument to every flag set selected by mask
+static void tokenizer_emit(CCTokenizer *tok, const char *arg, unsigned int mask) {
+  for(int kind = 0; kind < CC_SOURCE_KIND_COUNT; kind++) {
+    if((mask & (1u << kind)) && flag_list_append(&tok->project->flags[kind], arg) != 0) {
+      tok->failed = 1;
     }
+  }
+}
 
-    if(strstr(line, "-isystem") || strstr(line, "-I")) {
-      if(*count < MAX_LINES - 1) {
-        // Strip newline character
-        line[strcspn(line, "\n")] = '\0';
-        lines[*count] = strdup(line);
-        (*count)++;
-      }
+// Function to join an option with its value, resolving relative paths against the project root
+static void tokenizer_emit_option(CCTokenizer *tok, const CCValueOption *option, const char *value,
+                                  unsigned int mask) {
+  char resolved[PATH_MAX];
+  char joined[PATH_MAX + 32];
+
+  if(value[0] == '\0') {
+    return;
+  }
+
+  if(option->is_path && value[0] != '/' && tok->project_dir) {
+    char candidate[PATH_MAX];
+    snprintf(candidate, sizeof(candidate), "%s/%s", tok->project_dir, value);
+
+    if(realpath(candidate, resolved) != NULL) {
+      value = resolved;
+    }
+
+    // -include/-imacros may also name a header found through the include path; keep those as written
+    else if(strcmp(option->name, "-include") != 0 && strcmp(option->name, "-imacros") != 0) {
+      snprintf(resolved, sizeof(resolved), "%s", candidate);
+      value = resolved;
     }
   }
 
-  while(fgets(line, sizeof(line), f2) != NULL) {
-    // Skip lines that contain "-Iinc"
-    if(strstr(line, "-Iinc")) {
+  if(strcmp(option->name, "-target") == 0) {
+    snprintf(joined, sizeof(joined), "--target=%s", value);
+  }
+
+  else if(strcmp(option->name, "--sysroot") == 0) {
+    snprintf(joined, sizeof(joined), "--sysroot=%s", value);
+  }
+
+  else {
+    snprintf(joined, sizeof(joined), "%s%s", option->name, value);
+  }
+
+  tokenizer_emit(tok, joined, mask);
+}
+
+// Function to process one argument token of a config line
+static void tokenizer_accept(CCTokenizer *tok, const char *arg, unsigned int mask) {
+  if(tok->pending) {
+    const CCValueOption *option = tok->pending;
+    tok->pending = NULL;
+    tokenizer_emit_option(tok, option, arg, tok->pending_mask);
+    return;
+  }
+
+  if(mask == 0) {
+    return;  // Argument restricted to a language we never complete (e.g. %cu)
+  }
+
+  for(size_t i = 0; i < sizeof(value_options) / sizeof(value_options[0]); i++) {
+    const CCValueOption *option = &value_options[i];
+    size_t name_len = strlen(option->name);
+
+    if(strncmp(arg, option->name, name_len) != 0) {
       continue;
     }
 
-    if(strstr(line, "-isystem") || strstr(line, "-I")) {
-      if(*count < MAX_LINES - 1) {
-        // Strip newline character
-        line[strcspn(line, "\n")] = '\0';
-        lines[*count] = strdup(line);
-        (*count)++;
-      }
+    if(arg[name_len] == '\0') {
+      tok->pending = option;
+      tok->pending_mask = mask;
+      return;
+    }
+
+    // "--sysroot=/x" and "--target=x" are plain flags; "-target" has no joined form
+    if(strcmp(option->name, "--sysroot") == 0 || strcmp(option->name, "-target") == 0) {
+      break;
     }
+
+    tokenizer_emit_option(tok, option, arg + name_len, mask);
+    return;
   }
 
-  fclose(f1);
-  fclose(f2);
+  if(is_completion_flag(arg)) {
+    tokenizer_emit(tok, arg, mask);
+  }
 }
 
-/*
-  Function Description:
-    Removes duplicate strings from an array of strings (lines) and updates the count of unique entries.
-    This function ensures the list of include paths (e.g., "-I/project/include") has no repeats,
-    reducing redundancy and potential confusion for tools like clang.
+// Function to scan a mapped config file in a single pass
+static void tokenize_config_buffer(CCTokenizer *tok, const char *data, size_t size) {
+  char token[PATH_MAX];
+  size_t pos = 0;
 
-  Parameters:
-    - lines (char **): An array of string pointers containing the lines to process. Strings are assumed
-      to be dynamically allocated (e.g., via strdup) and will be freed if duplicated.
-    - count (int *): Pointer to an integer representing the current number of lines; updated to reflect
-      the number of unique lines after duplicates are removed.
+  while(pos < size) {
+    size_t line_end = pos;
 
-  Return Value: None
-    - Modifies the lines array and *count in place to remove duplicates.
+    while(line_end < size && data[line_end] != '\n') {
+      line_end++;
+    }
 
-  Detailed Steps:
-    1. Iterate Through Lines:
-       - Uses two nested loops: outer loop (i) picks a line, inner loop (j) checks subsequent lines.
-       - Compares each line (lines[i]) with later lines (lines[j]) using strcmp.
-    2. Detect and Remove Duplicates:
-       - If a match is found (strcmp returns 0), frees the duplicate (lines[j]).
-       - Shifts all subsequent lines left to fill the gap (k loop moves lines[k+1] to lines[k]).
-       - Decrements *count to reflect the removal.
-       - Adjusts j to recheck the new line at j after shifting.
-    3. Continue Until Done:
-       - Outer loop continues until all lines are checked; inner loop adjusts dynamically as count shrinks.
+    unsigned int mask = CC_LANG_MASK_ALL;
+    int has_directive = 0;
+    int first_token = 1;
+    size_t cursor = pos;
 
-  Flow and Logic:
-    - Step 1: Start at the first line and look ahead for duplicates.
-    - Step 2: When a duplicate is found, erase it, slide everything over, and update the tally.
-    - Step 3: Keep going until no more lines to check.
-    - Why this order? Left-to-right ensures earlier lines stay, later duplicates go; shifting maintains
-      array continuity.
+    while(cursor < line_end) {
+      while(cursor < line_end && isspace((unsigned char)data[cursor])) {
+        cursor++;
+      }
 
-  How It Works (For Novices):
-    - Imagine you have a list of notes (lines) like ["-I/project", "-I/usr", "-I/project"], and you
-      want only unique notes, counting how many are left (count).
-    - remove_duplicates is like cleaning up this list:
-      - Step 1: Pick the first note ("-I/project") and check the rest. The third note matches!
-      - Step 2: Cross out the third note (free it), slide "-I/usr" to the third spot, shorten the list
-        (decrease count), and check again from where you left off.
-      - Step 3: Move to the next note ("-I/usr"), check ahead (no matches), and keep going until done.
-    - It’s like tidying a messy list, tossing repeats, and keeping it neat and short!
+      if(cursor >= line_end) {
+        break;
+      }
 
-  Why It Works (For Novices):
-    - Fairness: Keeps the first copy of each note, removing later ones—simple rule.
-    - Tidiness: Shifts notes so there are no gaps, keeping the list ready to use.
-    - Accuracy: Updates count so you know exactly how many unique notes you have.
+      if(first_token && data[cursor] == '#') {
+        break;  // Comment line
+      }
 
-  Why It’s Designed This Way (For Maintainers):
-    - Efficiency Goal: Reduces redundant flags for clang (e.g., in collect_code_completion_args),
-      ensuring clean input on UNIX systems (per _POSIX_C_SOURCE) where duplicates could waste time.
-    - In-Place Operation: Modifies lines directly, avoiding new allocations, which is memory-efficient
-      but assumes the caller (e.g., store_lines) is okay with this.
-    - Memory Safety: Frees duplicates immediately, preventing leaks since lines are strdup’d (e.g.,
-      from read_files). Assumes caller frees remaining strings later.
-    - Simple Algorithm: Uses a basic O(n²) comparison with shifting—effective for small lists (typical
-      for include paths) but not optimized for huge arrays.
-    - Stability: Preserves order of first occurrences, which might matter for flag precedence in clang.
+      // Collect one token, honouring simple single/double quoting
+      size_t len = 0;
+      char quote = '\0';
 
-  Maintenance Notes:
-    - Performance: For large *count (e.g., >100), O(n²) comparisons slow down—consider a hash table
-      or sorting first (like qsort in store_lines) if this becomes a bottleneck.
-    - Edge Cases: If *count is 0 or 1, it does nothing (safe); test with duplicates at start/end to
-      ensure shifting works.
-    - Memory: Assumes lines[i] are valid pointers—NULLs could crash strcmp. Add a NULL check if
-      read_files might store them.
-    - Extensibility: To ignore case or whitespace in duplicates, tweak strcmp—current exact match
-      is strict but fast.
-    - Debugging: Log (via log_message) when duplicates are found to trace unexpected repeats in configs.
-*/
+      while(cursor < line_end && (quote || !isspace((unsigned char)data[cursor]))) {
+        char ch = data[cursor++];
 
-// Function to remove duplicate lines
-void remove_duplicates(char **lines, int *count) {
-  for(int i = 0; i < *count; i++) {
-    for(int j = i + 1; j < *count; j++) {
-      if(strcmp(lines[i], lines[j]) == 0) {
-        free(lines[j]);
+        if(quote && ch == quote) {
+          quote = '\0';
+          continue;
+        }
 
-        for(int k = j; k < *count - 1; k++) {
-          lines[k] = lines[k + 1];
+        if(!quote && (ch == '"' || ch == '\'')) {
+          quote = ch;
+          continue;
         }
 
-        (*count)--;
-        j--;
+        if(ch != '\r' && len < sizeof(token) - 1) {
+          token[len++] = ch;
+        }
+      }
+
+      token[len] = '\0';
+
+      if(len == 0) {
+        continue;
+      }
+
+      if(tok->is_ccls && !tok->driver_seen) {
+        tok->driver_seen = 1;
+
+        if(token[0] != '-' && token[0] != '%') {
+          break;  // Compiler driver line, e.g. "clang"
+        }
+      }
+
+      if(token[0] == '%' && !tok->pending) {
+        unsigned int selected = directive_mask(token + 1, len - 1);
+        mask = has_directive ? (mask | selected) : selected;
+        has_directive = 1;
+        first_token = 0;
+        continue;
       }
+
+      tokenizer_accept(tok, token, mask);
+      first_token = 0;
     }
+
+    pos = line_end + 1;
+  }
+}
+
+// Function to map a config file and feed it to the tokenizer. A missing or empty file is not an error
+static int tokenize_config_file(CCTokenizer *tok, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return 0;
+  }
+
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(data == MAP_FAILED) {
+    log_message("fn tokenize_config_file: mmap failed\n");
+    return 1;
   }
+
+  tokenize_config_buffer(tok, (const char *)data, (size_t)st.st_size);
+  munmap(data, (size_t)st.st_size);
+  tok->pending = NULL;  // A dangling option at end of file has no value
+  return tok->failed;
 }
 
 /*
   Function Description:
-    Reads include flags from two files (.ccls and compile_flags.txt), removes duplicates, sorts them,
-    and stores the results in two arrays: one for original order (lines) and one sorted (sorted_lines).
-    This function prepares a clean, ordered list of compiler flags for later use (e.g., by clang).
+    Parses `.ccls` and `compile_flags.txt` of a project root into per-source-kind flag sets.
+    compile_flags.txt is read first, then .ccls, so project-wide include paths keep their order.
 
   Parameters:
-    - file1 (const char *): Path to the first file (typically .ccls), not modified.
-    - file2 (const char *): Path to the second file (typically compile_flags.txt), not modified.
-    - lines (char **): Array of string pointers to store the unique lines in original order.
-      Caller must ensure it’s at least MAX_LINES and free the strings later.
-    - sorted_lines (char **): Array to store the same lines, but sorted alphabetically.
-      Same size and ownership rules as lines.
-    - count (int *): Pointer to an integer tracking the number of lines; updated with the final count.
-
-  Return Value: None
-    - Modifies lines, sorted_lines, and *count in place.
+    - project_dir (const char *): Canonical project root holding the two config files.
+    - project (CCProjectFlags *): Output; any previous content is released first.
 
-  Detailed Steps:
-    1. Read and Store Lines:
-       - Calls read_files to extract "-I" and "-isystem" lines from file1 and file2 into lines.
-       - Updates *count with the initial number of lines found.
-    2. Remove Duplicates:
-       - Calls remove_duplicates on lines, reducing *count to reflect only unique entries.
-    3. Copy to Sorted Array:
-       - Loops through lines, copying each pointer to sorted_lines (up to *count).
-    4. Sort the Lines:
-       - If *count > 0, uses qsort with compare_strings to sort sorted_lines alphabetically.
+  Return Value:
+    - int: 0 on success (missing files count as empty), 1 on mmap or allocation failure.
+*/
+int parse_project_config(const char *project_dir, CCProjectFlags *project) {
+  char ccls_path[PATH_MAX + 16];
+  char compile_flags_path[PATH_MAX + 32];
+  CCTokenizer tok;
+  free_project_flags(project);
+  snprintf(project->project_dir, PATH_MAX, "%s", project_dir);
+  snprintf(ccls_path, sizeof(ccls_path), "%s/.ccls", project_dir);
+  snprintf(compile_flags_path, sizeof(compile_flags_path), "%s/compile_flags.txt", project_dir);
+  // Fingerprint before reading, so an edit made while parsing triggers another parse next time
+  get_file_fingerprint(ccls_path, &project->ccls_fingerprint);
+  get_file_fingerprint(compile_flags_path, &project->compile_flags_fingerprint);
+  memset(&tok, 0, sizeof(tok));
+  tok.project_dir = project_dir;
+  tok.project = project;
+
+  if(tokenize_config_file(&tok, compile_flags_path) != 0) {
+    free_project_flags(project);
+    return 1;
+  }
 
-  Flow and Logic:
-    - Step 1: Gather all relevant lines from both files into lines.
-    - Step 2: Clean up by removing duplicates, keeping lines compact.
-    - Step 3: Duplicate the list into sorted_lines for sorting.
-    - Step 4: Sort sorted_lines if there’s anything to sort.
-    - Why this order? Read first to get raw data; deduplicate for efficiency; copy then sort to
-      preserve original order in lines while providing a sorted version.
+  tok.is_ccls = 1;
 
-  How It Works (For Novices):
-    - Imagine you’re collecting directions from two guidebooks (.ccls and compile_flags.txt) about
-      where to find tools (like "-I/project/include"), and you want two lists: one as-is (lines) and
-      one alphabetized (sorted_lines), counting how many (count).
-    - store_lines is like this organizing task:
-      - Step 1: Flip through both books with read_files, jotting down directions (e.g., "-I/usr",
-        "-I/project") in your first notebook (lines), counting them (*count).
-      - Step 2: Cross out repeats with remove_duplicates (e.g., two "-I/usr" become one), updating
-        your tally.
-      - Step 3: Copy the cleaned list into a second notebook (sorted_lines).
-      - Step 4: If there’s anything in the second notebook, sort it A-to-Z (qsort) so it’s easy to read.
-    - It’s like making two handy lists from messy notes—one raw, one neat and sorted!
+  if(tokenize_config_file(&tok, ccls_path) != 0) {
+    free_project_flags(project);
+    return 1;
+  }
 
-  Why It Works (For Novices):
-    - Completeness: Grabs all the directions you need from both books.
-    - Cleanliness: No repeats cluttering things up.
-    - Order: Gives you a sorted version for quick lookup, keeping the original too.
+  project->is_valid = 1;
+  return 0;
+}
 
-  Why It’s Designed This Way (For Maintainers):
-    - Dual Output: Provides both original (lines) and sorted (sorted_lines) lists, offering flexibility—
-      original order might matter for clang flag precedence, while sorted aids debugging or display.
-    - Integration: Builds on read_files and remove_duplicates, reusing their logic for modularity,
-      key for UNIX config processing (per _POSIX_C_SOURCE).
-    - Efficiency: Removes duplicates before sorting, reducing qsort’s work (O(n log n) vs. larger n).
-      Assumes small *count (typical for include paths), so O(n²) in remove_duplicates is fine.
-    - Memory: lines holds strdup’d strings from read_files; sorted_lines shares pointers, avoiding
-      extra allocations but tying their lifetimes together—caller must free lines[i].
-    - Sorting: qsort with compare_strings (strcmp) is standard and fast for small arrays, ensuring
-      alphabetical order for consistency.
+/*
+  Function Description:
+    Returns the cached flag sets for a project root, reparsing the config files only when their
+    fingerprints (device, inode, size, mtime) differ from the ones recorded at the last parse.
+    Up to MAX_CACHED_PROJECTS projects are kept; the least recently used one is evicted.
+
+  Parameters:
+    - cache (CCProjectFlags *): MAX_CACHED_PROJECTS slots owned by a cc_context.
+    - clock (unsigned long *): LRU clock of that cache.
+    - project_dir (const char *): Project root as found by findFiles.
+
+  Return Value:
+    - const CCProjectFlags *: Cache-owned flag sets (do not free), or NULL on failure.
 
   Maintenance Notes:
-    - Memory Ownership: sorted_lines points to lines’ strings—freeing lines[i] affects both. Document
-      this to avoid double-free or dangling pointers in callers (e.g., collect_code_completion_args).
-    - Edge Cases: If *count = 0, qsort skips safely; test with duplicate-heavy inputs to ensure
-      remove_duplicates scales.
-    - Extensibility: To filter more flag types (e.g., "-D"), adjust read_files and propagate here.
-      Add a sort option (e.g., reverse) by tweaking qsort comparator if needed.
-    - Error Handling: Relies on read_files exiting on failure—consider propagating errors (e.g., return
-      int) for more control in callers.
-    - Debugging: Log (via log_message) the final *count or sample lines to verify deduplication and sorting.
+    - Not locked here; callers hold the owning context's lock while using the result.
 */
+static const CCProjectFlags *lookup_project_flags(CCProjectFlags *cache, unsigned long *clock, const char *project_dir) {
+  char canonical[PATH_MAX];
+  char path[PATH_MAX + 32];
+  CCFileFingerprint ccls_now;
+  CCFileFingerprint flags_now;
+  CCProjectFlags *slot = NULL;
+
+  if(!project_dir || realpath(project_dir, canonical) == NULL) {
+    return NULL;
+  }
 
-// Function to store lines in the array
-// Parameters:
-//   file1: path to the first file, .ccls file
-//   file2: path to the second file, compile_flags.txt file
-//   lines: array to store the lines
-//   sorted_lines: array to store the sorted lines
-//   count: pointer to the number of lines
-void store_lines(const char *file1, const char *file2, char **lines, char **sorted_lines, int *count) {
-  // Read files and store lines in the array
-  read_files(file1, file2, lines, count);
-  remove_duplicates(lines, count);
+  snprintf(path, sizeof(path), "%s/.ccls", canonical);
+  get_file_fingerprint(path, &ccls_now);
+  snprintf(path, sizeof(path), "%s/compile_flags.txt", canonical);
+  get_file_fingerprint(path, &flags_now);
 
-  // Copy the lines to sorted_lines
-  for(int i = 0; i < *count; i++) {
-    sorted_lines[i] = lines[i];
+  for(int i = 0; i < MAX_CACHED_PROJECTS; i++) {
+    CCProjectFlags *entry = &cache[i];
+
+    if(entry->is_valid && strcmp(entry->project_dir, canonical) == 0) {
+      slot = entry;
+      break;
+    }
   }
 
-  // Sort the lines if count is valid
-  if(*count > 0) {
-    qsort(sorted_lines, (size_t)*count, sizeof(char *), compare_strings);
+  if(slot && fingerprints_equal(&slot->ccls_fingerprint, &ccls_now) &&
+      fingerprints_equal(&slot->compile_flags_fingerprint, &flags_now)) {
+    slot->last_used = ++*clock;
+    return slot;
+  }
+
+  if(!slot) {
+    slot = &cache[0];
+
+    for(int i = 0; i < MAX_CACHED_PROJECTS; i++) {
+      if(!cache[i].is_valid) {
+        slot = &cache[i];
+        break;
+      }
+
+      if(cache[i].last_used < slot->last_used) {
+        slot = &cache[i];
+      }
+    }
+  }
+
+  unsigned long generation = slot->generation;
+
+  if(parse_project_config(canonical, slot) != 0) {
+    log_message("fn lookup_project_flags: Failed to parse .ccls/compile_flags.txt\n");
+    return NULL;
   }
+
+  slot->generation = generation + 1;
+  slot->last_used = ++*clock;
+  return slot;
 }
 
 /*
   Function Description:
-    Compares two strings for sorting purposes, used as a callback by qsort to order an array of strings.
-    This function determines which string comes first alphabetically by comparing their characters.
+    Nested configurations. A monorepo may carry a top-level .ccls/compile_flags.txt plus overrides
+    in its components; every directory on the way from a source directory up to the checkout root
+    that holds either file is a layer, and the layers are merged into one flag set per source kind:
+      - include paths (-I, -isystem, -iquote, -idirafter) of the innermost layer come first, so a
+        component's headers shadow the top-level ones;
+      - every other flag is taken outermost first, and a flag is dropped when a more inner layer
+        sets the same thing: the same macro (-D/-U), or -std=, -stdlib=, --target=, --sysroot=,
+        -isysroot, -x.
+    The checkout root is the nearest directory holding .git at or above the project root found by
+    findFiles, else the project root itself; layers never come from above it.
+
+    The merged sets are cached per source directory together with the project root, so a request
+    costs one cache lookup plus a stat of each layer's config files. The directory chain itself is
+    walked again only after CC_LAYER_RECHECK seconds, which picks up newly created overrides.
 
-  Parameters:
-    - a (const void *): A pointer to the first string pointer (e.g., a char **), treated as immutable.
-    - b (const void *): A pointer to the second string pointer (e.g., a char **), treated as immutable.
+  Maintenance Notes:
+    - Layers are parsed through lookup_project_flags, so each config file is still parsed once per
+      change no matter how many directories share it.
+    - Not locked here; callers hold the owning context's lock while using the result.
+*/
 
-  Return Value:
-    - int: Returns a negative value if a < b (a comes first), 0 if a == b (equal), or positive if a > b
-      (b comes first), per qsort’s comparison contract.
+#define CC_MAX_LAYERS 8              // Config-bearing directories merged for one source directory
+#define MAX_CACHED_DIRECTORIES 32    // Source directories whose merged flag sets are kept
+#define CC_LAYER_RECHECK 5           // Seconds before the directory chain is walked again
+
+// Merged flag sets of one source directory
+typedef struct {
+  char directory[PATH_MAX];                      // Canonical source directory (cache key)
+  char root[PATH_MAX];                           // Project root found by findFiles
+  char top[PATH_MAX];                            // Checkout root, the outermost directory searched
+  char *layers[CC_MAX_LAYERS];                   // Config-bearing directories, innermost first
+  CCFileFingerprint fingerprints[CC_MAX_LAYERS][2]; // .ccls and compile_flags.txt of each layer
+  int layer_count;
+  CCFlagList flags[CC_SOURCE_KIND_COUNT];
+  time_t walked_at;
+  unsigned long generation;                      // Unique per merge, changes whenever flags change
+  unsigned long last_used;
+  int is_valid;
+} CCLayeredFlags;
+
+// Function to release a merged entry and mark it invalid
+static void free_layered_flags(CCLayeredFlags *entry) {
+  for(int i = 0; i < entry->layer_count; i++) {
+    free(entry->layers[i]);
+    entry->layers[i] = NULL;
+  }
 
-  Detailed Steps:
-    1. Dereference Pointers:
-       - Casts a and b from void* to const char ** to access the string pointers they point to.
-       - Gets the actual strings by dereferencing once (*(const char **)a and *(const char **)b).
-    2. Compare Strings:
-       - Uses strcmp to compare the two strings character-by-character.
-       - Returns strcmp’s result directly (negative, 0, or positive).
+  for(int kind = 0; kind < CC_SOURCE_KIND_COUNT; kind++) {
+    flag_list_free(&entry->flags[kind]);
+  }
 
-  Flow and Logic:
-    - Step 1: Unpack the pointers qsort gives us to reach the strings.
-    - Step 2: Let strcmp do the heavy lifting to decide order.
-    - Why this order? Dereference first to get the data; compare next to decide—simple and direct.
+  entry->layer_count = 0;
+  entry->is_valid = 0;
+}
 
-  How It Works (For Novices):
-    - Imagine you’re sorting a pile of notes (like "-I/project", "-I/usr") with qsort, and it needs
-      help deciding which note goes before another.
-    - compare_strings is like your sorting rule:
-      - Step 1: qsort hands you two notes wrapped in boxes (a and b). You open the boxes (cast and
-        dereference) to see the notes inside (the strings).
-      - Step 2: Compare the notes with strcmp—like checking letter-by-letter: "-I/p" vs. "-I/u".
-        If "-I/p" comes first (p < u), say “negative”; if same, say “zero”; if "-I/u" first, say “positive.”
-    - It’s like telling qsort, “Put this one before that one” based on alphabetical order!
+// Function to fingerprint the two config files of a layer directory
+static void layer_fingerprints(const char *directory, CCFileFingerprint fingerprints[2]) {
+  char path[PATH_MAX + 32];
+  snprintf(path, sizeof(path), "%s/.ccls", directory);
+  get_file_fingerprint(path, &fingerprints[0]);
+  snprintf(path, sizeof(path), "%s/compile_flags.txt", directory);
+  get_file_fingerprint(path, &fingerprints[1]);
+}
 
-  Why It Works (For Novices):
-    - Simplicity: Uses strcmp, a built-in tool, to compare letters, so you don’t have to write it yourself.
-    - Accuracy: Follows alphabetical rules (e.g., "a" < "b"), making the sorted list neat.
-    - Helpfulness: Gives qsort exactly what it needs (negative/zero/positive) to shuffle the notes.
+// Function to decide whether a flag adds to the header search path
+static int is_include_path_flag(const char *arg) {
+  return strncmp(arg, "-I", 2) == 0 || strncmp(arg, "-isystem", 8) == 0 ||
+         strncmp(arg, "-iquote", 7) == 0 || strncmp(arg, "-idirafter", 10) == 0;
+}
 
-  Why It’s Designed This Way (For Maintainers):
-    - qsort Compatibility: Matches qsort’s required comparator signature (const void *, returns int),
-      enabling sorting in store_lines for UNIX config flags (per _POSIX_C_SOURCE).
-    - Efficiency: Relies on strcmp, an optimized standard library function, avoiding custom comparison
-      logic—fast and reliable for small string arrays like include paths.
-    - Type Safety: Uses const void * and proper casting to const char **, ensuring no modification of
-      the strings and safe access, as qsort passes pointers-to-pointers (char ** elements).
-    - Minimalism: Single-line implementation keeps it focused—compares strings, nothing else.
-    - Standard Behavior: strcmp’s lexicographical order (ASCII-based) is predictable and matches
-      typical sorting expectations for flags.
+// Function to decide whether two flags set the same thing, so the inner one overrides the outer one
+static int flags_set_same(const char *a, const char *b) {
+  static const char *const single[] = {"-std=", "-stdlib=", "--target=", "--sysroot=", "-isysroot", "-x"};
 
-  Maintenance Notes:
-    - Assumptions: Expects a and b to point to valid char **—NULL or invalid pointers crash strcmp.
-      Ensure store_lines (caller) populates lines safely (e.g., via read_files).
-    - Extensibility: To change sort order (e.g., reverse), swap a and b in strcmp or negate the result.
-      For case-insensitive sort, use strcasecmp (with proper includes).
-    - Edge Cases: Equal strings return 0, preserving their relative order (stable sort with qsort).
-      Test with duplicates from remove_duplicates to confirm.
-    - Debugging: If sorting fails (e.g., wrong order), log a and b values (via log_message) to trace
-      what qsort sees—rare, since strcmp is robust.
-    - Performance: strcmp is O(n) per comparison, fine for short flags; qsort’s O(n log n) dominates
-      overall cost in store_lines.
-*/
+  if((strncmp(a, "-D", 2) == 0 || strncmp(a, "-U", 2) == 0) && (strncmp(b, "-D", 2) == 0 || strncmp(b, "-U", 2) == 0)) {
+    size_t length = strcspn(a + 2, "=");
+    return length == strcspn(b + 2, "=") && strncmp(a + 2, b + 2, length) == 0;
+  }
 
-// Function to compare strings
-int compare_strings(const void *a, const void *b) {
-  return strcmp(*(const char **)a, *(const char **)b);
+  for(size_t i = 0; i < sizeof(single) / sizeof(single[0]); i++) {
+    size_t length = strlen(single[i]);
+
+    if(strncmp(a, single[i], length) == 0 && strncmp(b, single[i], length) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Function to merge the flag lists of the layers (innermost first) into out. Returns 1 on allocation failure
+static int merge_layer_flags(CCFlagList *layers, int count, CCFlagList *out) {
+  int failed = 0;
+
+  for(int layer = 0; layer < count; layer++) {
+    for(int i = 0; i < layers[layer].count && !failed; i++) {
+      if(is_include_path_flag(layers[layer].args[i])) {
+        failed = flag_list_append(out, layers[layer].args[i]);
+      }
+    }
+  }
+
+  for(int layer = count - 1; layer >= 0; layer--) {
+    for(int i = 0; i < layers[layer].count && !failed; i++) {
+      const char *arg = layers[layer].args[i];
+      int overridden = is_include_path_flag(arg);
+
+      for(int inner = 0; inner < layer && !overridden; inner++) {
+        for(int j = 0; j < layers[inner].count && !overridden; j++) {
+          overridden = flags_set_same(arg, layers[inner].args[j]);
+        }
+      }
+
+      if(!overridden) {
+        failed = flag_list_append(out, arg);
+      }
+    }
+  }
+
+  return failed;
+}
+
+// Function to list the config-bearing directories from directory up to the checkout root of root,
+// innermost first; top (PATH_MAX) receives that checkout root.
+// Returns the number of layers stored in layers (strdup'ed), or -1 on allocation failure
+static int collect_config_layers(const char *directory, const char *root, char **layers, char *top) {
+  char current[PATH_MAX];
+  char marker[PATH_MAX + 16];
+  struct stat st;
+  int count = 0;
+  snprintf(top, PATH_MAX, "%s", root);
+
+  // The checkout root: nearest .git at or above the project root on the same file system
+  if(stat(root, &st) == 0) {
+    dev_t device = st.st_dev;
+    snprintf(current, sizeof(current), "%s", root);
+
+    for(;;) {
+      snprintf(marker, sizeof(marker), "%s/.git", current);
+
+      if(faccessat(AT_FDCWD, marker, F_OK, 0) == 0) {
+        snprintf(top, PATH_MAX, "%s", current);
+        break;
+      }
+
+      char *slash = strrchr(current, '/');
+
+      if(!slash || slash == current || is_ceiling_directory(current)) {
+        break;
+      }
+
+      *slash = '\0';
+
+      if(stat(current, &st) != 0 || st.st_dev != device) {
+        break;
+      }
+    }
+  }
+
+  snprintf(current, sizeof(current), "%s", directory);
+
+  for(;;) {
+    CCFileFingerprint fingerprints[2];
+    layer_fingerprints(current, fingerprints);
+
+    if((fingerprints[0].exists || fingerprints[1].exists) && count < CC_MAX_LAYERS) {
+      layers[count] = strdup(current);
+
+      if(!layers[count]) {
+        break;
+      }
+
+      count++;
+    }
+
+    char *slash = strrchr(current, '/');
+
+    if(strcmp(current, top) == 0 || !slash || slash == current) {
+      return count;
+    }
+
+    *slash = '\0';
+  }
+
+  while(count > 0) {
+    free(layers[--count]);
+  }
+
+  return -1;
 }
 
 /*
   Function Description:
-    Retrieves the CPU architecture (target) from the `clang --version` command and stores it in the
-    provided output buffer. It first checks the cache; if not cached, it runs the command, parses
-    the output for the "Target:" line, and caches the result for future use.
+    Returns the merged flag sets for a source directory, from the cache when the entry belongs to
+    the same project root, is younger than CC_LAYER_RECHECK seconds and none of its layers' config
+    files changed; otherwise the layers are collected and merged again.
 
   Parameters:
-    - output (char *): A caller-provided buffer where the CPU architecture string (e.g.,
-      "x86_64-unknown-linux-gnu") is stored. Must be at least MAX_LINE_LENGTH bytes.
+    - cache (CCLayeredFlags *): MAX_CACHED_DIRECTORIES slots owned by a cc_context.
+    - clock (unsigned long *): LRU clock of that cache, also numbers the merges.
+    - projects (CCProjectFlags *), project_clock (unsigned long *): The context's per-directory
+      parse cache, used for every layer.
+    - directory (const char *): Canonical directory of the source file.
+    - root (const char *): Project root found by findFiles; NULL to accept any cached root (a
+      lookup that must not touch the file system tree beyond the layers).
 
   Return Value:
-    - int: Returns 0 on success (target retrieved and stored); 1 on failure (e.g., fork, clang, or parsing fails).
+    - const CCLayeredFlags *: Cache-owned entry (do not free), or NULL when root is NULL and
+      nothing usable is cached, or on failure.
+*/
+static const CCLayeredFlags *lookup_layered_flags(CCLayeredFlags *cache, unsigned long *clock, CCProjectFlags *projects,
+    unsigned long *project_clock, const char *directory, const char *root) {
+  CCLayeredFlags *slot = NULL;
 
-  Detailed Steps:
-    1. Check Cache:
-       - If completion_cache.is_valid is true and cpu_arch isn’t empty, copies cached value to output.
-       - Limits copy to MAX_LINE_LENGTH - 1, null-terminates, and returns 0.
-    2. Allocate Output Buffer:
-       - Allocates a temporary buffer (output_buffer) of MAX_OUTPUT size for clang’s output.
-    3. Set Up Pipe and Fork:
-       - Creates a pipe to capture clang’s output.
-       - Forks a child process; if fork fails, logs and returns 1.
-    4. Child Process:
-       - Redirects stdout to pipe’s write end (dup2), closes unused pipe ends, and runs `clang --version`.
-       - Exits child with 0 (success) or after execlp fails.
-    5. Parent Process:
-       - Closes pipe’s write end, reads from read end into output_buffer (up to MAX_OUTPUT - 1).
-       - Null-terminates buffer, closes pipe, waits for child to finish.
-    6. Parse Output:
-       - Searches for "Target: " in output_buffer with strstr.
-       - If found, extracts the target value (until newline), copies to output and cache, frees buffer, returns 0.
-       - If not found, frees buffer, returns 1.
-    7. Handle Errors:
-       - On fork failure, frees buffer and returns 1.
+  for(int i = 0; i < MAX_CACHED_DIRECTORIES; i++) {
+    if(cache[i].is_valid && strcmp(cache[i].directory, directory) == 0) {
+      slot = &cache[i];
+      break;
+    }
+  }
 
-  Flow and Logic:
-    - Step 1: Use cached value if available—fast path.
-    - Steps 2-5: Run clang and capture output if cache is empty—slow path setup.
-    - Step 6: Extract and store the target—slow path result.
-    - Step 7: Handle failures gracefully.
-    - Why this order? Cache check first optimizes; process setup then parsing follows UNIX exec pattern.
+  if(slot && (!root || strcmp(slot->root, root) == 0) && time(NULL) - slot->walked_at < CC_LAYER_RECHECK) {
+    int fresh = 1;
 
-  How It Works (For Novices):
-    - Imagine you need to know your computer’s “type” (like "x86_64") for clang to work right, and
-      you’ll write it in a notebook (output). You can check a memo (cache) or ask clang directly.
-    - get_clang_target is like this:
+    for(int i = 0; i < slot->layer_count && fresh; i++) {
+      CCFileFingerprint now[2];
+      layer_fingerprints(slot->layers[i], now);
+      fresh = fingerprints_equal(&now[0], &slot->fingerprints[i][0]) && fingerprints_equal(&now[1], &slot->fingerprints[i][1]);
+    }
+
+    if(fresh) {
+      slot->last_used = ++*clock;
+      return slot;
+    }
+  }
+
+  if(!root) {
+    return NULL;
+  }
+
+  if(!slot) {
+    slot = &cache[0];
+
+    for(int i = 0; i < MAX_CACHED_DIRECTORIES; i++) {
+      if(!cache[i].is_valid) {
+        slot = &cache[i];
+        break;
+      }
+
+      if(cache[i].last_used < slot->last_used) {
+        slot = &cache[i];
+      }
+    }
+  }
+
+  free_layered_flags(slot);
+  int count = collect_config_layers(directory, root, slot->layers, slot->top);
+
+  if(count < 0) {
+    return NULL;
+  }
+
+  slot->layer_count = count;
+  // Copy every layer's sets first: fetching a later layer may evict an earlier one from projects
+  CCFlagList copies[CC_MAX_LAYERS][CC_SOURCE_KIND_COUNT];
+  int failed = 0;
+  memset(copies, 0, sizeof(copies));
+
+  for(int i = 0; i < count && !failed; i++) {
+    layer_fingerprints(slot->layers[i], slot->fingerprints[i]);
+    const CCProjectFlags *project = lookup_project_flags(projects, project_clock, slot->layers[i]);
+    failed = !project;
+
+    for(int kind = 0; kind < CC_SOURCE_KIND_COUNT && !failed; kind++) {
+      for(int j = 0; j < project->flags[kind].count && !failed; j++) {
+        failed = flag_list_append(&copies[i][kind], project->flags[kind].args[j]);
+      }
+    }
+  }
+
+  for(int kind = 0; kind < CC_SOURCE_KIND_COUNT && !failed; kind++) {
+    CCFlagList layers[CC_MAX_LAYERS];
+
+    for(int i = 0; i < count; i++) {
+      layers[i] = copies[i][kind];
+    }
+
+    failed = merge_layer_flags(layers, count, &slot->flags[kind]);
+  }
+
+  for(int i = 0; i < count; i++) {
+    for(int kind = 0; kind < CC_SOURCE_KIND_COUNT; kind++) {
+      flag_list_free(&copies[i][kind]);
+    }
+  }
+
+  if(failed) {
+    log_message("fn lookup_layered_flags: Failed to merge the configuration layers\n");
+    free_layered_flags(slot);
+    return NULL;
+  }
+
+  snprintf(slot->directory, sizeof(slot->directory), "%s", directory);
+  snprintf(slot->root, sizeof(slot->root), "%s", root);
+  slot->walked_at = time(NULL);
+  slot->generation = ++*clock;
+  slot->last_used = slot->generation;
+  slot->is_valid = 1;
+  return slot;
+}
+
+/*
+  Function Description:
+    compile_commands.json support. The database is located in the project root (or its build/
+    subdirectory), memory-mapped and stream-parsed once into:
+      - a set of deduplicated flag lists (entries with identical flags share one list),
+      - an open-addressing hash index from canonical source path to its flag list,
+      - a second index from source directory to the flag list of its first translation unit, used
+        as the fallback for header files, which never appear in the database.
+    Each entry's "arguments" array or "command" string is run through the same tokenizer rules as
+    .ccls (only parse-relevant flags, paths resolved against the entry's "directory"), so the
+    command lines stay minimal. The database is reparsed only when its fingerprint changes.
+
+  Maintenance Notes:
+    - Canonical paths are computed lexically (directory + file, "." and ".." collapsed) to avoid a
+      realpath call per entry on databases with thousands of entries; lookups use realpath'd files.
+    - The JSON reader only understands what compile_commands.json contains (an array of flat
+      objects); unknown members are skipped, malformed input aborts the parse and is logged.
+*/
+
+// One slot of a path -> flag set hash index
+typedef struct {
+  char *path;       // Canonical path (owned), NULL for an empty slot
+  int flag_set;     // Index into CCCompileDatabase.flag_sets
+} CCPathSlot;
+
+// Parsed compile_commands.json of one project
+typedef struct {
+  char json_path[PATH_MAX];
+  CCFileFingerprint fingerprint;
+  CCFlagList *flag_sets;            // Deduplicated flag lists
+  unsigned long *flag_set_hashes;
+  int flag_set_count;
+  int flag_set_capacity;
+  int *set_index;                   // Hash index over flag_sets (-1 = empty)
+  size_t set_index_size;
+  CCPathSlot *files;                // Source file index
+  size_t files_size;
+  size_t file_count;
+  CCPathSlot *dirs;                 // Directory index for the header fallback
+  size_t dirs_size;
+  size_t dir_count;
+  unsigned long generation;
+  unsigned long last_used;
+  int is_valid;
+} CCCompileDatabase;
+
+// A completion request being answered; identical requests wait for its result instead of running clang
+typedef struct CCInflight {
+  char *key;                  // Canonical file, its fingerprint, changedtick and position
+  char *buffer;               // Canonical file alone: newer requests for it supersede this one
+  unsigned long generation;   // Order of the request among those for the same buffer
+  pid_t pgid;                 // Process group of the running clang, 0 when none runs
+  int cancelled;              // Superseded; clang is killed and the result discarded
+  int refs;                   // The leader plus every attached follower
+  int done;
+  cc_status status;
+  char *text;
+  pthread_cond_t finished;
+  struct CCInflight *calls[CC_MAX_BACKENDS];  // Backend runs of a hedged request, cancelled with it
+  struct CCInflight *next;
+} CCInflight;
+
+// Include flags discovered for a checkout without configuration files
+typedef struct {
+  char root[PATH_MAX];
+  CCFlagList flags;       // "-I<dir>" flags, best ranked first
+  time_t discovered_at;
+  unsigned long generation;
+  unsigned long last_used;
+  int is_valid;
+} CCDiscoveredFlags;
+
+#define CC_SIGNATURE_SLOTS 256
+#define CC_CCLS_MAX_SESSIONS 8  // Upper bound of settings.ccls_sessions
+
+// Completion clang gave for a call expression in a file, answered again when clang fails
+typedef struct {
+  unsigned long hash;  // File and call expression
+  char *text;
+} CCSignature;
+
+// State behind a cc_context handle. Every field is guarded by lock; clang runs outside of it
+struct cc_context {
+  pthread_mutex_t lock;
+  cc_settings settings;
+  CCProjectFlags projects[MAX_CACHED_PROJECTS];      // .ccls / compile_flags.txt flag sets
+  unsigned long project_clock;
+  CCCompileDatabase databases[MAX_CACHED_PROJECTS];  // compile_commands.json indexes
+  unsigned long database_clock;
+  CCDiscoveredFlags discovered[MAX_CACHED_PROJECTS];  // Zero-config include sets
+  unsigned long discovery_clock;
+  CCLayeredFlags layered[MAX_CACHED_DIRECTORIES];    // Merged flag sets per source directory
+  unsigned long layered_clock;
+  char cpu_arch[MAX_LINE_LENGTH];                    // `clang --version` target, empty until queried
+  CCInflight *inflight;                              // Requests currently running clang
+  unsigned long generation_clock;                    // Numbers requests that carry no generation
+  pthread_cond_t changed;                            // Signalled on cancellation, ends debounce waits
+  CCSignature signatures[CC_SIGNATURE_SLOTS];        // Signature store backend, direct-mapped
+  struct CCClsSession *ccls_sessions[CC_CCLS_MAX_SESSIONS];  // Persistent ccls processes by project root
+  unsigned long ccls_clock;
+  cc_stats stats;
+};
+
+// Function to hash a string (FNV-1a), continuing from a previous hash value
+static unsigned long hash_string(unsigned long hash, const char *str) {
+  for(const unsigned char *p = (const unsigned char *)str; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
+#define CC_HASH_SEED 14695981039346656037UL
+
+// Function to append an argument without deduplication (raw argv of a compile command)
+static int argv_push(CCFlagList *list, const char *arg, size_t len) {
+  if(list->count == list->capacity) {
+    int new_capacity = list->capacity ? list->capacity * 2 : 32;
+    char **grown = (char **)realloc(list->args, (size_t)new_capacity * sizeof(char *));
+
+    if(!grown) {
+      return 1;
+    }
+
+    list->args = grown;
+    list->capacity = new_capacity;
+  }
+
+  list->args[list->count] = strndup(arg, len);
+
+  if(!list->args[list->count]) {
+    return 1;
+  }
+
+  list->count++;
+  return 0;
+}
+
+// Function to split a shell command line ("command" member) into arguments
+static int split_command_line(const char *command, CCFlagList *argv) {
+  size_t cap = strlen(command) + 1;
+  char *token = (char *)malloc(cap);
+
+  if(!token) {
+    return 1;
+  }
+
+  const char *p = command;
+
+  while(*p) {
+    while(*p && isspace((unsigned char)*p)) {
+      p++;
+    }
+
+    if(!*p) {
+      break;
+    }
+
+    size_t len = 0;
+    char quote = '\0';
+
+    while(*p && (quote || !isspace((unsigned char)*p))) {
+      if(quote == '\'' && *p == '\'') {
+        quote = '\0';
+      }
+
+      else if(quote == '"' && *p == '"') {
+        quote = '\0';
+      }
+
+      else if(!quote && (*p == '\'' || *p == '"')) {
+        quote = *p;
+      }
+
+      else if(*p == '\\' && quote != '\'' && p[1]) {
+        token[len++] = *++p;
+      }
+
+      else {
+        token[len++] = *p;
+      }
+
+      p++;
+    }
+
+    if(argv_push(argv, token, len) != 0) {
+      free(token);
+      return 1;
+    }
+  }
+
+  free(token);
+  return 0;
+}
+
+// Function to build a lexically normalised absolute path from a directory and a (possibly relative) file
+static void normalize_path(const char *directory, const char *file, char *out, size_t out_size) {
+  char joined[PATH_MAX * 2];
+  size_t len = 0;
+
+  if(file[0] == '/' || !directory || !directory[0]) {
+    snprintf(joined, sizeof(joined), "%s", file);
+  }
+
+  else {
+    snprintf(joined, sizeof(joined), "%s/%s", directory, file);
+  }
+
+  // Collapse "//", "/./" and "/../" segments in place
+  const char *p = joined;
+  out[0] = '\0';
+
+  while(*p) {
+    while(*p == '/') {
+      p++;
+    }
+
+    const char *segment = p;
+
+    while(*p && *p != '/') {
+      p++;
+    }
+
+    size_t seg_len = (size_t)(p - segment);
+
+    if(seg_len == 0 || (seg_len == 1 && segment[0] == '.')) {
+      continue;
+    }
+
+    if(seg_len == 2 && segment[0] == '.' && segment[1] == '.') {
+      while(len > 0 && out[len - 1] != '/') {
+        len--;
+      }
+
+      if(len > 0) {
+        len--;
+      }
+
+      out[len] = '\0';
+      continue;
+    }
+
+    if(len + seg_len + 2 >= out_size) {
+      break;
+    }
+
+    out[len++] = '/';
+    memcpy(out + len, segment, seg_len);
+    len += seg_len;
+    out[len] = '\0';
+  }
+
+  if(len == 0) {
+    snprintf(out, out_size, "/");
+  }
+}
+
+// Function to release a compile database
+static void free_compile_database(CCCompileDatabase *db) {
+  for(int i = 0; i < db->flag_set_count; i++) {
+    flag_list_free(&db->flag_sets[i]);
+  }
+
+  for(size_t i = 0; i < db->files_size; i++) {
+    free(db->files[i].path);
+  }
+
+  for(size_t i = 0; i < db->dirs_size; i++) {
+    free(db->dirs[i].path);
+  }
+
+  free(db->flag_sets);
+  free(db->flag_set_hashes);
+  free(db->set_index);
+  free(db->files);
+  free(db->dirs);
+  unsigned long generation = db->generation;
+  memset(db, 0, sizeof(*db));
+  db->generation = generation;
+}
+
+// Function to find the slot of a path in an index; returns the empty slot where it would go
+static CCPathSlot *path_index_find(CCPathSlot *table, size_t size, const char *path) {
+  size_t i = (size_t)hash_string(CC_HASH_SEED, path) & (size - 1);
+
+  while(table[i].path && strcmp(table[i].path, path) != 0) {
+    i = (i + 1) & (size - 1);
+  }
+
+  return &table[i];
+}
+
+// Function to insert a path into an index unless present (first entry wins), growing it at 50% load
+static int path_index_insert(CCPathSlot **table, size_t *size, size_t *count, const char *path, int flag_set) {
+  if((*count + 1) * 2 > *size) {
+    size_t new_size = *size ? *size * 2 : 1024;
+    CCPathSlot *grown = (CCPathSlot *)calloc(new_size, sizeof(CCPathSlot));
+
+    if(!grown) {
+      return 1;
+    }
+
+    for(size_t i = 0; i < *size; i++) {
+      if((*table)[i].path) {
+        *path_index_find(grown, new_size, (*table)[i].path) = (*table)[i];
+      }
+    }
+
+    free(*table);
+    *table = grown;
+    *size = new_size;
+  }
+
+  CCPathSlot *slot = path_index_find(*table, *size, path);
+
+  if(slot->path) {
+    return 0;
+  }
+
+  slot->path = strdup(path);
+
+  if(!slot->path) {
+    return 1;
+  }
+
+  slot->flag_set = flag_set;
+  (*count)++;
+  return 0;
+}
+
+// Function to intern a flag list; returns the index of the shared copy or -1 on allocation failure
+// On success the database takes ownership of the list's contents (or frees them if a copy exists)
+static int intern_flag_set(CCCompileDatabase *db, CCFlagList *list) {
+  unsigned long hash = CC_HASH_SEED;
+
+  for(int i = 0; i < list->count; i++) {
+    hash = hash_string(hash, list->args[i]);
+    hash = (hash ^ 0xffUL) * 1099511628211UL;  // Argument separator
+  }
+
+  if((size_t)(db->flag_set_count + 1) * 2 > db->set_index_size) {
+    size_t new_size = db->set_index_size ? db->set_index_size * 2 : 256;
+    int *grown = (int *)malloc(new_size * sizeof(int));
+
+    if(!grown) {
+      return -1;
+    }
+
+    for(size_t i = 0; i < new_size; i++) {
+      grown[i] = -1;
+    }
+
+    for(int s = 0; s < db->flag_set_count; s++) {
+      size_t i = (size_t)db->flag_set_hashes[s] & (new_size - 1);
+
+      while(grown[i] != -1) {
+        i = (i + 1) & (new_size - 1);
+      }
+
+      grown[i] = s;
+    }
+
+    free(db->set_index);
+    db->set_index = grown;
+    db->set_index_size = new_size;
+  }
+
+  size_t i = (size_t)hash & (db->set_index_size - 1);
+
+  while(db->set_index[i] != -1) {
+    int s = db->set_index[i];
+
+    if(db->flag_set_hashes[s] == hash && db->flag_sets[s].count == list->count) {
+      int same = 1;
+
+      for(int a = 0; a < list->count && same; a++) {
+        same = strcmp(db->flag_sets[s].args[a], list->args[a]) == 0;
+      }
+
+      if(same) {
+        flag_list_free(list);
+        return s;
+      }
+    }
+
+    i = (i + 1) & (db->set_index_size - 1);
+  }
+
+  if(db->flag_set_count == db->flag_set_capacity) {
+    int new_capacity = db->flag_set_capacity ? db->flag_set_capacity * 2 : 64;
+    CCFlagList *sets = (CCFlagList *)realloc(db->flag_sets, (size_t)new_capacity * sizeof(CCFlagList));
+
+    if(!sets) {
+      return -1;
+    }
+
+    db->flag_sets = sets;
+    unsigned long *hashes = (unsigned long *)realloc(db->flag_set_hashes, (size_t)new_capacity * sizeof(unsigned long));
+
+    if(!hashes) {
+      return -1;
+    }
+
+    db->flag_set_hashes = hashes;
+    db->flag_set_capacity = new_capacity;
+  }
+
+  int index = db->flag_set_count++;
+  db->flag_sets[index] = *list;
+  db->flag_set_hashes[index] = hash;
+  db->set_index[i] = index;
+  memset(list, 0, sizeof(*list));
+  return index;
+}
+
+// Streaming JSON reader over a mapped buffer
+typedef struct {
+  const char *data;
+  size_t size;
+  size_t pos;
+  char *buffer;        // Scratch buffer for decoded strings
+  size_t buffer_cap;
+} CCJsonReader;
+
+static void json_skip_ws(CCJsonReader *r) {
+  while(r->pos < r->size && isspace((unsigned char)r->data[r->pos])) {
+    r->pos++;
+  }
+}
+
+// Function to decode a JSON string at the cursor into r->buffer. Returns the length or -1 on error
+static long json_read_string(CCJsonReader *r) {
+  size_t len = 0;
+
+  if(r->pos >= r->size || r->data[r->pos] != '"') {
+    return -1;
+  }
+
+  r->pos++;
+
+  while(r->pos < r->size && r->data[r->pos] != '"') {
+    char ch = r->data[r->pos++];
+
+    if(len + 8 >= r->buffer_cap) {
+      size_t new_cap = r->buffer_cap ? r->buffer_cap * 2 : 4096;
+      char *grown = (char *)realloc(r->buffer, new_cap);
+
+      if(!grown) {
+        return -1;
+      }
+
+      r->buffer = grown;
+      r->buffer_cap = new_cap;
+    }
+
+    if(ch != '\\') {
+      r->buffer[len++] = ch;
+      continue;
+    }
+
+    if(r->pos >= r->size) {
+      return -1;
+    }
+
+    ch = r->data[r->pos++];
+
+    switch(ch) {
+      case 'n':
+        r->buffer[len++] = '\n';
+        break;
+
+      case 't':
+        r->buffer[len++] = '\t';
+        break;
+
+      case 'r':
+        r->buffer[len++] = '\r';
+        break;
+
+      case 'b':
+        r->buffer[len++] = '\b';
+        break;
+
+      case 'f':
+        r->buffer[len++] = '\f';
+        break;
+
+      case 'u': {
+        unsigned int code = 0;
+
+        if(r->pos + 4 > r->size) {
+          return -1;
+        }
+
+        for(int k = 0; k < 4; k++) {
+          char h = r->data[r->pos++];
+          code = code * 16 + (unsigned int)(isdigit((unsigned char)h) ? h - '0' : (tolower((unsigned char)h) - 'a' + 10));
+        }
+
+        // A high surrogate followed by a low one is a single character past U+FFFF
+        if(code >= 0xD800 && code < 0xDC00 && r->pos + 6 <= r->size && r->data[r->pos] == '\\' &&
+           r->data[r->pos + 1] == 'u') {
+          unsigned int low = 0;
+          int k = 0;
+
+          for(; k < 4 && isxdigit((unsigned char)r->data[r->pos + 2 + k]); k++) {
+            char h = r->data[r->pos + 2 + k];
+            low = low * 16 + (unsigned int)(isdigit((unsigned char)h) ? h - '0' : (tolower((unsigned char)h) - 'a' + 10));
+          }
+
+          if(k == 4 && low >= 0xDC00 && low < 0xE000) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            r->pos += 6;
+          }
+        }
+
+        // Encode the character as UTF-8
+        if(code < 0x80) {
+          r->buffer[len++] = (char)code;
+        }
+
+        else if(code < 0x800) {
+          r->buffer[len++] = (char)(0xC0 | (code >> 6));
+          r->buffer[len++] = (char)(0x80 | (code & 0x3F));
+        }
+
+        else if(code < 0x10000) {
+          r->buffer[len++] = (char)(0xE0 | (code >> 12));
+          r->buffer[len++] = (char)(0x80 | ((code >> 6) & 0x3F));
+          r->buffer[len++] = (char)(0x80 | (code & 0x3F));
+        }
+
+        else {
+          r->buffer[len++] = (char)(0xF0 | (code >> 18));
+          r->buffer[len++] = (char)(0x80 | ((code >> 12) & 0x3F));
+          r->buffer[len++] = (char)(0x80 | ((code >> 6) & 0x3F));
+          r->buffer[len++] = (char)(0x80 | (code & 0x3F));
+        }
+
+        break;
+      }
+
+      default:
+        r->buffer[len++] = ch;  // \" \\ \/
+        break;
+    }
+  }
+
+  if(r->pos >= r->size) {
+    return -1;
+  }
+
+  r->pos++;  // Closing quote
+
+  if(!r->buffer) {
+    r->buffer = (char *)malloc(16);
+    r->buffer_cap = r->buffer ? 16 : 0;
+
+    if(!r->buffer) {
+      return -1;
+    }
+  }
+
+  r->buffer[len] = '\0';
+  return (long)len;
+}
+
+// Function to skip any JSON value at the cursor. Returns 0 on success, 1 on malformed input
+static int json_skip_value(CCJsonReader *r) {
+  int depth = 0;
+
+  do {
+    json_skip_ws(r);
+
+    if(r->pos >= r->size) {
+      return 1;
+    }
+
+    char ch = r->data[r->pos];
+
+    if(ch == '"') {
+      if(json_read_string(r) < 0) {
+        return 1;
+      }
+    }
+
+    else if(ch == '{' || ch == '[') {
+      depth++;
+      r->pos++;
+    }
+
+    else if(ch == '}' || ch == ']') {
+      depth--;
+      r->pos++;
+    }
+
+    else {
+      r->pos++;  // Numbers, literals, ',' and ':' inside containers
+
+      // A number or literal on its own ends at the next delimiter
+      while(depth == 0 && r->pos < r->size && !strchr(",:}] \t\r\n", r->data[r->pos])) {
+        r->pos++;
+      }
+    }
+  }
+  while(depth > 0);
+
+  return 0;
+}
+
+// Function to turn one entry's raw argv into a minimal flag set and register it in the database
+static int compile_db_add_entry(CCCompileDatabase *db, const char *directory, const char *file, CCFlagList *argv) {
+  CCProjectFlags scratch;
+  CCTokenizer tok;
+  char canonical[PATH_MAX];
+  memset(&scratch, 0, sizeof(scratch));
+  memset(&tok, 0, sizeof(tok));
+  tok.project_dir = directory;
+  tok.project = &scratch;
+
+  // argv[0] is the compiler; source files and output names are not flags and get dropped
+  for(int i = 1; i < argv->count; i++) {
+    if(strcmp(argv->args[i], "-o") == 0 || strcmp(argv->args[i], "-MF") == 0 ||
+        strcmp(argv->args[i], "-MT") == 0 || strcmp(argv->args[i], "-MQ") == 0) {
+      i++;
+      continue;
+    }
+
+    tokenizer_accept(&tok, argv->args[i], CC_LANG_MASK_C);
+  }
+
+  for(int kind = 1; kind < CC_SOURCE_KIND_COUNT; kind++) {
+    flag_list_free(&scratch.flags[kind]);
+  }
+
+  if(tok.failed) {
+    flag_list_free(&scratch.flags[CC_SOURCE_C]);
+    return 1;
+  }
+
+  int set = intern_flag_set(db, &scratch.flags[CC_SOURCE_C]);
+
+  if(set < 0) {
+    flag_list_free(&scratch.flags[CC_SOURCE_C]);
+    return 1;
+  }
+
+  normalize_path(directory, file, canonical, sizeof(canonical));
+
+  if(path_index_insert(&db->files, &db->files_size, &db->file_count, canonical, set) != 0) {
+    return 1;
+  }
+
+  char *slash = strrchr(canonical, '/');
+
+  if(slash && slash != canonical) {
+    *slash = '\0';
+  }
+
+  return path_index_insert(&db->dirs, &db->dirs_size, &db->dir_count, canonical, set);
+}
+
+// Function to parse a mapped compile_commands.json. Returns 0 on success, 1 on malformed input or allocation failure
+static int parse_compile_database_buffer(CCCompileDatabase *db, const char *data, size_t size) {
+  CCJsonReader r = {data, size, 0, NULL, 0};
+  CCFlagList argv = {NULL, 0, 0};
+  char *directory = NULL;
+  char *file = NULL;
+  int status = 1;
+  json_skip_ws(&r);
+
+  if(r.pos >= r.size || r.data[r.pos] != '[') {
+    return 1;
+  }
+
+  r.pos++;
+
+  for(;;) {
+    json_skip_ws(&r);
+
+    if(r.pos < r.size && r.data[r.pos] == ']') {
+      status = 0;
+      break;
+    }
+
+    if(r.pos < r.size && r.data[r.pos] == ',') {
+      r.pos++;
+      continue;
+    }
+
+    if(r.pos >= r.size || r.data[r.pos] != '{') {
+      break;
+    }
+
+    r.pos++;
+    int has_arguments = 0;
+    int entry_failed = 0;
+
+    while(!entry_failed) {
+      json_skip_ws(&r);
+
+      if(r.pos < r.size && r.data[r.pos] == ',') {
+        r.pos++;
+        continue;
+      }
+
+      if(r.pos < r.size && r.data[r.pos] == '}') {
+        r.pos++;
+        break;
+      }
+
+      if(json_read_string(&r) < 0) {
+        entry_failed = 1;
+        break;
+      }
+
+      char key[16];
+      snprintf(key, sizeof(key), "%s", r.buffer);
+      json_skip_ws(&r);
+
+      if(r.pos >= r.size || r.data[r.pos] != ':') {
+        entry_failed = 1;
+        break;
+      }
+
+      r.pos++;
+      json_skip_ws(&r);
+
+      if(strcmp(key, "directory") == 0 || strcmp(key, "file") == 0) {
+        if(json_read_string(&r) < 0) {
+          entry_failed = 1;
+          break;
+        }
+
+        char **target = key[0] == 'd' ? &directory : &file;
+        free(*target);
+        *target = strdup(r.buffer);
+        entry_failed = *target == NULL;
+      }
+
+      else if(strcmp(key, "arguments") == 0 && r.pos < r.size && r.data[r.pos] == '[') {
+        // "arguments" wins over "command" when both are present
+        for(int i = 0; i < argv.count; i++) {
+          free(argv.args[i]);
+        }
+
+        argv.count = 0;
+        has_arguments = 1;
+        r.pos++;
+
+        for(;;) {
+          json_skip_ws(&r);
+
+          if(r.pos < r.size && r.data[r.pos] == ']') {
+            r.pos++;
+            break;
+          }
+
+          if(r.pos < r.size && r.data[r.pos] == ',') {
+            r.pos++;
+            continue;
+          }
+
+          long len = json_read_string(&r);
+
+          if(len < 0 || argv_push(&argv, r.buffer, (size_t)len) != 0) {
+            entry_failed = 1;
+            break;
+          }
+        }
+      }
+
+      else if(strcmp(key, "command") == 0 && !has_arguments) {
+        if(json_read_string(&r) < 0 || split_command_line(r.buffer, &argv) != 0) {
+          entry_failed = 1;
+        }
+      }
+
+      else if(json_skip_value(&r) != 0) {
+        entry_failed = 1;
+      }
+    }
+
+    if(entry_failed) {
+      break;
+    }
+
+    if(directory && file && argv.count > 0 && compile_db_add_entry(db, directory, file, &argv) != 0) {
+      break;
+    }
+
+    for(int i = 0; i < argv.count; i++) {
+      free(argv.args[i]);
+    }
+
+    argv.count = 0;
+    free(directory);
+    free(file);
+    directory = NULL;
+    file = NULL;
+  }
+
+  flag_list_free(&argv);
+  free(directory);
+  free(file);
+  free(r.buffer);
+  return status;
+}
+
+// Function to locate compile_commands.json for a project root (root first, then build/)
+// Returns 0 and fills json_path when found, 1 otherwise (also when the path does not fit in size)
+int find_compile_database(const char *project_dir, char *json_path, size_t size) {
+  const char *candidates[] = {"compile_commands.json", "build/compile_commands.json"};
+
+  for(size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+    if((size_t)snprintf(json_path, size, "%s/%s", project_dir, candidates[i]) < size && access(json_path, R_OK) == 0) {
+      return 0;
+    }
+  }
+
+  json_path[0] = '\0';
+  return 1;
+}
+
+// Function to (re)load a compile database into a cache slot
+static int load_compile_database(CCCompileDatabase *db, const char *json_path, const CCFileFingerprint *fingerprint) {
+  free_compile_database(db);
+
+  // A truncated path would never match its slot again
+  if(strlen(json_path) >= sizeof(db->json_path)) {
+    return 1;
+  }
+
+  memcpy(db->json_path, json_path, strlen(json_path) + 1);
+  db->fingerprint = *fingerprint;
+  int fd = open(json_path, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0) {
+    return 1;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return 1;
+  }
+
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(data == MAP_FAILED) {
+    return 1;
+  }
+
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  int status = parse_compile_database_buffer(db, (const char *)data, (size_t)st.st_size);
+  munmap(data, (size_t)st.st_size);
+
+  if(status != 0) {
+    log_message("fn load_compile_database: Malformed compile_commands.json or out of memory\n");
+    free_compile_database(db);
+    return 1;
+  }
+
+  db->generation++;
+  db->is_valid = 1;
+  return 0;
+}
+
+/*
+  Function Description:
+    Returns the flag set compile_commands.json records for a source file, loading and indexing the
+    database on first use and reparsing it only when its fingerprint changes.
+
+  Parameters:
+    - cache (CCCompileDatabase *): MAX_CACHED_PROJECTS slots owned by a cc_context.
+    - clock (unsigned long *): LRU clock of that cache.
+    - project_dir (const char *): Canonical project root.
+    - abs_filename (const char *): realpath of the source file.
+    - generation (unsigned long *): Optional; receives the database generation, which changes on reparse.
+
+  Return Value:
+    - const CCFlagList *: Cache-owned flag set of the file; for a header without its own entry, the
+      flag set of a translation unit in the same directory. NULL when the project has no database or
+      nothing matches, in which case callers fall back to .ccls/compile_flags.txt.
+*/
+static const CCFlagList *lookup_compile_db_flags(CCCompileDatabase *cache, unsigned long *clock, const char *project_dir,
+    const char *abs_filename, unsigned long *generation) {
+  char json_path[PATH_MAX];
+  CCFileFingerprint now;
+  CCCompileDatabase *db = NULL;
+
+  if(!project_dir || !abs_filename || find_compile_database(project_dir, json_path, sizeof(json_path)) != 0 ||
+      get_file_fingerprint(json_path, &now) != 0) {
+    return NULL;
+  }
+
+  for(int i = 0; i < MAX_CACHED_PROJECTS; i++) {
+    if(cache[i].json_path[0] && strcmp(cache[i].json_path, json_path) == 0) {
+      db = &cache[i];
+      break;
+    }
+  }
+
+  if(!db) {
+    db = &cache[0];
+
+    for(int i = 0; i < MAX_CACHED_PROJECTS; i++) {
+      if(!cache[i].json_path[0]) {
+        db = &cache[i];
+        break;
+      }
+
+      if(cache[i].last_used < db->last_used) {
+        db = &cache[i];
+      }
+    }
+  }
+
+  db->last_used = ++*clock;
+
+  // A failed parse is remembered through the fingerprint, so a broken file is not re-read every keystroke
+  if(strcmp(db->json_path, json_path) != 0 || !fingerprints_equal(&db->fingerprint, &now)) {
+    load_compile_database(db, json_path, &now);
+  }
+
+  if(!db->is_valid || db->files_size == 0) {
+    return NULL;
+  }
+
+  if(generation) {
+    *generation = db->generation;
+  }
+
+  CCPathSlot *slot = path_index_find(db->files, db->files_size, abs_filename);
+
+  if(slot->path) {
+    return &db->flag_sets[slot->flag_set];
+  }
+
+  CCSourceKind kind = classify_source_file(abs_filename);
+
+  if(kind != CC_SOURCE_C_HEADER && kind != CC_SOURCE_CPP_HEADER) {
+    return NULL;
+  }
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", abs_filename);
+  char *slash = strrchr(dir, '/');
+
+  if(slash && slash != dir) {
+    *slash = '\0';
+  }
+
+  slot = path_index_find(db->dirs, db->dirs_size, dir);
+  return slot->path ? &db->flag_sets[slot->flag_set] : NULL;
+}
+
+/*
+  Function Description:
+    Reads the include flags (-I, -isystem and friends) from two config files (.ccls and
+    compile_flags.txt) and stores them in a provided array. The files are parsed with the same
+    mmap-based tokenizer behind the per-project flag sets, so language prefixes, quoting and two-line
+    options are understood; the union of all language sections is returned.
+
+  Parameters:
+    - file1 (const char *): Path to the first file (.ccls or compile_flags.txt), not modified.
+    - file2 (const char *): Path to the second file, not modified.
+    - lines (char **): An array of string pointers where matching flags are stored. Caller must
+      ensure it’s at least MAX_LINES in size and free the strings later.
+    - count (int *): Pointer to an integer tracking the number of lines stored; updated by the function.
+
+  Return Value: None
+    - Modifies lines and *count in place. A missing file is logged and treated as empty; the
+      function never terminates the process (it can be reached from Vim through libcallnr).
+
+  Detailed Steps:
+    1. Tokenize Files:
+       - Each file is tokenized; the one named ".ccls" has its compiler-driver line skipped.
+       - Relative include paths are resolved against the directory holding the file.
+    2. Collect Include Flags:
+       - Walks every per-language flag set and copies include-type flags (-I, -isystem, -iquote,
+         -idirafter) into lines with strdup, up to MAX_LINES - 1 entries.
+    3. Clean Up:
+       - Releases the temporary flag sets.
+
+  Maintenance Notes:
+    - Callers wanting language-correct command lines should use cc_complete instead; this
+      function is kept for the store_lines API.
+    - Duplicates across language sections are left to remove_duplicates, as before.
+*/
+
+// Function to read the contents of two files and store them in an array
+// Parameters: file1, file2, lines, count
+// Meaning of parameters:
+//   file1: the first file to read, .ccls
+//   file2: the second file to read, compile_flags.txt
+//   lines: the array to store the lines in
+//   count: the number of lines read
+// Return value: none
+void read_files(const char *file1, const char *file2, char **lines, int *count) {
+  const char *files[2] = {file1, file2};
+  CCProjectFlags parsed;
+  memset(&parsed, 0, sizeof(parsed));
+
+  for(int f = 0; f < 2; f++) {
+    char dir_copy[PATH_MAX];
+    CCTokenizer tok;
+
+    if(access(files[f], R_OK) != 0) {
+      log_message("fn read_files: Config file missing or unreadable, treated as empty\n");
+      continue;
+    }
+
+    snprintf(dir_copy, sizeof(dir_copy), "%s", files[f]);
+    const char *base = strrchr(files[f], '/');
+    memset(&tok, 0, sizeof(tok));
+    tok.project_dir = dirname(dir_copy);
+    tok.project = &parsed;
+    tok.is_ccls = strcmp(base ? base + 1 : files[f], ".ccls") == 0;
+    tokenize_config_file(&tok, files[f]);
+  }
+
+  for(int kind = 0; kind < CC_SOURCE_KIND_COUNT; kind++) {
+    for(int i = 0; i < parsed.flags[kind].count; i++) {
+      const char *arg = parsed.flags[kind].args[i];
+
+      if(strncmp(arg, "-I", 2) != 0 && strncmp(arg, "-isystem", 8) != 0 &&
+          strncmp(arg, "-iquote", 7) != 0 && strncmp(arg, "-idirafter", 10) != 0) {
+        continue;
+      }
+
+      if(*count < MAX_LINES - 1) {
+        lines[*count] = strdup(arg);
+
+        if(lines[*count]) {
+          (*count)++;
+        }
+      }
+    }
+  }
+
+  free_project_flags(&parsed);
+}
+
+/*
+  Function Description:
+    Removes duplicate strings from an array of strings (lines) and updates the count of unique entries.
+    This function ensures the list of include paths (e.g., "-I/project/include") has no repeats,
+    reducing redundancy and potential confusion for tools like clang.
+
+  Parameters:
+    - lines (char **): An array of string pointers containing the lines to process. Strings are assumed
+      to be dynamically allocated (e.g., via strdup) and will be freed if duplicated.
+    - count (int *): Pointer to an integer representing the current number of lines; updated to reflect
+      the number of unique lines after duplicates are removed.
+
+  Return Value: None
+    - Modifies the lines array and *count in place to remove duplicates.
+
+  Detailed Steps:
+    1. Iterate Through Lines:
+       - Uses two nested loops: outer loop (i) picks a line, inner loop (j) checks subsequent lines.
+       - Compares each line (lines[i]) with later lines (lines[j]) using strcmp.
+    2. Detect and Remove Duplicates:
+       - If a match is found (strcmp returns 0), frees the duplicate (lines[j]).
+       - Shifts all subsequent lines left to fill the gap (k loop moves lines[k+1] to lines[k]).
+       - Decrements *count to reflect the removal.
+       - Adjusts j to recheck the new line at j after shifting.
+    3. Continue Until Done:
+       - Outer loop continues until all lines are checked; inner loop adjusts dynamically as count shrinks.
+
+  Flow and Logic:
+    - Step 1: Start at the first line and look ahead for duplicates.
+    - Step 2: When a duplicate is found, erase it, slide everything over, and update the tally.
+    - Step 3: Keep going until no more lines to check.
+    - Why this order? Left-to-right ensures earlier lines stay, later duplicates go; shifting maintains
+      array continuity.
+
+  How It Works (For Novices):
+    - Imagine you have a list of notes (lines) like ["-I/project", "-I/usr", "-I/project"], and you
+      want only unique notes, counting how many are left (count).
+    - remove_duplicates is like cleaning up this list:
+      - Step 1: Pick the first note ("-I/project") and check the rest. The third note matches!
+      - Step 2: Cross out the third note (free it), slide "-I/usr" to the third spot, shorten the list
+        (decrease count), and check again from where you left off.
+      - Step 3: Move to the next note ("-I/usr"), check ahead (no matches), and keep going until done.
+    - It’s like tidying a messy list, tossing repeats, and keeping it neat and short!
+
+  Why It Works (For Novices):
+    - Fairness: Keeps the first copy of each note, removing later ones—simple rule.
+    - Tidiness: Shifts notes so there are no gaps, keeping the list ready to use.
+    - Accuracy: Updates count so you know exactly how many unique notes you have.
+
+  Why It’s Designed This Way (For Maintainers):
+    - Efficiency Goal: Reduces redundant flags for clang (e.g., in collect_code_completion_args),
+      ensuring clean input on UNIX systems (per _POSIX_C_SOURCE) where duplicates could waste time.
+    - In-Place Operation: Modifies lines directly, avoiding new allocations, which is memory-efficient
+      but assumes the caller (e.g., store_lines) is okay with this.
+    - Memory Safety: Frees duplicates immediately, preventing leaks since lines are strdup’d (e.g.,
+      from read_files). Assumes caller frees remaining strings later.
+    - Simple Algorithm: Uses a basic O(n²) comparison with shifting—effective for small lists (typical
+      for include paths) but not optimized for huge arrays.
+    - Stability: Preserves order of first occurrences, which might matter for flag precedence in clang.
+
+  Maintenance Notes:
+    - Performance: For large *count (e.g., >100), O(n²) comparisons slow down—consider a hash table
+      or sorting first (like qsort in store_lines) if this becomes a bottleneck.
+    - Edge Cases: If *count is 0 or 1, it does nothing (safe); test with duplicates at start/end to
+      ensure shifting works.
+    - Memory: Assumes lines[i] are valid pointers—NULLs could crash strcmp. Add a NULL check if
+      read_files might store them.
+    - Extensibility: To ignore case or whitespace in duplicates, tweak strcmp—current exact match
+      is strict but fast.
+    - Debugging: Log (via log_message) when duplicates are found to trace unexpected repeats in configs.
+*/
+
+// Function to remove duplicate lines
+void remove_duplicates(char **lines, int *count) {
+  for(int i = 0; i < *count; i++) {
+    for(int j = i + 1; j < *count; j++) {
+      if(strcmp(lines[i], lines[j]) == 0) {
+        free(lines[j]);
+
+        for(int k = j; k < *count - 1; k++) {
+          lines[k] = lines[k + 1];
+        }
+
+        (*count)--;
+        j--;
+      }
+    }
+  }
+}
+
+/*
+  Function Description:
+    Reads include flags from two files (.ccls and compile_flags.txt), removes duplicates, sorts them,
+    and stores the results in two arrays: one for original order (lines) and one sorted (sorted_lines).
+    This function prepares a clean, ordered list of compiler flags for later use (e.g., by clang).
+
+  Parameters:
+    - file1 (const char *): Path to the first file (typically .ccls), not modified.
+    - file2 (const char *): Path to the second file (typically compile_flags.txt), not modified.
+    - lines (char **): Array of string pointers to store the unique lines in original order.
+      Caller must ensure it’s at least MAX_LINES and free the strings later.
+    - sorted_lines (char **): Array to store the same lines, but sorted alphabetically.
+      Same size and ownership rules as lines.
+    - count (int *): Pointer to an integer tracking the number of lines; updated with the final count.
+
+  Return Value: None
+    - Modifies lines, sorted_lines, and *count in place.
+
+  Detailed Steps:
+    1. Read and Store Lines:
+       - Calls read_files to extract "-I" and "-isystem" lines from file1 and file2 into lines.
+       - Updates *count with the initial number of lines found.
+    2. Remove Duplicates:
+       - Calls remove_duplicates on lines, reducing *count to reflect only unique entries.
+    3. Copy to Sorted Array:
+       - Loops through lines, copying each pointer to sorted_lines (up to *count).
+    4. Sort the Lines:
+       - If *count > 0, uses qsort with compare_strings to sort sorted_lines alphabetically.
+
+  Flow and Logic:
+    - Step 1: Gather all relevant lines from both files into lines.
+    - Step 2: Clean up by removing duplicates, keeping lines compact.
+    - Step 3: Duplicate the list into sorted_lines for sorting.
+    - Step 4: Sort sorted_lines if there’s anything to sort.
+    - Why this order? Read first to get raw data; deduplicate for efficiency; copy then sort to
+      preserve original order in lines while providing a sorted version.
+
+  How It Works (For Novices):
+    - Imagine you’re collecting directions from two guidebooks (.ccls and compile_flags.txt) about
+      where to find tools (like "-I/project/include"), and you want two lists: one as-is (lines) and
+      one alphabetized (sorted_lines), counting how many (count).
+    - store_lines is like this organizing task:
+      - Step 1: Flip through both books with read_files, jotting down directions (e.g., "-I/usr",
+        "-I/project") in your first notebook (lines), counting them (*count).
+      - Step 2: Cross out repeats with remove_duplicates (e.g., two "-I/usr" become one), updating
+        your tally.
+      - Step 3: Copy the cleaned list into a second notebook (sorted_lines).
+      - Step 4: If there’s anything in the second notebook, sort it A-to-Z (qsort) so it’s easy to read.
+    - It’s like making two handy lists from messy notes—one raw, one neat and sorted!
+
+  Why It Works (For Novices):
+    - Completeness: Grabs all the directions you need from both books.
+    - Cleanliness: No repeats cluttering things up.
+    - Order: Gives you a sorted version for quick lookup, keeping the original too.
+
+  Why It’s Designed This Way (For Maintainers):
+    - Dual Output: Provides both original (lines) and sorted (sorted_lines) lists, offering flexibility—
+      original order might matter for clang flag precedence, while sorted aids debugging or display.
+    - Integration: Builds on read_files and remove_duplicates, reusing their logic for modularity,
+      key for UNIX config processing (per _POSIX_C_SOURCE).
+    - Efficiency: Removes duplicates before sorting, reducing qsort’s work (O(n log n) vs. larger n).
+      Assumes small *count (typical for include paths), so O(n²) in remove_duplicates is fine.
+    - Memory: lines holds strdup’d strings from read_files; sorted_lines shares pointers, avoiding
+      extra allocations but tying their lifetimes together—caller must free lines[i].
+    - Sorting: qsort with compare_strings (strcmp) is standard and fast for small arrays, ensuring
+      alphabetical order for consistency.
+
+  Maintenance Notes:
+    - Memory Ownership: sorted_lines points to lines’ strings—freeing lines[i] affects both. Document
+      this to avoid double-free or dangling pointers in callers (e.g., collect_code_completion_args).
+    - Edge Cases: If *count = 0, qsort skips safely; test with duplicate-heavy inputs to ensure
+      remove_duplicates scales.
+    - Extensibility: To filter more flag types (e.g., "-D"), adjust read_files and propagate here.
+      Add a sort option (e.g., reverse) by tweaking qsort comparator if needed.
+    - Error Handling: read_files treats missing files as empty, so store_lines never aborts the process.
+    - Debugging: Log (via log_message) the final *count or sample lines to verify deduplication and sorting.
+*/
+
+// Function to store lines in the array
+// Parameters:
+//   file1: path to the first file, .ccls file
+//   file2: path to the second file, compile_flags.txt file
+//   lines: array to store the lines
+//   sorted_lines: array to store the sorted lines
+//   count: pointer to the number of lines
+void store_lines(const char *file1, const char *file2, char **lines, char **sorted_lines, int *count) {
+  // Read files and store lines in the array
+  read_files(file1, file2, lines, count);
+  remove_duplicates(lines, count);
+
+  // Copy the lines to sorted_lines
+  for(int i = 0; i < *count; i++) {
+    sorted_lines[i] = lines[i];
+  }
+
+  // Sort the lines if count is valid
+  if(*count > 0) {
+    qsort(sorted_lines, (size_t)*count, sizeof(char *), compare_strings);
+  }
+}
+
+/*
+  Function Description:
+    Compares two strings for sorting purposes, used as a callback by qsort to order an array of strings.
+    This function determines which string comes first alphabetically by comparing their characters.
+
+  Parameters:
+    - a (const void *): A pointer to the first string pointer (e.g., a char **), treated as immutable.
+    - b (const void *): A pointer to the second string pointer (e.g., a char **), treated as immutable.
+
+  Return Value:
+    - int: Returns a negative value if a < b (a comes first), 0 if a == b (equal), or positive if a > b
+      (b comes first), per qsort’s comparison contract.
+
+  Detailed Steps:
+    1. Dereference Pointers:
+       - Casts a and b from void* to const char ** to access the string pointers they point to.
+       - Gets the actual strings by dereferencing once (*(const char **)a and *(const char **)b).
+    2. Compare Strings:
+       - Uses strcmp to compare the two strings character-by-character.
+       - Returns strcmp’s result directly (negative, 0, or positive).
+
+  Flow and Logic:
+    - Step 1: Unpack the pointers qsort gives us to reach the strings.
+    - Step 2: Let strcmp do the heavy lifting to decide order.
+    - Why this order? Dereference first to get the data; compare next to decide—simple and direct.
+
+  How It Works (For Novices):
+    - Imagine you’re sorting a pile of notes (like "-I/project", "-I/usr") with qsort, and it needs
+      help deciding which note goes before another.
+    - compare_strings is like your sorting rule:
+      - Step 1: qsort hands you two notes wrapped in boxes (a and b). You open the boxes (cast and
+        dereference) to see the notes inside (the strings).
+      - Step 2: Compare the notes with strcmp—like checking letter-by-letter: "-I/p" vs. "-I/u".
+        If "-I/p" comes first (p < u), say “negative”; if same, say “zero”; if "-I/u" first, say “positive.”
+    - It’s like telling qsort, “Put this one before that one” based on alphabetical order!
+
+  Why It Works (For Novices):
+    - Simplicity: Uses strcmp, a built-in tool, to compare letters, so you don’t have to write it yourself.
+    - Accuracy: Follows alphabetical rules (e.g., "a" < "b"), making the sorted list neat.
+    - Helpfulness: Gives qsort exactly what it needs (negative/zero/positive) to shuffle the notes.
+
+  Why It’s Designed This Way (For Maintainers):
+    - qsort Compatibility: Matches qsort’s required comparator signature (const void *, returns int),
+      enabling sorting in store_lines for UNIX config flags (per _POSIX_C_SOURCE).
+    - Efficiency: Relies on strcmp, an optimized standard library function, avoiding custom comparison
+      logic—fast and reliable for small string arrays like include paths.
+    - Type Safety: Uses const void * and proper casting to const char **, ensuring no modification of
+      the strings and safe access, as qsort passes pointers-to-pointers (char ** elements).
+    - Minimalism: Single-line implementation keeps it focused—compares strings, nothing else.
+    - Standard Behavior: strcmp’s lexicographical order (ASCII-based) is predictable and matches
+      typical sorting expectations for flags.
+
+  Maintenance Notes:
+    - Assumptions: Expects a and b to point to valid char **—NULL or invalid pointers crash strcmp.
+      Ensure store_lines (caller) populates lines safely (e.g., via read_files).
+    - Extensibility: To change sort order (e.g., reverse), swap a and b in strcmp or negate the result.
+      For case-insensitive sort, use strcasecmp (with proper includes).
+    - Edge Cases: Equal strings return 0, preserving their relative order (stable sort with qsort).
+      Test with duplicates from remove_duplicates to confirm.
+    - Debugging: If sorting fails (e.g., wrong order), log a and b values (via log_message) to trace
+      what qsort sees—rare, since strcmp is robust.
+    - Performance: strcmp is O(n) per comparison, fine for short flags; qsort’s O(n log n) dominates
+      overall cost in store_lines.
+*/
+
+// Function to compare strings
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+  Function Description:
+    Child process launch layer used for every external program (clang, ccls). Each child runs in
+    its own process group with stdin and stderr on /dev/null, so a deadline or a cancellation can
+    kill it together with everything it started (clang's cc1 child), and nothing it prints can
+    reach the editor. Optional RLIMIT_AS / RLIMIT_CPU limits bound runaway template instantiation.
+    Background children (indexing, harvesting) are started at the lowest CPU and I/O priority so
+    they never take latency away from interactive completion or from the user's build.
+
+  Maintenance Notes:
+    - The deadline is wall-clock and enforced by the parent: poll() on the output pipe while
+      reading, then waitpid(WNOHANG) polling until the child is reaped.
+    - Hitting RLIMIT_AS or RLIMIT_CPU just looks like a crashed child to the caller.
+    - CC_LAUNCH_BACKGROUND: SCHED_IDLE, nice 19 and the idle I/O class on Linux (nice 19 only
+      elsewhere), optionally pinned to the CPUs listed in CODE_CONNECTOR_BACKGROUND_CPUS
+      ("0-3,6"). Each step is best effort; a failure leaves the child at the inherited priority.
+    - Background children are also registered in the per-user background registry (a file in the
+      runtime directory shared by every process of the user). While any process of the user runs
+      an interactive clang run (interactive_begin/interactive_end), all registered process groups
+      are stopped with SIGSTOP and continued afterwards; the time they spent stopped is reported by
+      cc_context_stats. A deadline of a background child keeps running while it is stopped.
+    - Entries of a process that died are dropped at the next lock, so a crashed completion cannot
+      keep indexing stopped for longer than until the next registry use.
+    - wait_child checks for the exit with WNOWAIT and unregisters before reaping, so a stop or
+      continue signal can never reach a recycled process group id.
+*/
+
+#define CC_DEFAULT_TIMEOUT_MS 10000  // Deadline of a clang run unless configured otherwise
+
+// Scheduling class of a child process
+typedef enum {
+  CC_LAUNCH_INTERACTIVE = 0,  // Completion: the caller's priority
+  CC_LAUNCH_BACKGROUND        // Indexing, harvesting: idle CPU and I/O priority
+} CCLaunchClass;
+
+// Limits applied to one child process
+typedef struct {
+  int timeout_ms;        // Wall-clock deadline, <= 0 for none
+  long memory_limit_mb;  // RLIMIT_AS, <= 0 for none
+  int cpu_limit_sec;     // RLIMIT_CPU, <= 0 for none
+  CCLaunchClass launch_class;
+} CCLaunch;
+
+// A child process started by spawn_child
+typedef struct {
+  pid_t pid;                // Also its process group id
+  int output_fd;            // Read end of its stdout (its stdin too for CC_CAPTURE_SESSION), -1 when not captured
+  int background;           // Registered in background_jobs
+  struct timespec started;  // CLOCK_MONOTONIC
+} CCChild;
+
+#define CC_MAX_BACKGROUND_JOBS 64
+
+#define CC_CAPTURE_NONE 0    // stdout and stderr on /dev/null
+#define CC_CAPTURE_STDOUT 1  // stdout on the pipe, stderr on /dev/null
+#define CC_CAPTURE_ALL 2     // stdout and stderr on the pipe (log output, e.g. ccls progress)
+#define CC_CAPTURE_SESSION 3 // stdin and stdout on one socket (a long-lived language server), stderr on /dev/null
+
+#define CC_BACKGROUND_VERSION 1
+#define CC_MAX_INTERACTIVE_PROCESSES 64
+#define CC_BACKGROUND_CHECK_MS 1000  // How often a reader of a background child checks the registry for dead processes
+
+// One background child of a process of the user
+typedef struct {
+  pid_t group;  // Its process group, 0 for a free slot
+  pid_t owner;  // The process that started it and will reap it
+} CCBackgroundGroup;
+
+// One process of the user with interactive clang runs in progress
+typedef struct {
+  pid_t pid;    // 0 for a free slot
+  int runs;
+} CCInteractiveProcess;
+
+// Running background children and interactive runs of all processes of the user (the daemon, its
+// workers, --index jobs, one-shot completions), so a completion in any of them stops indexing in all.
+// Mapped from background.<version> in the runtime directory and guarded by flock
+typedef struct {
+  CCBackgroundGroup groups[CC_MAX_BACKGROUND_JOBS];
+  CCInteractiveProcess interactive[CC_MAX_INTERACTIVE_PROCESSES];
+  int stopped;                  // The groups are currently stopped
+  struct timespec stopped_at;   // CLOCK_MONOTONIC, which is system-wide
+  unsigned long preemptions;    // Times background work was stopped
+  unsigned long preempted_ms;   // Total time background work spent stopped
+} CCBackgroundRegistry;
+
+// This process's view of the registry
+typedef struct {
+  pthread_mutex_t lock;         // Serializes the threads of this process; flock serializes the processes
+  CCBackgroundRegistry *registry;  // Mapped registry, or private_registry when the runtime directory is unusable
+  CCBackgroundRegistry private_registry;
+  int fd;                       // Registry file, -1 while unopened or private
+  pid_t opened_by;              // Process that opened fd; a forked child opens its own, as flock is per open file
+  int count;                    // Registered background children of this process
+} CCBackgroundJobs;
+
+static CCBackgroundJobs background_jobs = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static int runtime_file_path(const char *name, char *path, size_t size);
+
+// Function to get the milliseconds elapsed since a CLOCK_MONOTONIC time stamp
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long)(now.tv_sec - since->tv_sec) * 1000L + (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+#if defined(__linux__)
+// Function to parse a CPU list such as "0-3,6" into set
+// Returns 0 on success, 1 when the list is malformed or empty
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+  const char *cursor = list;
+  CPU_ZERO(set);
+
+  while(*cursor) {
+    char *end;
+    long first = strtol(cursor, &end, 10);
+
+    if(end == cursor || first < 0) {
+      return 1;
+    }
+
+    long last = first;
+    cursor = end;
+
+    if(*cursor == '-') {
+      last = strtol(cursor + 1, &end, 10);
+
+      if(end == cursor + 1 || last < first) {
+        return 1;
+      }
+
+      cursor = end;
+    }
+
+    for(long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET((int)cpu, set);
+    }
+
+    if(*cursor == ',') {
+      cursor++;
+    }
+
+    else if(*cursor) {
+      return 1;
+    }
+  }
+
+  return CPU_COUNT(set) == 0;
+}
+#endif
+
+// Function to check whether a process of the user still exists
+static int process_alive(pid_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+// Function to check whether any process of the user runs an interactive clang run (registry locked)
+static int background_interactive_locked(const CCBackgroundRegistry *registry) {
+  for(int i = 0; i < CC_MAX_INTERACTIVE_PROCESSES; i++) {
+    if(registry->interactive[i].pid != 0 && registry->interactive[i].runs > 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Function to stop every background group (registry locked)
+static void background_stop_locked(CCBackgroundRegistry *registry) {
+  int stopped = 0;
+
+  if(registry->stopped) {
+    return;
+  }
+
+  for(int i = 0; i < CC_MAX_BACKGROUND_JOBS; i++) {
+    if(registry->groups[i].group != 0) {
+      kill(-registry->groups[i].group, SIGSTOP);
+      stopped = 1;
+    }
+  }
+
+  if(stopped) {
+    registry->stopped = 1;
+    registry->preemptions++;
+    clock_gettime(CLOCK_MONOTONIC, &registry->stopped_at);
+  }
+}
+
+// Function to continue the background groups once no interactive run is left (registry locked)
+static void background_continue_locked(CCBackgroundRegistry *registry) {
+  if(!registry->stopped || background_interactive_locked(registry)) {
+    return;
+  }
+
+  for(int i = 0; i < CC_MAX_BACKGROUND_JOBS; i++) {
+    if(registry->groups[i].group != 0) {
+      kill(-registry->groups[i].group, SIGCONT);
+    }
+  }
+
+  registry->stopped = 0;
+  registry->preempted_ms += (unsigned long)elapsed_ms(&registry->stopped_at);
+}
+
+// Function to map the registry file, keeping the private registry when it cannot be used
+// The caller holds background_jobs.lock
+static void background_open_locked(void) {
+  char name[64];
+  char path[PATH_MAX];
+  struct stat st;
+  snprintf(name, sizeof(name), "background.%d", CC_BACKGROUND_VERSION);
+
+  // A forked child shares the parent's open file, and with it the parent's flock
+  if(background_jobs.fd >= 0) {
+    close(background_jobs.fd);
+    background_jobs.fd = -1;
+  }
+
+  int fd = runtime_file_path(name, path, sizeof(path)) == 0 ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600) : -1;
+  background_jobs.opened_by = getpid();
+
+  if(fd < 0) {
+    background_jobs.registry = background_jobs.registry ? background_jobs.registry : &background_jobs.private_registry;
+    return;
+  }
+
+  // The first process sizes the file; the zero-filled pages are an empty registry
+  if(!background_jobs.registry || background_jobs.registry == &background_jobs.private_registry) {
+    void *map = MAP_FAILED;
+
+    if(flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 &&
+       (st.st_size >= (off_t)sizeof(CCBackgroundRegistry) || ftruncate(fd, (off_t)sizeof(CCBackgroundRegistry)) == 0)) {
+      map = mmap(NULL, sizeof(CCBackgroundRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    flock(fd, LOCK_UN);
+
+    if(map == MAP_FAILED) {
+      log_message("fn background_open_locked: The background registry is private to this process\n");
+      close(fd);
+      background_jobs.registry = &background_jobs.private_registry;
+      return;
+    }
+
+    background_jobs.registry = (CCBackgroundRegistry *)map;
+  }
+
+  background_jobs.fd = fd;
+}
+
+// Function to lock the registry for this thread and process, mapping it on first use, and to drop the
+// entries of processes that died without cleaning up (their children are reaped by init, so their
+// group ids may be recycled). Returns the registry; release it with background_unlock
+static CCBackgroundRegistry *background_lock(void) {
+  pthread_mutex_lock(&background_jobs.lock);
+
+  if(!background_jobs.registry || (background_jobs.registry != &background_jobs.private_registry &&
+                                   background_jobs.opened_by != getpid())) {
+    background_open_locked();
+  }
+
+  while(background_jobs.fd >= 0 && flock(background_jobs.fd, LOCK_EX) != 0 && errno == EINTR) {
+  }
+
+  CCBackgroundRegistry *registry = background_jobs.registry;
+
+  for(int i = 0; i < CC_MAX_BACKGROUND_JOBS; i++) {
+    if(registry->groups[i].group != 0 && !process_alive(registry->groups[i].owner)) {
+      registry->groups[i].group = 0;
+    }
+  }
+
+  for(int i = 0; i < CC_MAX_INTERACTIVE_PROCESSES; i++) {
+    if(registry->interactive[i].pid != 0 && !process_alive(registry->interactive[i].pid)) {
+      registry->interactive[i].pid = 0;
+    }
+  }
+
+  background_continue_locked(registry);
+  return registry;
+}
+
+// Function to release the registry taken with background_lock
+static void background_unlock(void) {
+  if(background_jobs.fd >= 0) {
+    flock(background_jobs.fd, LOCK_UN);
+  }
+
+  pthread_mutex_unlock(&background_jobs.lock);
+}
+
+// Function to track a background child; it is stopped at once when an interactive request is running
+static void background_register(pid_t group) {
+  CCBackgroundRegistry *registry = background_lock();
+
+  for(int i = 0; i < CC_MAX_BACKGROUND_JOBS; i++) {
+    if(registry->groups[i].group == 0) {
+      registry->groups[i].group = group;
+      registry->groups[i].owner = getpid();
+      background_jobs.count++;
+
+      if(registry->stopped) {
+        kill(-group, SIGSTOP);
+      }
+
+      else if(background_interactive_locked(registry)) {
+        background_stop_locked(registry);
+      }
+
+      break;
+    }
+  }
+
+  background_unlock();
+}
+
+// Function to count the background children registered by any of the given processes
+static int background_count(const pid_t *owners, int count) {
+  CCBackgroundRegistry *registry = background_lock();
+  int jobs = 0;
+
+  for(int i = 0; i < CC_MAX_BACKGROUND_JOBS; i++) {
+    for(int j = 0; registry->groups[i].group != 0 && j < count; j++) {
+      if(registry->groups[i].owner == owners[j]) {
+        jobs++;
+        break;
+      }
+    }
+  }
+
+  background_unlock();
+  return jobs;
+}
+
+// Function to forget a background child that has exited (but is not reaped yet)
+static void background_unregister(pid_t group) {
+  CCBackgroundRegistry *registry = background_lock();
+
+  for(int i = 0; i < CC_MAX_BACKGROUND_JOBS; i++) {
+    if(registry->groups[i].group == group && registry->groups[i].owner == getpid()) {
+      registry->groups[i].group = 0;
+      background_jobs.count--;
+      break;
+    }
+  }
+
+  background_unlock();
+}
+
+// Function to mark the start of an interactive clang run: background work of every process of the
+// user is stopped until it ends
+static void interactive_begin(void) {
+  CCBackgroundRegistry *registry = background_lock();
+  CCInteractiveProcess *slot = NULL;
+
+  for(int i = 0; i < CC_MAX_INTERACTIVE_PROCESSES; i++) {
+    if(registry->interactive[i].pid == getpid() || (!slot && registry->interactive[i].pid == 0)) {
+      slot = &registry->interactive[i];
+    }
+
+    if(registry->interactive[i].pid == getpid()) {
+      break;
+    }
+  }
+
+  if(slot) {
+    slot->runs = slot->pid == getpid() ? slot->runs + 1 : 1;
+    slot->pid = getpid();
+    background_stop_locked(registry);
+  }
+
+  background_unlock();
+}
+
+// Function to mark the end of an interactive clang run; the last one of the user continues background work
+static void interactive_end(void) {
+  CCBackgroundRegistry *registry = background_lock();
+
+  for(int i = 0; i < CC_MAX_INTERACTIVE_PROCESSES; i++) {
+    if(registry->interactive[i].pid == getpid()) {
+      if(--registry->interactive[i].runs <= 0) {
+        registry->interactive[i].pid = 0;
+      }
+
+      break;
+    }
+  }
+
+  background_continue_locked(registry);
+  background_unlock();
+}
+
+/*
+  Function Description:
+    Starts argv[0] (looked up in PATH) in a new process group.
+
+  Parameters:
+    - argv (char *const []): NULL-terminated argument vector.
+    - directory (const char *): Working directory of the child, NULL to inherit.
+    - launch (const CCLaunch *): Resource limits and scheduling class (the deadline is enforced by
+      the readers below).
+    - capture_output (int): CC_CAPTURE_NONE, CC_CAPTURE_STDOUT, CC_CAPTURE_ALL or CC_CAPTURE_SESSION;
+      what is captured is readable from child->output_fd.
+    - child (CCChild *): Receives the pid and the pipe.
+
+  Return Value:
+    - int: 0 when the child was started, 1 on failure. An exec failure shows up as exit status 127.
+*/
+static int spawn_child(char *const argv[], const char *directory, const CCLaunch *launch, int capture_output,
+                       CCChild *child) {
+  int pipe_fd[2] = {-1, -1};
+#if defined(__linux__)
+  // Parsed before fork(): the child of a multithreaded daemon should do as little as possible
+  cpu_set_t background_cpus;
+  const char *cpu_list = getenv("CODE_CONNECTOR_BACKGROUND_CPUS");
+  int pin_cpus = launch->launch_class == CC_LAUNCH_BACKGROUND && cpu_list &&
+                 parse_cpu_list(cpu_list, &background_cpus) == 0;
+#endif
+
+  // A session socket carries both directions; send() on it cannot raise SIGPIPE in the caller
+  if(capture_output == CC_CAPTURE_SESSION ? socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pipe_fd) != 0 :
+     capture_output && pipe(pipe_fd) != 0) {
+    perror("pipe");
+    return 1;
+  }
+
+  pid_t pid = fork();
+
+  if(pid == 0) {
+    setpgid(0, 0);
+    int null_fd = open("/dev/null", O_RDWR);
+
+    if(null_fd >= 0) {
+      dup2(capture_output == CC_CAPTURE_SESSION ? pipe_fd[1] : null_fd, STDIN_FILENO);
+      dup2(capture_output ? pipe_fd[1] : null_fd, STDOUT_FILENO);
+      // Diagnostics of a half-typed buffer must not reach the editor
+      dup2(capture_output == CC_CAPTURE_ALL ? pipe_fd[1] : null_fd, STDERR_FILENO);
+      close(null_fd);
+    }
+
+    if(capture_output) {
+      close(pipe_fd[0]);
+      close(pipe_fd[1]);
+    }
+
+    if(launch->memory_limit_mb > 0) {
+      struct rlimit limit;
+      limit.rlim_cur = limit.rlim_max = (rlim_t)launch->memory_limit_mb * 1024 * 1024;
+      setrlimit(RLIMIT_AS, &limit);
+    }
+
+    if(launch->cpu_limit_sec > 0) {
+      struct rlimit limit;
+      limit.rlim_cur = (rlim_t)launch->cpu_limit_sec;
+      limit.rlim_max = (rlim_t)launch->cpu_limit_sec + 1;  // SIGXCPU first, SIGKILL a second later
+      setrlimit(RLIMIT_CPU, &limit);
+    }
+
+    if(launch->launch_class == CC_LAUNCH_BACKGROUND) {
+#if defined(__linux__)
+      struct sched_param param = {0};
+      sched_setscheduler(0, SCHED_IDLE, &param);
+      syscall(SYS_ioprio_set, 1, 0, 3 << 13);  // IOPRIO_WHO_PROCESS, self, IOPRIO_CLASS_IDLE
+
+      if(pin_cpus) {
+        sched_setaffinity(0, sizeof(background_cpus), &background_cpus);
+      }
+
+#endif
+      setpriority(PRIO_PROCESS, 0, 19);
+    }
+
+    if(directory && chdir(directory) != 0) {
+      _exit(127);
+    }
+
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+
+  if(capture_output) {
+    close(pipe_fd[1]);
+  }
+
+  if(pid < 0) {
+    perror("fork");
+
+    if(capture_output) {
+      close(pipe_fd[0]);
+    }
+
+    return 1;
+  }
+
+  setpgid(pid, pid);  // Also from the parent, so the group exists before anyone can kill it
+  child->pid = pid;
+  child->output_fd = capture_output ? pipe_fd[0] : -1;
+  child->background = launch->launch_class == CC_LAUNCH_BACKGROUND;
+  clock_gettime(CLOCK_MONOTONIC, &child->started);
+
+  if(child->background) {
+    background_register(pid);
+  }
+
+  return 0;
+}
+
+// Function to get the milliseconds left until a child's deadline, -1 when it has none
+static int remaining_ms(const CCChild *child, const CCLaunch *launch) {
+  if(launch->timeout_ms <= 0) {
+    return -1;
+  }
+
+  long left = launch->timeout_ms - elapsed_ms(&child->started);
+  return left > 0 ? (int)left : 0;
+}
+
+// Function to read a child's stdout into output (max_length bytes plus terminator) until EOF or the deadline
+// The process group is killed when the deadline passes or the output does not fit
+// Returns 0 at EOF, 1 at the deadline, 2 on overflow; *length receives the bytes read
+static int read_child_output(CCChild *child, const CCLaunch *launch, char *output, size_t max_length, size_t *length) {
+  int outcome = 0;
+  *length = 0;
+
+  for(;;) {
+    struct pollfd pfd = {child->output_fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, remaining_ms(child, launch));
+
+    if(ready < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(ready == 0) {
+      outcome = 1;
+      break;
+    }
+
+    ssize_t got = read(child->output_fd, output + *length, max_length - *length);
+
+    if(got < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(got <= 0) {
+      break;
+    }
+
+    *length += (size_t)got;
+
+    if(*length == max_length) {
+      outcome = 2;
+      break;
+    }
+  }
+
+  output[*length] = '\0';
+
+  if(outcome != 0) {
+    kill(-child->pid, SIGKILL);
+  }
+
+  return outcome;
+}
+
+// Function to pass every line a child writes to on_line (without the newline) until EOF or the deadline
+// Lines longer than MAX_LINE_LENGTH - 1 are passed in pieces
+// Returns 0 at EOF, 1 at the deadline (the process group is killed)
+static int read_child_lines(CCChild *child, const CCLaunch *launch, void (*on_line)(const char *line, void *user),
+                            void *user) {
+  char buffer[MAX_LINE_LENGTH];
+  size_t length = 0;
+
+  for(;;) {
+    struct pollfd pfd = {child->output_fd, POLLIN, 0};
+    int left = remaining_ms(child, launch);
+    // A background child also wakes up now and then to drop the stop of an interactive run whose process died
+    int check = child->background && (left < 0 || left > CC_BACKGROUND_CHECK_MS);
+    int ready = poll(&pfd, 1, check ? CC_BACKGROUND_CHECK_MS : left);
+
+    if(ready < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(ready == 0 && check) {
+      background_lock();
+      background_unlock();
+      continue;
+    }
+
+    if(ready == 0) {
+      kill(-child->pid, SIGKILL);
+      return 1;
+    }
+
+    ssize_t got = read(child->output_fd, buffer + length, sizeof(buffer) - 1 - length);
+
+    if(got < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(got <= 0) {
+      break;
+    }
+
+    length += (size_t)got;
+    size_t start = 0;
+
+    for(size_t i = 0; i < length; i++) {
+      if(buffer[i] == '\n') {
+        buffer[i] = '\0';
+        on_line(buffer + start, user);
+        start = i + 1;
+      }
+    }
+
+    if(start == 0 && length == sizeof(buffer) - 1) {
+      buffer[length] = '\0';
+      on_line(buffer, user);
+      length = 0;
+    }
+
+    else {
+      memmove(buffer, buffer + start, length - start);
+      length -= start;
+    }
+  }
+
+  if(length > 0) {
+    buffer[length] = '\0';
+    on_line(buffer, user);
+  }
+
+  return 0;
+}
+
+// Function to reap a child, killing its process group when the deadline passes first
+// Returns 0 when it exited by itself, 1 when it was killed at the deadline; *exit_status gets the wait status
+static int wait_child(CCChild *child, const CCLaunch *launch, int *exit_status) {
+  int timed_out = 0;
+
+  if(child->output_fd >= 0) {
+    close(child->output_fd);
+    child->output_fd = -1;
+  }
+
+  for(;;) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    int waited = waitid(P_PID, (id_t)child->pid, &info,
+                        WEXITED | WNOWAIT | (launch->timeout_ms > 0 && !timed_out ? WNOHANG : 0));
+
+    if(waited == 0 && info.si_pid == child->pid) {
+      if(child->background) {
+        background_unregister(child->pid);
+      }
+
+      if(waitpid(child->pid, exit_status, 0) != child->pid) {
+        *exit_status = 0;
+      }
+
+      return timed_out;
+    }
+
+    if(waited < 0 && errno != EINTR) {
+      *exit_status = 0;
+      return timed_out;
+    }
+
+    if(waited == 0) {
+      if(elapsed_ms(&child->started) >= launch->timeout_ms) {
+        kill(-child->pid, SIGKILL);
+        timed_out = 1;
+      }
+
+      else {
+        struct timespec pause = {0, 10 * 1000000L};
+        nanosleep(&pause, NULL);
+      }
+    }
+  }
+}
+
+/*
+  Function Description:
+    Retrieves the CPU architecture (target) from the `clang --version` command and stores it in the
+    provided output buffer. It first checks the cache; if not cached, it runs the command, parses
+    the output for the "Target:" line, and caches the result for future use.
+
+  Parameters:
+    - output (char *): A caller-provided buffer where the CPU architecture string (e.g.,
+      "x86_64-unknown-linux-gnu") is stored. Must be at least MAX_LINE_LENGTH bytes.
+
+  Return Value:
+    - int: Returns 0 on success (target retrieved and stored); 1 on failure (e.g., fork, clang, or parsing fails).
+
+  Detailed Steps:
+    1. Check Cache:
+       - If completion_cache.is_valid is true and cpu_arch isn’t empty, copies cached value to output.
+       - Limits copy to MAX_LINE_LENGTH - 1, null-terminates, and returns 0.
+    2. Allocate Output Buffer:
+       - Allocates a temporary buffer (output_buffer) of MAX_OUTPUT size for clang’s output.
+    3. Set Up Pipe and Fork:
+       - Creates a pipe to capture clang’s output.
+       - Forks a child process; if fork fails, logs and returns 1.
+    4. Child Process:
+       - Redirects stdout to pipe’s write end (dup2), closes unused pipe ends, and runs `clang --version`.
+       - Exits child with 0 (success) or after execlp fails.
+    5. Parent Process:
+       - Closes pipe’s write end, reads from read end into output_buffer (up to MAX_OUTPUT - 1).
+       - Null-terminates buffer, closes pipe, waits for child to finish.
+    6. Parse Output:
+       - Searches for "Target: " in output_buffer with strstr.
+       - If found, extracts the target value (until newline), copies to output and cache, frees buffer, returns 0.
+       - If not found, frees buffer, returns 1.
+    7. Handle Errors:
+       - On fork failure, frees buffer and returns 1.
+
+  Flow and Logic:
+    - Step 1: Use cached value if available—fast path.
+    - Steps 2-5: Run clang and capture output if cache is empty—slow path setup.
+    - Step 6: Extract and store the target—slow path result.
+    - Step 7: Handle failures gracefully.
+    - Why this order? Cache check first optimizes; process setup then parsing follows UNIX exec pattern.
+
+  How It Works (For Novices):
+    - Imagine you need to know your computer’s “type” (like "x86_64") for clang to work right, and
+      you’ll write it in a notebook (output). You can check a memo (cache) or ask clang directly.
+    - get_clang_target is like this:
       - Step 1: Look at your memo (completion_cache.cpu_arch). If it’s there and valid, copy it to
         your notebook and done!
       - Step 2: If not, get a big scratch pad (output_buffer) to jot down clang’s answer.
@@ -1329,1073 +3756,8279 @@ int compare_strings(const void *a, const void *b) {
       - Step 7: If asking fails (fork), say “Oops” and stop.
     - It’s like checking a note or asking a friend for info, then saving it for next time!
 
-  Why It Works (For Novices):
-    - Speed: Uses the memo (cache) when possible, avoiding slow questions.
-    - Safety: Checks everything (cache, fork, output) to avoid mistakes.
-    - Smartness: Saves the answer (caches) so you don’t ask again.
+  Why It Works (For Novices):
+    - Speed: Uses the memo (cache) when possible, avoiding slow questions.
+    - Safety: Checks everything (cache, fork, output) to avoid mistakes.
+    - Smartness: Saves the answer (caches) so you don’t ask again.
+
+  Why It’s Designed This Way (For Maintainers):
+    - Cache Optimization: Leverages completion_cache for speed, critical for UNIX (per _POSIX_C_SOURCE)
+      where `clang --version` is a costly system call—used in collect_code_completion_args.
+    - UNIX Process Model: Fork/pipe/exec pattern is standard for capturing command output, robust for
+      clang’s variable-length response.
+    - Memory Safety: Allocates output_buffer dynamically (MAX_OUTPUT), avoiding stack overflows; frees
+      it on all paths. Assumes output is caller-allocated (MAX_LINE_LENGTH).
+    - Parsing: Simple "Target: " search with strstr is efficient for clang’s known output format,
+      though fragile if clang changes (e.g., multi-line targets).
+    - Error Handling: Returns 1 on any failure (fork, parse), letting callers (e.g., collect_code_completion_args)
+      retry or fallback—minimal but effective.
+
+  Maintenance Notes:
+    - Cache Sync: Relies on completion_cache being valid—test with clear_cache/update_cache to ensure
+      cpu_arch stays current.
+    - Buffer Size: MAX_OUTPUT must fit clang’s full output (test with verbose clang); MAX_LINE_LENGTH
+      must fit target (rarely exceeds 32 chars, but verify).
+    - Error Logging: perror on fork failure helps, but consider log_message for parsing failures
+      (e.g., "Target: not found") to debug clang output changes.
+    - Extensibility: To grab more clang info (e.g., version), expand parsing—current focus is narrow.
+    - Robustness: No timeout for clang—hung child could stall; add waitpid timeout if this occurs.
+    - Steps 2-6 live in query_clang_target, which cc_context also uses to detect the target once per
+      context with its configured compiler.
+*/
+
+// Function to run `<clang> --version` and copy the value of its `Target:` line into output (MAX_LINE_LENGTH bytes)
+// Returns 0 on success, 1 on failure
+static int query_clang_target(const char *clang, char *output) {
+  const char *target_str = "Target: ";
+  char *output_buffer = (char *)malloc(MAX_OUTPUT * sizeof(char));
+  char *const argv[] = {(char *)clang, "--version", NULL};
+  CCLaunch launch = {CC_DEFAULT_TIMEOUT_MS, 0, 0, CC_LAUNCH_INTERACTIVE};
+  CCChild child;
+  size_t total = 0;
+  int exit_status = 0;
+
+  if(!output_buffer) {
+    return 1;
+  }
+
+  if(spawn_child(argv, NULL, &launch, CC_CAPTURE_STDOUT, &child) != 0) {
+    free(output_buffer);
+    return 1;
+  }
+
+  // Read until EOF, a single read() may return only part of the version banner
+  int outcome = read_child_output(&child, &launch, output_buffer, MAX_OUTPUT - 1, &total);
+  wait_child(&child, &launch, &exit_status);
+
+  if(outcome == 1) {
+    log_message("fn query_clang_target: clang --version timed out\n");
+  }
+
+  // Find the line containing "Target: "
+  char *target_line = strstr(output_buffer, target_str);
+
+  if(!target_line) {
+    free(output_buffer);
+    return 1;
+  }
+
+  char *target_value = target_line + strlen(target_str);
+  size_t target_length = strcspn(target_value, "\n");
+
+  if(target_length > MAX_LINE_LENGTH - 1) {
+    target_length = MAX_LINE_LENGTH - 1;
+  }
+
+  memcpy(output, target_value, target_length);
+  output[target_length] = '\0';
+  free(output_buffer);
+  return 0;
+}
+
+// Function to get clang target. Filters output from the command `clang --version`. Takes the CPU architecture from the line `Target:`.
+int get_clang_target(char *output) {
+  // Check cache first
+  if(completion_cache.is_valid && completion_cache.cpu_arch[0] != '\0') {
+    strncpy(output, completion_cache.cpu_arch, MAX_LINE_LENGTH - 1);
+    output[MAX_LINE_LENGTH - 1] = '\0';
+    return 0;
+  }
+
+  if(query_clang_target("clang", output) != 0) {
+    return 1;
+  }
+
+  // Cache the CPU architecture
+  strncpy(completion_cache.cpu_arch, output, MAX_LINE_LENGTH - 1);
+  completion_cache.cpu_arch[MAX_LINE_LENGTH - 1] = '\0';
+  return 0;
+}
+
+// Function to append one shell-quoted argument to a growing command string
+// Arguments made only of safe characters are appended as-is, anything else is wrapped in single quotes
+// Returns 0 on success, 1 on allocation failure (the command is freed and set to NULL)
+static int append_command_arg(char **command, size_t *length, size_t *capacity, const char *arg) {
+  size_t needed = strlen(arg) * 4 + 4;  // Worst case: every character is a quote ('\'')
+
+  if(*length + needed >= *capacity) {
+    size_t new_capacity = (*capacity ? *capacity : 512);
+
+    while(*length + needed >= new_capacity) {
+      new_capacity *= 2;
+    }
+
+    char *grown = (char *)realloc(*command, new_capacity);
+
+    if(!grown) {
+      free(*command);
+      *command = NULL;
+      return 1;
+    }
+
+    *command = grown;
+    *capacity = new_capacity;
+  }
+
+  char *out = *command + *length;
+
+  if(*length > 0) {
+    *out++ = ' ';
+  }
+
+  if(arg[0] != '\0' && strspn(arg, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_=+./:,@%") == strlen(arg)) {
+    size_t arg_len = strlen(arg);
+    memcpy(out, arg, arg_len);
+    out += arg_len;
+  }
+
+  else {
+    *out++ = '\'';
+
+    for(const char *c = arg; *c; c++) {
+      if(*c == '\'') {
+        memcpy(out, "'\\''", 4);
+        out += 4;
+      }
+
+      else {
+        *out++ = *c;
+      }
+    }
+
+    *out++ = '\'';
+  }
+
+  *out = '\0';
+  *length = (size_t)(out - *command);
+  return 0;
+}
+
+/*
+  Function Description:
+    Process-shared project cache. One-shot code_connector_executable processes (and several Vim
+    instances) would otherwise each rebuild the same project state, so the merged flag sets of
+    lookup_layered_flags and the clang target are published to
+    $XDG_RUNTIME_DIR/code_connector/shared.cache.<version>, a fixed-size file every process maps
+    with MAP_SHARED. A cold process finds its directory's flags there after one mmap, a handful of
+    stat calls to validate them, and no parsing.
+
+    Concurrency is a seqlock per entry (and one for the target): the single writer, serialized
+    across processes by flock, makes the sequence odd, updates the entry and makes it even again.
+    Readers never lock; they copy the entry and retry when the sequence was odd or changed meanwhile,
+    giving up (a cache miss) after CC_SHARED_READ_RETRIES attempts.
+
+  Maintenance Notes:
+    - An entry is valid while the .ccls/compile_flags.txt fingerprints of every directory from the
+      source directory up to its checkout root are unchanged (this catches new overrides as well as
+      edits) and it is younger than CC_SHARED_TTL seconds, which bounds how long a new
+      compile_commands.json or project root can go unnoticed.
+    - The layout is versioned through the file name: bump CC_SHARED_VERSION whenever CCSharedCache
+      changes, so processes running an old build never map a file of another layout.
+    - Set CODE_CONNECTOR_NO_SHARED_CACHE to keep every process on its private caches.
+*/
+
+#define CC_SHARED_VERSION 1
+#define CC_SHARED_SLOTS 64            // Source directories kept; hashed, CC_SHARED_PROBES slots probed
+#define CC_SHARED_PROBES 4
+#define CC_SHARED_CHAIN 16            // Directories from a source directory to its checkout root
+#define CC_SHARED_FLAGS_BYTES 16384   // NUL-separated flags of all source kinds
+#define CC_SHARED_TTL 300
+#define CC_SHARED_READ_RETRIES 8
+
+static int runtime_file_path(const char *name, char *path, size_t size);
+
+// One published directory; guarded by its seqlock
+typedef struct {
+  unsigned int seq;                               // Odd while the writer updates the entry
+  unsigned int is_valid;
+  long long published;                            // time() of the update
+  char directory[PATH_MAX];
+  char root[PATH_MAX];
+  int chain_count;
+  CCFileFingerprint chain[CC_SHARED_CHAIN][2];    // .ccls and compile_flags.txt, directory upwards
+  int flag_counts[CC_SOURCE_KIND_COUNT];
+  char flags[CC_SHARED_FLAGS_BYTES];
+} CCSharedEntry;
+
+// Layout of the mapped file
+typedef struct {
+  unsigned int seq;                               // Seqlock of clang_path and triple
+  char clang_path[PATH_MAX];
+  char triple[MAX_LINE_LENGTH];
+  CCSharedEntry entries[CC_SHARED_SLOTS];
+} CCSharedCache;
+
+static pthread_once_t shared_cache_once = PTHREAD_ONCE_INIT;
+static CCSharedCache *shared_cache = NULL;
+static int shared_cache_fd = -1;
+
+// Function to map the shared cache file once per process; shared_cache stays NULL when unavailable
+static void shared_cache_open(void) {
+  char name[64];
+  char path[PATH_MAX];
+  struct stat st;
+
+  if(getenv("CODE_CONNECTOR_NO_SHARED_CACHE")) {
+    return;
+  }
+
+  snprintf(name, sizeof(name), "shared.cache.%d", CC_SHARED_VERSION);
+
+  if(runtime_file_path(name, path, sizeof(path)) != 0) {
+    return;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+  if(fd < 0) {
+    return;
+  }
+
+  // The first process sizes the file; the zero-filled pages are an empty cache
+  if(fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(CCSharedCache) &&
+                             (flock(fd, LOCK_EX) != 0 || ftruncate(fd, (off_t)sizeof(CCSharedCache)) != 0))) {
+    close(fd);
+    return;
+  }
+
+  flock(fd, LOCK_UN);
+  void *map = mmap(NULL, sizeof(CCSharedCache), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if(map == MAP_FAILED) {
+    log_message("fn shared_cache_open: mmap failed\n");
+    close(fd);
+    return;
+  }
+
+  shared_cache = (CCSharedCache *)map;
+  shared_cache_fd = fd;
+}
+
+// Function to return the mapped shared cache, or NULL when it is disabled or unavailable
+static CCSharedCache *shared_cache_get(void) {
+  pthread_once(&shared_cache_once, shared_cache_open);
+  return shared_cache;
+}
+
+// Function to copy a seqlock-guarded region without blocking. Returns 0 on a consistent copy
+static int shared_read(const unsigned int *seq, void *copy, const void *data, size_t size) {
+  for(int attempt = 0; attempt < CC_SHARED_READ_RETRIES; attempt++) {
+    unsigned int before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+    if(before & 1u) {
+      sched_yield();
+      continue;
+    }
+
+    memcpy(copy, data, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if(__atomic_load_n(seq, __ATOMIC_RELAXED) == before) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Function to open a seqlock write section; the caller holds the file lock
+static void shared_write_begin(unsigned int *seq) {
+  // A writer that died mid-update left the sequence odd; continuing from it is safe
+  __atomic_store_n(seq, (__atomic_load_n(seq, __ATOMIC_RELAXED) | 1u), __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Function to close a seqlock write section, publishing the update
+static void shared_write_end(unsigned int *seq) {
+  __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1u, __ATOMIC_RELEASE);
+}
+
+// Function to fingerprint the config files of every directory from directory up to top.
+// Returns the number of directories, or -1 when top is not an ancestor within CC_SHARED_CHAIN levels
+static int shared_chain_fingerprints(const char *directory, const char *top, CCFileFingerprint chain[][2]) {
+  char current[PATH_MAX];
+  snprintf(current, sizeof(current), "%s", directory);
+
+  for(int count = 0; count < CC_SHARED_CHAIN; count++) {
+    layer_fingerprints(current, chain[count]);
+
+    if(strcmp(current, top) == 0) {
+      return count + 1;
+    }
+
+    char *slash = strrchr(current, '/');
+
+    if(!slash || slash == current) {
+      return -1;
+    }
+
+    *slash = '\0';
+  }
+
+  return -1;
+}
+
+// Function to pick the first slot probed for a directory
+static unsigned long shared_slot(const char *directory) {
+  return hash_string(CC_HASH_SEED, directory) % CC_SHARED_SLOTS;
+}
+
+/*
+  Function Description:
+    Looks up a source directory in the shared cache and, when a valid entry exists, installs it as
+    the directory's merged flag set in the context.
+
+  Parameters:
+    - ctx (cc_context *): Context whose layered cache receives the entry; its lock is held.
+    - directory (const char *): Canonical directory of the source file.
+
+  Return Value:
+    - const CCLayeredFlags *: The installed context entry, or NULL on a miss.
+*/
+static const CCLayeredFlags *shared_cache_lookup(cc_context *ctx, const char *directory) {
+  CCSharedCache *cache = shared_cache_get();
+  CCSharedEntry *copy;
+  int found = 0;
+
+  if(!cache || (copy = (CCSharedEntry *)malloc(sizeof(CCSharedEntry))) == NULL) {
+    return NULL;
+  }
+
+  for(unsigned long probe = 0, slot = shared_slot(directory); probe < CC_SHARED_PROBES && !found; probe++) {
+    CCSharedEntry *entry = &cache->entries[(slot + probe) % CC_SHARED_SLOTS];
+    found = shared_read(&entry->seq, copy, entry, sizeof(*copy)) == 0 && copy->is_valid &&
+            strcmp(copy->directory, directory) == 0;
+  }
+
+  CCFileFingerprint now[CC_SHARED_CHAIN][2];
+
+  if(found) {
+    char top[PATH_MAX];
+    // The chain ends at the checkout root, chain_count - 1 levels up
+    snprintf(top, sizeof(top), "%s", directory);
+
+    for(int i = 1; i < copy->chain_count && strrchr(top, '/') != top; i++) {
+      *strrchr(top, '/') = '\0';
+    }
+
+    found = time(NULL) - copy->published < CC_SHARED_TTL && copy->chain_count > 0 &&
+            copy->chain_count <= CC_SHARED_CHAIN && shared_chain_fingerprints(directory, top, now) == copy->chain_count;
+
+    for(int i = 0; i < copy->chain_count && found; i++) {
+      found = fingerprints_equal(&now[i][0], &copy->chain[i][0]) && fingerprints_equal(&now[i][1], &copy->chain[i][1]);
+    }
+  }
+
+  CCLayeredFlags *slot = NULL;
+
+  if(found) {
+    // Reuse the context's entry for the directory, else an empty or the least recently used one
+    for(int i = 0; i < MAX_CACHED_DIRECTORIES && !slot; i++) {
+      slot = ctx->layered[i].is_valid && strcmp(ctx->layered[i].directory, directory) == 0 ? &ctx->layered[i] : NULL;
+    }
+
+    for(int i = 0; i < MAX_CACHED_DIRECTORIES && !slot; i++) {
+      slot = !ctx->layered[i].is_valid ? &ctx->layered[i] : NULL;
+    }
+
+    if(!slot) {
+      slot = &ctx->layered[0];
+
+      for(int i = 1; i < MAX_CACHED_DIRECTORIES; i++) {
+        slot = ctx->layered[i].last_used < slot->last_used ? &ctx->layered[i] : slot;
+      }
+    }
+
+    free_layered_flags(slot);
+    snprintf(slot->directory, sizeof(slot->directory), "%s", directory);
+    snprintf(slot->root, sizeof(slot->root), "%s", copy->root);
+    snprintf(slot->top, sizeof(slot->top), "%s", directory);
+    const char *current = copy->flags;
+    const char *end = copy->flags + sizeof(copy->flags);
+    int failed = 0;
+
+    for(int kind = 0; kind < CC_SOURCE_KIND_COUNT && !failed; kind++) {
+      for(int i = 0; i < copy->flag_counts[kind] && !failed; i++) {
+        size_t length = strnlen(current, (size_t)(end - current));
+        failed = current + length >= end || flag_list_append(&slot->flags[kind], current);
+        current += length + 1;
+      }
+    }
+
+    // Layers are the directories of the chain holding a config file
+    char layer[PATH_MAX];
+    snprintf(layer, sizeof(layer), "%s", directory);
+
+    for(int i = 0; i < copy->chain_count && !failed; i++) {
+      if((now[i][0].exists || now[i][1].exists) && slot->layer_count < CC_MAX_LAYERS) {
+        slot->layers[slot->layer_count] = strdup(layer);
+        failed = !slot->layers[slot->layer_count];
+        memcpy(slot->fingerprints[slot->layer_count], now[i], sizeof(now[i]));
+        slot->layer_count += !failed;
+      }
+
+      if(i + 1 < copy->chain_count) {
+        *strrchr(layer, '/') = '\0';
+        snprintf(slot->top, sizeof(slot->top), "%s", layer[0] ? layer : "/");
+      }
+    }
+
+    if(failed) {
+      free_layered_flags(slot);
+      slot = NULL;
+    }
+
+    else {
+      slot->walked_at = time(NULL);
+      slot->generation = ++ctx->layered_clock;
+      slot->last_used = slot->generation;
+      slot->is_valid = 1;
+      ctx->stats.shared_hits++;
+    }
+  }
+
+  free(copy);
+  return slot;
+}
+
+// Function to publish a context's merged flag set to the shared cache; silently skipped when the
+// cache is unavailable, the chain is too deep or the flags do not fit
+static void shared_cache_publish(const CCLayeredFlags *layered) {
+  CCSharedCache *cache = shared_cache_get();
+  CCSharedEntry *staged;
+
+  if(!cache || (staged = (CCSharedEntry *)calloc(1, sizeof(CCSharedEntry))) == NULL) {
+    return;
+  }
+
+  size_t used = 0;
+  int fits = 1;
+  staged->chain_count = shared_chain_fingerprints(layered->directory, layered->top, staged->chain);
+
+  for(int kind = 0; kind < CC_SOURCE_KIND_COUNT && fits; kind++) {
+    for(int i = 0; i < layered->flags[kind].count && fits; i++) {
+      size_t length = strlen(layered->flags[kind].args[i]) + 1;
+      fits = used + length <= sizeof(staged->flags);
+
+      if(fits) {
+        memcpy(staged->flags + used, layered->flags[kind].args[i], length);
+        used += length;
+      }
+    }
+
+    staged->flag_counts[kind] = layered->flags[kind].count;
+  }
+
+  if(fits && staged->chain_count > 0 && flock(shared_cache_fd, LOCK_EX) == 0) {
+    // Same directory, else a free slot, else the oldest among the probed ones
+    unsigned long first = shared_slot(layered->directory);
+    CCSharedEntry *target = &cache->entries[first];
+
+    for(unsigned long probe = 0; probe < CC_SHARED_PROBES; probe++) {
+      CCSharedEntry *entry = &cache->entries[(first + probe) % CC_SHARED_SLOTS];
+
+      if(entry->is_valid && strcmp(entry->directory, layered->directory) == 0) {
+        target = entry;
+        break;
+      }
+
+      if(!entry->is_valid ? target->is_valid : (target->is_valid && entry->published < target->published)) {
+        target = entry;
+      }
+    }
+
+    snprintf(staged->directory, sizeof(staged->directory), "%s", layered->directory);
+    snprintf(staged->root, sizeof(staged->root), "%s", layered->root);
+    staged->published = (long long)time(NULL);
+    staged->is_valid = 1;
+    shared_write_begin(&target->seq);
+    // Everything after the sequence number (the first member)
+    memcpy(&target->is_valid, &staged->is_valid, sizeof(*target) - offsetof(CCSharedEntry, is_valid));
+    shared_write_end(&target->seq);
+    flock(shared_cache_fd, LOCK_UN);
+  }
+
+  free(staged);
+}
+
+// Function to read the clang target published for clang_path. Returns 0 and fills triple on a hit
+static int shared_cache_triple(const char *clang_path, char *triple) {
+  CCSharedCache *cache = shared_cache_get();
+  struct {
+    char clang_path[PATH_MAX];
+    char triple[MAX_LINE_LENGTH];
+  } copy;  // Same layout as the two adjacent members of CCSharedCache
+
+  if(!cache || shared_read(&cache->seq, &copy, cache->clang_path, sizeof(copy)) != 0 ||
+     copy.triple[0] == '\0' || strcmp(copy.clang_path, clang_path) != 0) {
+    return 1;
+  }
+
+  snprintf(triple, MAX_LINE_LENGTH, "%s", copy.triple);
+  return 0;
+}
+
+// Function to publish the clang target of clang_path
+static void shared_cache_publish_triple(const char *clang_path, const char *triple) {
+  CCSharedCache *cache = shared_cache_get();
+
+  if(!cache || flock(shared_cache_fd, LOCK_EX) != 0) {
+    return;
+  }
+
+  shared_write_begin(&cache->seq);
+  snprintf(cache->clang_path, sizeof(cache->clang_path), "%s", clang_path);
+  snprintf(cache->triple, sizeof(cache->triple), "%s", triple);
+  shared_write_end(&cache->seq);
+  flock(shared_cache_fd, LOCK_UN);
+}
+
+// Function to get the clang target of a context; clang is queried once per context (or taken from the
+// shared cache), outside the context lock
+static int context_clang_target(cc_context *ctx, char *output) {
+  char clang[PATH_MAX];
+  pthread_mutex_lock(&ctx->lock);
+  snprintf(output, MAX_LINE_LENGTH, "%s", ctx->cpu_arch);
+  snprintf(clang, sizeof(clang), "%s", ctx->settings.clang_path);
+  pthread_mutex_unlock(&ctx->lock);
+
+  if(output[0] != '\0') {
+    return 0;
+  }
+
+  if(shared_cache_triple(clang, output) != 0) {
+    if(query_clang_target(clang, output) != 0) {
+      return 1;
+    }
+
+    shared_cache_publish_triple(clang, output);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  snprintf(ctx->cpu_arch, sizeof(ctx->cpu_arch), "%s", output);
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
+/*
+  Function Description:
+    Zero-config include discovery for checkouts without .ccls/compile_flags.txt or
+    compile_commands.json. The tree below the repository root (nearest .git/.hg/.svn, else the
+    file's directory) is walked by a bounded pool of threads: each directory is opened once by its
+    path and its entries are probed relative to that descriptor (file types come from d_type, else
+    fstatat; files are opened with openat), and the first CC_DISCOVERY_READ_BYTES of every C/C++
+    file are scanned for #include lines. Each include that names a project header (e.g. "net/socket.h" matching
+    <root>/lib/net/socket.h) votes for the directory it has to be resolved from (<root>/lib), and
+    the most voted directories become the -I flags of the project.
+
+  Maintenance Notes:
+    - The walk is bounded by CC_DISCOVERY_MAX_ENTRIES directory entries, CC_DISCOVERY_BUDGET_MS of
+      wall-clock time and CC_DISCOVERY_MAX_DEPTH levels, so opening a huge checkout stays interactive;
+      hidden directories and node_modules are skipped.
+    - Queued directories are kept as paths, not descriptors: a wide tree would otherwise hold one
+      open descriptor per pending directory and run into the descriptor limit.
+    - Results are cached per root in the context for CC_DISCOVERY_TTL seconds. Set
+      CODE_CONNECTOR_NO_DISCOVERY to keep the old behavior (no project, no completion).
+*/
+
+#define CC_DISCOVERY_MAX_THREADS 8
+#define CC_DISCOVERY_MAX_ENTRIES 200000  // Directory entries looked at per walk
+#define CC_DISCOVERY_BUDGET_MS 800       // Directories not started by then are skipped
+#define CC_DISCOVERY_READ_BYTES 16384    // Head of each file scanned for #include lines
+#define CC_DISCOVERY_MAX_DEPTH 12          // Directory levels below the root
+#define CC_DISCOVERY_MAX_DIRS 32         // -I directories kept, best ranked first
+#define CC_DISCOVERY_TTL 300             // Seconds a discovered include set is reused
+
+static int index_file_kind(const char *name);
+
+// Directory waiting to be read by a discovery worker
+typedef struct {
+  char *path;
+  int depth;
+} CCDiscoveryDir;
+
+// State shared by the discovery workers
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  CCDiscoveryDir *queue;
+  int queue_count;
+  int queue_capacity;
+  int active;                 // Workers reading a directory
+  int entries;                // Directory entries seen so far
+  struct timespec started;
+  CCFlagList headers;         // Absolute paths of the project headers
+  CCFlagList includes;        // Every include spec found, once per including file
+} CCDiscovery;
+
+// Include directory candidate and its votes
+typedef struct {
+  char *directory;
+  long votes;
+} CCDiscoveryVote;
+
+// Function to order strings for qsort
+static int compare_discovery_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to order header paths by file name, for looking them up by the last part of an include
+static int compare_discovery_basenames(const void *a, const void *b) {
+  return strcmp(strrchr(*(char *const *)a, '/') + 1, strrchr(*(char *const *)b, '/') + 1);
+}
+
+// Function to order votes by directory, then (second pass) by votes, most first
+static int compare_discovery_directories(const void *a, const void *b) {
+  return strcmp(((const CCDiscoveryVote *)a)->directory, ((const CCDiscoveryVote *)b)->directory);
+}
+
+static int compare_discovery_votes(const void *a, const void *b) {
+  long x = ((const CCDiscoveryVote *)a)->votes;
+  long y = ((const CCDiscoveryVote *)b)->votes;
+  return x < y ? 1 : x > y ? -1 : compare_discovery_directories(a, b);
+}
+
+// Function to queue a directory for the workers; the caller holds discovery->lock
+static void discovery_push_locked(CCDiscovery *discovery, const char *path, int depth) {
+  if(discovery->queue_count == discovery->queue_capacity) {
+    int capacity = discovery->queue_capacity ? discovery->queue_capacity * 2 : 64;
+    CCDiscoveryDir *queue = (CCDiscoveryDir *)realloc(discovery->queue, (size_t)capacity * sizeof(CCDiscoveryDir));
+
+    if(!queue) {
+      return;
+    }
+
+    discovery->queue = queue;
+    discovery->queue_capacity = capacity;
+  }
+
+  char *copy = strdup(path);
+
+  if(copy) {
+    discovery->queue[discovery->queue_count].path = copy;
+    discovery->queue[discovery->queue_count++].depth = depth;
+    pthread_cond_signal(&discovery->work);
+  }
+}
+
+// Function to add the #include specs of the head of a file (opened relative to its directory) to specs
+static void discovery_scan_file(int dir_fd, const char *name, CCFlagList *specs) {
+  char buffer[CC_DISCOVERY_READ_BYTES + 1];
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0) {
+    return;
+  }
+
+  ssize_t length = read(fd, buffer, CC_DISCOVERY_READ_BYTES);
+  close(fd);
+
+  if(length <= 0) {
+    return;
+  }
+
+  buffer[length] = '\0';
+
+  for(char *line = buffer; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+    char *cursor = line + strspn(line, " \t");
+
+    if(*cursor != '#') {
+      continue;
+    }
+
+    cursor += 1 + strspn(cursor + 1, " \t");
+
+    if(strncmp(cursor, "include", 7) != 0) {
+      continue;
+    }
+
+    cursor += 7 + strspn(cursor + 7, " \t");
+
+    if(*cursor != '"' && *cursor != '<') {
+      continue;
+    }
+
+    size_t length_of_spec = strcspn(cursor + 1, "\">\n");
+
+    if(length_of_spec > 0 && (cursor[1 + length_of_spec] == '"' || cursor[1 + length_of_spec] == '>')) {
+      argv_push(specs, cursor + 1, length_of_spec);
+    }
+  }
+}
+
+// Function to read one directory: queues its subdirectories, records headers and include specs
+static void discovery_scan_directory(CCDiscovery *discovery, const CCDiscoveryDir *dir) {
+  int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *stream = fd >= 0 ? fdopendir(fd) : NULL;
+  struct dirent *entry;
+  CCFlagList headers = {NULL, 0, 0};
+  CCFlagList specs = {NULL, 0, 0};
+  int seen = 0;
+
+  if(!stream) {
+    if(fd >= 0) {
+      close(fd);
+    }
+
+    return;
+  }
+
+  while((entry = readdir(stream)) != NULL) {
+    char path[PATH_MAX];
+    int is_dir = entry->d_type == DT_DIR;
+    int is_file = entry->d_type == DT_REG;
+
+    if(entry->d_name[0] == '.' || strcmp(entry->d_name, "node_modules") == 0) {
+      continue;
+    }
+
+    seen++;
+
+    if(entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+
+      if(fstatat(dirfd(stream), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        continue;
+      }
+
+      is_dir = S_ISDIR(st.st_mode);
+      is_file = S_ISREG(st.st_mode);
+    }
+
+    if(snprintf(path, sizeof(path), "%s/%s", dir->path, entry->d_name) >= (int)sizeof(path)) {
+      continue;
+    }
+
+    if(is_dir && dir->depth < CC_DISCOVERY_MAX_DEPTH) {
+      pthread_mutex_lock(&discovery->lock);
+      discovery_push_locked(discovery, path, dir->depth + 1);
+      pthread_mutex_unlock(&discovery->lock);
+    }
+
+    else if(is_file) {
+      int kind = index_file_kind(entry->d_name);
+
+      if(kind == 2) {
+        argv_push(&headers, path, strlen(path));
+      }
+
+      if(kind != 0) {
+        discovery_scan_file(dirfd(stream), entry->d_name, &specs);
+      }
+    }
+  }
+
+  closedir(stream);
+  pthread_mutex_lock(&discovery->lock);
+  discovery->entries += seen;
+
+  for(int i = 0; i < headers.count; i++) {
+    argv_push(&discovery->headers, headers.args[i], strlen(headers.args[i]));
+  }
+
+  for(int i = 0; i < specs.count; i++) {
+    argv_push(&discovery->includes, specs.args[i], strlen(specs.args[i]));
+  }
+
+  pthread_mutex_unlock(&discovery->lock);
+  flag_list_free(&headers);
+  flag_list_free(&specs);
+}
+
+// Function run by each discovery worker until the queue is empty and no worker can add to it
+static void *discovery_worker(void *arg) {
+  CCDiscovery *discovery = (CCDiscovery *)arg;
+  pthread_mutex_lock(&discovery->lock);
+
+  for(;;) {
+    while(discovery->queue_count == 0 && discovery->active > 0) {
+      pthread_cond_wait(&discovery->work, &discovery->lock);
+    }
+
+    if(discovery->queue_count == 0) {
+      break;
+    }
+
+    CCDiscoveryDir dir = discovery->queue[--discovery->queue_count];
+
+    // Out of budget: drop the directory, the walk ends once the queue drains
+    if(discovery->entries >= CC_DISCOVERY_MAX_ENTRIES || elapsed_ms(&discovery->started) >= CC_DISCOVERY_BUDGET_MS) {
+      free(dir.path);
+      continue;
+    }
+
+    discovery->active++;
+    pthread_mutex_unlock(&discovery->lock);
+    discovery_scan_directory(discovery, &dir);
+    free(dir.path);
+    pthread_mutex_lock(&discovery->lock);
+    discovery->active--;
+  }
+
+  pthread_cond_broadcast(&discovery->work);
+  pthread_mutex_unlock(&discovery->lock);
+  return NULL;
+}
+
+// Function to find the root of an unconfigured checkout: the nearest directory holding .git, .hg or
+// .svn (below $HOME and any ceiling directory), else dir itself. Returns 0 and fills root (PATH_MAX) on success
+static int discover_project_root(const char *dir, char *root) {
+  const char *markers[] = {".git", ".hg", ".svn"};
+  const char *home = getenv("HOME");
+  char current[PATH_MAX];
+  char marker[PATH_MAX + 8];
+
+  if(!realpath(dir, current)) {
+    return 1;
+  }
+
+  snprintf(root, PATH_MAX, "%s", current);
+
+  for(;;) {
+    for(size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); i++) {
+      snprintf(marker, sizeof(marker), "%s/%s", current, markers[i]);
+
+      if(access(marker, F_OK) == 0) {
+        snprintf(root, PATH_MAX, "%s", current);
+        return 0;
+      }
+    }
+
+    char *slash = strrchr(current, '/');
+
+    if(!slash || slash == current || (home && strcmp(current, home) == 0) || is_ceiling_directory(current)) {
+      return 0;
+    }
+
+    *slash = '\0';
+  }
+}
+
+/*
+  Function Description:
+    Walks the tree below root with the discovery pool and ranks the include directories.
+
+  Parameters:
+    - root (const char *): Canonical root from discover_project_root.
+    - flags (CCFlagList *): Empty list receiving "-I<dir>" flags, best ranked first.
+
+  Return Value:
+    - int: 0 on success (flags may still be empty), 1 on allocation failure.
+*/
+static int discover_include_flags(const char *root, CCFlagList *flags) {
+  CCDiscovery discovery;
+  pthread_t threads[CC_DISCOVERY_MAX_THREADS];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  // Mostly waiting for the disk, so a few threads help even on one core
+  int thread_count = cores * 2 < 2 ? 2 : cores * 2 > CC_DISCOVERY_MAX_THREADS ? CC_DISCOVERY_MAX_THREADS : (int)cores * 2;
+  int started = 0;
+  memset(&discovery, 0, sizeof(discovery));
+  pthread_mutex_init(&discovery.lock, NULL);
+  pthread_cond_init(&discovery.work, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &discovery.started);
+  discovery_push_locked(&discovery, root, 0);
+
+  while(started < thread_count && pthread_create(&threads[started], NULL, discovery_worker, &discovery) == 0) {
+    started++;
+  }
+
+  if(started == 0) {
+    discovery_worker(&discovery);
+  }
+
+  for(int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(discovery.queue);
+  pthread_cond_destroy(&discovery.work);
+  pthread_mutex_destroy(&discovery.lock);
+  // Count each distinct include spec once, then let it vote for every directory it resolves from
+  CCFlagList *headers = &discovery.headers;
+  CCFlagList *includes = &discovery.includes;
+  CCDiscoveryVote *votes = (CCDiscoveryVote *)malloc((size_t)(headers->count + 1) * (size_t)4 * sizeof(CCDiscoveryVote));
+  int vote_count = 0;
+  int vote_capacity = (headers->count + 1) * 4;
+  int failed = !votes;
+  qsort(headers->args, (size_t)headers->count, sizeof(char *), compare_discovery_basenames);
+  qsort(includes->args, (size_t)includes->count, sizeof(char *), compare_discovery_strings);
+
+  for(int i = 0; i < includes->count && !failed;) {
+    const char *spec = includes->args[i];
+    long uses = 0;
+
+    while(i < includes->count && strcmp(includes->args[i], spec) == 0) {
+      uses++;
+      i++;
+    }
+
+    const char *name = strrchr(spec, '/') ? strrchr(spec, '/') + 1 : spec;
+    size_t spec_length = strlen(spec);
+    int low = 0;
+    int high = headers->count;
+
+    // First header whose file name is not below name
+    while(low < high) {
+      int middle = (low + high) / 2;
+
+      if(strcmp(strrchr(headers->args[middle], '/') + 1, name) < 0) {
+        low = middle + 1;
+      }
+
+      else {
+        high = middle;
+      }
+    }
+
+    for(int h = low; h < headers->count && strcmp(strrchr(headers->args[h], '/') + 1, name) == 0; h++) {
+      const char *path = headers->args[h];
+      size_t path_length = strlen(path);
+
+      if(path_length <= spec_length || path[path_length - spec_length - 1] != '/' ||
+         strcmp(path + path_length - spec_length, spec) != 0 || vote_count == vote_capacity) {
+        continue;
+      }
+
+      votes[vote_count].directory = strndup(path, path_length - spec_length - 1);
+      votes[vote_count].votes = uses;
+      failed = !votes[vote_count].directory;
+      vote_count += !failed;
+    }
+  }
+
+  if(!failed) {
+    // Merge the votes per directory, then keep the best ranked ones
+    qsort(votes, (size_t)vote_count, sizeof(CCDiscoveryVote), compare_discovery_directories);
+    int merged = 0;
+
+    for(int i = 0; i < vote_count; i++) {
+      if(merged > 0 && strcmp(votes[merged - 1].directory, votes[i].directory) == 0) {
+        votes[merged - 1].votes += votes[i].votes;
+        free(votes[i].directory);
+      }
+
+      else {
+        votes[merged++] = votes[i];
+      }
+    }
+
+    vote_count = merged;
+    qsort(votes, (size_t)vote_count, sizeof(CCDiscoveryVote), compare_discovery_votes);
+
+    for(int i = 0; i < vote_count && i < CC_DISCOVERY_MAX_DIRS && !failed; i++) {
+      char flag[PATH_MAX + 4];
+      snprintf(flag, sizeof(flag), "-I%s", votes[i].directory);
+      failed = flag_list_append(flags, flag);
+    }
+  }
+
+  for(int i = 0; i < vote_count; i++) {
+    free(votes[i].directory);
+  }
+
+  free(votes);
+  flag_list_free(headers);
+  flag_list_free(includes);
+  return failed;
+}
+
+/*
+  Function Description:
+    Returns the discovered include flags of an unconfigured checkout, walking its tree only when the
+    context has no result younger than CC_DISCOVERY_TTL seconds for that root.
+
+  Parameters:
+    - ctx (cc_context *): Context owning the cache; its lock must NOT be held on entry.
+    - root (const char *): Canonical root from discover_project_root.
+
+  Return Value:
+    - const CCDiscoveredFlags *: Cache-owned entry, or NULL on failure. Either way the function
+      returns with ctx->lock held, so the entry stays valid until the caller unlocks.
+
+  Maintenance Notes:
+    - The walk runs without the lock; two requests racing for a new root may both walk it, and the
+      later result simply replaces the earlier one.
+*/
+static const CCDiscoveredFlags *lookup_discovered_flags(cc_context *ctx, const char *root) {
+  CCDiscoveredFlags *slot = NULL;
+  pthread_mutex_lock(&ctx->lock);
+
+  for(int i = 0; i < MAX_CACHED_PROJECTS; i++) {
+    if(ctx->discovered[i].is_valid && strcmp(ctx->discovered[i].root, root) == 0 &&
+       time(NULL) - ctx->discovered[i].discovered_at < CC_DISCOVERY_TTL) {
+      ctx->discovered[i].last_used = ++ctx->discovery_clock;
+      return &ctx->discovered[i];
+    }
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+  CCFlagList flags = {NULL, 0, 0};
+
+  if(discover_include_flags(root, &flags) != 0) {
+    flag_list_free(&flags);
+    pthread_mutex_lock(&ctx->lock);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+
+  for(int i = 0; i < MAX_CACHED_PROJECTS && !slot; i++) {
+    slot = ctx->discovered[i].is_valid && strcmp(ctx->discovered[i].root, root) == 0 ? &ctx->discovered[i] : NULL;
+  }
+
+  for(int i = 0; i < MAX_CACHED_PROJECTS && !slot; i++) {
+    slot = !ctx->discovered[i].is_valid ? &ctx->discovered[i] : NULL;
+  }
+
+  if(!slot) {
+    slot = &ctx->discovered[0];
+
+    for(int i = 1; i < MAX_CACHED_PROJECTS; i++) {
+      slot = ctx->discovered[i].last_used < slot->last_used ? &ctx->discovered[i] : slot;
+    }
+  }
+
+  flag_list_free(&slot->flags);
+  snprintf(slot->root, sizeof(slot->root), "%s", root);
+  slot->flags = flags;
+  slot->discovered_at = time(NULL);
+  slot->generation++;
+  slot->last_used = ++ctx->discovery_clock;
+  slot->is_valid = 1;
+  ctx->stats.discoveries++;
+  return slot;
+}
+
+/*
+  Function Description:
+    Implicit clang modules (CODE_CONNECTOR_MODULES). Most of the parse of a file including large SDK
+    headers goes to the same system headers every time; with modules, clang compiles each module
+    once into a per-user cache and later parses load the compiled form. context_build_argv adds
+    -fmodules and a cache path keyed by the target and a fingerprint of the flag set (so different
+    configurations never share compiled modules), plus a generated module map for every project
+    include directory that has none.
+
+  Maintenance Notes:
+    - The cache is $XDG_CACHE_HOME/code_connector/modules (else ~/.cache/code_connector/modules);
+      clang prunes it itself. Generated maps live in its maps/ directory, never in the project.
+    - A generated map makes every header of the directory a submodule of its own, named by
+      absolute path, so a header is only compiled together with what it includes. It is rewritten
+      when the directory changes (a header added or removed); edits to a header are noticed by
+      clang, which rebuilds the module.
+    - Headers that only work after the includer's macros are not modular; clang_backend_complete
+      completes without modules when the modular parse gives no completion.
+*/
+
+#define CC_MODULE_MAP_HEADERS 512  // Headers listed in one generated module map
+
+// Function to build the path of the per-user modules cache, creating it if needed. Returns 0 on success
+static int modules_cache_directory(char *path, size_t size) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int length = xdg && xdg[0] == '/' ? snprintf(path, size, "%s/code_connector/modules/maps", xdg) :
+               home && home[0] == '/' ? snprintf(path, size, "%s/.cache/code_connector/modules/maps", home) : -1;
+
+  if(length < 0 || (size_t)length >= size) {
+    return 1;
+  }
+
+  // Every component of the path, then strip "/maps" again
+  for(char *slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+    if(slash) {
+      *slash = '\0';
+    }
+
+    int failed = mkdir(path, 0700) != 0 && errno != EEXIST;
+
+    if(slash) {
+      *slash = '/';
+    }
+
+    if(failed) {
+      return 1;
+    }
+
+    if(!slash) {
+      break;
+    }
+  }
+
+  path[length - 5] = '\0';
+  return 0;
+}
+
+// Function to check whether a file name is a header's
+static int is_header_name(const char *name) {
+  const char *extension = strrchr(name, '.');
+  return extension && (strcmp(extension, ".h") == 0 || strcmp(extension, ".hh") == 0 || strcmp(extension, ".hpp") == 0 ||
+                       strcmp(extension, ".hxx") == 0 || strcmp(extension, ".H") == 0);
+}
+
+// Function to write text into a module map string literal, escaping quotes, backslashes and newlines
+static void write_module_map_string(FILE *out, const char *text) {
+  for(const char *c = text; *c; c++) {
+    if(*c == '"' || *c == '\\') {
+      fputc('\\', out);
+      fputc(*c, out);
+    }
+
+    else if(*c == '\n') {
+      fputs("\\n", out);
+    }
+
+    else {
+      fputc(*c, out);
+    }
+  }
+}
+
+// Function to get the generated module map of an include directory that has none of its own, writing
+// it when the directory changed since. Returns 0 when map names a map to pass, 1 otherwise
+static int module_map_for_directory(const char *cache, const char *directory, char *map, size_t size) {
+  static unsigned long map_clock = 0;
+  char own[PATH_MAX];
+  char temporary[PATH_MAX + 48];
+  struct stat directory_st, map_st;
+
+  for(int i = 0; i < 2; i++) {
+    snprintf(own, sizeof(own), "%s/%s", directory, i ? "module.map" : "module.modulemap");
+
+    if(access(own, F_OK) == 0) {
+      return 1;  // clang finds it by itself
+    }
+  }
+
+  unsigned long hash = hash_string(CC_HASH_SEED, directory);
+
+  if(stat(directory, &directory_st) != 0 || !S_ISDIR(directory_st.st_mode) ||
+     (size_t)snprintf(map, size, "%s/maps/%016lx.modulemap", cache, hash) >= size) {
+    return 1;
+  }
+
+  if(stat(map, &map_st) == 0 && map_st.st_mtime > directory_st.st_mtime) {
+    return 0;
+  }
+
+  // Unique per call, so threads writing the same map never share a temporary file
+  if((size_t)snprintf(temporary, sizeof(temporary), "%s.%ld.%lu", map, (long)getpid(),
+                      __atomic_add_fetch(&map_clock, 1, __ATOMIC_RELAXED)) >= sizeof(temporary)) {
+    return 1;
+  }
+
+  DIR *dir = opendir(directory);
+  FILE *out = dir ? fopen(temporary, "w") : NULL;
+  struct dirent *entry;
+  int headers = 0;
+
+  if(!out) {
+    if(dir) {
+      closedir(dir);
+    }
+
+    return 1;
+  }
+
+  fprintf(out, "// Generated by code_connector for ");
+  write_module_map_string(out, directory);
+  fprintf(out, "\nmodule code_connector_%016lx {\n", hash);
+
+  while((entry = readdir(dir)) != NULL && headers < CC_MODULE_MAP_HEADERS) {
+    if(entry->d_name[0] == '.' || !is_header_name(entry->d_name)) {
+      continue;
+    }
+
+    fprintf(out, "  module h%d_", headers++);
+
+    for(const char *c = entry->d_name; *c; c++) {
+      fputc(isalnum((unsigned char)*c) ? *c : '_', out);
+    }
+
+    fprintf(out, " {\n    header \"");
+    write_module_map_string(out, directory);
+    fputc('/', out);
+    write_module_map_string(out, entry->d_name);
+    fprintf(out, "\"\n    export *\n  }\n");
+  }
+
+  fprintf(out, "}\n");
+  closedir(dir);
+  int failed = fclose(out) != 0 || headers == 0 || rename(temporary, map) != 0;
+
+  if(failed) {
+    unlink(temporary);
+  }
+
+  return failed;
+}
+
+// Function to add the modules arguments for a flag set: the keyed cache path and the maps of the project
+// include directories in include_dirs. Returns 0 on success, 1 on allocation failure
+static int push_module_args(CCFlagList *argv, const char *target, unsigned long fingerprint, const CCFlagList *include_dirs) {
+  char cache[PATH_MAX];
+  char map[PATH_MAX];
+  char arg[2 * PATH_MAX];
+
+  if(modules_cache_directory(cache, sizeof(cache)) != 0) {
+    return 0;  // Without a cache directory clang runs as before
+  }
+
+  int length = snprintf(arg, sizeof(arg), "-fmodules-cache-path=%s/", cache);
+
+  // The target triple and the fingerprint name the cache of this configuration
+  for(const char *c = target; *c && length < (int)sizeof(arg) - 24; c++) {
+    arg[length++] = isalnum((unsigned char)*c) || *c == '-' || *c == '_' || *c == '.' ? *c : '_';
+  }
+
+  snprintf(arg + length, sizeof(arg) - (size_t)length, "-%016lx", fingerprint);
+  int failed = argv_push(argv, "-fmodules", 9) || argv_push(argv, arg, strlen(arg));
+
+  for(int i = 0; i < include_dirs->count && !failed; i++) {
+    if(module_map_for_directory(cache, include_dirs->args[i], map, sizeof(map)) == 0) {
+      snprintf(arg, sizeof(arg), "-fmodule-map-file=%s", map);
+      failed = argv_push(argv, arg, strlen(arg));
+    }
+  }
+
+  return failed;
+}
+
+/*
+  Function Description:
+    Constructs the clang argument vector for code completion at a specific file position. The project
+    root is located with findFiles, the per-language flag set of that project is taken from the
+    context's flag cache (parsed once, reparsed only when .ccls or compile_flags.txt change), and the
+    CPU architecture comes from the context's cached `clang --version` target.
+
+  Parameters:
+    - ctx (cc_context *): Context owning the caches and settings.
+    - filename (const char *): Path to the source file (e.g., "/project/main.c"), not modified.
+    - unsaved (const char *): File holding the editor's text of filename, or NULL; clang reads it in
+      place of filename (-remap-file), so quoted includes still resolve next to filename.
+    - line (int): Line number in the file where completion is requested (1-based).
+    - column (int): Column number in the file where completion is requested (1-based).
+    - mirror_legacy (int): Non-zero to also refresh the legacy global buffers and completion_cache.
+    - modules (int): Non-zero to load headers as implicit clang modules (see push_module_args).
+    - argv (CCFlagList *): Empty list receiving the arguments (argv[0] is clang); release it with
+      flag_list_free.
+    - status (cc_status *): Receives the reason of a failure.
+
+  Return Value:
+    - int: 0 on success, 1 on failure (argv is left empty).
+
+  Detailed Steps:
+    1. Validate File:
+       - Checks if filename exists with access and resolves its directory with realpath.
+    2. Find Project Root:
+       - A cached merged flag set of the file's directory (lookup_layered_flags, else one published
+         by another process in the shared cache) supplies the root.
+       - Otherwise calls findFiles on the file’s directory (no shared state, runs unlocked). Without any
+         configuration file the checkout root is used and its include paths are discovered
+         (lookup_discovered_flags, cached per root).
+    3. Get CPU Target (done first, the lookups below need the lock):
+       - context_clang_target runs clang once per context, outside the lock.
+    4. Select Flag Set (under the context lock):
+       - If the project has a compile_commands.json, lookup_compile_db_flags returns the file's own
+         flag set in O(1) (headers fall back to a translation unit in the same directory).
+       - Otherwise classify_source_file picks C, C++, C header or C++ header and lookup_layered_flags
+         returns the matching flag set, merged from every .ccls/compile_flags.txt between the file
+         and its checkout root.
+    5. Mirror Into Legacy Cache (mirror_legacy only):
+       - When the project, its flag generation or the selected flag set changed, the flag set is copied to
+         global_buffer_header_paths and update_cache, so existing API users keep seeing current data.
+    6. Build Arguments (still under the lock, the flag set is cache-owned):
+       - Arguments are copied as-is, clang is exec'ed without a shell; a project-provided --target
+         replaces the detected one.
+       - With modules, the flag set is fingerprinted and its include directories inside the project
+         root are collected; the module arguments are added after the lock is released, since
+         module maps may have to be written.
+
+  Maintenance Notes:
+    - Only the copied arguments leave the lock; clang itself is run by the caller without it, so
+      requests on one context only serialize on the cheap cache lookups.
+    - C and C++ buffers of the same project get different command lines (-std, language-only -D),
+      exactly as ccls would index them.
+*/
+static int context_build_argv(cc_context *ctx, const char *filename, const char *unsaved, int line, int column,
+                              int mirror_legacy, int modules, CCFlagList *argv, cc_status *status) {
+  char abs_filename[PATH_MAX];
+  char abs_file[PATH_MAX];
+  char found_at[PATH_MAX];
+  char target_output[MAX_LINE_LENGTH];
+  char completion_at[PATH_MAX + 64];
+  char remap[2 * PATH_MAX + 2];
+  static unsigned long mirrored_generation = 0;  // Only touched with mirror_legacy, i.e. under the default context lock
+  static const CCFlagList *mirrored_flags = NULL;
+
+  // Check if the file exists and get its absolute path
+  if(access(filename, F_OK) != 0 || realpath(filename, abs_filename) == NULL) {
+    log_message("fn context_build_argv: File does not exist\n");
+    *status = CC_STATUS_INVALID_ARGUMENT;
+    return 1;
+  }
+
+  snprintf(abs_file, sizeof(abs_file), "%s", abs_filename);  // dirname() modifies abs_filename
+  char *dir_path = dirname(abs_filename);
+
+  // Get the clang target
+  if(context_clang_target(ctx, target_output) != 0) {
+    log_message("fn context_build_argv: Error getting clang target\n");
+    *status = CC_STATUS_CLANG_FAILED;
+    return 1;
+  }
+
+  // A recently merged flag set of this directory already knows its project root
+  pthread_mutex_lock(&ctx->lock);
+  const CCLayeredFlags *layered = lookup_layered_flags(ctx->layered, &ctx->layered_clock, ctx->projects,
+                                  &ctx->project_clock, dir_path, NULL);
+  int discovered = 0;
+
+  // A cold process: another process may have published it
+  if(!layered) {
+    layered = shared_cache_lookup(ctx, dir_path);
+  }
+
+  if(layered) {
+    snprintf(found_at, sizeof(found_at), "%s", layered->root);
+  }
+
+  else {
+    pthread_mutex_unlock(&ctx->lock);
+    // Find the directory where .ccls and compile_flags.txt are located, else discover include paths
+    discovered = findFiles(dir_path, found_at) != 0;
+
+    if(discovered && (getenv("CODE_CONNECTOR_NO_DISCOVERY") || discover_project_root(dir_path, found_at) != 0)) {
+      log_message("fn context_build_argv: Error finding .ccls and compile_flags.txt\n");
+      *status = CC_STATUS_NO_PROJECT;
+      return 1;
+    }
+
+    if(!discovered) {
+      pthread_mutex_lock(&ctx->lock);
+    }
+  }
+
+  const CCFlagList *flags = NULL;
+  unsigned long generation = 0;
+
+  if(discovered) {
+    // Returns with the lock held
+    const CCDiscoveredFlags *entry = lookup_discovered_flags(ctx, found_at);
+
+    if(!entry) {
+      pthread_mutex_unlock(&ctx->lock);
+      log_message("fn context_build_argv: Include discovery failed\n");
+      *status = CC_STATUS_OUT_OF_MEMORY;
+      return 1;
+    }
+
+    flags = &entry->flags;
+    generation = entry->generation;
+  }
+
+  else {
+    // Language-specific flag set of the directory's configuration layers, merged once per change
+    if(!layered) {
+      layered = lookup_layered_flags(ctx->layered, &ctx->layered_clock, ctx->projects, &ctx->project_clock,
+                                     dir_path, found_at);
+
+      if(layered) {
+        shared_cache_publish(layered);
+      }
+    }
+
+    if(!layered) {
+      pthread_mutex_unlock(&ctx->lock);
+      log_message("fn context_build_argv: Error reading .ccls and compile_flags.txt\n");
+      *status = CC_STATUS_NO_PROJECT;
+      return 1;
+    }
+
+    CCSourceKind kind = classify_source_file(filename);
+    flags = &layered->flags[kind];
+    generation = layered->generation;
+    // compile_commands.json, when present, provides exact per-file flags (headers use a sibling TU)
+    unsigned long db_generation = 0;
+    const CCFlagList *db_flags = lookup_compile_db_flags(ctx->databases, &ctx->database_clock, found_at, abs_file,
+                                 &db_generation);
+
+    if(db_flags) {
+      flags = db_flags;
+      generation = db_generation;
+    }
+  }
+
+  // Mirror the flag set into the legacy global buffers and cache when it changed
+  if(mirror_legacy) {
+    strncpy(global_buffer_project_dir, found_at, PATH_MAX - 1);
+    global_buffer_project_dir[PATH_MAX - 1] = '\0'; // Ensure null termination
+    strncpy(global_buffer_cpu_arc, target_output, MAX_OUTPUT - 1);
+    global_buffer_cpu_arc[MAX_OUTPUT - 1] = '\0'; // Ensure null termination
+
+    if(!is_cache_valid(found_at) || mirrored_generation != generation || mirrored_flags != flags) {
+      char *temp_paths[MAX_LINES];
+      int num_lines = 0;
+
+      for(int i = 0; i < flags->count && num_lines < MAX_LINES; i++) {
+        strncpy(global_buffer_header_paths[num_lines], flags->args[i], MAX_PATH_LENGTH - 1);
+        global_buffer_header_paths[num_lines][MAX_PATH_LENGTH - 1] = '\0'; // Null-terminate
+        temp_paths[num_lines] = global_buffer_header_paths[num_lines];
+        num_lines++;
+      }
+
+      update_cache(found_at, temp_paths, num_lines, global_buffer_cpu_arc);
+      mirrored_generation = generation;
+      mirrored_flags = flags;
+    }
+  }
+
+  // Build the argument vector
+  int has_target = 0;
+  int failed = 0;
+
+  for(int i = 0; i < flags->count; i++) {
+    if(strncmp(flags->args[i], "--target=", 9) == 0) {
+      has_target = 1;
+    }
+  }
+
+  snprintf(completion_at, sizeof(completion_at), "-code-completion-at=%s:%d:%d", filename, line, column);
+  const char *head_args[] = {ctx->settings.clang_path, "-target", target_output, "-fsyntax-only", "-Xclang", "-code-completion-macros"};
+  const char *tail_args[] = {"-Xclang", completion_at, filename};
+  snprintf(remap, sizeof(remap), "%s;%s", abs_file, unsaved ? unsaved : "");
+  const char *remap_args[] = {"-Xclang", "-remap-file", "-Xclang", remap};
+
+  for(size_t i = 0; i < sizeof(head_args) / sizeof(head_args[0]) && !failed; i++) {
+    // A --target from the project config wins over the detected host target
+    if(has_target && (i == 1 || i == 2)) {
+      continue;
+    }
+
+    failed = argv_push(argv, head_args[i], strlen(head_args[i]));
+  }
+
+  CCFlagList include_dirs = {NULL, 0, 0};
+  unsigned long fingerprint = hash_string(CC_HASH_SEED, target_output);
+  size_t root_length = strlen(found_at);
+
+  for(int i = 0; i < flags->count && !failed; i++) {
+    failed = argv_push(argv, flags->args[i], strlen(flags->args[i]));
+    fingerprint = hash_string(fingerprint, flags->args[i]);
+    // -I<dir> or -I <dir> inside the project root, a relative one is taken from the root
+    const char *dir = strncmp(flags->args[i], "-I", 2) != 0 ? NULL : flags->args[i][2] ? flags->args[i] + 2 :
+                      i + 1 < flags->count ? flags->args[i + 1] : NULL;
+    char absolute[PATH_MAX];
+
+    if(modules && dir && dir[0] != '/' && (size_t)snprintf(absolute, sizeof(absolute), "%s/%s", found_at, dir) < sizeof(absolute)) {
+      dir = absolute;
+    }
+
+    if(modules && dir && strncmp(dir, found_at, root_length) == 0 && (dir[root_length] == '/' || dir[root_length] == '\0')) {
+      failed = flag_list_append(&include_dirs, dir);
+    }
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  if(modules && !failed) {
+    failed = push_module_args(argv, has_target ? "project" : target_output, fingerprint, &include_dirs);
+  }
+
+  flag_list_free(&include_dirs);
+
+  for(size_t i = 0; unsaved && i < sizeof(remap_args) / sizeof(remap_args[0]) && !failed; i++) {
+    failed = argv_push(argv, remap_args[i], strlen(remap_args[i]));
+  }
+
+  for(size_t i = 0; i < sizeof(tail_args) / sizeof(tail_args[0]) && !failed; i++) {
+    failed = argv_push(argv, tail_args[i], strlen(tail_args[i]));
+  }
+
+  if(failed) {
+    log_message("In fn context_build_argv: Failed to allocate memory for the result.\n");
+    flag_list_free(argv);
+    *status = CC_STATUS_OUT_OF_MEMORY;
+    return 1;
+  }
+
+  *status = CC_STATUS_OK;
+  return 0;
+}
+
+/*
+  Function Description:
+    Constructs the clang completion command for a file position using the default context, and
+    keeps the legacy globals (global_buffer_project_dir, global_buffer_cpu_arc,
+    global_buffer_header_paths, completion_cache) in sync for existing API users.
+
+  Parameters:
+    - filename (const char *): Path to the source file, not modified.
+    - line (int): Line number (1-based).
+    - column (int): Column number (1-based).
+
+  Return Value:
+    - char *: A dynamically allocated command string, or NULL on failure. Caller must free it.
+
+  Maintenance Notes:
+    - The globals are process-wide; multi-threaded callers should use cc_complete with their own
+      context instead.
+*/
+
+// Function to build the clang arguments on the default context, keeping the legacy globals in sync
+// Prints why it failed, as the legacy entry points always did. Returns 0 on success, 1 on failure
+static int legacy_build_argv(const char *filename, int line, int column, CCFlagList *argv) {
+  cc_context *ctx = cc_default_context();
+  cc_status status = CC_STATUS_OK;
+  // Initialize cache if not already done
+  static int cache_initialized = 0;
+
+  if(!ctx) {
+    return 1;
+  }
+
+  if(!cache_initialized) {
+    init_cache();
+    cache_initialized = 1;
+  }
+
+  if(context_build_argv(ctx, filename, NULL, line, column, 1, 0, argv, &status) == 0) {
+    return 0;
+  }
+
+  if(status == CC_STATUS_INVALID_ARGUMENT) {
+    fprintf(stderr, "File does not exist: %s\n", filename);
+  }
+
+  else if(status == CC_STATUS_NO_PROJECT) {
+    printf("Error finding .ccls and compile_flags.txt\n");
+  }
+
+  else if(status == CC_STATUS_CLANG_FAILED) {
+    printf("Error getting clang target\n");
+  }
+
+  return 1;
+}
+
+// Function to collect filename, line number, and column number
+char *collect_code_completion_args(const char *filename, int line, int column) {
+  CCFlagList argv = {NULL, 0, 0};
+  char *command = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  int failed = legacy_build_argv(filename, line, column, &argv);
+
+  // Join the arguments into one shell-quoted command line
+  for(int i = 0; i < argv.count && !failed; i++) {
+    failed = append_command_arg(&command, &length, &capacity, argv.args[i]);
+  }
+
+  flag_list_free(&argv);
+
+  if(failed) {
+    free(command);
+    return NULL;
+  }
+
+  return command;
+}
+
+/*
+  Function Description:
+    Executes a clang code completion command for a given file position and captures the output as a string.
+    This function builds the arguments on the default context, runs clang in its own process group, and returns
+    the completion suggestions (e.g., function names) for processing (e.g., by Vim).
+
+  Parameters:
+    - filename (const char *): Path to the source file (e.g., "/project/main.c"), not modified.
+    - line (int): Line number in the file for completion (1-based).
+    - column (int): Column number in the file for completion (1-based).
+
+  Return Value:
+    - char *: A dynamically allocated string containing clang’s completion output, or NULL on failure.
+      Caller must free this string.
+
+  Detailed Steps:
+    1. Build Arguments:
+       - legacy_build_argv builds the clang arguments (and keeps the legacy globals current).
+       - If it fails (e.g., file missing), it prints why and NULL is returned.
+    2. Start clang:
+       - run_completion_command starts clang through spawn_child: own process group, no shell,
+         stdout on a pipe, stderr on /dev/null, optional RLIMIT_AS/RLIMIT_CPU.
+    3. Read Output:
+       - Reads the pipe into a MAX_OUTPUT buffer until EOF or the deadline; larger output or an
+         expired deadline kills the group and fails the request.
+    4. Clean Up:
+       - Reaps the child; returns the output ("" when clang printed nothing) or NULL on failure.
+
+  Flow and Logic:
+    - Step 1: Get the clang command ready.
+    - Step 2: Start clang and listen for its answer.
+    - Step 3: Grab what clang says into a note.
+    - Step 4: Finish up, check the note’s not empty, and hand it over.
+    - Why this order? Build first, execute next, read then clean—standard pipe/command pattern.
+
+  How It Works (For Novices):
+    - Imagine you’re asking clang for a list of word suggestions (completions) for your code at a
+      specific spot (filename:line:column), and you want that list as a note (the output string).
+    - execute_code_completion_command is like this:
+      - Step 1: Write a question for clang (e.g., "clang -code-completion-at=main.c:5:3") using
+        collect_code_completion_args. If you can’t write it, give up.
+      - Step 2: Shout the question through a tube (popen) so clang can answer back.
+      - Step 3: Get a blank note (allocate output), listen through the tube (fread), and write down
+        clang’s suggestions (e.g., "printf, scanf").
+      - Step 4: Close the tube (pclose), toss the question paper (free command), and if the note’s
+        empty, toss it too—otherwise, give it to you.
+    - It’s like asking a smart friend for help and taking notes on what they say!
+
+  Why It Works (For Novices):
+    - Ease: Builds the question for you, so you don’t have to.
+    - Safety: Checks every step (command, pipe, read) to avoid trouble.
+    - Usefulness: Gives you clang’s ideas in a handy note you can read later.
+
+  Why It’s Designed This Way (For Maintainers):
+    - Integration: Ties into collect_code_completion_args for modularity, feeding clang’s completion
+      output to Vim via processCompletionDataFromString—core to UNIX tooling (per _POSIX_C_SOURCE).
+    - Process Control: fork/exec instead of popen gives the parent clang's pid, so a superseded
+      request can kill clang's process group; no shell is involved, so nothing needs quoting.
+    - Memory: Allocates output dynamically (MAX_OUTPUT), avoiding stack issues; command is freed
+      early, but output persists for caller—clean ownership.
+    - Error Handling: NULL returns on failure (command build, popen, empty output) with logs
+      (log_message) allow tracing—caller (e.g., Vim plugin) decides next steps.
+    - Simplicity: Minimal parsing—raw output is returned, leaving interpretation to processCompletionDataFromString.
+
+  Maintenance Notes:
+    - Buffer Size: MAX_OUTPUT must fit clang’s completion output—test with large suggestion lists
+      (e.g., big structs) to avoid truncation.
+    - Error Detail: fork/pipe failures go through perror; exec failures (exit 127) are logged.
+    - Memory Leaks: Frees command and output on all paths—verify with valgrind, especially on failure.
+    - Robustness: A stalled clang is killed with its process group at the context's deadline
+      (CODE_CONNECTOR_TIMEOUT_MS, CC_DEFAULT_TIMEOUT_MS by default) and NULL is returned.
+    - Extensibility: To filter output here (e.g., strip errors), parse before returning—current raw
+      approach is simpler but less refined.
+*/
+
+// Function to get the limits of a clang run from the settings of a context
+static void context_launch(const cc_context *ctx, CCLaunch *launch) {
+  launch->timeout_ms = ctx->settings.timeout_ms == 0 ? CC_DEFAULT_TIMEOUT_MS : ctx->settings.timeout_ms;
+  launch->memory_limit_mb = ctx->settings.memory_limit_mb;
+  launch->cpu_limit_sec = ctx->settings.cpu_limit_sec;
+  launch->launch_class = CC_LAUNCH_INTERACTIVE;
+}
+
+// Function to run clang with the arguments built by context_build_argv and capture its stdout
+// clang is started by spawn_child under the context's deadline and limits. When entry is given, its
+// pgid is published under ctx->lock so a newer request can kill the whole group
+// Returns the output ("" when clang printed nothing) or NULL with *status set (CC_STATUS_TIMEOUT when
+// the deadline killed clang); the caller frees it
+static char *run_completion_command(const CCFlagList *argv, cc_context *ctx, CCInflight *entry, cc_status *status) {
+  char **exec_argv = (char **)malloc(((size_t)argv->count + 1) * sizeof(char *));
+  char *output = (char *)malloc(MAX_OUTPUT * sizeof(char));
+  CCLaunch launch;
+  CCChild child;
+
+  if(!exec_argv || !output || argv->count == 0) {
+    free(exec_argv);
+    free(output);
+    *status = CC_STATUS_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  memcpy(exec_argv, argv->args, (size_t)argv->count * sizeof(char *));
+  exec_argv[argv->count] = NULL;
+  context_launch(ctx, &launch);
+  *status = CC_STATUS_CLANG_FAILED;
+  int spawned = spawn_child(exec_argv, NULL, &launch, CC_CAPTURE_STDOUT, &child);
+  free(exec_argv);
+
+  if(spawned != 0) {
+    free(output);
+    return NULL;
+  }
+
+  if(entry) {
+    pthread_mutex_lock(&ctx->lock);
+    entry->pgid = child.pid;
+
+    if(entry->cancelled) {
+      kill(-child.pid, SIGKILL);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  size_t total_length = 0;
+  int outcome = read_child_output(&child, &launch, output, MAX_OUTPUT - 1, &total_length);
+  int cancelled = 0;
+
+  // Unpublish before reaping: the group id cannot be reused while the child is still a zombie
+  if(entry) {
+    pthread_mutex_lock(&ctx->lock);
+    entry->pgid = 0;
+    cancelled = entry->cancelled;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  int exit_status = 0;
+  outcome = wait_child(&child, &launch, &exit_status) ? 1 : outcome;
+
+  if(cancelled) {
+    free(output);
+    *status = CC_STATUS_CANCELLED;
+    return NULL;
+  }
+
+  if(outcome == 1) {
+    log_message("fn run_completion_command: clang killed at its deadline\n");
+    free(output);
+    *status = CC_STATUS_TIMEOUT;
+    return NULL;
+  }
+
+  if(outcome == 2 || (WIFEXITED(exit_status) && WEXITSTATUS(exit_status) == 127)) {
+    log_message(outcome == 2 ? "fn run_completion_command: clang output too large\n" :
+                "fn run_completion_command: Could not execute clang\n");
+    free(output);
+    return NULL;
+  }
+
+  // A non-zero exit status only means the buffer has errors; the completions are still valid
+  if(!WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0) {
+    log_message("fn run_completion_command: clang exited with errors\n");
+  }
+
+  char *result = (char *)realloc(output, total_length + 1);
+  *status = CC_STATUS_OK;
+  return result ? result : output;
+}
+
+// Function to execute the code completion command: `clang -fsyntax-only -Xclang -code-completion-macros -Xclang -code-completion-at=file.c:line:column file.c`
+char *execute_code_completion_command(const char *filename, int line, int column) {
+  /* printf("DEBUG: Starting code completion for file %s at line %d, column %d\n",
+         filename, line, column); */
+  CCFlagList argv = {NULL, 0, 0};
+  cc_status status = CC_STATUS_OK;
+
+  if(legacy_build_argv(filename, line, column, &argv) != 0) {
+    /* printf("DEBUG: Failed to collect code completion arguments\n"); */
+    return NULL;
+  }
+
+  char *output = run_completion_command(&argv, cc_default_context(), NULL, &status);
+  flag_list_free(&argv);
+  return output;
+}
+
+// Function to write a whole buffer to a socket or pipe, retrying on short writes and EINTR
+// Returns 0 on success, 1 on failure
+static int write_all(int fd, const char *data, size_t length) {
+  while(length > 0) {
+    ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+
+    // Pipes (the stdio of --lsp) take write(); the caller ignores SIGPIPE there
+    if(written < 0 && errno == ENOTSOCK) {
+      written = write(fd, data, length);
+    }
+
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return 1;
+    }
+
+    data += written;
+    length -= (size_t)written;
+  }
+
+  return 0;
+}
+
+/*
+  Function Description:
+    Persistent ccls sessions. For a project indexed by `ccls --index` (it has a .ccls-cache), a
+    long-lived ccls process is started on its root and spoken to over stdio JSON-RPC (LSP framing).
+    The buffer of a request is sent with textDocument/didOpen, or didChange once it changed on
+    disk, and textDocument/signatureHelp answers from ccls's warm index and preamble instead of a
+    cold clang parse. ccls_signature_text maps the answer to the placeholders filter_clang_output
+    produces, so the plugin cannot tell the two apart.
+
+  Maintenance Notes:
+    - settings.ccls_sessions bounds the sessions of a context (CODE_CONNECTOR_CCLS_SESSIONS); the
+      daemon and its workers default to CC_CCLS_DEFAULT_SESSIONS, one-shot processes to none since
+      a session would not outlive them.
+    - A session is started on a detached thread the first time its project is asked for, so that
+      request still goes to clang. A session that fails is only retried after CC_CCLS_RETRY_SEC.
+    - conversation serializes requests on a session; state and refs are guarded by ctx->lock. A
+      session is only closed when no request and no start thread holds a reference.
+    - Responses of requests given up on (timeout, cancellation) arrive later and are skipped by id.
+*/
+
+#define CC_CCLS_DEFAULT_SESSIONS 2     // Sessions of the daemon when CODE_CONNECTOR_CCLS_SESSIONS is unset
+#define CC_CCLS_DOCUMENTS 32           // Buffers kept open per session; the least recently used is closed
+#define CC_CCLS_START_TIMEOUT_MS 10000
+#define CC_CCLS_REQUEST_TIMEOUT_MS 5000
+#define CC_CCLS_RETRY_SEC 60
+#define CC_CCLS_POLL_MS 50             // Slice in which a waiting request notices its cancellation
+
+typedef enum {
+  CC_CCLS_STARTING = 0,
+  CC_CCLS_READY,
+  CC_CCLS_FAILED
+} CCClsState;
+
+// Receiving side of a JSON-RPC connection with LSP framing (Content-Length headers)
+typedef struct {
+  int fd;
+  char *buffer;  // Bytes received but not yet parsed
+  size_t length;
+  size_t capacity;
+} CCRpcStream;
+
+// A buffer open in a ccls session
+typedef struct {
+  char path[PATH_MAX];
+  CCFileFingerprint fingerprint;  // Of the file when its text was last sent
+  int version;
+  unsigned long last_used;
+} CCClsDocument;
+
+// A ccls process serving one project root
+typedef struct CCClsSession {
+  char root[PATH_MAX];
+  CCChild child;                     // child.output_fd is the socket on ccls's stdin and stdout
+  pthread_mutex_t conversation;      // One request at a time; guards the fields up to document_clock
+  CCRpcStream stream;                // Reads child.output_fd
+  long next_id;
+  CCClsDocument documents[CC_CCLS_DOCUMENTS];
+  unsigned long document_clock;
+  CCClsState state;                  // Guarded by ctx->lock, like the fields below
+  int refs;                          // Requests and the start thread using the session
+  time_t failed_at;
+  unsigned long last_used;
+  cc_context *ctx;
+} CCClsSession;
+
+// Function to quote length bytes of text as a JSON string. Returns a malloc'ed string or NULL
+static char *json_quote(const char *text, size_t length) {
+  char *quoted = (char *)malloc(length * 6 + 3);
+  char *out = quoted;
+
+  if(!quoted) {
+    return NULL;
+  }
+
+  *out++ = '"';
+
+  for(size_t i = 0; i < length; i++) {
+    unsigned char ch = (unsigned char)text[i];
+
+    if(ch == '"' || ch == '\\') {
+      *out++ = '\\';
+      *out++ = (char)ch;
+    }
+
+    else if(ch == '\n') {
+      *out++ = '\\';
+      *out++ = 'n';
+    }
+
+    else if(ch < 0x20) {
+      out += sprintf(out, "\\u%04x", ch);
+    }
+
+    else {
+      *out++ = (char)ch;
+    }
+  }
+
+  *out++ = '"';
+  *out = '\0';
+  return quoted;
+}
+
+// Function to turn a path into a file:// URI quoted as a JSON string, percent-encoding every byte
+// but unreserved characters and "/" (the inverse of lsp_uri_path). Returns a malloc'ed string or NULL
+static char *json_path_uri(const char *path) {
+  char *uri = (char *)malloc(strlen(path) * 3 + 10);
+  char *out = uri;
+
+  if(!uri) {
+    return NULL;
+  }
+
+  out += sprintf(out, "\"file://");
+
+  for(const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    if(isalnum(*p) || strchr("/-._~", *p)) {
+      *out++ = (char)*p;
+    }
+
+    else {
+      out += sprintf(out, "%%%02X", *p);
+    }
+  }
+
+  *out++ = '"';
+  *out = '\0';
+  return uri;
+}
+
+// Function to move the cursor from an object to the value of one of its members
+// Returns 0 when the member exists, 1 otherwise
+static int json_find_member(CCJsonReader *r, const char *key) {
+  json_skip_ws(r);
+
+  if(r->pos >= r->size || r->data[r->pos] != '{') {
+    return 1;
+  }
+
+  r->pos++;
+
+  for(;;) {
+    json_skip_ws(r);
+
+    if(r->pos < r->size && r->data[r->pos] == ',') {
+      r->pos++;
+      json_skip_ws(r);
+    }
+
+    if(json_read_string(r) < 0) {
+      return 1;
+    }
+
+    int found = strcmp(r->buffer, key) == 0;
+    json_skip_ws(r);
+
+    if(r->pos >= r->size || r->data[r->pos] != ':') {
+      return 1;
+    }
+
+    r->pos++;
+    json_skip_ws(r);
+
+    if(found) {
+      return 0;
+    }
+
+    if(json_skip_value(r) != 0) {
+      return 1;
+    }
+  }
+}
+
+// Function to move the cursor from an array to one of its elements
+// Returns 0 when the element exists, 1 otherwise
+static int json_find_element(CCJsonReader *r, int index) {
+  json_skip_ws(r);
+
+  if(r->pos >= r->size || r->data[r->pos] != '[') {
+    return 1;
+  }
+
+  r->pos++;
+
+  for(int i = 0;; i++) {
+    json_skip_ws(r);
+
+    if(r->pos >= r->size || r->data[r->pos] == ']') {
+      return 1;
+    }
+
+    if(i == index) {
+      return 0;
+    }
+
+    if(json_skip_value(r) != 0) {
+      return 1;
+    }
+
+    json_skip_ws(r);
+
+    if(r->pos < r->size && r->data[r->pos] == ',') {
+      r->pos++;
+    }
+  }
+}
+
+// Function to read the number at the cursor, fallback when there is none
+static long json_read_long(CCJsonReader *r, long fallback) {
+  json_skip_ws(r);
+
+  if(r->pos >= r->size || !(isdigit((unsigned char)r->data[r->pos]) || r->data[r->pos] == '-')) {
+    return fallback;
+  }
+
+  return strtol(r->data + r->pos, NULL, 10);  // Message bodies are NUL-terminated
+}
+
+// Function to send one JSON-RPC message with its header. Returns 0 on success, 1 on failure
+static int rpc_send(int fd, const char *body) {
+  char header[64];
+  size_t length = strlen(body);
+  int header_length = snprintf(header, sizeof(header), "Content-Length: %zu\r\n\r\n", length);
+  return write_all(fd, header, (size_t)header_length) || write_all(fd, body, length);
+}
+
+// Function to check whether a waiting request was given up on (takes ctx->lock)
+static int rpc_call_cancelled(cc_context *ctx, const CCInflight *call) {
+  if(!call) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  int cancelled = call->cancelled;
+  pthread_mutex_unlock(&ctx->lock);
+  return cancelled;
+}
+
+// Function to receive one JSON-RPC message; call, when given, is checked every CC_CCLS_POLL_MS
+// Returns the malloc'ed, NUL-terminated body or NULL with *status set: CC_STATUS_TIMEOUT after timeout_ms
+// (< 0 waits for ever), CC_STATUS_CANCELLED when call was cancelled, CC_STATUS_CLANG_FAILED on end of file
+static char *rpc_receive(CCRpcStream *stream, int timeout_ms, cc_context *ctx, const CCInflight *call, cc_status *status) {
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  for(;;) {
+    char *end = stream->length > 0 ? memmem(stream->buffer, stream->length, "\r\n\r\n", 4) : NULL;
+
+    if(end) {
+      size_t header_length = (size_t)(end - stream->buffer) + 4;
+      const char *field = memmem(stream->buffer, header_length, "Content-Length:", 15);
+      size_t body_length = field ? strtoul(field + 15, NULL, 10) : 0;
+
+      if(!field) {
+        *status = CC_STATUS_CLANG_FAILED;
+        return NULL;
+      }
+
+      if(stream->length >= header_length + body_length) {
+        char *body = (char *)malloc(body_length + 1);
+
+        if(!body) {
+          *status = CC_STATUS_OUT_OF_MEMORY;
+          return NULL;
+        }
+
+        memcpy(body, stream->buffer + header_length, body_length);
+        body[body_length] = '\0';
+        stream->length -= header_length + body_length;
+        memmove(stream->buffer, stream->buffer + header_length + body_length, stream->length);
+        return body;
+      }
+    }
+
+    if(stream->capacity - stream->length < 4096) {
+      size_t capacity = stream->capacity ? stream->capacity * 2 : 65536;
+      char *grown = (char *)realloc(stream->buffer, capacity);
+
+      if(!grown) {
+        *status = CC_STATUS_OUT_OF_MEMORY;
+        return NULL;
+      }
+
+      stream->buffer = grown;
+      stream->capacity = capacity;
+    }
+
+    long left = timeout_ms < 0 ? CC_CCLS_POLL_MS : timeout_ms - elapsed_ms(&started);
+
+    if(left <= 0) {
+      *status = CC_STATUS_TIMEOUT;
+      return NULL;
+    }
+
+    if(rpc_call_cancelled(ctx, call)) {
+      *status = CC_STATUS_CANCELLED;
+      return NULL;
+    }
+
+    struct pollfd fds = {stream->fd, POLLIN, 0};
+    int ready = poll(&fds, 1, !call && timeout_ms < 0 ? -1 : left < CC_CCLS_POLL_MS ? (int)left : CC_CCLS_POLL_MS);
+
+    if(ready < 0 && errno != EINTR) {
+      *status = CC_STATUS_CLANG_FAILED;
+      return NULL;
+    }
+
+    if(ready > 0) {
+      ssize_t received = read(stream->fd, stream->buffer + stream->length, stream->capacity - stream->length);
+
+      if(received <= 0 && !(received < 0 && errno == EINTR)) {
+        *status = CC_STATUS_CLANG_FAILED;
+        return NULL;
+      }
+
+      stream->length += received > 0 ? (size_t)received : 0;
+    }
+  }
+}
+
+// Function to send a request to ccls and wait for its response (conversation held). Requests ccls sends
+// meanwhile are answered with null, notifications and stale responses are dropped
+// Returns the malloc'ed response body or NULL with *status set as by rpc_receive
+static char *ccls_request(CCClsSession *session, const char *method, const char *params, int timeout_ms,
+                          const CCInflight *call, cc_status *status) {
+  long id = ++session->next_id;
+  size_t size = strlen(method) + strlen(params) + 96;
+  char *message = (char *)malloc(size);
+
+  if(!message) {
+    *status = CC_STATUS_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  snprintf(message, size, "{\"jsonrpc\":\"2.0\",\"id\":%ld,\"method\":\"%s\",\"params\":%s}", id, method, params);
+  int failed = rpc_send(session->stream.fd, message);
+  free(message);
+
+  if(failed) {
+    *status = CC_STATUS_CLANG_FAILED;
+    return NULL;
+  }
+
+  for(;;) {
+    char *body = rpc_receive(&session->stream, timeout_ms, session->ctx, call, status);
+
+    if(!body) {
+      if(*status == CC_STATUS_CANCELLED || *status == CC_STATUS_TIMEOUT) {
+        char cancel[128];
+        snprintf(cancel, sizeof(cancel), "{\"jsonrpc\":\"2.0\",\"method\":\"$/cancelRequest\",\"params\":{\"id\":%ld}}", id);
+        rpc_send(session->stream.fd, cancel);
+      }
+
+      return NULL;
+    }
+
+    CCJsonReader reader = {body, strlen(body), 0, NULL, 0};
+    long received_id = json_find_member(&reader, "id") == 0 ? json_read_long(&reader, -1) : -1;
+    reader.pos = 0;
+    int is_request = json_find_member(&reader, "method") == 0;
+    free(reader.buffer);
+
+    if(is_request && received_id >= 0) {
+      char reply[128];
+      snprintf(reply, sizeof(reply), "{\"jsonrpc\":\"2.0\",\"id\":%ld,\"result\":null}", received_id);
+      rpc_send(session->stream.fd, reply);
+    }
+
+    else if(!is_request && received_id == id) {
+      return body;
+    }
+
+    free(body);
+  }
+}
+
+// Function to send a notification to ccls (conversation held). Returns 0 on success, 1 on failure
+static int ccls_notify(CCClsSession *session, const char *method, const char *params) {
+  size_t size = strlen(method) + strlen(params) + 64;
+  char *message = (char *)malloc(size);
+
+  if(!message) {
+    return 1;
+  }
+
+  snprintf(message, size, "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"params\":%s}", method, params);
+  int failed = rpc_send(session->stream.fd, message);
+  free(message);
+  return failed;
+}
+
+// Function to make ccls see the current text of a buffer, read from source (path itself or its unsaved
+// text): didOpen the first time, didChange (whole text) when source changed since; the least recently
+// used buffer is closed to make room. Returns 0 on success, 1 when source cannot be read or ccls is gone
+// (conversation held)
+static int ccls_sync_document(CCClsSession *session, const char *path, const char *source) {
+  CCFileFingerprint fingerprint;
+  CCClsDocument *document = NULL;
+  CCClsDocument *oldest = &session->documents[0];
+
+  if(get_file_fingerprint(source, &fingerprint) != 0) {
+    return 1;
+  }
+
+  for(int i = 0; i < CC_CCLS_DOCUMENTS && !document; i++) {
+    if(strcmp(session->documents[i].path, path) == 0) {
+      document = &session->documents[i];
+    }
+
+    else if(session->documents[i].last_used < oldest->last_used) {
+      oldest = &session->documents[i];
+    }
+  }
+
+  char *uri = json_path_uri(path);
+
+  if(!uri) {
+    return 1;
+  }
+
+  if(document && fingerprints_equal(&document->fingerprint, &fingerprint)) {
+    document->last_used = ++session->document_clock;
+    free(uri);
+    return 0;
+  }
+
+  if(!document && oldest->path[0] != '\0') {
+    char *closed = json_path_uri(oldest->path);
+    size_t size = closed ? strlen(closed) + 64 : 0;
+    char *params = closed ? (char *)malloc(size) : NULL;
+
+    if(params) {
+      snprintf(params, size, "{\"textDocument\":{\"uri\":%s}}", closed);
+      ccls_notify(session, "textDocument/didClose", params);
+    }
+
+    free(params);
+    free(closed);
+    oldest->path[0] = '\0';
+  }
+
+  FILE *file = fopen(source, "r");
+  char *text = NULL;
+  size_t length = 0;
+
+  if(file) {
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    text = file_size >= 0 ? (char *)malloc((size_t)file_size + 1) : NULL;
+    length = text ? fread(text, 1, (size_t)file_size, file) : 0;
+    fclose(file);
+  }
+
+  char *quoted = text ? json_quote(text, length) : NULL;
+  free(text);
+
+  if(!quoted) {
+    free(uri);
+    return 1;
+  }
+
+  size_t size = strlen(uri) + strlen(quoted) + 160;
+  char *params = (char *)malloc(size);
+  int failed = 1;
+
+  if(params) {
+    if(document) {
+      document->version++;
+      snprintf(params, size, "{\"textDocument\":{\"uri\":%s,\"version\":%d},\"contentChanges\":[{\"text\":%s}]}",
+               uri, document->version, quoted);
+      failed = ccls_notify(session, "textDocument/didChange", params);
+    }
+
+    else {
+      document = oldest;
+      snprintf(document->path, sizeof(document->path), "%s", path);
+      document->version = 1;
+      CCSourceKind kind = classify_source_file(path);
+      snprintf(params, size, "{\"textDocument\":{\"uri\":%s,\"languageId\":\"%s\",\"version\":1,\"text\":%s}}",
+               uri, kind == CC_SOURCE_C || kind == CC_SOURCE_C_HEADER ? "c" : "cpp", quoted);
+      failed = ccls_notify(session, "textDocument/didOpen", params);
+    }
+
+    document->fingerprint = fingerprint;
+    document->last_used = ++session->document_clock;
+  }
+
+  free(params);
+  free(quoted);
+  free(uri);
+  return failed;
+}
+
+// Function to turn a textDocument/signatureHelp response into the text filter_clang_output makes of
+// clang's completion, e.g. "remainderf(`<float x>`, `<float y>`)"
+// Returns a malloc'ed string, or NULL when ccls offered no signature of identifier with parameters
+static char *ccls_signature_text(const char *body, const char *identifier) {
+  CCJsonReader reader = {body, strlen(body), 0, NULL, 0};
+  char *label = NULL;
+  char *text = NULL;
+  size_t used = 0;
+
+  if(json_find_member(&reader, "result") != 0 || reader.data[reader.pos] != '{') {
+    free(reader.buffer);
+    return NULL;
+  }
+
+  size_t result = reader.pos;
+  long active = json_find_member(&reader, "activeSignature") == 0 ? json_read_long(&reader, 0) : 0;
+  reader.pos = result;
+
+  if(json_find_member(&reader, "signatures") == 0 && json_find_element(&reader, (int)active) == 0) {
+    size_t signature = reader.pos;
+
+    if(json_find_member(&reader, "label") == 0 && json_read_string(&reader) >= 0) {
+      label = strdup(reader.buffer);
+    }
+
+    reader.pos = signature;
+    const char *name = label ? strstr(label, identifier) : NULL;
+    size_t name_length = strlen(identifier);
+
+    // The signature must be the one of the function before the cursor
+    if(name && name[name_length] == '(' &&
+       json_find_member(&reader, "parameters") == 0 && reader.data[reader.pos] == '[') {
+      size_t parameters = reader.pos;
+      size_t size = strlen(label) * 2 + name_length + 8;
+      text = (char *)malloc(size);
+      used = text ? (size_t)snprintf(text, size, "%s(", identifier) : 0;
+
+      for(int i = 0; text && (reader.pos = parameters, json_find_element(&reader, i) == 0); i++) {
+        const char *start = NULL;
+        size_t length = 0;
+
+        if(json_find_member(&reader, "label") != 0) {
+          break;
+        }
+
+        // A parameter label is a string or a [start, end) range of the signature label
+        if(reader.data[reader.pos] == '"' && json_read_string(&reader) >= 0) {
+          start = reader.buffer;
+          length = strlen(reader.buffer);
+        }
+
+        else if(reader.data[reader.pos] == '[') {
+          size_t range = reader.pos;
+          long from = json_find_element(&reader, 0) == 0 ? json_read_long(&reader, -1) : -1;
+          reader.pos = range;
+          long to = json_find_element(&reader, 1) == 0 ? json_read_long(&reader, -1) : -1;
+
+          if(from >= 0 && to > from && (size_t)to <= strlen(label)) {
+            start = label + from;
+            length = (size_t)(to - from);
+          }
+        }
+
+        if(!start || used + length + 8 >= size) {
+          break;
+        }
+
+        // clang keeps the variadic part in the placeholder of the last named parameter
+        if(i > 0 && length == 3 && strncmp(start, "...", 3) == 0) {
+          used -= 2;
+          used += (size_t)snprintf(text + used, size - used, ", ...>`");
+          continue;
+        }
+
+        used += (size_t)snprintf(text + used, size - used, "%s`<%.*s>`", i > 0 ? ", " : "", (int)length, start);
+      }
+
+      // A function without parameters has no placeholders; clang's output is dropped the same way
+      if(text && text[used - 1] == '(') {
+        free(text);
+        text = NULL;
+      }
+
+      else if(text) {
+        snprintf(text + used, size - used, ")");
+      }
+    }
+  }
+
+  free(label);
+  free(reader.buffer);
+  return text;
+}
+
+// Function to stop a session's ccls and release the session; nobody may hold a reference
+static void ccls_session_close(CCClsSession *session) {
+  if(session->child.pid > 0) {
+    pthread_mutex_lock(&session->conversation);
+    ccls_notify(session, "exit", "null");
+    pthread_mutex_unlock(&session->conversation);
+    close(session->child.output_fd);
+    kill(-session->child.pid, SIGKILL);
+    waitpid(session->child.pid, NULL, 0);
+  }
+
+  pthread_mutex_destroy(&session->conversation);
+  free(session->stream.buffer);
+  free(session);
+}
+
+// Function to start ccls on a session's root and initialize it, run on a detached thread
+static void *ccls_session_start(void *arg) {
+  CCClsSession *session = (CCClsSession *)arg;
+  cc_context *ctx = session->ctx;
+  char *const argv[] = {"ccls", NULL};
+  CCLaunch launch = {0, ctx->settings.memory_limit_mb, 0, CC_LAUNCH_INTERACTIVE};
+  cc_status status = CC_STATUS_CLANG_FAILED;
+  char *response = NULL;
+  pthread_mutex_lock(&session->conversation);
+
+  if(spawn_child(argv, session->root, &launch, CC_CAPTURE_SESSION, &session->child) == 0) {
+    session->stream.fd = session->child.output_fd;
+    char *root = json_quote(session->root, strlen(session->root));
+    char *root_uri = json_path_uri(session->root);
+    size_t size = root && root_uri ? strlen(root) + strlen(root_uri) + 160 : 0;
+    char *params = size ? (char *)malloc(size) : NULL;
+
+    if(params) {
+      snprintf(params, size, "{\"processId\":%ld,\"rootPath\":%s,\"rootUri\":%s,\"capabilities\":{}}",
+               (long)getpid(), root, root_uri);
+      response = ccls_request(session, "initialize", params, CC_CCLS_START_TIMEOUT_MS, NULL, &status);
+    }
+
+    if(response && ccls_notify(session, "initialized", "{}") != 0) {
+      free(response);
+      response = NULL;
+    }
+
+    free(params);
+    free(root);
+    free(root_uri);
+  }
+
+  pthread_mutex_unlock(&session->conversation);
+
+  if(!response) {
+    log_message("fn ccls_session_start: ccls did not start\n");
+  }
+
+  free(response);
+  pthread_mutex_lock(&ctx->lock);
+  session->state = response ? CC_CCLS_READY : CC_CCLS_FAILED;
+  session->failed_at = time(NULL);
+  session->refs--;
+  pthread_cond_broadcast(&ctx->changed);
+  pthread_mutex_unlock(&ctx->lock);
+  return NULL;
+}
+
+// Function to find the session of a root, starting one when there is none (ctx->lock held)
+// Returns the session when it is ready, with a reference taken, NULL otherwise
+static CCClsSession *ccls_session_acquire(cc_context *ctx, const char *root) {
+  CCClsSession **slot = NULL;
+  int sessions = ctx->settings.ccls_sessions < CC_CCLS_MAX_SESSIONS ? ctx->settings.ccls_sessions : CC_CCLS_MAX_SESSIONS;
+
+  for(int i = 0; i < sessions; i++) {
+    CCClsSession *session = ctx->ccls_sessions[i];
+
+    if(session && strcmp(session->root, root) == 0) {
+      if(session->state == CC_CCLS_READY) {
+        session->refs++;
+        session->last_used = ++ctx->ccls_clock;
+        return session;
+      }
+
+      // Starting, or failed not long ago: leave it to clang
+      if(session->state == CC_CCLS_STARTING || session->refs > 0 || time(NULL) - session->failed_at < CC_CCLS_RETRY_SEC) {
+        return NULL;
+      }
+
+      slot = &ctx->ccls_sessions[i];
+      break;
+    }
+
+    if(!session || session->refs == 0) {
+      if(!slot || (*slot && (!session || session->last_used < (*slot)->last_used))) {
+        slot = &ctx->ccls_sessions[i];
+      }
+    }
+  }
+
+  if(!slot) {
+    return NULL;
+  }
+
+  CCClsSession *session = (CCClsSession *)calloc(1, sizeof(CCClsSession));
+  pthread_t thread;
+  pthread_attr_t attributes;
+
+  if(!session) {
+    return NULL;
+  }
+
+  snprintf(session->root, sizeof(session->root), "%s", root);
+  pthread_mutex_init(&session->conversation, NULL);
+  session->ctx = ctx;
+  session->refs = 1;
+  session->last_used = ++ctx->ccls_clock;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+  if(pthread_create(&thread, &attributes, ccls_session_start, session) != 0) {
+    pthread_attr_destroy(&attributes);
+    pthread_mutex_destroy(&session->conversation);
+    free(session);
+    return NULL;
+  }
+
+  pthread_attr_destroy(&attributes);
+
+  // The evicted session is idle; closing it only waits for its ccls to exit
+  if(*slot) {
+    ccls_session_close(*slot);
+  }
+
+  *slot = session;
+  return NULL;
+}
+
+// Function to drop a reference taken by ccls_session_acquire; a session whose ccls failed is not
+// used again until it is restarted
+static void ccls_session_release(cc_context *ctx, CCClsSession *session, int failed) {
+  pthread_mutex_lock(&ctx->lock);
+  session->refs--;
+
+  if(failed) {
+    session->state = CC_CCLS_FAILED;
+    session->failed_at = time(NULL);
+  }
+
+  pthread_cond_broadcast(&ctx->changed);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+  Function Description:
+    Reentrant completion API. A cc_context owns everything a completion request needs to cache
+    (project flag sets, compile_commands.json indexes, the clang target) plus its settings, so
+    several contexts, or several threads sharing one context, can serve requests concurrently.
+    processCompletionDataFromString and the other legacy entry points run on cc_default_context().
+
+  Maintenance Notes:
+    - A context lock is held only for cache lookups and command construction, never while clang
+      runs; keep it that way when adding state to struct cc_context.
+    - cc_result.text is malloc'ed, so a caller may also take it over and release it with free().
+*/
+
+// Function to fill settings with the defaults overridden by the environment: CODE_CONNECTOR_DEBOUNCE_MS,
+// CODE_CONNECTOR_TIMEOUT_MS, CODE_CONNECTOR_MEMORY_LIMIT_MB, CODE_CONNECTOR_CPU_LIMIT, CODE_CONNECTOR_HEDGE_MS,
+// CODE_CONNECTOR_CCLS_SESSIONS, CODE_CONNECTOR_ELIDE_BODIES, CODE_CONNECTOR_MODULES
+void cc_settings_from_environment(cc_settings *settings) {
+  memset(settings, 0, sizeof(*settings));
+  const char *value = getenv("CODE_CONNECTOR_DEBOUNCE_MS");
+  settings->debounce_ms = value ? atoi(value) : 0;
+  value = getenv("CODE_CONNECTOR_TIMEOUT_MS");
+  settings->timeout_ms = value ? atoi(value) : 0;
+  value = getenv("CODE_CONNECTOR_MEMORY_LIMIT_MB");
+  settings->memory_limit_mb = value ? atol(value) : 0;
+  value = getenv("CODE_CONNECTOR_CPU_LIMIT");
+  settings->cpu_limit_sec = value ? atoi(value) : 0;
+  value = getenv("CODE_CONNECTOR_HEDGE_MS");
+  settings->hedge_ms = value ? atoi(value) : 0;
+  value = getenv("CODE_CONNECTOR_CCLS_SESSIONS");
+  settings->ccls_sessions = value ? atoi(value) : 0;
+  value = getenv("CODE_CONNECTOR_ELIDE_BODIES");
+  settings->elide_bodies = value ? atoi(value) : 0;
+  value = getenv("CODE_CONNECTOR_MODULES");
+  settings->modules = value ? atoi(value) : 0;
+}
+
+// Function to create a context; settings may be NULL for the defaults
+// Returns NULL on allocation failure
+cc_context *cc_context_create(const cc_settings *settings) {
+  cc_context *ctx = (cc_context *)calloc(1, sizeof(cc_context));
+
+  if(!ctx) {
+    log_message("fn cc_context_create: Failed to allocate the context\n");
+    return NULL;
+  }
+
+  if(pthread_mutex_init(&ctx->lock, NULL) != 0) {
+    log_message("fn cc_context_create: Failed to initialize the context lock\n");
+    free(ctx);
+    return NULL;
+  }
+
+  pthread_cond_init(&ctx->changed, NULL);
+
+  if(settings) {
+    ctx->settings = *settings;
+  }
+
+  if(ctx->settings.clang_path[0] == '\0') {
+    snprintf(ctx->settings.clang_path, sizeof(ctx->settings.clang_path), "clang");
+  }
+
+  return ctx;
+}
+
+// Function to release a context and every cache it owns. No request may be running on it
+void cc_context_destroy(cc_context *ctx) {
+  if(!ctx) {
+    return;
+  }
+
+  for(int i = 0; i < MAX_CACHED_PROJECTS; i++) {
+    free_project_flags(&ctx->projects[i]);
+    free_compile_database(&ctx->databases[i]);
+    flag_list_free(&ctx->discovered[i].flags);
+  }
+
+  for(int i = 0; i < MAX_CACHED_DIRECTORIES; i++) {
+    free_layered_flags(&ctx->layered[i]);
+  }
+
+  for(int i = 0; i < CC_SIGNATURE_SLOTS; i++) {
+    free(ctx->signatures[i].text);
+  }
+
+  // A session still starting holds a reference until its ccls answered or failed
+  pthread_mutex_lock(&ctx->lock);
+
+  for(int i = 0; i < CC_CCLS_MAX_SESSIONS; i++) {
+    while(ctx->ccls_sessions[i] && ctx->ccls_sessions[i]->refs > 0) {
+      pthread_cond_wait(&ctx->changed, &ctx->lock);
+    }
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  for(int i = 0; i < CC_CCLS_MAX_SESSIONS; i++) {
+    if(ctx->ccls_sessions[i]) {
+      ccls_session_close(ctx->ccls_sessions[i]);
+    }
+  }
+
+  pthread_cond_destroy(&ctx->changed);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+}
+
+static cc_context *default_context = NULL;
+static pthread_once_t default_context_once = PTHREAD_ONCE_INIT;
+
+// Function to create the default context exactly once
+static void create_default_context(void) {
+  cc_settings settings;
+  cc_settings_from_environment(&settings);
+  default_context = cc_context_create(&settings);
+}
+
+// Function to get the process-wide context used by the legacy API (NULL if it could not be created)
+cc_context *cc_default_context(void) {
+  pthread_once(&default_context_once, create_default_context);
+  return default_context;
+}
+
+// Function to mark an in-flight request as superseded and kill its clang (ctx->lock held)
+static void cancel_inflight(cc_context *ctx, CCInflight *entry) {
+  if(entry->cancelled) {
+    return;
+  }
+
+  entry->cancelled = 1;
+
+  if(entry->pgid > 0) {
+    kill(-entry->pgid, SIGKILL);
+  }
+
+  for(int i = 0; i < CC_MAX_BACKENDS; i++) {
+    if(entry->calls[i]) {
+      cancel_inflight(ctx, entry->calls[i]);
+    }
+  }
+
+  pthread_cond_broadcast(&ctx->changed);
+}
+
+/*
+  Function Description:
+    Completion backends. A request is answered by the first backend of completion_backends that
+    can answer it (a warm ccls session, else the clang CLI) and, when that is slower than usual,
+    raced against the next one when that one may hedge: after the hedge delay (settings.hedge_ms, or
+    the p90 of the primary's own latency histogram) the second backend is launched, the first valid
+    answer wins and the loser is cancelled. A primary that fails outright is followed by the second
+    backend at once.
+    Every finished run is counted in cc_stats.latency, so the delay follows the latency the user
+    actually sees.
+
+  Maintenance Notes:
+    - To add a backend, insert it into completion_backends by preference (at most CC_MAX_BACKENDS).
+      available must be cheap: it decides under no lock whether hedging is worth a thread at all.
+      clang must stay available for every request.
+    - A backend's call is its cancellation token: a child it starts must publish its process group
+      in call->pgid under ctx->lock (run_completion_command does) and give up once call->cancelled.
+    - hedge says whether a backend may race the primary. Only a backend that gives the same answer
+      as clang for the same buffer may: the signature store remembers clang's last answer per file and
+      call expression, which can be stale after an edit, so it only answers once clang has failed.
+    - Until the primary has CC_HEDGE_MIN_SAMPLES runs its p90 is noise and nothing is hedged.
+*/
+
+#define CC_HEDGE_MIN_SAMPLES 20
+
+// A completion request as the backends see it
+typedef struct {
+  const cc_request *request;
+  char file[PATH_MAX];                // Canonical file; signatures are remembered per file
+  char directory[PATH_MAX];           // Directory of the file
+  char identifier[MAX_LINE_LENGTH];   // Function name before the "(" at the cursor, empty when none
+  char callee[MAX_LINE_LENGTH];       // Whole call expression before the "(" (e.g. "names.push_back")
+  char ccls_root[PATH_MAX];          // Project root indexed by ccls, empty when none or sessions are off
+} CCBackendRequest;
+
+// One completion backend; complete sets *text (malloc'ed) on CC_STATUS_OK
+typedef struct {
+  const char *name;
+  int hedge;  // May race the primary: answers exactly what clang would for the same buffer
+  int (*available)(cc_context *ctx, const CCBackendRequest *request);
+  cc_status (*complete)(cc_context *ctx, const CCBackendRequest *request, CCInflight *call, char **text);
+} CCBackend;
+
+// One backend run of a hedged request
+typedef struct CCBackendRun {
+  cc_context *ctx;
+  const CCBackendRequest *request;
+  const CCBackend *backend;
+  int index;
+  CCInflight call;            // pgid and cancelled only
+  pthread_cond_t *finished;   // Signalled with ctx->lock held when done is set
+  struct CCBackendRun **winner;  // First run with a valid answer, NULL until then
+  pthread_t thread;
+  int started;
+  int done;
+  cc_status status;
+  char *text;
+} CCBackendRun;
+
+// Function to get the histogram bucket of a duration in milliseconds
+static int latency_bucket(long ms) {
+  int bucket = 0;
+
+  while(ms > 0 && bucket < CC_LATENCY_BUCKETS - 1) {
+    ms >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+// Function to get a percentile (1-100) of a latency histogram in milliseconds, interpolated inside
+// its bucket. Returns -1 for an empty histogram
+int cc_latency_percentile(const unsigned long *histogram, int percent) {
+  unsigned long total = 0;
+  unsigned long seen = 0;
+
+  for(int bucket = 0; bucket < CC_LATENCY_BUCKETS; bucket++) {
+    total += histogram[bucket];
+  }
+
+  if(total == 0) {
+    return -1;
+  }
+
+  unsigned long rank = (total * (unsigned long)percent + 99) / 100;
+
+  for(int bucket = 0; bucket < CC_LATENCY_BUCKETS; bucket++) {
+    if(histogram[bucket] > 0 && seen + histogram[bucket] >= rank) {
+      long low = bucket == 0 ? 0 : 1L << (bucket - 1);
+      long high = 1L << bucket;
+      return (int)(low + (high - low) * (long)(rank - seen) / (long)histogram[bucket]);
+    }
+
+    seen += histogram[bucket];
+  }
+
+  return 1 << (CC_LATENCY_BUCKETS - 1);
+}
+
+// Function to find the slot of a call expression in the signature store
+static CCSignature *signature_slot(cc_context *ctx, const CCBackendRequest *request, unsigned long *hash) {
+  *hash = hash_string(hash_string(CC_HASH_SEED, request->file), request->callee);
+  return &ctx->signatures[*hash % CC_SIGNATURE_SLOTS];
+}
+
+// Function to remember clang's completion for the call expression of a request
+static void signature_store(cc_context *ctx, const CCBackendRequest *request, const char *text) {
+  size_t length = strlen(request->identifier);
+  unsigned long hash;
+
+  // Only a signature of the function being called is worth answering again
+  if(length == 0 || strncmp(text, request->identifier, length) != 0 || text[length] != '(') {
+    return;
+  }
+
+  char *copy = strdup(text);
+
+  if(copy) {
+    pthread_mutex_lock(&ctx->lock);
+    CCSignature *slot = signature_slot(ctx, request, &hash);
+    free(slot->text);
+    slot->hash = hash;
+    slot->text = copy;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+}
+
+// Function to check whether the signature store knows the call expression of a request
+static int store_backend_available(cc_context *ctx, const CCBackendRequest *request) {
+  unsigned long hash;
+
+  if(request->identifier[0] == '\0' || request->callee[0] == '\0') {
+    return 0;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  CCSignature *slot = signature_slot(ctx, request, &hash);
+  int available = slot->text && slot->hash == hash;
+  pthread_mutex_unlock(&ctx->lock);
+  return available;
+}
+
+// Function to answer from the signature store
+static cc_status store_backend_complete(cc_context *ctx, const CCBackendRequest *request, CCInflight *call, char **text) {
+  unsigned long hash;
+  cc_status status = CC_STATUS_NO_COMPLETION;
+  pthread_mutex_lock(&ctx->lock);
+  CCSignature *slot = signature_slot(ctx, request, &hash);
+
+  if(call->cancelled) {
+    status = CC_STATUS_CANCELLED;
+  }
+
+  else if(slot->text && slot->hash == hash) {
+    *text = strdup(slot->text);
+    status = *text ? CC_STATUS_OK : CC_STATUS_OUT_OF_MEMORY;
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+  return status;
+}
+
+/*
+  Function Description:
+    Function-body elision (CODE_CONNECTOR_ELIDE_BODIES). clang's completion time grows with everything
+    in the file, but a signature needs the declarations and the function being edited only. Before a
+    large source is handed to clang, a copy is written in which the body of every other function
+    definition is reduced to "{}", and clang reads it in place of the file through -remap-file.
+
+  Parameters:
+    - source (const char *): The file with the text to complete in (the buffer, or its unsaved copy).
+    - line, column (int): The 1-based cursor position.
+    - path (const char *): Where the elided copy is written.
+
+  Return Value:
+    - long: Bytes removed, or -1 when no copy was written: the source is small, nothing could be
+      elided, the braces do not balance, or the copy could not be written.
+
+  Detailed Steps:
+    1. Lex: elide_next knows comments, string, character and raw string literals, numbers and
+       preprocessor directives (skipped whole), which is enough to match braces and parentheses.
+    2. Classify each '{' of a declaration scope (file, namespace, extern "C", class body) by the
+       statement before it: after a closing parenthesis followed only by qualifiers or a trailing
+       return type, without '=', auto, decltype, constexpr or consteval, it opens a function body;
+       after namespace, extern, class, struct or union it opens a scope that is searched further;
+       anything else (enum bodies, initializers) is skipped whole.
+    3. Elide a body unless it holds the cursor, ends on the cursor line, or contains a preprocessor
+       directive (a #define inside a body still counts after it).
+
+  Maintenance Notes:
+    - Position mapping: an elided body keeps its newlines ("{" + newlines + "}"), so every line
+      keeps its number and, because nothing on the cursor line before the cursor moves, the cursor
+      keeps its column; clang is asked at the position the editor sent.
+    - Deduced return types (auto) and constexpr functions keep their bodies because callers
+      depend on them; doubtful constructs are kept rather than elided.
+    - clang_backend_complete parses the whole file again when the elided copy yields no completion,
+      and CODE_CONNECTOR_ELIDE_BODIES=2 always does, answering with the full parse and counting
+      mismatches and both parse times in the stats.
+*/
+
+#define CC_ELIDE_MIN_BYTES 65536  // Smaller sources are parsed whole
+
+// Tokenizer of the elision pass
+typedef struct {
+  const char *text;
+  size_t size;
+  size_t pos;
+  int line_start;  // Only whitespace since the last newline
+  int directives;  // Preprocessor directives skipped so far
+} CCElideLexer;
+
+// Function to move past a quoted literal whose opening quote is at lex->pos
+static void elide_skip_quoted(CCElideLexer *lex) {
+  char quote = lex->text[lex->pos++];
+
+  while(lex->pos < lex->size && lex->text[lex->pos] != quote && lex->text[lex->pos] != '\n') {
+    lex->pos += lex->text[lex->pos] == '\\' && lex->pos + 1 < lex->size ? 2 : 1;
+  }
+
+  lex->pos += lex->pos < lex->size && lex->text[lex->pos] == quote;
+}
+
+// Function to move to the next token, skipping whitespace, comments and preprocessor directives
+// Returns the token's first byte ('a' for identifiers and numbers, '"' for literals), 0 at the end
+static int elide_next(CCElideLexer *lex, size_t *start) {
+  const char *text = lex->text;
+
+  while(lex->pos < lex->size) {
+    char c = text[lex->pos];
+
+    if(c == '\n' || isspace((unsigned char)c)) {
+      lex->line_start |= c == '\n';
+      lex->pos++;
+    }
+
+    else if(c == '/' && lex->pos + 1 < lex->size && text[lex->pos + 1] == '/') {
+      const char *newline = memchr(text + lex->pos, '\n', lex->size - lex->pos);
+      lex->pos = newline ? (size_t)(newline - text) : lex->size;
+    }
+
+    else if(c == '/' && lex->pos + 1 < lex->size && text[lex->pos + 1] == '*') {
+      const char *end = memmem(text + lex->pos + 2, lex->size - lex->pos - 2, "*/", 2);
+      lex->pos = end ? (size_t)(end - text) + 2 : lex->size;
+    }
+
+    else if(c == '#' && lex->line_start) {
+      lex->directives++;
+
+      // To the end of the line, continued lines included
+      while(lex->pos < lex->size && !(text[lex->pos] == '\n' && text[lex->pos - 1] != '\\')) {
+        lex->pos++;
+      }
+    }
+
+    else {
+      break;
+    }
+  }
+
+  if(lex->pos >= lex->size) {
+    return 0;
+  }
+
+  *start = lex->pos;
+  lex->line_start = 0;
+  char c = text[lex->pos];
+
+  if(isalpha((unsigned char)c) || c == '_') {
+    while(lex->pos < lex->size && (isalnum((unsigned char)text[lex->pos]) || text[lex->pos] == '_')) {
+      lex->pos++;
+    }
+
+    size_t length = lex->pos - *start;
+    char quote = lex->pos < lex->size ? text[lex->pos] : '\0';
+    int raw = quote == '"' && text[lex->pos - 1] == 'R' && length <= 3 && strspn(text + *start, "uUL8R") == length;
+
+    if(raw) {
+      // R"delimiter( ... )delimiter"
+      char closing[20] = ")";
+      size_t delimiter = strcspn(text + lex->pos + 1, "(\n");
+
+      if(delimiter > 16 || lex->pos + 1 + delimiter >= lex->size) {
+        lex->pos = lex->size;
+        return '"';
+      }
+
+      memcpy(closing + 1, text + lex->pos + 1, delimiter);
+      closing[delimiter + 1] = '"';
+      const char *end = memmem(text + lex->pos, lex->size - lex->pos, closing, delimiter + 2);
+      lex->pos = end ? (size_t)(end - text) + delimiter + 2 : lex->size;
+      return '"';
+    }
+
+    // Encoding prefixes of string and character literals
+    if((quote == '"' || quote == '\'') && length <= 2 && strspn(text + *start, "uUL8") == length) {
+      elide_skip_quoted(lex);
+      return '"';
+    }
+
+    return 'a';
+  }
+
+  if(isdigit((unsigned char)c) || (c == '.' && lex->pos + 1 < lex->size && isdigit((unsigned char)text[lex->pos + 1]))) {
+    // Digit separators and exponent signs belong to the number
+    while(lex->pos < lex->size && (isalnum((unsigned char)text[lex->pos]) || strchr("_.'", text[lex->pos]) ||
+                                   ((text[lex->pos] == '+' || text[lex->pos] == '-') && strchr("eEpP", text[lex->pos - 1])))) {
+      lex->pos++;
+    }
+
+    return 'a';
+  }
+
+  if(c == '"' || c == '\'') {
+    elide_skip_quoted(lex);
+    return '"';
+  }
+
+  lex->pos++;
+  return (unsigned char)c;
+}
+
+// Function to move past the block whose '{' was just read; *close receives the offset of its '}'
+// Returns 0 on success, 1 when the file ends first
+static int elide_skip_block(CCElideLexer *lex, size_t *close) {
+  int depth = 1;
+  int token;
+
+  while((token = elide_next(lex, close)) != 0) {
+    depth += token == '{';
+    depth -= token == '}';
+
+    if(depth == 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Function to check whether an identifier token is one of a list of words
+static int elide_word(const char *token, size_t length, const char *const *words) {
+  for(; *words; words++) {
+    if(strlen(*words) == length && memcmp(*words, token, length) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static long elide_function_bodies(const char *source, int line, int column, const char *path) {
+  static const char *const kept[] = {"auto", "decltype", "constexpr", "consteval", NULL};
+  static const char *const scopes[] = {"namespace", "extern", "class", "struct", "union", NULL};
+  struct stat st;
+  int fd = open(source, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < CC_ELIDE_MIN_BYTES) {
+    if(fd >= 0) {
+      close(fd);
+    }
+
+    return -1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  char *text = (char *)malloc(size + 1);  // NUL-terminated for strcspn
+  char *out = (char *)malloc(size);
+  size_t got = 0;
+
+  while(text && out && got < size) {
+    ssize_t n = read(fd, text + got, size - got);
+
+    if(n <= 0) {
+      break;
+    }
+
+    got += (size_t)n;
+  }
+
+  close(fd);
+
+  if(!text || !out || got != size) {
+    free(text);
+    free(out);
+    return -1;
+  }
+
+  text[size] = '\0';
+
+  // The cursor line [line_begin, line_end) and the cursor offset
+  size_t line_begin = 0;
+
+  for(int i = 1; i < line && line_begin < size; i++) {
+    const char *newline = memchr(text + line_begin, '\n', size - line_begin);
+    line_begin = newline ? (size_t)(newline - text) + 1 : size;
+  }
+
+  const char *line_newline = memchr(text + line_begin, '\n', size - line_begin);
+  size_t line_end = line_newline ? (size_t)(line_newline - text) : size;
+  size_t cursor = line_begin + (size_t)(column > 1 ? column - 1 : 0);
+  CCElideLexer lex = {text, size, 0, 1, 0};
+  size_t copied = 0;
+  size_t used = 0;
+  long removed = 0;
+  int depth = 0;       // Declaration scopes entered
+  int failed = 0;
+  // The statement read so far in the current declaration scope
+  int parens = 0, closed = 0, trailing = 0, assigned = 0, excluded = 0, scope = 0, operator_name = 0, initializers = 0;
+  int previous = 0;
+  size_t start;
+  int token;
+
+  for(; !failed && (token = elide_next(&lex, &start)) != 0; previous = token) {
+    if(token == '(') {
+      parens++;
+      operator_name = 0;
+    }
+
+    else if(token == ')') {
+      parens -= parens > 0;
+      closed |= parens == 0;
+      trailing = parens == 0;
+    }
+
+    // A member initialized with braces in a constructor's initializer list, as in b{2}
+    else if(token == '{' && parens == 0 && initializers && (previous == 'a' || previous == '>')) {
+      size_t close;
+      failed = elide_skip_block(&lex, &close);
+      trailing = 1;
+    }
+
+    else if(token == '{') {
+      size_t close;
+      int directives = lex.directives;
+      int body = parens == 0 && closed && trailing && !assigned && !excluded;
+
+      if(parens == 0 && !body && scope && !assigned) {
+        depth++;
+      }
+
+      else if(elide_skip_block(&lex, &close) != 0) {
+        failed = 1;
+      }
+
+      else if(body && lex.directives == directives && (cursor < start || cursor > close) &&
+              (close < line_begin || close >= line_end)) {
+        // "{" + the body's newlines + "}"
+        memcpy(out + used, text + copied, start + 1 - copied);
+        used += start + 1 - copied;
+
+        for(size_t i = start + 1; i < close; i++) {
+          if(text[i] == '\n') {
+            out[used++] = '\n';
+          }
+
+          else {
+            removed++;
+          }
+        }
+
+        copied = close;
+      }
+
+      if(parens == 0) {
+        closed = trailing = assigned = excluded = scope = operator_name = initializers = 0;
+      }
+    }
+
+    else if(parens > 0) {
+      continue;
+    }
+
+    else if(token == ';' || token == '}') {
+      if(token == '}' && depth-- == 0) {
+        failed = 1;  // More closing braces than opening ones
+      }
+
+      closed = trailing = assigned = excluded = scope = operator_name = initializers = 0;
+    }
+
+    else if(token == 'a') {
+      size_t length = lex.pos - start;
+      excluded |= elide_word(text + start, length, kept);
+      scope |= elide_word(text + start, length, scopes);
+      operator_name = length == 8 && memcmp(text + start, "operator", 8) == 0;
+    }
+
+    else if(token == '=' && !operator_name) {
+      assigned = 1;
+      trailing = 0;
+    }
+
+    // Qualifiers and trailing return types may follow the parameter list
+    else if(!operator_name && !strchr("&*<>:-,", token)) {
+      trailing = 0;
+    }
+
+    // A single ':' after the parameter list starts a constructor's initializer list
+    if(token == ':' && parens == 0 && closed && text[start + 1] != ':' && (start == 0 || text[start - 1] != ':')) {
+      initializers = 1;
+    }
+  }
+
+  if(!failed && depth == 0 && removed > 0) {
+    memcpy(out + used, text + copied, size - copied);
+    used += size - copied;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    failed = fd < 0 || write_all(fd, out, used) != 0;
+    failed |= fd >= 0 && close(fd) != 0;
+
+    if(failed) {
+      unlink(path);
+    }
+  }
+
+  free(text);
+  free(out);
+  return failed || depth != 0 || removed == 0 ? -1 : removed;
+}
+
+// Function to check whether clang can be tried; it is the backend that always answers
+static int clang_backend_available(cc_context *ctx, const CCBackendRequest *request) {
+  (void)ctx;
+  (void)request;
+  return 1;
+}
+
+// Function to run clang on the text in unsaved (NULL for the file itself): builds the clang arguments from
+// the cached project flags, runs clang without holding the context lock and keeps the first filtered completion.
+// With modules on, a parse that fails or has no answer is run again without them
+static cc_status clang_complete_text(cc_context *ctx, const CCBackendRequest *request, const char *unsaved, CCInflight *call,
+                                     char **text) {
+  cc_status status = CC_STATUS_OK;
+
+  for(int modules = ctx->settings.modules > 0; ; modules = 0) {
+    CCFlagList argv = {NULL, 0, 0};
+
+    if(context_build_argv(ctx, request->request->filename, unsaved, request->request->line,
+                          request->request->column, 0, modules, &argv, &status) != 0) {
+      return status;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stats.clang_launches++;
+    pthread_mutex_unlock(&ctx->lock);
+    interactive_begin();
+    char *output = run_completion_command(&argv, ctx, call, &status);
+    interactive_end();
+    flag_list_free(&argv);
+
+    if(!output && status == CC_STATUS_TIMEOUT) {
+      pthread_mutex_lock(&ctx->lock);
+      ctx->stats.timeouts++;
+      pthread_mutex_unlock(&ctx->lock);
+    }
+
+    char *filtered = output ? filter_clang_output(output) : NULL;
+    status = output ? CC_STATUS_NO_COMPLETION : status;
+    free(output);
+    // Only the first line of the filtered output is used
+    size_t first_line = filtered ? strcspn(filtered, "\n") : 0;
+
+    if(first_line > 0) {
+      *text = strndup(filtered, first_line);
+      free(filtered);
+      return *text ? CC_STATUS_OK : CC_STATUS_OUT_OF_MEMORY;
+    }
+
+    free(filtered);
+
+    // Headers that are not modular make the modular parse fail; the textual one decides
+    if(!modules || (status != CC_STATUS_NO_COMPLETION && status != CC_STATUS_CLANG_FAILED)) {
+      return status;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stats.module_fallbacks++;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+}
+
+// Function to answer with the clang CLI, on a copy without the other functions' bodies when elision is on
+static cc_status clang_backend_complete(cc_context *ctx, const CCBackendRequest *request, CCInflight *call, char **text) {
+  static unsigned long elide_clock = 0;
+  const cc_request *req = request->request;
+  char name[64];
+  char elided[PATH_MAX];
+  long removed = -1;
+  cc_status status;
+
+  if(ctx->settings.elide_bodies > 0) {
+    snprintf(name, sizeof(name), "elide.%ld.%lu", (long)getpid(), __atomic_add_fetch(&elide_clock, 1, __ATOMIC_RELAXED));
+
+    if(runtime_file_path(name, elided, sizeof(elided)) == 0) {
+      removed = elide_function_bodies(req->unsaved ? req->unsaved : req->filename, req->line, req->column, elided);
+    }
+  }
+
+  if(removed < 0) {
+    status = clang_complete_text(ctx, request, req->unsaved, call, text);
+  }
+
+  else {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    status = clang_complete_text(ctx, request, elided, call, text);
+    long elided_ms = elapsed_ms(&started);
+    unlink(elided);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stats.elisions++;
+    ctx->stats.elided_bytes += (unsigned long)removed;
+    pthread_mutex_unlock(&ctx->lock);
+
+    // The whole file is the reference: parsed again when the copy has no answer, or always to compare
+    if(status == CC_STATUS_NO_COMPLETION || (status != CC_STATUS_CANCELLED && ctx->settings.elide_bodies > 1)) {
+      char *full = NULL;
+      clock_gettime(CLOCK_MONOTONIC, &started);
+      cc_status full_status = clang_complete_text(ctx, request, req->unsaved, call, &full);
+      long full_ms = elapsed_ms(&started);
+      int mismatch = full_status != status || (full && *text && strcmp(full, *text) != 0);
+
+      if(full_status != CC_STATUS_CANCELLED && ctx->settings.elide_bodies > 1) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stats.elide_checks++;
+        ctx->stats.elide_mismatches += (unsigned long)mismatch;
+        ctx->stats.elide_ms += (unsigned long)elided_ms;
+        ctx->stats.elide_full_ms += (unsigned long)full_ms;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if(mismatch) {
+          log_message("fn clang_backend_complete: Elided and full parse disagree\n");
+        }
+      }
+
+      free(*text);
+      *text = full;
+      status = full_status;
+    }
+  }
+
+  if(status == CC_STATUS_OK) {
+    signature_store(ctx, request, *text);
+  }
+
+  return status;
+}
+
+// Function to check whether a ready ccls session can answer the signature at the cursor; asking for
+// an indexed project without a session starts one for the requests that follow
+static int ccls_backend_available(cc_context *ctx, const CCBackendRequest *request) {
+  if(request->identifier[0] == '\0' || request->ccls_root[0] == '\0') {
+    return 0;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  CCClsSession *session = ccls_session_acquire(ctx, request->ccls_root);
+
+  if(session) {
+    session->refs--;  // complete takes its own reference
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+  return session != NULL;
+}
+
+// Function to answer with textDocument/signatureHelp of the project's ccls session
+static cc_status ccls_backend_complete(cc_context *ctx, const CCBackendRequest *request, CCInflight *call, char **text) {
+  char abs_filename[PATH_MAX];
+  cc_status status = CC_STATUS_CLANG_FAILED;
+  pthread_mutex_lock(&ctx->lock);
+  CCClsSession *session = ccls_session_acquire(ctx, request->ccls_root);
+  pthread_mutex_unlock(&ctx->lock);
+
+  if(!session) {
+    return status;
+  }
+
+  pthread_mutex_lock(&session->conversation);
+
+  if(realpath(request->request->filename, abs_filename) != NULL &&
+     ccls_sync_document(session, abs_filename, request->request->unsaved ? request->request->unsaved : abs_filename) == 0) {
+    char *uri = json_path_uri(abs_filename);
+    size_t size = uri ? strlen(uri) + 128 : 0;
+    char *params = uri ? (char *)malloc(size) : NULL;
+    status = CC_STATUS_OUT_OF_MEMORY;
+
+    // LSP positions are 0-based; the cursor is right after column
+    if(params) {
+      snprintf(params, size, "{\"textDocument\":{\"uri\":%s,\"position\":{\"line\":%d,\"character\":%d}}",
+               uri, request->request->line - 1, request->request->column);
+      char *response = ccls_request(session, "textDocument/signatureHelp", params, CC_CCLS_REQUEST_TIMEOUT_MS, call, &status);
+
+      if(response) {
+        *text = ccls_signature_text(response, request->identifier);
+        status = *text ? CC_STATUS_OK : CC_STATUS_NO_COMPLETION;
+      }
+
+      free(response);
+    }
+
+    free(params);
+    free(uri);
+  }
+
+  pthread_mutex_unlock(&session->conversation);
+  ccls_session_release(ctx, session, status == CC_STATUS_CLANG_FAILED);
+  return status;
+}
+
+static const CCBackend completion_backends[] = {
+  {"ccls", 1, ccls_backend_available, ccls_backend_complete},
+  {"clang", 1, clang_backend_available, clang_backend_complete},
+  {"store", 0, store_backend_available, store_backend_complete},
+};
+
+#define CC_BACKEND_COUNT ((int)(sizeof(completion_backends) / sizeof(completion_backends[0])))
+
+// Function to get the name of a backend, the index into cc_stats.latency. NULL past the last one
+const char *cc_backend_name(int backend) {
+  return backend >= 0 && backend < CC_BACKEND_COUNT ? completion_backends[backend].name : NULL;
+}
+
+// Function to copy the function name before the "(" at a 1-based column of a line into identifier
+// and the call expression ending in it (receivers and scopes included) into callee (size bytes
+// each); both are left empty when the cursor is not in such a call
+static void call_identifier(const char *text, ssize_t length, int column, char *identifier, char *callee, size_t size) {
+  ssize_t end = column < length ? column : length;
+  identifier[0] = '\0';
+  callee[0] = '\0';
+
+  while(end > 0 && isspace((unsigned char)text[end - 1])) {
+    end--;
+  }
+
+  if(end > 0 && text[end - 1] == '(') {
+    end--;
+
+    while(end > 0 && isspace((unsigned char)text[end - 1])) {
+      end--;
+    }
+
+    ssize_t start = end;
+
+    while(start > 0 && (isalnum((unsigned char)text[start - 1]) || text[start - 1] == '_')) {
+      start--;
+    }
+
+    if(end - start < (ssize_t)size) {
+      memcpy(identifier, text + start, (size_t)(end - start));
+      identifier[end - start] = '\0';
+    }
+
+    // Receivers and scopes: "a.b->c::f", "v[i].f" and "get().f" up to the enclosing expression
+    ssize_t begin = start;
+
+    for(int depth = 0; begin > 0; begin--) {
+      char ch = text[begin - 1];
+
+      if(ch == ')' || ch == ']') {
+        depth++;
+      }
+
+      else if((ch == '(' || ch == '[') && depth > 0) {
+        depth--;
+      }
+
+      else if(depth == 0 && !isalnum((unsigned char)ch) && ch != '_' && ch != '.' && ch != ':' &&
+              !(ch == '>' && begin >= 2 && text[begin - 2] == '-') && !(ch == '-' && text[begin] == '>')) {
+        break;
+      }
+    }
+
+    if(identifier[0] != '\0' && end - begin < (ssize_t)size) {
+      memcpy(callee, text + begin, (size_t)(end - begin));
+      callee[end - begin] = '\0';
+    }
+  }
+}
+
+// Function to fill the backend view of a request: the file's directory, the function name before
+// the "(" at the cursor (column is the 1-based column of the last character before the cursor) and,
+// for such a call with ccls sessions enabled, the project root when ccls has indexed it
+static void backend_request_init(cc_context *ctx, const cc_request *request, CCBackendRequest *backend_request) {
+  char abs_filename[PATH_MAX];
+  memset(backend_request, 0, sizeof(*backend_request));
+  backend_request->request = request;
+
+  if(realpath(request->filename, abs_filename) == NULL) {
+    return;
+  }
+
+  memcpy(backend_request->file, abs_filename, sizeof(backend_request->file));
+  snprintf(backend_request->directory, sizeof(backend_request->directory), "%s", dirname(abs_filename));
+  FILE *file = fopen(request->unsaved ? request->unsaved : request->filename, "r");
+  char *text = NULL;
+  size_t size = 0;
+  ssize_t length = -1;
+
+  for(int line = 0; file && line < request->line && (length = getline(&text, &size, file)) >= 0; line++) {
+  }
+
+  if(file) {
+    fclose(file);
+  }
+
+  if(length < 0 || request->column <= 0) {
+    free(text);
+    return;
+  }
+
+  call_identifier(text, length, request->column, backend_request->identifier, backend_request->callee,
+                  sizeof(backend_request->identifier));
+  free(text);
+  char cache[PATH_MAX + 16];
+  struct stat st;
+
+  if(backend_request->identifier[0] != '\0' && ctx->settings.ccls_sessions > 0 &&
+     findFiles(backend_request->directory, backend_request->ccls_root) == 0) {
+    snprintf(cache, sizeof(cache), "%s/.ccls-cache", backend_request->ccls_root);
+
+    if(stat(cache, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      backend_request->ccls_root[0] = '\0';
+    }
+  }
+}
+
+// Function to count a finished backend run in its latency histogram; cancelled runs say nothing
+static void record_latency(cc_context *ctx, int backend, const struct timespec *started, cc_status status) {
+  if(status != CC_STATUS_CANCELLED) {
+    long ms = elapsed_ms(started);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stats.latency[backend][latency_bucket(ms)]++;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+}
+
+// Function to get how long the primary backend may run before a second one is launched (ctx->lock held)
+// Returns -1 when hedging is off or the primary has not answered often enough for a p90
+static int context_hedge_delay(cc_context *ctx, int primary) {
+  unsigned long samples = 0;
+
+  if(ctx->settings.hedge_ms != 0) {
+    return ctx->settings.hedge_ms;
+  }
+
+  for(int bucket = 0; bucket < CC_LATENCY_BUCKETS; bucket++) {
+    samples += ctx->stats.latency[primary][bucket];
+  }
+
+  return samples < CC_HEDGE_MIN_SAMPLES ? -1 : cc_latency_percentile(ctx->stats.latency[primary], 90);
+}
+
+// Function to run one backend of a hedged request on its own thread
+static void *backend_run_thread(void *arg) {
+  CCBackendRun *run = (CCBackendRun *)arg;
+  struct timespec started;
+  char *text = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  cc_status status = run->backend->complete(run->ctx, run->request, &run->call, &text);
+  record_latency(run->ctx, run->index, &started, status);
+  pthread_mutex_lock(&run->ctx->lock);
+  run->status = status;
+  run->text = text;
+  run->done = 1;
+
+  if(status == CC_STATUS_OK && !*run->winner) {
+    *run->winner = run;
+  }
+
+  pthread_cond_broadcast(run->finished);
+  pthread_mutex_unlock(&run->ctx->lock);
+  return NULL;
+}
+
+// Function to start a backend run of a hedged request and let the request's cancellation reach it
+// (ctx->lock held). Returns 0 when its thread runs
+static int start_backend_run(CCBackendRun *run, CCInflight *entry) {
+  run->call.cancelled = entry && entry->cancelled;
+
+  if(pthread_create(&run->thread, NULL, backend_run_thread, run) != 0) {
+    return 1;
+  }
+
+  run->started = 1;
+
+  if(entry) {
+    entry->calls[run->index] = &run->call;
+  }
+
+  return 0;
+}
+
+// Function to race the primary backend against a second one launched after delay_ms, or as soon as the
+// primary failed. Returns the status of the winner, or of the primary when no run found a valid answer
+static cc_status hedge_request(cc_context *ctx, const CCBackendRequest *request, CCInflight *entry, int primary,
+                               int secondary, int delay_ms, char **text) {
+  CCBackendRun runs[2];
+  CCBackendRun *winner = NULL;
+  pthread_cond_t finished;
+  struct timespec deadline;
+  memset(runs, 0, sizeof(runs));
+  pthread_cond_init(&finished, NULL);
+
+  for(int i = 0; i < 2; i++) {
+    runs[i].ctx = ctx;
+    runs[i].request = request;
+    runs[i].index = i == 0 ? primary : secondary;
+    runs[i].backend = &completion_backends[runs[i].index];
+    runs[i].finished = &finished;
+    runs[i].winner = &winner;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += delay_ms / 1000;
+  deadline.tv_nsec += (long)(delay_ms % 1000) * 1000000L;
+
+  if(deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+
+  if(start_backend_run(&runs[0], entry) == 0) {
+    while(!runs[0].done && pthread_cond_timedwait(&finished, &ctx->lock, &deadline) != ETIMEDOUT) {
+    }
+
+    // The primary is slower than usual, or failed: race the second backend against it
+    if(!winner && !runs[0].call.cancelled && start_backend_run(&runs[1], entry) == 0) {
+      ctx->stats.hedges++;
+    }
+
+    while(!winner && !(runs[0].done && (runs[1].done || !runs[1].started))) {
+      pthread_cond_wait(&finished, &ctx->lock);
+    }
+
+    // The loser is killed; its result is discarded below
+    for(int i = 0; i < 2; i++) {
+      if(runs[i].started && !runs[i].done && &runs[i] != winner) {
+        cancel_inflight(ctx, &runs[i].call);
+      }
+
+      if(entry) {
+        entry->calls[runs[i].index] = NULL;
+      }
+    }
+  }
+
+  ctx->stats.hedge_wins += winner == &runs[1];
+  pthread_mutex_unlock(&ctx->lock);
+  cc_status status = CC_STATUS_OUT_OF_MEMORY;
+
+  for(int i = 0; i < 2; i++) {
+    if(runs[i].started) {
+      pthread_join(runs[i].thread, NULL);
+    }
+
+    if(winner ? &runs[i] == winner : i == 0) {
+      status = runs[i].started ? runs[i].status : status;
+      *text = runs[i].text;
+    }
+
+    else {
+      free(runs[i].text);
+    }
+  }
+
+  pthread_cond_destroy(&finished);
+  return status;
+}
+
+// Function to run one backend on the calling thread, cancelled through the request itself
+static cc_status run_backend(cc_context *ctx, int backend, const CCBackendRequest *request, CCInflight *entry, char **text) {
+  CCInflight call;
+  struct timespec started;
+  memset(&call, 0, sizeof(call));
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  cc_status status = completion_backends[backend].complete(ctx, request, entry ? entry : &call, text);
+  record_latency(ctx, backend, &started, status);
+  return status;
+}
+
+// Function to answer one request with the first backend that can, hedged with the next one once the
+// first runs longer than the hedge delay
+static cc_status complete_request(cc_context *ctx, const cc_request *request, CCInflight *entry, cc_result *result) {
+  CCBackendRequest backend_request;
+  int primary = -1;
+  int secondary = -1;
+  backend_request_init(ctx, request, &backend_request);
+
+  for(int backend = 0; backend < CC_BACKEND_COUNT && secondary < 0; backend++) {
+    if(completion_backends[backend].available(ctx, &backend_request)) {
+      *(primary < 0 ? &primary : &secondary) = backend;
+    }
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  int delay_ms = context_hedge_delay(ctx, primary);
+  pthread_mutex_unlock(&ctx->lock);
+
+  if(secondary >= 0 && delay_ms >= 0 && completion_backends[secondary].hedge) {
+    result->status = hedge_request(ctx, &backend_request, entry, primary, secondary, delay_ms, &result->text);
+    return result->status;
+  }
+
+  // Nothing that may race: the backends run on this thread, the second only when the first failed
+  result->status = run_backend(ctx, primary, &backend_request, entry, &result->text);
+
+  if(secondary >= 0 && result->status != CC_STATUS_OK && result->status != CC_STATUS_CANCELLED) {
+    result->status = run_backend(ctx, secondary, &backend_request, entry, &result->text);
+  }
+
+  return result->status;
+}
+
+// Function to build the coalescing key of a request: canonical file, on-disk fingerprint (the
+// buffer Vim just wrote, or the unsaved text), changedtick and position. abs_filename (PATH_MAX) receives
+// the canonical file. Returns a malloc'ed key or NULL
+static char *request_key(const cc_request *request, char *abs_filename) {
+  CCFileFingerprint fingerprint;
+
+  if(realpath(request->filename, abs_filename) == NULL ||
+     get_file_fingerprint(request->unsaved ? request->unsaved : abs_filename, &fingerprint) != 0) {
+    return NULL;
+  }
+
+  size_t size = strlen(abs_filename) + 160;
+  char *key = (char *)malloc(size);
+
+  if(key) {
+    snprintf(key, size, "%s\n%llu:%llu:%lld:%lld.%ld\n%ld:%d:%d", abs_filename, fingerprint.device,
+             fingerprint.inode, fingerprint.size, fingerprint.mtime_sec, fingerprint.mtime_nsec,
+             request->changedtick, request->line, request->column);
+  }
+
+  return key;
+}
+
+/*
+  Function Description:
+    Runs one completion request on a context. Requests arriving while an identical one (same
+    file content, changedtick, line and column) is still running attach to it and receive a copy
+    of its result instead of starting another clang; key repeat and remapped keys routinely fire
+    the same request two or three times. A request for the same buffer that is not identical
+    supersedes the older ones (latest wins): their clang process groups are killed and they
+    return CC_STATUS_CANCELLED, so CPU only goes to the completion the user is still waiting for.
+
+  Parameters:
+    - ctx (cc_context *): Context to use; may be shared between threads.
+    - request (const cc_request *): File, 1-based position, optional changedtick and generation.
+    - result (cc_result *): Receives the status and, on CC_STATUS_OK, the completion text.
+
+  Return Value:
+    - cc_status: Same value as result->status.
+
+  Detailed Steps:
+    1. Key the request; join an identical in-flight request as a follower if there is one.
+    2. Otherwise cancel older requests for the buffer (or give up if a newer one is running).
+    3. With settings.debounce_ms, wait that long for a superseding request before starting clang.
+    4. Run clang, publish the result to the followers and unlink the entry.
+
+  Maintenance Notes:
+    - A request's generation is request->generation when the client numbers its requests per
+      buffer, otherwise its arrival order in this context; a client should do one or the other.
+    - Only in-flight requests are shared; a finished entry is unlinked at once, so a later request
+      always sees the current file. Results are not cached here.
+    - The entry is freed by whichever of the leader and its followers lets go of it last.
+*/
+cc_status cc_complete(cc_context *ctx, const cc_request *request, cc_result *result) {
+  char abs_filename[PATH_MAX];
+
+  if(!result) {
+    return CC_STATUS_INVALID_ARGUMENT;
+  }
+
+  result->text = NULL;
+  result->status = CC_STATUS_INVALID_ARGUMENT;
+
+  if(!ctx || !request || !request->filename) {
+    return result->status;
+  }
+
+  char *key = request_key(request, abs_filename);
+
+  if(!key) {
+    return complete_request(ctx, request, NULL, result);  // Reports the missing file
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->stats.requests++;
+  unsigned long generation = request->generation ? request->generation : ++ctx->generation_clock;
+  CCInflight *entry = ctx->inflight;
+
+  while(entry && strcmp(entry->key, key) != 0) {
+    entry = entry->next;
+  }
+
+  if(entry) {
+    // Follower: wait for the leader's clang run
+    entry->refs++;
+    ctx->stats.coalesced++;
+
+    while(!entry->done) {
+      pthread_cond_wait(&entry->finished, &ctx->lock);
+    }
+
+    result->status = entry->status;
+    result->text = entry->text ? strdup(entry->text) : NULL;
+
+    if(entry->text && !result->text) {
+      result->status = CC_STATUS_OUT_OF_MEMORY;
+    }
+  }
+
+  else {
+    // Latest wins: older requests for this buffer are cancelled, a newer one makes this one moot
+    int superseded = 0;
+
+    for(CCInflight *other = ctx->inflight; other; other = other->next) {
+      if(strcmp(other->buffer, abs_filename) == 0) {
+        if(other->generation < generation) {
+          cancel_inflight(ctx, other);
+        }
+
+        else if(other->generation > generation) {
+          superseded = 1;
+        }
+      }
+    }
+
+    entry = superseded ? NULL : (CCInflight *)calloc(1, sizeof(CCInflight));
+
+    if(entry) {
+      entry->buffer = strdup(abs_filename);
+    }
+
+    if(!entry || !entry->buffer) {
+      if(entry) {
+        free(entry);
+      }
+
+      result->status = superseded ? CC_STATUS_CANCELLED : CC_STATUS_OUT_OF_MEMORY;
+      ctx->stats.cancelled += superseded;
+      pthread_mutex_unlock(&ctx->lock);
+      free(key);
+      return result->status;
+    }
+
+    entry->key = key;
+    key = NULL;
+    entry->generation = generation;
+    entry->refs = 1;
+    pthread_cond_init(&entry->finished, NULL);
+    entry->next = ctx->inflight;
+    ctx->inflight = entry;
+
+    // Debounce: give a quickly following keystroke the chance to supersede this request for free
+    if(ctx->settings.debounce_ms > 0) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += ctx->settings.debounce_ms / 1000;
+      deadline.tv_nsec += (long)(ctx->settings.debounce_ms % 1000) * 1000000L;
+
+      if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+
+      while(!entry->cancelled && pthread_cond_timedwait(&ctx->changed, &ctx->lock, &deadline) != ETIMEDOUT) {
+      }
+    }
+
+    int cancelled = entry->cancelled;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(cancelled) {
+      result->status = CC_STATUS_CANCELLED;
+    }
+
+    else {
+      complete_request(ctx, request, entry, result);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    // Publish the result and unlink the entry, so new requests start a fresh run
+    entry->status = result->status;
+    entry->text = result->text ? strdup(result->text) : NULL;
+
+    if(result->text && !entry->text) {
+      entry->status = CC_STATUS_OUT_OF_MEMORY;
+    }
+
+    entry->done = 1;
+    pthread_cond_broadcast(&entry->finished);
+
+    for(CCInflight **link = &ctx->inflight; *link; link = &(*link)->next) {
+      if(*link == entry) {
+        *link = entry->next;
+        break;
+      }
+    }
+  }
+
+  ctx->stats.cancelled += result->status == CC_STATUS_CANCELLED;
+
+  if(--entry->refs == 0) {
+    pthread_cond_destroy(&entry->finished);
+    free(entry->key);
+    free(entry->buffer);
+    free(entry->text);
+    free(entry);
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+  free(key);
+  return result->status;
+}
+
+// Function to copy the counters of a context
+void cc_context_stats(cc_context *ctx, cc_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+
+  if(ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  // Background children belong to the process, preemptions to every process of the user
+  CCBackgroundRegistry *registry = background_lock();
+  stats->background_jobs = (unsigned long)background_jobs.count;
+  stats->preemptions = registry->preemptions;
+  stats->preempted_ms = registry->preempted_ms;
+
+  if(registry->stopped) {
+    stats->preempted_ms += (unsigned long)elapsed_ms(&registry->stopped_at);
+  }
+
+  background_unlock();
+}
+
+// Function to release the text of a result filled by cc_complete
+void cc_result_free(cc_result *result) {
+  if(result) {
+    free(result->text);
+    result->text = NULL;
+  }
+}
+
+/*
+  Function Description:
+    Completes several positions of one file, as tools asking for the signatures at every call site
+    of a file do. clang completes one position per parse; a position asked more than once is parsed
+    once and its answer copied to the others. Calls of the same function name are not grouped:
+    a.size( and b.size(, or two overloads, need their own parse to get their own signature.
+
+  Parameters:
+    - ctx (cc_context *): Context to use; may be shared between threads.
+    - filename (const char *): File to complete in.
+    - unsaved (const char *): File holding the editor's text of filename, NULL when filename is current.
+    - positions (cc_batch_position *): line and column (1-based) of each position; each result receives
+      its status and completion text, release them with cc_batch_free.
+    - count (int): Number of positions.
+
+  Return Value:
+    - cc_status: CC_STATUS_OK once every position has its result, CC_STATUS_CANCELLED when a newer
+      request for the file superseded the batch, else why no position was run.
+
+  Detailed Steps:
+    1. Run cc_complete at the first position without a result and copy its result to the other
+       positions with the same line and column.
+    2. Count the batch, its positions and the parses saved in the context statistics.
+
+  Maintenance Notes:
+    - The parses run through cc_complete one after the other: they coalesce with the requests of
+      other clients, and a newer request for the same buffer cancels the rest of the batch.
+*/
+cc_status cc_complete_batch(cc_context *ctx, const char *filename, const char *unsaved, cc_batch_position *positions,
+                            int count) {
+  if(!positions || count < 0) {
+    return CC_STATUS_INVALID_ARGUMENT;
+  }
+
+  for(int i = 0; i < count; i++) {
+    positions[i].result.status = CC_STATUS_INVALID_ARGUMENT;
+    positions[i].result.text = NULL;
+  }
+
+  if(!ctx || !filename || access(unsaved ? unsaved : filename, R_OK) != 0) {
+    return CC_STATUS_INVALID_ARGUMENT;
+  }
+
+  int *answered = (int *)calloc(count > 0 ? (size_t)count : 1, sizeof(int));
+
+  if(!answered) {
+    log_message("fn cc_complete_batch: Failed to allocate the positions\n");
+    return CC_STATUS_OUT_OF_MEMORY;
+  }
+
+  // Step 1: one parse per distinct position
+  cc_status status = CC_STATUS_OK;
+  int parses = 0;
+
+  for(int leader = 0; leader < count; leader++) {
+    if(answered[leader]) {
+      continue;
+    }
+
+    cc_request request = {.filename = filename, .line = positions[leader].line, .column = positions[leader].column,
+                          .unsaved = unsaved};
+    cc_result *result = &positions[leader].result;
+    cc_complete(ctx, &request, result);
+    answered[leader] = 1;
+    parses++;
+
+    for(int i = leader + 1; i < count; i++) {
+      int same_position = positions[i].line == positions[leader].line && positions[i].column == positions[leader].column;
+
+      if(answered[i] || (!same_position && result->status != CC_STATUS_CANCELLED)) {
+        continue;
+      }
+
+      cc_result *copy = &positions[i].result;
+      answered[i] = 1;
+
+      // A cancelled parse ends the batch: the buffer has a newer request
+      if(!same_position) {
+        copy->status = CC_STATUS_CANCELLED;
+        continue;
+      }
+
+      copy->text = result->text ? strdup(result->text) : NULL;
+      copy->status = result->text && !copy->text ? CC_STATUS_OUT_OF_MEMORY : result->status;
+    }
+
+    if(result->status == CC_STATUS_CANCELLED) {
+      status = CC_STATUS_CANCELLED;
+    }
+  }
+
+  free(answered);
+  // Step 2: the parses the repeated positions saved
+  pthread_mutex_lock(&ctx->lock);
+  ctx->stats.batches++;
+  ctx->stats.batch_positions += (unsigned long)count;
+  ctx->stats.batch_parses_saved += (unsigned long)(count - parses);
+  pthread_mutex_unlock(&ctx->lock);
+  return status;
+}
+
+// Function to release the results filled by cc_complete_batch
+void cc_batch_free(cc_batch_position *positions, int count) {
+  for(int i = 0; positions && i < count; i++) {
+    cc_result_free(&positions[i].result);
+  }
+}
+
+// Function to get the protocol name of a status, e.g. "NO_PROJECT"
+const char *cc_status_name(cc_status status) {
+  switch(status) {
+    case CC_STATUS_OK:
+      return "OK";
+
+    case CC_STATUS_INVALID_ARGUMENT:
+      return "INVALID_ARGUMENT";
+
+    case CC_STATUS_NO_PROJECT:
+      return "NO_PROJECT";
+
+    case CC_STATUS_CLANG_FAILED:
+      return "CLANG_FAILED";
+
+    case CC_STATUS_NO_COMPLETION:
+      return "NO_COMPLETION";
+
+    case CC_STATUS_OUT_OF_MEMORY:
+      return "OUT_OF_MEMORY";
+
+    case CC_STATUS_CANCELLED:
+      return "CANCELLED";
+
+    case CC_STATUS_TIMEOUT:
+      return "TIMEOUT";
+
+    case CC_STATUS_CRASHED:
+      return "CRASHED";
+
+    case CC_STATUS_COUNT:
+      break;
+  }
+
+  return "UNKNOWN";
+}
+
+/*
+  Function Description:
+    Completion daemon. `code_connector_executable --daemon` runs cc_daemon_run, which serves
+    completion requests from any number of editors over a per-user Unix socket. Connections are
+    queued to a fixed pool of worker threads (one per online core by default). The threads hand
+    completion and index work to crash-isolated worker processes, each owning a cc_context, picked
+    by project so every client profits from the flag caches, compile_commands.json indexes and
+    clang target the others already paid for (see worker_pool_complete below).
+
+    Protocol (one request per connection, one text line each way, the daemon closes afterwards):
+      COMPLETE <line> <column> <changedtick> <path>  ->  OK <completion>  |  ERROR <status name>
+      PING                                           ->  PONG
+      INDEX <directory>                              ->  OK  (ccls --index runs in the background)
+      STATS                                          ->  key=value lines
+      SHUTDOWN                                       ->  BYE
+
+  Maintenance Notes:
+    - The socket lives in $XDG_RUNTIME_DIR/code_connector (or /tmp/code_connector-<uid>), a 0700
+      directory checked to belong to the user, so no other account can reach the daemon.
+    - The socket name carries CC_DAEMON_PROTOCOL and the identity of the library file (see
+      cc_daemon_socket_path), so a client of a rebuilt or upgraded plugin never reaches a daemon
+      running the old code: it starts its own daemon, and the old one exits once idle. Bump
+      CC_DAEMON_PROTOCOL whenever the request grammar changes.
+    - A flock on <socket>.lock next to the socket makes sure only one daemon serves a socket; a
+      stale socket file left by a crash is replaced.
+    - Clients are given CC_DAEMON_IO_TIMEOUT seconds to send their request line, so a stuck client
+      cannot pin a worker.
+    - INDEX runs on its own detached thread, not on a worker. Its ccls is a background child, so it
+      is stopped whenever a completion runs clang; the daemon does not exit idle while it runs.
+*/
+
+#define CC_DAEMON_QUEUE_SIZE 64   // Accepted connections waiting for a worker
+#define CC_DAEMON_MAX_WORKERS 64
+#define CC_DAEMON_IO_TIMEOUT 5    // Seconds a client has to send its request line
+#define CC_DAEMON_REQUEST_MAX (PATH_MAX + 64)
+#define CC_DAEMON_IDLE_TIMEOUT 600  // Seconds without requests before the daemon exits (CODE_CONNECTOR_DAEMON_IDLE)
+#define CC_DAEMON_REPLY_TIMEOUT 30  // Seconds a client waits for the daemon before completing in-process
+#define CC_DAEMON_PROTOCOL 2        // 2: COMPLETE carries <changedtick>
+
+// State shared by the acceptor and the workers of a running daemon
+typedef struct {
+  cc_context *ctx;            // Completes in-process when there are no worker processes
+  struct CCWorkerPool *pool;  // Crash-isolated worker processes, NULL when disabled
+  pthread_mutex_t lock;       // Guards the queue and the counters
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  int queue[CC_DAEMON_QUEUE_SIZE];
+  int queue_head;
+  int queue_count;
+  int stopping;
+  int worker_count;
+  int busy;                   // Workers currently serving a connection
+  time_t last_activity;       // Last accepted connection, for the idle exit
+  unsigned long requests;     // Requests answered
+  unsigned long completions;  // COMPLETE requests answered with OK
+  time_t started;
+} CCDaemon;
+
+static volatile sig_atomic_t daemon_stop_signal = 0;
+
+// Function to record SIGTERM/SIGINT; the acceptor notices it within one poll interval
+static void daemon_on_signal(int signo) {
+  (void)signo;
+  daemon_stop_signal = 1;
+}
+
+// Function to create (if needed) and validate the private directory holding the daemon socket
+// Returns 0 when dir exists, is a directory owned by the user and is not accessible to others
+static int daemon_prepare_dir(const char *dir) {
+  struct stat st;
+
+  if(mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    perror("mkdir");
+    return 1;
+  }
+
+  if(lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0077) != 0) {
+    fprintf(stderr, "fn daemon_prepare_dir: %s is not a private directory of this user\n", dir);
+    log_message("fn daemon_prepare_dir: Socket directory is not private\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// Function to build the path of a file in the private per-user runtime directory
+// ($XDG_RUNTIME_DIR/code_connector or /tmp/code_connector-<uid>), creating the directory if needed
+// Returns 0 on success, 1 when the directory is unusable or the path does not fit
+static int runtime_file_path(const char *name, char *path, size_t size) {
+  char dir[PATH_MAX];
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+  if(runtime_dir && runtime_dir[0] == '/') {
+    snprintf(dir, sizeof(dir), "%s/code_connector", runtime_dir);
+  }
+
+  else {
+    snprintf(dir, sizeof(dir), "/tmp/code_connector-%lu", (unsigned long)getuid());
+  }
+
+  if(daemon_prepare_dir(dir) != 0) {
+    return 1;
+  }
+
+  int written = snprintf(path, size, "%s/%s", dir, name);
+  return written < 0 || (size_t)written >= size;
+}
+
+static const char daemon_socket_prefix[] = "daemon";
+
+// Function to identify the build of the code serving the daemon protocol: path, size and mtime of the
+// library (or executable) holding this function, so a rebuilt plugin never talks to an old daemon
+static unsigned long daemon_build_identity(void) {
+  static unsigned long identity = 0;
+  Dl_info library;
+  struct stat st;
+  char text[96];
+
+  if(identity != 0) {
+    return identity;
+  }
+
+  // dli_fname of the main program may be relative, and the daemon runs in "/"
+  const char *path = dladdr((const void *)daemon_socket_prefix, &library) != 0 && library.dli_fname &&
+                     library.dli_fname[0] == '/' ? library.dli_fname : "/proc/self/exe";
+
+  if(stat(path, &st) == 0) {
+    snprintf(text, sizeof(text), "%lld %lld %ld", (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    identity = hash_string(hash_string(CC_HASH_SEED, path), text);
+  }
+
+  return identity;
+}
+
+/*
+  Function Description:
+    Computes the per-user daemon socket path, $XDG_RUNTIME_DIR/code_connector/daemon.<protocol>.<build>.sock,
+    or /tmp/code_connector-<uid>/daemon.<protocol>.<build>.sock when XDG_RUNTIME_DIR is not set, where
+    <protocol> is CC_DAEMON_PROTOCOL and <build> identifies the file of this code. The directory is
+    created with mode 0700 and rejected when it belongs to someone else.
+
+  Parameters:
+    - path (char *): Receives the socket path.
+    - size (size_t): Size of path; sun_path limits usable paths to about 100 bytes.
+
+  Return Value:
+    - int: 0 on success, 1 on failure.
+*/
+int cc_daemon_socket_path(char *path, size_t size) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s.%d.%08lx.sock", daemon_socket_prefix, CC_DAEMON_PROTOCOL,
+           daemon_build_identity() & 0xffffffffUL);
+
+  if(runtime_file_path(name, path, size) != 0) {
+    return 1;
+  }
+
+  size_t written = strlen(path);
+
+  if(written + 1 >= size || written >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+    log_message("fn cc_daemon_socket_path: Socket path too long\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// Function to read one '\n'-terminated line from a socket into line (without the newline)
+// Returns 0 on success, 1 on EOF, timeout, error or a line longer than size - 1
+static int read_line(int fd, char *line, size_t size) {
+  size_t length = 0;
+
+  while(length < size - 1) {
+    ssize_t got = recv(fd, line + length, 1, 0);
+
+    if(got < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(got <= 0) {
+      return 1;
+    }
+
+    if(line[length] == '\n') {
+      line[length] = '\0';
+      return 0;
+    }
+
+    length++;
+  }
+
+  return 1;
+}
+
+// Function run by the detached thread of an INDEX request; arg is the malloc'ed directory
+static void *daemon_index(void *arg) {
+  char *directory = (char *)arg;
+
+  if(cc_index_run(directory, 0, NULL, NULL) != 0) {
+    log_message("fn daemon_index: ccls --index failed\n");
+  }
+
+  free(directory);
+  return NULL;
+}
+
+/*
+  Function Description:
+    Crash-isolated completion processes. With worker processes enabled, the daemon does not run
+    cc_complete itself: each COMPLETE (and INDEX) request is forwarded to one of a fixed number of
+    worker processes, each owning its own cc_context, chosen by project affinity (hash of the
+    project root), so a project's requests keep landing on the process that already holds its
+    flag caches, and same-buffer coalescing and cancellation keep working inside that process.
+
+    Workers are forked by a zygote: a single-threaded child forked before the daemon starts any
+    thread, which forks a fresh worker on request and hands back its pid and a socket through
+    SCM_RIGHTS. Forking from a multi-threaded daemon would copy locks held by other threads.
+
+    A worker that dies (EOF on its socket) fails every request it was serving; each of those is
+    retried once on a freshly forked worker. A worker reporting CC_STATUS_OUT_OF_MEMORY, or whose
+    resident set exceeds the memory cap after a reply, is retired: it gets no new requests, finishes
+    the ones it has and exits, and the request that hit OUT_OF_MEMORY is retried. A second failure
+    is returned as CC_STATUS_CRASHED.
+
+  Maintenance Notes:
+    - Frames are a CCWorkerFrame followed by `length` payload bytes: the path for 'C' and 'I', the
+      completion for replies to 'C', a cc_stats for replies to 'S'. 'I' gets no reply.
+    - Each connection has a reader thread (counted in pool->readers); a connection is freed by
+      whoever sees it dead with no pending request last.
+    - clang children of a crashed worker lose their deadline; they are in their own process group
+      and end with their input.
+    - CODE_CONNECTOR_WORKER_PROCESSES sets the number of workers (0 keeps completion in the daemon),
+      CODE_CONNECTOR_WORKER_MEMORY_MB the resident-set cap.
+*/
+
+#define CC_WORKER_MAX_PROCESSES 16
+#define CC_WORKER_DEFAULT_PROCESSES 4   // At most, fewer on machines with fewer cores
+#define CC_WORKER_MEMORY_MB 512         // Resident set above which a worker is retired
+
+// Header of every message between the daemon and a worker
+typedef struct {
+  char kind;                 // Requests: 'C' complete, 'I' index, 'S' stats. Replies: 'R'
+  int status;                // Replies: cc_status of the request
+  unsigned long long id;     // Matches a reply to its request
+  int line;
+  int column;
+  long changedtick;
+  unsigned int length;       // Payload bytes following the header
+} CCWorkerFrame;
+
+// A request waiting for its reply
+typedef struct CCWorkerCall {
+  unsigned long long id;
+  int done;
+  int status;                // cc_status, CC_STATUS_CRASHED when the worker died
+  char *payload;
+  unsigned int length;
+  struct CCWorkerCall *next;
+} CCWorkerCall;
+
+// Connection to one worker process
+typedef struct CCWorkerConn {
+  pid_t pid;
+  int fd;
+  int pending;               // Requests sent and not yet collected by their caller
+  int retiring;              // Gets no new requests; its socket is shut down once idle
+  int dead;                  // EOF seen, every call failed
+  CCWorkerCall *calls;
+  struct CCWorkerConn *next; // Every live connection of the pool
+} CCWorkerConn;
+
+typedef struct CCWorkerPool {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;    // A reply arrived, a worker died or a reader exited
+  int zygote_fd;
+  pid_t zygote_pid;
+  int count;
+  CCWorkerConn *slots[CC_WORKER_MAX_PROCESSES];  // Current worker of each affinity slot
+  CCWorkerConn *conns;
+  int readers;
+  unsigned long long next_id;
+  long memory_cap_kb;
+  unsigned long crashes;     // Workers that died while serving
+  unsigned long retries;     // Requests run a second time on a fresh worker
+  unsigned long recycled;    // Workers retired for memory
+} CCWorkerPool;
+
+// Function to read exactly length bytes from a socket. Returns 0 on success, 1 on EOF or error
+static int read_all(int fd, void *data, size_t length) {
+  char *cursor = (char *)data;
+
+  while(length > 0) {
+    ssize_t got = recv(fd, cursor, length, 0);
+
+    if(got < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(got <= 0) {
+      return 1;
+    }
+
+    cursor += got;
+    length -= (size_t)got;
+  }
+
+  return 0;
+}
+
+// Function to read a frame and its payload (malloc'ed, NUL-terminated). Returns 0 on success
+static int read_frame(int fd, CCWorkerFrame *frame, char **payload) {
+  *payload = NULL;
+
+  if(read_all(fd, frame, sizeof(*frame)) != 0 || (*payload = (char *)malloc((size_t)frame->length + 1)) == NULL) {
+    return 1;
+  }
+
+  if(read_all(fd, *payload, frame->length) != 0) {
+    free(*payload);
+    *payload = NULL;
+    return 1;
+  }
+
+  (*payload)[frame->length] = '\0';
+  return 0;
+}
+
+// Function to write a frame and its payload. Returns 0 on success
+static int write_frame(int fd, CCWorkerFrame *frame, const void *payload, unsigned int length) {
+  frame->length = length;
+  return write_all(fd, (const char *)frame, sizeof(*frame)) != 0 || (length > 0 && write_all(fd, (const char *)payload, length) != 0);
+}
+
+// State of a worker process
+typedef struct {
+  int fd;
+  cc_context *ctx;
+  pthread_mutex_t lock;      // Serializes replies and guards active
+  pthread_cond_t idle;
+  int active;
+} CCWorkerProcess;
+
+// One request being served inside a worker process
+typedef struct {
+  CCWorkerProcess *worker;
+  CCWorkerFrame frame;
+  char *payload;
+} CCWorkerTask;
+
+// Function run on its own thread inside a worker for every request
+static void *worker_process_task(void *arg) {
+  CCWorkerTask *task = (CCWorkerTask *)arg;
+  CCWorkerProcess *worker = task->worker;
+  CCWorkerFrame reply = {.kind = 'R', .id = task->frame.id};
+
+  if(task->frame.kind == 'C') {
+    cc_request request = {.filename = task->payload, .line = task->frame.line, .column = task->frame.column,
+                          .changedtick = task->frame.changedtick};
+    cc_result result;
+    reply.status = (int)cc_complete(worker->ctx, &request, &result);
+    pthread_mutex_lock(&worker->lock);
+    write_frame(worker->fd, &reply, result.text, result.text ? (unsigned int)strlen(result.text) : 0);
+    pthread_mutex_unlock(&worker->lock);
+    cc_result_free(&result);
+  }
+
+  else if(task->frame.kind == 'S') {
+    cc_stats stats;
+    cc_context_stats(worker->ctx, &stats);
+    pthread_mutex_lock(&worker->lock);
+    write_frame(worker->fd, &reply, &stats, (unsigned int)sizeof(stats));
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  else if(task->frame.kind == 'I' && cc_index_run(task->payload, 0, NULL, NULL) != 0) {
+    log_message("fn worker_process_task: ccls --index failed\n");
+  }
+
+  free(task->payload);
+  free(task);
+  pthread_mutex_lock(&worker->lock);
+  worker->active--;
+  pthread_cond_broadcast(&worker->idle);
+  pthread_mutex_unlock(&worker->lock);
+  return NULL;
+}
+
+// Function run by a freshly forked worker: serves frames from the daemon until its socket closes
+static void worker_process_main(int fd) {
+  CCWorkerProcess worker;
+  cc_settings settings;
+  signal(SIGCHLD, SIG_DFL);  // The zygote ignores it; clang children must be waitable
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_IGN);   // Ctrl-C on a foreground daemon is handled by the daemon
+  cc_settings_from_environment(&settings);
+  settings.ccls_sessions = getenv("CODE_CONNECTOR_CCLS_SESSIONS") ? settings.ccls_sessions : CC_CCLS_DEFAULT_SESSIONS;
+  memset(&worker, 0, sizeof(worker));
+  worker.fd = fd;
+  worker.ctx = cc_context_create(&settings);
+  pthread_mutex_init(&worker.lock, NULL);
+  pthread_cond_init(&worker.idle, NULL);
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+  while(worker.ctx) {
+    CCWorkerTask *task = (CCWorkerTask *)malloc(sizeof(CCWorkerTask));
+    pthread_t thread;
+
+    if(!task || read_frame(fd, &task->frame, &task->payload) != 0) {
+      free(task);
+      break;
+    }
+
+    task->worker = &worker;
+    pthread_mutex_lock(&worker.lock);
+    worker.active++;
+    pthread_mutex_unlock(&worker.lock);
+
+    if(pthread_create(&thread, &attributes, worker_process_task, task) != 0) {
+      worker_process_task(task);
+    }
+  }
+
+  // The daemon closed the connection: finish what is running, then leave
+  pthread_mutex_lock(&worker.lock);
+
+  while(worker.active > 0) {
+    pthread_cond_wait(&worker.idle, &worker.lock);
+  }
+
+  pthread_mutex_unlock(&worker.lock);
+  pthread_attr_destroy(&attributes);
+  _exit(0);
+}
+
+// Function run by the zygote: forks one worker per byte received, replying with its pid and socket
+static void worker_zygote(int control_fd) {
+  char command;
+  signal(SIGCHLD, SIG_IGN);  // Workers are reaped automatically
+  signal(SIGINT, SIG_IGN);   // Ctrl-C on a foreground daemon is handled by the daemon
+
+  while(recv(control_fd, &command, 1, 0) == 1) {
+    int pair[2];
+    pid_t pid = -1;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec data = {&pid, sizeof(pid)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0) {
+      pid = fork();
+
+      if(pid == 0) {
+        close(control_fd);
+        close(pair[0]);
+        worker_process_main(pair[1]);
+      }
+
+      close(pair[1]);
+    }
+
+    if(pid > 0) {
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(header), &pair[0], sizeof(int));
+    }
+
+    sendmsg(control_fd, &message, MSG_NOSIGNAL);
+
+    if(pid > 0) {
+      close(pair[0]);
+    }
+  }
+
+  _exit(0);
+}
+
+// Function to read the resident set of a process in KiB, or -1 when unknown
+static long process_rss_kb(pid_t pid) {
+  char path[64];
+  long pages = -1;
+  snprintf(path, sizeof(path), "/proc/%ld/statm", (long)pid);
+  FILE *file = fopen(path, "r");
+
+  if(file) {
+    if(fscanf(file, "%*s %ld", &pages) != 1) {
+      pages = -1;
+    }
+
+    fclose(file);
+  }
+
+  return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Function to unlink and free a connection; the caller holds pool->lock and the connection is dead and idle
+static void worker_conn_free_locked(CCWorkerPool *pool, CCWorkerConn *conn) {
+  for(CCWorkerConn **link = &pool->conns; *link; link = &(*link)->next) {
+    if(*link == conn) {
+      *link = conn->next;
+      break;
+    }
+  }
+
+  close(conn->fd);
+  free(conn);
+}
+
+// Function to retire a connection: no new requests, its socket is shut down once it is idle
+static void worker_conn_retire_locked(CCWorkerPool *pool, CCWorkerConn *conn) {
+  for(int i = 0; i < pool->count; i++) {
+    if(pool->slots[i] == conn) {
+      pool->slots[i] = NULL;
+    }
+  }
+
+  if(!conn->retiring && !conn->dead) {
+    conn->retiring = 1;
+    pool->recycled++;
+  }
+
+  if(conn->pending == 0 && !conn->dead) {
+    shutdown(conn->fd, SHUT_WR);  // The worker finishes and exits, the reader then sees EOF
+  }
+}
+
+// Function run by the reader thread of a connection: hands replies to their callers until EOF
+static void *worker_conn_reader(void *arg) {
+  void **args = (void **)arg;
+  CCWorkerPool *pool = (CCWorkerPool *)args[0];
+  CCWorkerConn *conn = (CCWorkerConn *)args[1];
+  CCWorkerFrame frame;
+  char *payload;
+  free(args);
+
+  while(read_frame(conn->fd, &frame, &payload) == 0) {
+    pthread_mutex_lock(&pool->lock);
+
+    for(CCWorkerCall *call = conn->calls; call; call = call->next) {
+      if(call->id == frame.id && !call->done) {
+        call->done = 1;
+        call->status = frame.status;
+        call->payload = payload;
+        call->length = frame.length;
+        payload = NULL;
+        break;
+      }
+    }
+
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    free(payload);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  conn->dead = 1;
+
+  for(int i = 0; i < pool->count; i++) {
+    if(pool->slots[i] == conn) {
+      pool->slots[i] = NULL;
+    }
+  }
+
+  for(CCWorkerCall *call = conn->calls; call; call = call->next) {
+    if(!call->done) {
+      call->done = 1;
+      call->status = CC_STATUS_CRASHED;
+    }
+  }
+
+  pool->crashes += conn->pending > 0 && !conn->retiring;
+
+  if(conn->pending == 0) {
+    worker_conn_free_locked(pool, conn);
+  }
+
+  pool->readers--;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Function to fork a worker through the zygote and install it in a slot. Returns 0 on success
+static int worker_pool_spawn_locked(CCWorkerPool *pool, int slot) {
+  pid_t pid = -1;
+  int fd = -1;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec data = {&pid, sizeof(pid)};
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  if(send(pool->zygote_fd, "s", 1, MSG_NOSIGNAL) != 1 || recvmsg(pool->zygote_fd, &message, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(pid) ||
+     pid <= 0) {
+    log_message("fn worker_pool_spawn_locked: The zygote could not fork a worker\n");
+    return 1;
+  }
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+  if(header && header->cmsg_type == SCM_RIGHTS) {
+    memcpy(&fd, CMSG_DATA(header), sizeof(int));
+  }
+
+  CCWorkerConn *conn = fd >= 0 ? (CCWorkerConn *)calloc(1, sizeof(CCWorkerConn)) : NULL;
+  void **args = conn ? (void **)malloc(2 * sizeof(void *)) : NULL;
+  pthread_t thread;
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+  if(args) {
+    conn->pid = pid;
+    conn->fd = fd;
+    args[0] = pool;
+    args[1] = conn;
+  }
+
+  if(!args || pthread_create(&thread, &attributes, worker_conn_reader, args) != 0) {
+    pthread_attr_destroy(&attributes);
+    free(args);
+    free(conn);
+
+    if(fd >= 0) {
+      close(fd);  // The worker sees EOF and exits
+    }
+
+    return 1;
+  }
+
+  pthread_attr_destroy(&attributes);
+  conn->next = pool->conns;
+  pool->conns = conn;
+  pool->readers++;
+  pool->slots[slot] = conn;
+  return 0;
+}
+
+// Function to pick the affinity slot of a file or directory: its project root, else its directory
+static int worker_pool_slot(const CCWorkerPool *pool, const char *path, int is_directory) {
+  char resolved[CC_DAEMON_REQUEST_MAX];  // realpath needs PATH_MAX, an unresolved request path may be longer
+  char root[PATH_MAX];
+
+  if(!realpath(path, resolved) && (size_t)snprintf(resolved, sizeof(resolved), "%s", path) >= sizeof(resolved)) {
+    resolved[0] = '\0';  // Every overlong path goes to the same slot
+  }
+
+  const char *directory = is_directory ? resolved : dirname(resolved);
+  const char *key = findFiles(directory, root) == 0 ? root : directory;
+  return (int)(hash_string(CC_HASH_SEED, key) % (unsigned long)pool->count);
+}
+
+/*
+  Function Description:
+    Sends one request to the worker of a slot (forking one when the slot is empty and spawn is set)
+    and waits for its reply.
+
+  Parameters:
+    - pool (CCWorkerPool *): The daemon's pool; its lock must NOT be held.
+    - slot (int): Affinity slot.
+    - frame (CCWorkerFrame *): Request header; id is assigned here.
+    - payload (const char *): Request payload (may be empty).
+    - spawn (int): Fork a worker for an empty slot; 0 to fail instead.
+    - call (CCWorkerCall *): Receives status and reply payload (free call->payload).
+    - pid (pid_t *): Receives the worker's pid.
+
+  Return Value:
+    - int: 0 when call holds a reply (or CC_STATUS_CRASHED), 1 when the slot has no worker and none
+      could be (or was to be) started.
+*/
+static int worker_pool_call(CCWorkerPool *pool, int slot, CCWorkerFrame *frame, const char *payload, int spawn,
+                            CCWorkerCall *call, pid_t *pid) {
+  pthread_mutex_lock(&pool->lock);
+
+  if(!pool->slots[slot] && (!spawn || worker_pool_spawn_locked(pool, slot) != 0)) {
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+  }
+
+  CCWorkerConn *conn = pool->slots[slot];
+  memset(call, 0, sizeof(*call));
+  call->id = frame->id = ++pool->next_id;
+  call->next = conn->calls;
+  conn->calls = call;
+  conn->pending++;
+  *pid = conn->pid;
+
+  if(write_frame(conn->fd, frame, payload, (unsigned int)strlen(payload)) != 0) {
+    shutdown(conn->fd, SHUT_RDWR);  // Treated like a crash: the reader fails the calls
+  }
+
+  while(!call->done) {
+    pthread_cond_wait(&pool->changed, &pool->lock);
+  }
+
+  for(CCWorkerCall **link = &conn->calls; *link; link = &(*link)->next) {
+    if(*link == call) {
+      *link = call->next;
+      break;
+    }
+  }
+
+  conn->pending--;
+
+  if(conn->dead && conn->pending == 0) {
+    worker_conn_free_locked(pool, conn);
+  }
+
+  else if(conn->retiring && conn->pending == 0) {
+    shutdown(conn->fd, SHUT_WR);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+/*
+  Function Description:
+    Completes a request on the worker process of its project, retrying once on a fresh worker when
+    the first one crashed or ran out of memory.
+
+  Return Value:
+    - cc_status: As cc_complete; CC_STATUS_CRASHED when both attempts failed that way, and
+      CC_STATUS_COUNT when no worker could be started (the caller then completes in-process).
+*/
+static cc_status worker_pool_complete(CCWorkerPool *pool, const cc_request *request, cc_result *result) {
+  int slot = worker_pool_slot(pool, request->filename, 0);
+  result->status = CC_STATUS_COUNT;
+  result->text = NULL;
+
+  for(int attempt = 0; attempt < 2; attempt++) {
+    CCWorkerFrame frame = {.kind = 'C', .line = request->line, .column = request->column,
+                           .changedtick = request->changedtick};
+    CCWorkerCall call;
+    pid_t pid;
+
+    if(worker_pool_call(pool, slot, &frame, request->filename, 1, &call, &pid) != 0) {
+      return CC_STATUS_COUNT;
+    }
+
+    result->status = (cc_status)call.status;
+    free(result->text);
+    result->text = call.status == CC_STATUS_OK ? call.payload : NULL;
+
+    if(call.status != CC_STATUS_OK) {
+      free(call.payload);
+    }
+
+    long rss_kb = process_rss_kb(pid);
+    pthread_mutex_lock(&pool->lock);
+
+    // Out of memory, or over the cap: this worker takes no more requests
+    for(CCWorkerConn *conn = pool->conns; conn; conn = conn->next) {
+      if(conn->pid == pid && (call.status == CC_STATUS_OUT_OF_MEMORY || (pool->memory_cap_kb > 0 && rss_kb > pool->memory_cap_kb))) {
+        worker_conn_retire_locked(pool, conn);
+      }
+    }
+
+    int retry = attempt == 0 && (call.status == CC_STATUS_CRASHED || call.status == CC_STATUS_OUT_OF_MEMORY);
+    pool->retries += retry;
+    pthread_mutex_unlock(&pool->lock);
+
+    if(!retry) {
+      break;
+    }
+  }
+
+  return result->status;
+}
+
+// Function to start an index job on the worker of a directory's project; the job reports nothing back
+// Its ccls children are paused by completions of every worker through the per-user background registry
+static int worker_pool_index(CCWorkerPool *pool, const char *directory) {
+  int slot = worker_pool_slot(pool, directory, 1);
+  CCWorkerFrame frame = {.kind = 'I'};
+  int failed = 0;
+  pthread_mutex_lock(&pool->lock);
+
+  if(!pool->slots[slot] && worker_pool_spawn_locked(pool, slot) != 0) {
+    failed = 1;
+  }
+
+  else {
+    frame.id = ++pool->next_id;
+    failed = write_frame(pool->slots[slot]->fd, &frame, directory, (unsigned int)strlen(directory));
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return failed;
+}
+
+// Function to add the counters of every running worker to stats
+static void worker_pool_stats(CCWorkerPool *pool, cc_stats *stats) {
+  // Preemptions are counted in the per-user registry, every worker reports the same ones
+  unsigned long preemptions = stats->preemptions;
+  unsigned long preempted_ms = stats->preempted_ms;
+
+  // An empty slot is skipped under the pool lock: statistics never fork a worker
+  for(int slot = 0; slot < pool->count; slot++) {
+    CCWorkerFrame frame = {.kind = 'S'};
+    CCWorkerCall call;
+    pid_t pid;
+
+    if(worker_pool_call(pool, slot, &frame, "", 0, &call, &pid) == 0) {
+      if(call.status == CC_STATUS_OK && call.length == sizeof(cc_stats)) {
+        unsigned long *sum = (unsigned long *)stats;
+        const unsigned long *add = (const unsigned long *)call.payload;
+
+        // cc_stats is made of unsigned long counters only
+        for(size_t i = 0; i < sizeof(cc_stats) / sizeof(unsigned long); i++) {
+          sum[i] += add[i];
+        }
+      }
+
+      free(call.payload);
+    }
+  }
+
+  stats->preemptions = preemptions;
+  stats->preempted_ms = preempted_ms;
+}
+
+// Function to fork the zygote; must run before the daemon starts any thread. Returns 0 on success
+static int worker_pool_start(CCWorkerPool *pool, int count, const int *close_fds, int close_count) {
+  int pair[2];
+  const char *cap = getenv("CODE_CONNECTOR_WORKER_MEMORY_MB");
+  memset(pool, 0, sizeof(*pool));
+  pool->zygote_fd = -1;
+
+  if(count <= 0 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+    return 1;
+  }
+
+  pid_t pid = fork();
+
+  if(pid == 0) {
+    for(int i = 0; i < close_count; i++) {
+      close(close_fds[i]);  // Neither the daemon lock nor the listening socket may outlive the daemon
+    }
+
+    close(pair[0]);
+    worker_zygote(pair[1]);
+  }
+
+  close(pair[1]);
+
+  if(pid < 0) {
+    close(pair[0]);
+    return 1;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->changed, NULL);
+  pool->zygote_fd = pair[0];
+  pool->zygote_pid = pid;
+  pool->count = count > CC_WORKER_MAX_PROCESSES ? CC_WORKER_MAX_PROCESSES : count;
+  pool->memory_cap_kb = (cap ? atol(cap) : CC_WORKER_MEMORY_MB) * 1024;
+  return 0;
+}
+
+// Function to stop every worker and the zygote, waiting for the reader threads to finish
+static void worker_pool_stop(CCWorkerPool *pool) {
+  if(pool->zygote_fd < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+
+  for(CCWorkerConn *conn = pool->conns; conn; conn = conn->next) {
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+
+  while(pool->readers > 0) {
+    pthread_cond_wait(&pool->changed, &pool->lock);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  close(pool->zygote_fd);  // The zygote sees EOF and exits
+  waitpid(pool->zygote_pid, NULL, 0);
+  pthread_cond_destroy(&pool->changed);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+// Function to collect the counters of the daemon's own context and of its worker processes
+static void daemon_stats(CCDaemon *daemon, cc_stats *stats) {
+  cc_context_stats(daemon->ctx, stats);
+
+  if(daemon->pool) {
+    worker_pool_stats(daemon->pool, stats);
+  }
+}
+
+// Function to count the background jobs (INDEX) of the daemon and its worker processes, from the
+// per-user registry without asking the workers
+static int daemon_background_jobs(CCDaemon *daemon) {
+  pid_t owners[CC_WORKER_MAX_PROCESSES * 2 + 1];
+  int count = 0;
+  owners[count++] = getpid();
+
+  if(daemon->pool) {
+    pthread_mutex_lock(&daemon->pool->lock);
+
+    // Retiring workers are still in conns and may run a job
+    for(CCWorkerConn *conn = daemon->pool->conns; conn && count < (int)(sizeof(owners) / sizeof(owners[0]));
+        conn = conn->next) {
+      owners[count++] = conn->pid;
+    }
+
+    pthread_mutex_unlock(&daemon->pool->lock);
+  }
+
+  return background_count(owners, count);
+}
+
+// Function to answer one connection
+static void daemon_serve_client(CCDaemon *daemon, int fd) {
+  char request[CC_DAEMON_REQUEST_MAX];
+  struct timeval timeout = {CC_DAEMON_IO_TIMEOUT, 0};
+  int line = 0;
+  int column = 0;
+  long changedtick = 0;
+  int offset = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  if(read_line(fd, request, sizeof(request)) != 0) {
+    return;
+  }
+
+  if(strcmp(request, "PING") == 0) {
+    write_all(fd, "PONG\n", 5);
+  }
+
+  else if(strcmp(request, "STATS") == 0) {
+    char stats[2048];
+    cc_stats context_stats;
+    daemon_stats(daemon, &context_stats);
+    pthread_mutex_lock(&daemon->lock);
+    int length = snprintf(stats, sizeof(stats),
+                          "workers=%d\nrequests=%lu\ncompletions=%lu\nuptime=%ld\nclang_launches=%lu\ncoalesced=%lu\ncancelled=%lu\ntimeouts=%lu\n"
+                          "background_jobs=%lu\npreemptions=%lu\npreempted_ms=%lu\ndiscoveries=%lu\nshared_hits=%lu\nhedges=%lu\n"
+                          "hedge_wins=%lu\n",
+                          daemon->worker_count, daemon->requests, daemon->completions,
+                          (long)(time(NULL) - daemon->started), context_stats.clang_launches,
+                          context_stats.coalesced, context_stats.cancelled, context_stats.timeouts,
+                          context_stats.background_jobs, context_stats.preemptions, context_stats.preempted_ms,
+                          context_stats.discoveries, context_stats.shared_hits, context_stats.hedges, context_stats.hedge_wins);
+    pthread_mutex_unlock(&daemon->lock);
+
+    // Percentiles of the histograms summed over the worker processes
+    for(int backend = 0; cc_backend_name(backend); backend++) {
+      int p50 = cc_latency_percentile(context_stats.latency[backend], 50);
+
+      if(p50 >= 0) {
+        length += snprintf(stats + length, sizeof(stats) - (size_t)length, "latency_%s_p50_ms=%d\nlatency_%s_p90_ms=%d\n",
+                           cc_backend_name(backend), p50, cc_backend_name(backend),
+                           cc_latency_percentile(context_stats.latency[backend], 90));
+      }
+    }
+
+    if(context_stats.elisions > 0) {
+      length += snprintf(stats + length, sizeof(stats) - (size_t)length,
+                         "elisions=%lu\nelided_bytes=%lu\nelide_checks=%lu\nelide_mismatches=%lu\nelide_ms=%lu\nelide_full_ms=%lu\n",
+                         context_stats.elisions, context_stats.elided_bytes, context_stats.elide_checks,
+                         context_stats.elide_mismatches, context_stats.elide_ms, context_stats.elide_full_ms);
+    }
+
+    if(daemon->ctx->settings.modules > 0) {
+      length += snprintf(stats + length, sizeof(stats) - (size_t)length, "module_fallbacks=%lu\n",
+                         context_stats.module_fallbacks);
+    }
+
+    if(daemon->pool) {
+      pthread_mutex_lock(&daemon->pool->lock);
+      length += snprintf(stats + length, sizeof(stats) - (size_t)length,
+                         "processes=%d\nprocess_crashes=%lu\nprocess_retries=%lu\nprocess_recycled=%lu\n",
+                         daemon->pool->count, daemon->pool->crashes, daemon->pool->retries, daemon->pool->recycled);
+      pthread_mutex_unlock(&daemon->pool->lock);
+    }
+
+    write_all(fd, stats, (size_t)length);
+  }
+
+  else if(strcmp(request, "SHUTDOWN") == 0) {
+    write_all(fd, "BYE\n", 4);
+    daemon_stop_signal = 1;
+  }
+
+  else if(strncmp(request, "INDEX ", 6) == 0 && request[6] != '\0' && daemon->pool) {
+    int failed = worker_pool_index(daemon->pool, request + 6);
+    write_all(fd, failed ? "ERROR CLANG_FAILED\n" : "OK\n", failed ? 19 : 3);
+  }
+
+  else if(strncmp(request, "INDEX ", 6) == 0 && request[6] != '\0') {
+    char *directory = strdup(request + 6);
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    if(directory && pthread_create(&thread, &attributes, daemon_index, directory) == 0) {
+      write_all(fd, "OK\n", 3);
+    }
+
+    else {
+      free(directory);
+      write_all(fd, "ERROR OUT_OF_MEMORY\n", 20);
+    }
+
+    pthread_attr_destroy(&attributes);
+  }
+
+  else if(sscanf(request, "COMPLETE %d %d %ld %n", &line, &column, &changedtick, &offset) == 3 &&
+          request[offset] != '\0') {
+    cc_request completion = {.filename = request + offset, .line = line, .column = column, .changedtick = changedtick};
+    cc_result result = {CC_STATUS_COUNT, NULL};
+    cc_status status = daemon->pool ? worker_pool_complete(daemon->pool, &completion, &result) : CC_STATUS_COUNT;
+
+    // No worker process could be started: complete in the daemon itself
+    if(status == CC_STATUS_COUNT) {
+      cc_result_free(&result);
+      status = cc_complete(daemon->ctx, &completion, &result);
+    }
+
+    if(status == CC_STATUS_OK) {
+      write_all(fd, "OK ", 3);
+      write_all(fd, result.text, strlen(result.text));
+      write_all(fd, "\n", 1);
+    }
+
+    else {
+      char reply[64];
+      int length = snprintf(reply, sizeof(reply), "ERROR %s\n", cc_status_name(status));
+      write_all(fd, reply, (size_t)length);
+    }
+
+    cc_result_free(&result);
+    pthread_mutex_lock(&daemon->lock);
+    daemon->completions += status == CC_STATUS_OK;
+    pthread_mutex_unlock(&daemon->lock);
+  }
+
+  else {
+    write_all(fd, "ERROR BAD_REQUEST\n", 18);
+  }
+
+  pthread_mutex_lock(&daemon->lock);
+  daemon->requests++;
+  pthread_mutex_unlock(&daemon->lock);
+}
+
+// Function run by each worker thread: takes accepted connections off the queue until the daemon stops
+static void *daemon_worker(void *arg) {
+  CCDaemon *daemon = (CCDaemon *)arg;
+
+  for(;;) {
+    pthread_mutex_lock(&daemon->lock);
+
+    while(daemon->queue_count == 0 && !daemon->stopping) {
+      pthread_cond_wait(&daemon->not_empty, &daemon->lock);
+    }
+
+    if(daemon->queue_count == 0) {
+      pthread_mutex_unlock(&daemon->lock);
+      return NULL;
+    }
+
+    int fd = daemon->queue[daemon->queue_head];
+    daemon->queue_head = (daemon->queue_head + 1) % CC_DAEMON_QUEUE_SIZE;
+    daemon->queue_count--;
+    daemon->busy++;
+    pthread_cond_signal(&daemon->not_full);
+    pthread_mutex_unlock(&daemon->lock);
+    daemon_serve_client(daemon, fd);
+    close(fd);
+    pthread_mutex_lock(&daemon->lock);
+    daemon->busy--;
+    daemon->last_activity = time(NULL);
+    pthread_mutex_unlock(&daemon->lock);
+  }
+}
+
+// Function to bind and listen on the daemon socket, replacing a stale socket file
+// Returns the listening descriptor, or -1 on failure
+static int daemon_listen(const char *socket_path) {
+  struct sockaddr_un address;
+  size_t length = strlen(socket_path);
+
+  // A truncated path would bind a different socket than clients connect to
+  if(length >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    log_message("fn daemon_listen: Socket path too long\n");
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, socket_path, length + 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if(fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  unlink(socket_path);  // Safe: its lock is held, so any existing socket file is stale
+
+  if(bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    perror("bind/listen");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*
+  Function Description:
+    Runs the completion daemon in the foreground until SIGTERM, SIGINT, a SHUTDOWN request or
+    idle_timeout seconds without any request.
+
+  Parameters:
+    - options (const cc_daemon_options *): May be NULL; zeroed fields select the defaults
+      (cc_daemon_socket_path, one worker per online core, CODE_CONNECTOR_DAEMON_IDLE or
+      CC_DAEMON_IDLE_TIMEOUT seconds of idle time, where 0 or less in the variable means never).
+
+  Return Value:
+    - int: 0 after a clean shutdown, 1 when the daemon could not start (including when another
+      daemon already serves the socket).
+
+  Detailed Steps:
+    1. Resolve the socket path and take the exclusive flock on <socket>.lock beside it.
+    2. Bind the socket, start the worker threads and the shared cc_context.
+    3. Accept connections (poll with a one second tick to notice stop requests and the idle
+       timeout) and queue them.
+    4. On stop: wake and join the workers, remove the socket, release the context.
+*/
+int cc_daemon_run(const cc_daemon_options *options) {
+  char socket_path[PATH_MAX];
+  char lock_path[PATH_MAX + 16];
+  pthread_t workers[CC_DAEMON_MAX_WORKERS];
+  CCDaemon daemon;
+  int worker_count = options ? options->worker_count : 0;
+  int idle_timeout = options ? options->idle_timeout : 0;
+
+  if(idle_timeout == 0) {
+    const char *idle_env = getenv("CODE_CONNECTOR_DAEMON_IDLE");
+    idle_timeout = idle_env ? atoi(idle_env) : CC_DAEMON_IDLE_TIMEOUT;
+  }
+
+  if(options && options->socket_path[0] != '\0') {
+    snprintf(socket_path, sizeof(socket_path), "%s", options->socket_path);
+  }
+
+  else if(cc_daemon_socket_path(socket_path, sizeof(socket_path)) != 0) {
+    return 1;
+  }
+
+  if(worker_count <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cores > 0 ? (int)cores : 1;
+  }
+
+  if(worker_count > CC_DAEMON_MAX_WORKERS) {
+    worker_count = CC_DAEMON_MAX_WORKERS;
+  }
+
+  snprintf(lock_path, sizeof(lock_path), "%s.lock", socket_path);
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+  if(lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    fprintf(stderr, "fn cc_daemon_run: Another daemon is serving %s\n", socket_path);
+    log_message("fn cc_daemon_run: Another daemon is already running\n");
+
+    if(lock_fd >= 0) {
+      close(lock_fd);
+    }
+
+    return 1;
+  }
+
+  int listen_fd = daemon_listen(socket_path);
+
+  if(listen_fd < 0) {
+    close(lock_fd);
+    return 1;
+  }
+
+  // Worker processes are forked by the zygote, which must be forked before any thread exists
+  CCWorkerPool pool;
+  int process_count = options ? options->worker_processes : 0;
+  const char *processes_env = getenv("CODE_CONNECTOR_WORKER_PROCESSES");
+  int inherited[] = {lock_fd, listen_fd};
+
+  if(process_count == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    process_count = processes_env ? atoi(processes_env) :
+                    cores < 1 ? 1 : cores > CC_WORKER_DEFAULT_PROCESSES ? CC_WORKER_DEFAULT_PROCESSES : (int)cores;
+  }
+
+  int pool_started = worker_pool_start(&pool, process_count, inherited, 2) == 0;
+  memset(&daemon, 0, sizeof(daemon));
+  daemon.pool = pool_started ? &pool : NULL;
+  cc_settings settings;
+  cc_settings_from_environment(&settings);
+  settings.ccls_sessions = getenv("CODE_CONNECTOR_CCLS_SESSIONS") ? settings.ccls_sessions : CC_CCLS_DEFAULT_SESSIONS;
+  daemon.ctx = cc_context_create(&settings);
+  daemon.worker_count = worker_count;
+  daemon.started = time(NULL);
+  daemon.last_activity = daemon.started;
+  pthread_mutex_init(&daemon.lock, NULL);
+  pthread_cond_init(&daemon.not_empty, NULL);
+  pthread_cond_init(&daemon.not_full, NULL);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = daemon_on_signal;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  daemon_stop_signal = 0;
+  int started = 0;
+
+  while(daemon.ctx && started < worker_count &&
+        pthread_create(&workers[started], NULL, daemon_worker, &daemon) == 0) {
+    started++;
+  }
+
+  daemon.worker_count = started;
+
+  while(started > 0 && !daemon_stop_signal) {
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+
+    if(poll(&pfd, 1, 1000) <= 0) {
+      pthread_mutex_lock(&daemon.lock);
+      int idle = idle_timeout > 0 && daemon.queue_count == 0 && daemon.busy == 0 &&
+                 time(NULL) - daemon.last_activity >= idle_timeout;
+      pthread_mutex_unlock(&daemon.lock);
+      idle = idle && daemon_background_jobs(&daemon) == 0;
+
+      if(idle) {
+        log_message("fn cc_daemon_run: Idle timeout reached, exiting\n");
+        break;
+      }
+
+      continue;
+    }
+
+    int client = accept(listen_fd, NULL, NULL);
+
+    if(client < 0) {
+      continue;
+    }
+
+    fcntl(client, F_SETFD, FD_CLOEXEC);  // clang children must not inherit client sockets
+
+    pthread_mutex_lock(&daemon.lock);
+
+    while(daemon.queue_count == CC_DAEMON_QUEUE_SIZE) {
+      pthread_cond_wait(&daemon.not_full, &daemon.lock);
+    }
+
+    daemon.queue[(daemon.queue_head + daemon.queue_count) % CC_DAEMON_QUEUE_SIZE] = client;
+    daemon.queue_count++;
+    daemon.last_activity = time(NULL);
+    pthread_cond_signal(&daemon.not_empty);
+    pthread_mutex_unlock(&daemon.lock);
+  }
+
+  // Let the workers drain the queue, then stop them
+  pthread_mutex_lock(&daemon.lock);
+  daemon.stopping = 1;
+  pthread_cond_broadcast(&daemon.not_empty);
+  pthread_mutex_unlock(&daemon.lock);
+
+  for(int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  if(daemon.pool) {
+    worker_pool_stop(daemon.pool);
+  }
+
+  close(listen_fd);
+  unlink(socket_path);
+  close(lock_fd);
+  cc_context_destroy(daemon.ctx);
+  pthread_cond_destroy(&daemon.not_full);
+  pthread_cond_destroy(&daemon.not_empty);
+  pthread_mutex_destroy(&daemon.lock);
+  return started > 0 ? 0 : 1;
+}
+
+// Function to connect to the daemon socket; returns the connected descriptor or -1 when no daemon listens
+static int daemon_connect(void) {
+  struct sockaddr_un address;
+  char socket_path[sizeof(address.sun_path)];
+
+  if(cc_daemon_socket_path(socket_path, sizeof(socket_path)) != 0) {
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if(fd < 0) {
+    return -1;
+  }
+
+  if(connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*
+  Function Description:
+    Forwards one completion request to the running daemon and waits for its answer.
+
+  Parameters:
+    - request (const cc_request *): File and position; a relative filename is made absolute first,
+      since the daemon runs in another working directory.
+    - result (cc_result *): Receives the daemon's status and completion text (free with cc_result_free).
+
+  Return Value:
+    - int: 0 when the daemon answered (successfully or with an error status), 1 when no daemon is
+      reachable or the exchange broke off, in which case the caller should complete in-process.
+*/
+int cc_daemon_complete(const cc_request *request, cc_result *result) {
+  char abs_filename[PATH_MAX];
+  char header[64];
+  size_t length = 0;
+  size_t capacity = 4096;
+
+  if(!request || !request->filename || !result || realpath(request->filename, abs_filename) == NULL) {
+    return 1;
+  }
+
+  result->text = NULL;
+  result->status = CC_STATUS_INVALID_ARGUMENT;
+  int fd = daemon_connect();
+
+  if(fd < 0) {
+    return 1;
+  }
+
+  struct timeval timeout = {CC_DAEMON_REPLY_TIMEOUT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  int header_length = snprintf(header, sizeof(header), "COMPLETE %d %d %ld ", request->line, request->column,
+                               request->changedtick);
+  char *reply = (char *)malloc(capacity);
+
+  if(!reply || write_all(fd, header, (size_t)header_length) != 0 ||
+      write_all(fd, abs_filename, strlen(abs_filename)) != 0 || write_all(fd, "\n", 1) != 0) {
+    free(reply);
+    close(fd);
+    return 1;
+  }
+
+  // The daemon closes the connection after its single reply line
+  for(;;) {
+    if(length + 1 >= capacity) {
+      char *grown = (char *)realloc(reply, capacity * 2);
+
+      if(!grown) {
+        break;
+      }
+
+      reply = grown;
+      capacity *= 2;
+    }
+
+    ssize_t got = recv(fd, reply + length, capacity - length - 1, 0);
+
+    if(got < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(got <= 0) {
+      break;
+    }
+
+    length += (size_t)got;
+  }
+
+  close(fd);
+  reply[length] = '\0';
+
+  if(length == 0 || reply[length - 1] != '\n') {
+    free(reply);
+    return 1;
+  }
+
+  reply[length - 1] = '\0';
+
+  if(strncmp(reply, "OK ", 3) == 0) {
+    memmove(reply, reply + 3, length - 3);
+    result->text = reply;
+    result->status = CC_STATUS_OK;
+    return 0;
+  }
+
+  int answered = 1;
+
+  if(strncmp(reply, "ERROR ", 6) == 0) {
+    for(int status = CC_STATUS_INVALID_ARGUMENT; status < CC_STATUS_COUNT; status++) {
+      if(strcmp(reply + 6, cc_status_name((cc_status)status)) == 0) {
+        result->status = (cc_status)status;
+        answered = 0;
+      }
+    }
+  }
+
+  free(reply);
+  return answered;
+}
+
+// Function to double-fork a process detached from the caller: own session, stdio on /dev/null, no other
+// descriptors but keep_fd (-1 for none), working directory "/". Returns 0 in the detached process (which
+// may only call async-signal-safe functions before it execs or ends with _exit), 1 in the caller once it
+// is running, -1 on failure
+static int detach_process(int keep_fd) {
+  pid_t pid = fork();
+
+  if(pid < 0) {
+    perror("fork");
+    return -1;
+  }
+
+  if(pid == 0) {
+    if(setsid() < 0 || fork() != 0) {
+      _exit(0);
+    }
+
+    int null_fd = open("/dev/null", O_RDWR);
+
+    if(null_fd >= 0) {
+      dup2(null_fd, STDIN_FILENO);
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+    }
+
+    long max_fd = sysconf(_SC_OPEN_MAX);
+
+    for(int fd = STDERR_FILENO + 1; fd < (max_fd > 0 && max_fd < 4096 ? max_fd : 4096); fd++) {
+      if(fd != keep_fd) {
+        close(fd);
+      }
+    }
+
+    if(chdir("/") != 0) {
+      _exit(1);
+    }
+
+    return 0;
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 1 : -1;
+}
+
+/*
+  Function Description:
+    Starts a detached daemon (`<executable> --daemon`) for later requests and returns at once. The
+    daemon is double-forked into its own session with stdio on /dev/null, so it neither keeps Vim's
+    output pipe open nor receives the terminal's signals. When several clients race to spawn, the
+    flock beside the socket lets exactly one of them serve.
+
+  Parameters:
+    - executable (const char *): Path of code_connector_executable (e.g. "/proc/self/exe").
+
+  Return Value:
+    - int: 0 when the daemon process was started, 1 on failure.
+*/
+int cc_daemon_spawn(const char *executable) {
+  int detached = detach_process(-1);
+
+  if(detached == 0) {
+    execl(executable, "code_connector_executable", "--daemon", (char *)NULL);
+    _exit(127);
+  }
+
+  return detached < 0 ? 1 : 0;
+}
+
+/*
+  Function Description:
+    Language-server mode (`code_connector_executable --lsp`): LSP over stdio, used by the plugin when
+    Vim has listener_add and by other editors. Documents live in memory: the whole text comes once with
+    didOpen, then didChange sends only the changed line ranges (incremental sync);
+    textDocument/signatureHelp and textDocument/completion run cc_complete on the server's context, so
+    the flag caches, the process-shared cache, the ccls sessions and the backends are the same as in
+    the daemon, and the answer is the one filter_clang_output gives the plugin, rendered as an LSP
+    signature or as a snippet with one tab stop per placeholder.
+
+  Parameters:
+    - input_fd (int): Where requests are read (stdin).
+    - output_fd (int): Where responses are written (stdout); nothing else may write to it.
+
+  Return Value:
+    - int: 0 after exit following shutdown, 1 when the input ended or broke off first.
+
+  Maintenance Notes:
+    - Nothing the editor has not saved is written over its files. A document's text is written to a
+      shadow file in the runtime directory only when a request needs a version that is not there yet,
+      and clang reads it through -remap-file (cc_request.unsaved); the version is the changedtick of
+      the request, so identical requests coalesce and a newer one cancels the older.
+    - The last answer of a document is kept with its version and position; asking again before the
+      next change is answered from memory.
+    - A document is a piece table over two buffers, the text it was opened with and the text of later
+      edits, each with an index of its newlines; an edit costs its own length plus a walk over the
+      pieces, never a copy of the document. Contiguous text is only produced for clang, by writing the
+      pieces to the shadow file; past CC_LSP_MAX_PIECES pieces the document is compacted.
+    - Requests are answered on detached threads, notifications in order on the reading thread; a
+      document's text is only touched under server->lock.
+    - Positions count UTF-16 code units, the LSP default, unless the client offers "utf-8" in
+      capabilities.general.positionEncodings; then the server picks it and columns are byte offsets.
+    - A completion item carries the cursor line with the completion substituted in its data member
+      (substitute_function_pattern, as the executable prints it), which is what the plugin inserts.
+*/
+
+#define CC_LSP_DOCUMENTS 64
+#define CC_LSP_MAX_PIECES 4096  // Pieces of a document before it is compacted into one buffer
+
+// Append-only text of a document with the offsets of its newlines
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+  size_t *newlines;  // Ascending offsets of the '\n' bytes of data
+  size_t newline_count;
+  size_t newline_capacity;
+} CCLspBuffer;
+
+// A run of a document's text: length bytes of buffers[buffer] from start
+typedef struct {
+  int buffer;  // 0: the text the document was opened or compacted with, 1: text of later edits
+  size_t start;
+  size_t length;
+} CCLspPiece;
+
+// A document open in the language server
+typedef struct {
+  char *uri;
+  char path[PATH_MAX];
+  CCLspBuffer buffers[2];
+  CCLspPiece *pieces;  // The document's text, in order
+  int piece_count;
+  int piece_capacity;
+  size_t length;
+  long version;
+  long shadow_version;       // Version of the text in shadow, 0 when it was never written
+  char shadow[PATH_MAX];
+  unsigned long generation;  // Numbers the document's requests: the latest wins
+  long answer_version;       // Version, position and result of the last answer
+  int answer_line;
+  int answer_column;
+  int answer_completion;
+  cc_status answer_status;
+  char *answer_text;
+} CCLspDocument;
+
+typedef struct {
+  cc_context *ctx;
+  int output_fd;
+  pthread_mutex_t lock;  // Documents, output and active
+  pthread_cond_t idle;
+  int active;            // Requests being answered on threads
+  CCLspDocument documents[CC_LSP_DOCUMENTS];
+  unsigned long shadow_clock;
+  int utf8_positions;    // positionEncoding "utf-8" was negotiated, else positions count UTF-16 code units
+} CCLspServer;
+
+// A signatureHelp or completion request answered on its own thread
+typedef struct {
+  CCLspServer *server;
+  char *id;                  // JSON text of the request id
+  int completion;            // textDocument/completion, else signatureHelp
+  char filename[PATH_MAX];
+  char unsaved[PATH_MAX];
+  cc_request request;
+  int line;                  // 0-based cursor position, in the client's position encoding
+  int character;
+  int column;                // Byte offset of the cursor in its line
+  int name_start;            // Start of the function name (or word) the answer replaces, as character
+  int active_parameter;
+  char *source;              // Cursor line
+} CCLspTask;
+
+// Function to free a request once it is answered
+static void lsp_task_free(CCLspTask *task) {
+  free(task->source);
+  free(task->id);
+  free(task);
+}
+
+// Function to write a message to the editor (takes server->lock)
+static void lsp_send(CCLspServer *server, const char *body) {
+  pthread_mutex_lock(&server->lock);
+  rpc_send(server->output_fd, body);
+  pthread_mutex_unlock(&server->lock);
+}
+
+// Function to answer a request with a JSON result, or with an error when code is not 0
+static void lsp_respond(CCLspServer *server, const char *id, const char *result, int code, const char *message) {
+  size_t size = strlen(id) + (result ? strlen(result) : 0) + 160;
+  char *body = (char *)malloc(size);
+
+  if(!body) {
+    return;
+  }
+
+  if(code) {
+    snprintf(body, size, "{\"jsonrpc\":\"2.0\",\"id\":%s,\"error\":{\"code\":%d,\"message\":\"%s\"}}", id, code, message);
+  }
+
+  else {
+    snprintf(body, size, "{\"jsonrpc\":\"2.0\",\"id\":%s,\"result\":%s}", id, result);
+  }
+
+  lsp_send(server, body);
+  free(body);
+}
+
+// Function to copy the JSON text of the value at the cursor. Returns a malloc'ed string or NULL
+static char *json_raw_value(CCJsonReader *r) {
+  json_skip_ws(r);
+  size_t start = r->pos;
+  return json_skip_value(r) == 0 ? strndup(r->data + start, r->pos - start) : NULL;
+}
+
+// Function to read the string member key of the object at offset object into a malloc'ed copy
+// (*length receives its length). Returns NULL when there is no such string
+static char *json_member_string(CCJsonReader *r, size_t object, const char *key, size_t *length) {
+  r->pos = object;
+
+  if(json_find_member(r, key) != 0) {
+    return NULL;
+  }
+
+  long decoded = json_read_string(r);
+  char *copy = decoded < 0 ? NULL : (char *)malloc((size_t)decoded + 1);
+
+  if(copy) {
+    memcpy(copy, r->buffer, (size_t)decoded + 1);
+  }
+
+  if(length) {
+    *length = copy ? (size_t)decoded : 0;
+  }
+
+  return copy;
+}
+
+// Function to read the number member key of the object at offset object, fallback when there is none
+static long json_member_long(CCJsonReader *r, size_t object, const char *key, long fallback) {
+  r->pos = object;
+  return json_find_member(r, key) == 0 ? json_read_long(r, fallback) : fallback;
+}
+
+// Function to find the offset of the object member key of the object at offset object, 0 when there is none
+static size_t json_member_object(CCJsonReader *r, size_t object, const char *key) {
+  r->pos = object;
+
+  if(json_find_member(r, key) != 0 || r->data[r->pos] != '{') {
+    return 0;
+  }
+
+  return r->pos;
+}
+
+// Function to tell whether the client of an initialize request (params at offset params) accepts
+// UTF-8 positions
+static int lsp_client_utf8(CCJsonReader *r, size_t params) {
+  size_t capabilities = params ? json_member_object(r, params, "capabilities") : 0;
+  size_t general = capabilities ? json_member_object(r, capabilities, "general") : 0;
+  r->pos = general;
+
+  if(!general || json_find_member(r, "positionEncodings") != 0) {
+    return 0;
+  }
+
+  size_t encodings = r->pos;
+
+  for(int i = 0; (r->pos = encodings, json_find_element(r, i) == 0); i++) {
+    if(json_read_string(r) == 5 && strcmp(r->buffer, "utf-8") == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Function to find an open document by URI (server->lock held)
+static CCLspDocument *lsp_document(CCLspServer *server, const char *uri) {
+  for(int i = 0; uri && i < CC_LSP_DOCUMENTS; i++) {
+    if(server->documents[i].uri && strcmp(server->documents[i].uri, uri) == 0) {
+      return &server->documents[i];
+    }
+  }
+
+  return NULL;
+}
+
+// Function to append text to a document buffer, indexing its newlines. Returns 0 on success
+static int lsp_buffer_append(CCLspBuffer *buffer, const char *text, size_t length) {
+  if(buffer->length + length + 1 > buffer->capacity) {
+    size_t capacity = (buffer->length + length + 1) * 2;
+    char *grown = (char *)realloc(buffer->data, capacity);
+
+    if(!grown) {
+      return 1;
+    }
+
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+
+  for(const char *p = text; (p = memchr(p, '\n', length - (size_t)(p - text))) != NULL; p++) {
+    if(buffer->newline_count == buffer->newline_capacity) {
+      size_t capacity = buffer->newline_capacity ? buffer->newline_capacity * 2 : 256;
+      size_t *grown = (size_t *)realloc(buffer->newlines, capacity * sizeof(size_t));
+
+      if(!grown) {
+        return 1;
+      }
+
+      buffer->newlines = grown;
+      buffer->newline_capacity = capacity;
+    }
+
+    buffer->newlines[buffer->newline_count++] = buffer->length + (size_t)(p - text);
+  }
+
+  memcpy(buffer->data + buffer->length, text, length);
+  buffer->length += length;
+  return 0;
+}
+
+// Function to count the newlines of a document buffer before offset
+static size_t lsp_buffer_newlines_before(const CCLspBuffer *buffer, size_t offset) {
+  size_t low = 0;
+  size_t high = buffer->newline_count;
+
+  while(low < high) {
+    size_t middle = low + (high - low) / 2;
+
+    if(buffer->newlines[middle] < offset) {
+      low = middle + 1;
+    }
+
+    else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+// Function to free the text of a document
+static void lsp_document_free_text(CCLspDocument *document) {
+  for(int i = 0; i < 2; i++) {
+    free(document->buffers[i].data);
+    free(document->buffers[i].newlines);
+  }
+
+  free(document->pieces);
+  memset(document->buffers, 0, sizeof(document->buffers));
+  document->pieces = NULL;
+  document->piece_count = 0;
+  document->piece_capacity = 0;
+  document->length = 0;
+}
+
+// Function to replace the whole text of a document with one piece. Returns 0 on success
+static int lsp_document_set_text(CCLspDocument *document, const char *text, size_t length) {
+  lsp_document_free_text(document);
+  document->pieces = (CCLspPiece *)malloc(16 * sizeof(CCLspPiece));
+
+  if(!document->pieces || lsp_buffer_append(&document->buffers[0], text, length) != 0) {
+    lsp_document_free_text(document);
+    return 1;
+  }
+
+  document->piece_capacity = 16;
+  document->piece_count = length > 0;
+  document->pieces[0] = (CCLspPiece) {0, 0, length};
+  document->length = length;
+  return 0;
+}
+
+// Function to copy the bytes [start, end) of a document to out
+static void lsp_document_copy(const CCLspDocument *document, size_t start, size_t end, char *out) {
+  size_t position = 0;
+
+  for(int i = 0; i < document->piece_count && position < end; i++) {
+    const CCLspPiece *piece = &document->pieces[i];
+    size_t from = start > position ? start - position : 0;
+    size_t to = end - position < piece->length ? end - position : piece->length;
+
+    if(from < to) {
+      memcpy(out, document->buffers[piece->buffer].data + piece->start + from, to - from);
+      out += to - from;
+    }
+
+    position += piece->length;
+  }
+}
+
+// Function to count the UTF-16 code units of length bytes of UTF-8 text
+static long lsp_utf16_units(const char *text, size_t length) {
+  long units = 0;
+
+  for(size_t i = 0; i < length; i++) {
+    unsigned char ch = (unsigned char)text[i];
+    units += (ch & 0xC0) == 0x80 ? 0 : ch >= 0xF0 ? 2 : 1;
+  }
+
+  return units;
+}
+
+// Function to turn a 0-based line and column (bytes when utf8, else UTF-16 code units) into an offset of
+// a document; a column past the end of its line stands for the line's end, a line past the last for the
+// end of the document
+static size_t lsp_document_offset(const CCLspDocument *document, long line, long character, int utf8) {
+  size_t position = 0;
+  size_t offset = line <= 0 ? 0 : document->length;
+  long lines = 0;
+  int i = 0;
+
+  // Find the piece holding the newline that ends the previous line
+  for(; line > 0 && i < document->piece_count; i++) {
+    const CCLspPiece *piece = &document->pieces[i];
+    const CCLspBuffer *buffer = &document->buffers[piece->buffer];
+    size_t first = lsp_buffer_newlines_before(buffer, piece->start);
+    long count = (long)(lsp_buffer_newlines_before(buffer, piece->start + piece->length) - first);
+
+    if(lines + count >= line) {
+      offset = position + buffer->newlines[first + (size_t)(line - lines - 1)] - piece->start + 1;
+      break;
+    }
+
+    lines += count;
+    position += piece->length;
+  }
+
+  // Walk the line until character is used up
+  int done = character <= 0;
+
+  for(position = 0, i = 0; i < document->piece_count && !done; i++) {
+    const CCLspPiece *piece = &document->pieces[i];
+
+    if(position + piece->length > offset) {
+      const char *from = document->buffers[piece->buffer].data + piece->start + (offset - position);
+      size_t available = position + piece->length - offset;
+      size_t moved = 0;
+
+      if(utf8) {
+        size_t wanted = (size_t)character < available ? (size_t)character : available;
+        const char *newline = memchr(from, '\n', wanted);
+        moved = newline ? (size_t)(newline - from) : wanted;
+        character = newline ? 0 : character - (long)moved;
+        done = character == 0;
+      }
+
+      // A 4-byte sequence is a surrogate pair (two units), continuation bytes count nothing; the walk
+      // ends on a character boundary, so it may go on into the next piece with character used up
+      else {
+        while(moved < available && from[moved] != '\n' && (character > 0 || (from[moved] & 0xC0) == 0x80)) {
+          unsigned char ch = (unsigned char)from[moved++];
+          character -= (ch & 0xC0) == 0x80 ? 0 : ch >= 0xF0 ? 2 : 1;
+        }
+
+        done = moved < available;
+      }
+
+      offset += moved;
+    }
+
+    position += piece->length;
+  }
+
+  return offset;
+}
+
+// Function to make a piece of a document start at offset, splitting the one across it; there must be
+// room for one more piece. Returns the index of that piece (piece_count at the end of the document)
+static int lsp_document_split(CCLspDocument *document, size_t offset) {
+  size_t position = 0;
+
+  for(int i = 0; i < document->piece_count; i++) {
+    CCLspPiece *piece = &document->pieces[i];
+
+    if(position == offset) {
+      return i;
+    }
+
+    if(offset < position + piece->length) {
+      memmove(&document->pieces[i + 2], &document->pieces[i + 1], (size_t)(document->piece_count - i - 1) * sizeof(CCLspPiece));
+      size_t head = offset - position;
+      document->pieces[i + 1] = (CCLspPiece) {piece->buffer, piece->start + head, piece->length - head};
+      piece->length = head;
+      document->piece_count++;
+      return i + 1;
+    }
+
+    position += piece->length;
+  }
+
+  return document->piece_count;
+}
+
+// Function to rewrite a document as one piece holding all its text. Returns 0 on success
+static int lsp_document_compact(CCLspDocument *document) {
+  char *text = (char *)malloc(document->length + 1);
+
+  if(!text) {
+    return 1;
+  }
+
+  lsp_document_copy(document, 0, document->length, text);
+  int failed = lsp_document_set_text(document, text, document->length);
+  free(text);
+  return failed;
+}
+
+// Function to replace the bytes [start, end) of a document with text. Returns 0 on success
+static int lsp_document_replace(CCLspDocument *document, size_t start, size_t end, const char *text, size_t length) {
+  CCLspBuffer *added = &document->buffers[1];
+  size_t added_start = added->length;
+
+  if(end < start || end > document->length) {
+    return 1;
+  }
+
+  // Two splits and the new piece
+  if(document->piece_count + 3 > document->piece_capacity) {
+    int capacity = document->piece_capacity * 2 + 3;
+    CCLspPiece *grown = (CCLspPiece *)realloc(document->pieces, (size_t)capacity * sizeof(CCLspPiece));
+
+    if(!grown) {
+      return 1;
+    }
+
+    document->pieces = grown;
+    document->piece_capacity = capacity;
+  }
+
+  if(lsp_buffer_append(added, text, length) != 0) {
+    return 1;
+  }
+
+  int first = lsp_document_split(document, start);
+  int last = lsp_document_split(document, end);
+  memmove(&document->pieces[first], &document->pieces[last], (size_t)(document->piece_count - last) * sizeof(CCLspPiece));
+  document->piece_count -= last - first;
+  CCLspPiece *previous = first > 0 ? &document->pieces[first - 1] : NULL;
+
+  // Typing appends to the piece of the previous keystroke
+  if(previous && previous->buffer == 1 && previous->start + previous->length == added_start) {
+    previous->length += length;
+  }
+
+  else if(length > 0) {
+    memmove(&document->pieces[first + 1], &document->pieces[first], (size_t)(document->piece_count - first) * sizeof(CCLspPiece));
+    document->pieces[first] = (CCLspPiece) {1, added_start, length};
+    document->piece_count++;
+  }
+
+  document->length += length - (end - start);
+  return document->piece_count > CC_LSP_MAX_PIECES ? lsp_document_compact(document) : 0;
+}
+
+// Function to forget a document and remove its shadow file (server->lock held)
+static void lsp_close_document(CCLspDocument *document) {
+  if(document->shadow_version) {
+    unlink(document->shadow);
+  }
+
+  free(document->uri);
+  lsp_document_free_text(document);
+  free(document->answer_text);
+  memset(document, 0, sizeof(*document));
+}
+
+// Function to turn a file:// URI into a path, decoding %XX escapes. Returns 0 on success
+static int lsp_uri_path(const char *uri, char *path, size_t size) {
+  size_t length = 0;
+
+  if(strncmp(uri, "file://", 7) != 0) {
+    return 1;
+  }
+
+  for(const char *p = uri + 7; *p && length + 1 < size; p++) {
+    unsigned int code;
+
+    if(*p == '%' && sscanf(p + 1, "%2x", &code) == 1) {
+      path[length++] = (char)code;
+      p += 2;
+    }
+
+    else {
+      path[length++] = *p;
+    }
+  }
+
+  path[length] = '\0';
+  return 0;
+}
+
+// Function to write the current version of a document to its shadow file unless it is there already
+// (server->lock held). Returns 0 on success
+static int lsp_write_shadow(CCLspServer *server, CCLspDocument *document) {
+  char name[64];
+  char temporary[PATH_MAX + 8];
+
+  if(document->shadow_version == document->version && document->shadow_version != 0) {
+    return 0;
+  }
+
+  if(document->shadow[0] == '\0') {
+    const char *extension = strrchr(document->path, '.');
+    snprintf(name, sizeof(name), "lsp.%ld.%lu%s", (long)getpid(), ++server->shadow_clock,
+             extension && !strchr(extension, '/') ? extension : "");
+
+    if(runtime_file_path(name, document->shadow, sizeof(document->shadow)) != 0) {
+      document->shadow[0] = '\0';
+      return 1;
+    }
+  }
+
+  // Renamed into place: a clang still reading the previous version keeps its inode
+  snprintf(temporary, sizeof(temporary), "%s.tmp", document->shadow);
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+  if(fd < 0) {
+    return 1;
+  }
+
+  int failed = 0;
+
+  // The only place the pieces become contiguous text
+  for(int i = 0; i < document->piece_count && !failed; i++) {
+    const CCLspPiece *piece = &document->pieces[i];
+    failed = write_all(fd, document->buffers[piece->buffer].data + piece->start, piece->length);
+  }
+
+  failed |= close(fd) != 0;
+
+  if(failed || rename(temporary, document->shadow) != 0) {
+    unlink(temporary);
+    return 1;
+  }
+
+  document->shadow_version = document->version;
+  return 0;
+}
+
+// Function to find, on the cursor line, where the function name of the call the cursor is in starts and
+// which of its arguments the cursor is on; outside of a call, the word before the cursor
+// Returns the 1-based column of the call's "(" (the position the plugin would send), or 0 outside of a call
+static int lsp_call_context(const char *text, int length, int character, int *name_start, int *active) {
+  int cursor = character < length ? character : length;
+  int depth = 0;
+  int commas = 0;
+  int open = -1;
+
+  for(int i = cursor - 1; i >= 0 && open < 0; i--) {
+    if(text[i] == ')') {
+      depth++;
+    }
+
+    else if(text[i] == '(' && depth > 0) {
+      depth--;
+    }
+
+    else if(text[i] == '(') {
+      open = i;
+    }
+
+    else if(text[i] == ',' && depth == 0) {
+      commas++;
+    }
+  }
+
+  int start = open >= 0 ? open : cursor;
+
+  while(open >= 0 && start > 0 && isspace((unsigned char)text[start - 1])) {
+    start--;
+  }
+
+  while(start > 0 && (isalnum((unsigned char)text[start - 1]) || text[start - 1] == '_')) {
+    start--;
+  }
+
+  *name_start = start;
+  *active = open >= 0 ? commas : 0;
+  return open >= 0 ? open + 1 : 0;
+}
+
+// Function to append length bytes of text to a growing string as they are. Returns 0 on success
+static int lsp_append_raw(char **out, size_t *used, size_t *size, const char *text, size_t length) {
+  if(length >= (size_t)-1 / 2 - *used) {
+    return 1;
+  }
+
+  if(*used + length + 1 > *size) {
+    size_t grown_size = (*used + length + 1) * 2;
+    char *grown = (char *)realloc(*out, grown_size);
+
+    if(!grown) {
+      return 1;
+    }
+
+    *out = grown;
+    *size = grown_size;
+  }
+
+  memcpy(*out + *used, text, length);
+  *used += length;
+  (*out)[*used] = '\0';
+  return 0;
+}
+
+// Function to append text to a growing string, escaping it for JSON. Returns 0 on success
+static int lsp_append(char **out, size_t *used, size_t *size, const char *text, size_t length, int quote) {
+  if(!quote) {
+    return lsp_append_raw(out, used, size, text, length);
+  }
+
+  char *quoted = json_quote(text, length);
+
+  if(!quoted) {
+    return 1;
+  }
+
+  int failed = lsp_append_raw(out, used, size, quoted, strlen(quoted));
+  free(quoted);
+  return failed;
+}
+
+// Function to render a completion such as "remainderf(`<float x>`, `<float y>`)" for the editor: a
+// SignatureHelp, or a CompletionList whose one item inserts a snippet with a tab stop per placeholder
+// Returns the malloc'ed JSON result or NULL
+static char *lsp_render(const CCLspTask *task, const char *text) {
+  const char *open = strchr(text, '(');
+  char *label = NULL;
+  char *snippet = NULL;
+  char *parameters = NULL;
+  size_t label_used = 0, label_size = 0, snippet_used = 0, snippet_size = 0, parameters_used = 0, parameters_size = 0;
+  int count = 0;
+  int failed = !open;
+
+  if(!failed) {
+    failed |= lsp_append(&label, &label_used, &label_size, text, (size_t)(open - text) + 1, 0);
+    failed |= lsp_append(&snippet, &snippet_used, &snippet_size, text, (size_t)(open - text) + 1, 0);
+    failed |= lsp_append(&parameters, &parameters_used, &parameters_size, "[", 1, 0);
+  }
+
+  for(const char *p = open; !failed && (p = strstr(p, "`<")) != NULL; count++) {
+    const char *close = strstr(p + 2, ">`");
+
+    if(!close) {
+      break;
+    }
+
+    char stop[32];
+    int stop_length = snprintf(stop, sizeof(stop), "%s${%d:", count ? ", " : "", count + 1);
+    failed |= lsp_append(&label, &label_used, &label_size, ", ", count ? 2 : 0, 0);
+    failed |= lsp_append(&label, &label_used, &label_size, p + 2, (size_t)(close - p - 2), 0);
+    failed |= lsp_append(&snippet, &snippet_used, &snippet_size, stop, (size_t)stop_length, 0);
+
+    // '$', '}' and '\' are snippet syntax
+    for(const char *c = p + 2; c < close && !failed; c++) {
+      failed |= lsp_append(&snippet, &snippet_used, &snippet_size, "\\", strchr("$}\\", *c) ? 1 : 0, 0);
+      failed |= lsp_append(&snippet, &snippet_used, &snippet_size, c, 1, 0);
+    }
+
+    failed |= lsp_append(&snippet, &snippet_used, &snippet_size, "}", 1, 0);
+    failed |= lsp_append(&parameters, &parameters_used, &parameters_size, count ? ",{\"label\":" : "{\"label\":", count ? 10 : 9, 0);
+    failed |= lsp_append(&parameters, &parameters_used, &parameters_size, p + 2, (size_t)(close - p - 2), 1);
+    failed |= lsp_append(&parameters, &parameters_used, &parameters_size, "}", 1, 0);
+    p = close + 2;
+  }
+
+  failed |= lsp_append(&label, &label_used, &label_size, ")", 1, 0);
+  failed |= lsp_append(&snippet, &snippet_used, &snippet_size, ")", 1, 0);
+  failed |= lsp_append(&parameters, &parameters_used, &parameters_size, "]", 1, 0);
+  char *quoted_label = failed ? NULL : json_quote(label, label_used);
+  char *quoted_snippet = failed ? NULL : json_quote(snippet, snippet_used);
+  // The line as the executable would print it, for the plugin
+  char *substituted = task->completion && task->source ? substitute_function_pattern(task->source, text) : NULL;
+  char *quoted_line = substituted ? json_quote(substituted, strlen(substituted)) : NULL;
+  char *result = NULL;
+
+  if(quoted_label && quoted_snippet) {
+    size_t size = strlen(quoted_label) + strlen(quoted_snippet) + parameters_used + (quoted_line ? strlen(quoted_line) : 0) + 320;
+    result = (char *)malloc(size);
+
+    if(result && task->completion) {
+      snprintf(result, size, "{\"isIncomplete\":false,\"items\":[{\"label\":%s,\"kind\":3,\"insertTextFormat\":2,"
+               "\"textEdit\":{\"range\":{\"start\":{\"line\":%d,\"character\":%d},\"end\":{\"line\":%d,\"character\":%d}},"
+               "\"newText\":%s},\"data\":{\"line\":%s}}]}", quoted_label, task->line, task->name_start, task->line, task->character,
+               quoted_snippet, quoted_line ? quoted_line : "null");
+    }
+
+    else if(result) {
+      snprintf(result, size, "{\"signatures\":[{\"label\":%s,\"parameters\":%s}],\"activeSignature\":0,\"activeParameter\":%d}",
+               quoted_label, parameters, task->active_parameter < count ? task->active_parameter : count > 0 ? count - 1 : 0);
+    }
+  }
+
+  free(quoted_label);
+  free(quoted_snippet);
+  free(quoted_line);
+  free(substituted);
+  free(label);
+  free(snippet);
+  free(parameters);
+  return result;
+}
+
+// Function to answer a request from a cc_complete result
+static void lsp_answer(CCLspTask *task, cc_status status, const char *text) {
+  char *result = status == CC_STATUS_OK ? lsp_render(task, text) : NULL;
+
+  if(status == CC_STATUS_CANCELLED) {
+    lsp_respond(task->server, task->id, NULL, -32800, "Superseded by a newer request");
+  }
+
+  else {
+    lsp_respond(task->server, task->id, result ? result : task->completion ? "{\"isIncomplete\":false,\"items\":[]}" : "null", 0, NULL);
+  }
+
+  free(result);
+}
+
+// Function run for one signatureHelp or completion request: completes, remembers the answer for its
+// document version and responds
+static void *lsp_task_thread(void *arg) {
+  CCLspTask *task = (CCLspTask *)arg;
+  CCLspServer *server = task->server;
+  cc_result result;
+  cc_complete(server->ctx, &task->request, &result);
+  pthread_mutex_lock(&server->lock);
+
+  for(int i = 0; i < CC_LSP_DOCUMENTS; i++) {
+    CCLspDocument *document = &server->documents[i];
+
+    // Only an answer for the current text is worth keeping
+    if(document->uri && strcmp(document->path, task->filename) == 0 && document->version == task->request.changedtick &&
+       result.status != CC_STATUS_CANCELLED) {
+      free(document->answer_text);
+      document->answer_text = result.text ? strdup(result.text) : NULL;
+      document->answer_status = document->answer_text || !result.text ? result.status : CC_STATUS_OUT_OF_MEMORY;
+      document->answer_version = task->request.changedtick;
+      document->answer_line = task->request.line;
+      document->answer_column = task->request.column;
+      document->answer_completion = task->completion;
+    }
+  }
+
+  pthread_mutex_unlock(&server->lock);
+  // Remembered before answering, so asking again right after the answer finds it
+  lsp_answer(task, result.status, result.text);
+  pthread_mutex_lock(&server->lock);
+  server->active--;
+  pthread_cond_broadcast(&server->idle);
+  pthread_mutex_unlock(&server->lock);
+  cc_result_free(&result);
+  lsp_task_free(task);
+  return NULL;
+}
+
+// Function to start answering a signatureHelp or completion request (params at offset params)
+static void lsp_request_completion(CCLspServer *server, CCJsonReader *r, size_t params, char *id, int completion) {
+  size_t document_object = json_member_object(r, params, "textDocument");
+  size_t position = json_member_object(r, params, "position");
+  char *uri = document_object ? json_member_string(r, document_object, "uri", NULL) : NULL;
+  CCLspTask *task = (CCLspTask *)calloc(1, sizeof(CCLspTask));
+  pthread_t thread;
+  pthread_attr_t attributes;
+
+  if(!task || !uri || !position) {
+    lsp_respond(server, id, NULL, -32602, "Invalid params");
+    free(task);
+    free(uri);
+    free(id);
+    return;
+  }
+
+  task->server = server;
+  task->id = id;
+  task->completion = completion;
+  task->line = (int)json_member_long(r, position, "line", 0);
+  task->character = (int)json_member_long(r, position, "character", 0);
+  pthread_mutex_lock(&server->lock);
+  CCLspDocument *document = lsp_document(server, uri);
+  free(uri);
+
+  size_t line_start = document ? lsp_document_offset(document, task->line, 0, 1) : 0;
+  size_t line_end = document ? lsp_document_offset(document, task->line, LONG_MAX, 1) : 0;
+  task->column = document ? (int)(lsp_document_offset(document, task->line, task->character, server->utf8_positions) -
+                                  line_start) : 0;
+  task->source = document ? (char *)calloc(1, line_end - line_start + 1) : NULL;
+
+  if(!task->source || lsp_write_shadow(server, document) != 0) {
+    pthread_mutex_unlock(&server->lock);
+
+    if(document) {
+      lsp_answer(task, CC_STATUS_INVALID_ARGUMENT, NULL);
+    }
+
+    else {
+      lsp_respond(server, task->id, NULL, -32602, "Document not open");
+    }
+
+    lsp_task_free(task);
+    return;
+  }
+
+  lsp_document_copy(document, line_start, line_end, task->source);
+  int call = lsp_call_context(task->source, (int)(line_end - line_start), task->column, &task->name_start,
+                              &task->active_parameter);
+
+  if(!server->utf8_positions) {
+    task->name_start = (int)lsp_utf16_units(task->source, (size_t)task->name_start);
+  }
+
+  snprintf(task->filename, sizeof(task->filename), "%s", document->path);
+  snprintf(task->unsaved, sizeof(task->unsaved), "%s", document->shadow);
+  task->request.filename = task->filename;
+  task->request.unsaved = task->unsaved;
+  task->request.line = task->line + 1;
+  // A signature is asked for at the call's "(" like the plugin does, a completion at the cursor
+  task->request.column = !completion && call > 0 ? call : task->column;
+  task->request.changedtick = document->version;
+  task->request.generation = ++document->generation;
+
+  // Asked again before the next change: answer from memory
+  if(document->answer_version == document->version && document->answer_line == task->request.line &&
+     document->answer_column == task->request.column && document->answer_completion == completion) {
+    char *text = document->answer_text ? strdup(document->answer_text) : NULL;
+    cc_status status = document->answer_text && !text ? CC_STATUS_OUT_OF_MEMORY : document->answer_status;
+    pthread_mutex_unlock(&server->lock);
+    lsp_answer(task, status, text);
+    free(text);
+    lsp_task_free(task);
+    return;
+  }
+
+  server->active++;
+  pthread_mutex_unlock(&server->lock);
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+  if(pthread_create(&thread, &attributes, lsp_task_thread, task) != 0) {
+    lsp_task_thread(task);
+  }
+
+  pthread_attr_destroy(&attributes);
+}
+
+// Function to apply didOpen, didChange or didClose (params at offset params; server->lock held)
+static void lsp_sync_document(CCLspServer *server, CCJsonReader *r, size_t params, const char *method) {
+  size_t document_object = json_member_object(r, params, "textDocument");
+  char *uri = document_object ? json_member_string(r, document_object, "uri", NULL) : NULL;
+  CCLspDocument *document = lsp_document(server, uri);
+  long version = document_object ? json_member_long(r, document_object, "version", 0) : 0;
+  size_t length = 0;
+  char *text = NULL;
+
+  if(!uri) {
+    return;
+  }
+
+  if(strcmp(method, "textDocument/didClose") == 0) {
+    if(document) {
+      lsp_close_document(document);
+    }
+  }
+
+  else if(strcmp(method, "textDocument/didOpen") == 0) {
+    text = json_member_string(r, document_object, "text", &length);
+
+    for(int i = 0; !document && text && i < CC_LSP_DOCUMENTS; i++) {
+      if(!server->documents[i].uri) {
+        document = &server->documents[i];
+      }
+    }
+
+    if(document && text && lsp_uri_path(uri, document->path, sizeof(document->path)) == 0 &&
+       lsp_document_set_text(document, text, length) == 0) {
+      free(document->uri);
+      document->uri = uri;
+      uri = NULL;
+      document->version = version > 0 ? version : 1;
+    }
+  }
+
+  else if(document) {
+    int failed = 0;
+    r->pos = params;
+
+    // Changes apply in order, each to the text the previous one left
+    if(json_find_member(r, "contentChanges") == 0) {
+      size_t changes = r->pos;
+
+      for(int i = 0; !failed && (r->pos = changes, json_find_element(r, i) == 0); i++) {
+        size_t change = r->pos;
+        size_t range = json_member_object(r, change, "range");
+        size_t start = range ? json_member_object(r, range, "start") : 0;
+        size_t end = range ? json_member_object(r, range, "end") : 0;
+        free(text);
+        text = json_member_string(r, change, "text", &length);
+
+        if(!text || (range && (!start || !end))) {
+          failed = 1;
+        }
+
+        else if(!range) {
+          failed = lsp_document_set_text(document, text, length);
+        }
+
+        else {
+          size_t from = lsp_document_offset(document, json_member_long(r, start, "line", 0),
+                                            json_member_long(r, start, "character", 0), server->utf8_positions);
+          size_t to = lsp_document_offset(document, json_member_long(r, end, "line", 0),
+                                          json_member_long(r, end, "character", 0), server->utf8_positions);
+          failed = lsp_document_replace(document, from, to > from ? to : from, text, length);
+        }
+      }
+    }
+
+    // Out of step with the editor: forget the document, its next request reports that it is not open
+    if(failed) {
+      log_message("fn lsp_sync_document: A change could not be applied, document dropped\n");
+      lsp_close_document(document);
+    }
+
+    else {
+      document->version = version > document->version ? version : document->version + 1;
+    }
+  }
+
+  free(text);
+  free(uri);
+}
+
+int cc_lsp_run(int input_fd, int output_fd) {
+  CCLspServer server;
+  CCRpcStream stream = {input_fd, NULL, 0, 0};
+  cc_settings settings;
+  int shutdown_requested = 0;
+  int exited = 0;
+  memset(&server, 0, sizeof(server));
+  cc_settings_from_environment(&settings);
+  settings.ccls_sessions = getenv("CODE_CONNECTOR_CCLS_SESSIONS") ? settings.ccls_sessions : CC_CCLS_DEFAULT_SESSIONS;
+  server.ctx = cc_context_create(&settings);
+  server.output_fd = output_fd;
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.idle, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  while(server.ctx && !exited) {
+    cc_status status;
+    char *body = rpc_receive(&stream, -1, NULL, NULL, &status);
+
+    if(!body) {
+      break;
+    }
+
+    CCJsonReader reader = {body, strlen(body), 0, NULL, 0};
+    char *method = json_member_string(&reader, 0, "method", NULL);
+    reader.pos = 0;
+    char *id = json_find_member(&reader, "id") == 0 ? json_raw_value(&reader) : NULL;
+    reader.pos = 0;
+    size_t params = json_find_member(&reader, "params") == 0 && reader.data[reader.pos] == '{' ? reader.pos : 0;
+
+    if(!method) {
+      free(id);  // A response to nothing we asked
+    }
+
+    else if(strcmp(method, "initialize") == 0 && id) {
+      char capabilities[512];
+      server.utf8_positions = lsp_client_utf8(&reader, params);
+      snprintf(capabilities, sizeof(capabilities),
+               "{\"capabilities\":{%s\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+               "\"signatureHelpProvider\":{\"triggerCharacters\":[\"(\",\",\"]},"
+               "\"completionProvider\":{\"triggerCharacters\":[\"(\"]}},"
+               "\"serverInfo\":{\"name\":\"code_connector\"}}",
+               server.utf8_positions ? "\"positionEncoding\":\"utf-8\"," : "");
+      lsp_respond(&server, id, capabilities, 0, NULL);
+      free(id);
+    }
+
+    else if((strcmp(method, "textDocument/signatureHelp") == 0 || strcmp(method, "textDocument/completion") == 0) &&
+            id && params) {
+      lsp_request_completion(&server, &reader, params, id, strcmp(method, "textDocument/completion") == 0);
+    }
+
+    else if(strncmp(method, "textDocument/did", 16) == 0 && params) {
+      pthread_mutex_lock(&server.lock);
+      lsp_sync_document(&server, &reader, params, method);
+      pthread_mutex_unlock(&server.lock);
+      free(id);
+    }
+
+    else if(strcmp(method, "shutdown") == 0 && id) {
+      pthread_mutex_lock(&server.lock);
+
+      while(server.active > 0) {
+        pthread_cond_wait(&server.idle, &server.lock);
+      }
+
+      pthread_mutex_unlock(&server.lock);
+      shutdown_requested = 1;
+      lsp_respond(&server, id, "null", 0, NULL);
+      free(id);
+    }
+
+    else if(strcmp(method, "exit") == 0) {
+      exited = 1;
+      free(id);
+    }
+
+    else if(id) {
+      lsp_respond(&server, id, NULL, -32601, "Method not found");
+      free(id);
+    }
+
+    free(method);
+    free(reader.buffer);
+    free(body);
+  }
+
+  pthread_mutex_lock(&server.lock);
+
+  while(server.active > 0) {
+    pthread_cond_wait(&server.idle, &server.lock);
+  }
+
+  for(int i = 0; i < CC_LSP_DOCUMENTS; i++) {
+    lsp_close_document(&server.documents[i]);
+  }
+
+  pthread_mutex_unlock(&server.lock);
+  cc_context_destroy(server.ctx);
+  pthread_cond_destroy(&server.idle);
+  pthread_mutex_destroy(&server.lock);
+  free(stream.buffer);
+  return exited && shutdown_requested ? 0 : 1;
+}
+
+/*
+  Function Description:
+    Filters clang’s code completion output to extract only the relevant completion suggestions,
+    removing extraneous lines and formatting them into a newline-separated string. This processes
+    raw clang output (from execute_code_completion_command) into a clean list for Vim.
+
+  Parameters:
+    - input (const char *): The raw clang output string (e.g., "COMPLETION: printf : ..."), not modified.
+
+  Return Value:
+    - char *: A dynamically allocated string with filtered completions (e.g., "printf\nscanf\n"), or
+      NULL on failure (e.g., memory allocation). Caller must free this string.
+
+  Detailed Steps:
+    1. Validate Input:
+       - If input is NULL or empty (input[0] == '\0'), returns NULL—no data to process.
+    2. Allocate Buffers:
+       - Allocates filtered_output (MAX_OUTPUT) for the result and line_buffer (MAX_LINE_LENGTH)
+         for parsing lines.
+       - If either allocation fails, frees both and returns NULL.
+    3. Initialize Parsing:
+       - Creates a copy of input with strdup to work with strtok; if fails, frees buffers and returns NULL.
+       - Sets initial filtered_length to 0 to track output size.
+    4. Tokenize and Filter:
+       - Uses strtok to split input_copy by newline, processing each line.
+       - For each line, checks if it starts with "COMPLETION: " (strstr).
+       - If it does, extracts the completion name (after "COMPLETION: " up to " :" or end), copies to
+         line_buffer, appends to filtered_output with a newline, updates filtered_length.
+       - Limits total length to MAX_OUTPUT - 1 to prevent overflow.
+    5. Clean Up and Return:
+       - Frees input_copy and line_buffer.
+       - If filtered_length is 0 (no completions), frees filtered_output and returns NULL.
+       - Otherwise, null-terminates filtered_output and returns it.
+
+  Flow and Logic:
+    - Step 1: Quick check to skip invalid input.
+    - Steps 2-3: Set up memory and a workable input copy.
+    - Step 4: Loop through lines, grab completions, build the output.
+    - Step 5: Wrap up, ensure something was found, return result.
+    - Why this order? Validation first, setup next, filter then clean—standard string processing flow.
+
+  How It Works (For Novices):
+    - Imagine clang hands you a messy note (input) with lines like "COMPLETION: printf : ..." and
+      junk like "Target: x86_64", and you want a neat list of just the suggestions (e.g., "printf\nscanf").
+    - filter_clang_output is like cleaning it up:
+      - Step 1: If the note’s blank or missing, toss it (return NULL).
+      - Step 2: Get a big clean sheet (filtered_output) and a scratch pad (line_buffer).
+      - Step 3: Copy the messy note (strdup) so you can cut it up (strtok).
+      - Step 4: Cut the note into lines. If a line says "COMPLETION: ", grab the word after it (e.g.,
+        "printf"), write it on the clean sheet with a newline, keep track of space used.
+      - Step 5: Toss the scratch stuff (free input_copy, line_buffer). If the clean sheet’s empty, toss
+        it too (return NULL); otherwise, finish it and hand it over.
+    - It’s like turning a cluttered brainstorm into a tidy to-do list!
+
+  Why It Works (For Novices):
+    - Focus: Picks only the useful bits (completions), ignoring clutter.
+    - Safety: Checks memory and space so it doesn’t mess up.
+    - Neatness: Gives you a simple list, one suggestion per line.
+
+  Why It’s Designed This Way (For Maintainers):
+    - Purpose: Cleans clang’s verbose output (from execute_code_completion_command) for Vim via
+      processCompletionDataFromString, key for UNIX tooling (per _POSIX_C_SOURCE).
+    - String Handling: strtok splits lines efficiently; strdup protects input—standard C practices.
+    - Memory: Dynamic allocation (MAX_OUTPUT) handles variable output sizes; caller frees result,
+      consistent with execute_code_completion_command.
+    - Filtering: "COMPLETION: " check is specific to clang’s format—effective but tied to its output style.
+    - Error Handling: NULL on failure (input, memory, no completions) lets callers (e.g., Vim plugin)
+      handle gracefully, with minimal logging.
+
+  Maintenance Notes:
+    - Buffer Limits: MAX_OUTPUT and MAX_LINE_LENGTH must fit clang output and longest completion—
+      test with huge structs or namespaces to avoid truncation.
+    - Clang Format: Relies on "COMPLETION: " and " :"—if clang changes (e.g., "Completion:"), adjust
+      strstr checks. Log failures (via log_message) to catch this.
+    - Memory Leaks: Frees all temps on all paths—verify with valgrind, especially on early returns.
+    - Edge Cases: Empty lines or no completions return NULL—ensure callers (e.g., processCompletionDataFromString)
+      handle this (e.g., fallback to empty list).
+    - Extensibility: To keep more data (e.g., types after " :"), expand parsing—current focus is minimal.
+*/
+
+/* Substitute the output from the command
+  clang -fsyntax-only -Xclang -code-completion-macros -Xclang -code-completion-at=file.c:line:column file.c
+  such as: PREFERRED-TYPE: double
+  COMPLETION: remainderf : [#float#]remainderf(<#float x#>, <#float y#>)
+  with    double result = remainderf(`<float x>`, `<float y>`) by matching certain patterns */
+char *filter_clang_output(const char *input) {
+  /* printf("DEBUG: Input string:\n%s\n", input); */
+  // Dynamically allocate memory for output
+  char *output = (char *)malloc(MAX_OUTPUT * sizeof(char));
+
+  if(!output) {
+    /* printf("DEBUG: Failed to allocate output buffer\n"); */
+    return NULL;
+  }
+
+  output[0] = '\0';
+  /* printf("DEBUG: Output buffer allocated, initial length: %zu\n", strlen(output)); */
+  regex_t regex;
+  regmatch_t *matches = (regmatch_t *)malloc(MAX_REGX_MATCHES * sizeof(regmatch_t));
+
+  if(!matches) {
+    /* printf("DEBUG: Failed to allocate matches array\n"); */
+    free(output);
+    return NULL;
+  }
+
+  /* printf("DEBUG: Matches array allocated\n"); */
+  // Pattern to match "COMPLETION: function : [#type#]function(<#type#>, <#type#>)"
+  const char *pattern = "^COMPLETION: ([^ ]+) : \\[#([^#]+)#\\]\\1\\(<#([^#]+)#>(, <#([^#]+)#>)*\\)";
+  /* printf("DEBUG: Using regex pattern: %s\n", pattern); */
+  int regex_result = regcomp(&regex, pattern, REG_EXTENDED | REG_NEWLINE);
+
+  if(regex_result != 0) {
+    char errbuf[256];
+    regerror(regex_result, &regex, errbuf, sizeof(errbuf));
+    /* printf("DEBUG: Regex compilation failed: %s\n", errbuf); */
+    free(output);
+    free(matches);
+    return NULL;
+  }
+
+  /* printf("DEBUG: Regex compiled successfully\n"); */
+  // Check if input contains COMPLETION lines
+  const char *cursor = input;
+  int has_completion = 0;
+
+  while(*cursor != '\0') {
+    if(strncmp(cursor, "COMPLETION:", 11) == 0) {
+      has_completion = 1;
+      break;
+    }
+
+    while(*cursor != '\0' && *cursor != '\n') {
+      cursor++;
+    }
+
+    if(*cursor == '\n') {
+      cursor++;
+    }
+  }
+
+  /* printf("DEBUG: Input contains COMPLETION lines: %s\n",
+         has_completion ? "yes" : "no"); */
+  cursor = input;
+  size_t matches_size = MAX_REGX_MATCHES;
+  int match_count = 0;
+
+  while(regexec(&regex, cursor, matches_size, matches, 0) == 0) {
+    match_count++;
+    /* printf("DEBUG: Found match #%d\n", match_count); */
+    /*printf("DEBUG: Match[0] (full): %.*s\n",
+           (int)(matches[0].rm_eo - matches[0].rm_so),
+           cursor + matches[0].rm_so);
+      printf("DEBUG: Match[1] (function): %.*s\n",
+           (int)(matches[1].rm_eo - matches[1].rm_so),
+           cursor + matches[1].rm_so);
+      printf("DEBUG: Match[2] (return type): %.*s\n",
+           (int)(matches[2].rm_eo - matches[2].rm_so),
+           cursor + matches[2].rm_so);
+      printf("DEBUG: Match[3] (first param): %.*s\n",
+           (int)(matches[3].rm_eo - matches[3].rm_so),
+           cursor + matches[3].rm_so); */
+    // Calculate remaining space in output buffer
+    size_t output_len = strlen(output);
+    size_t remaining_space = MAX_OUTPUT - output_len - 1;
+    /* printf("DEBUG: Output length: %zu, Remaining space: %zu\n",
+           output_len, remaining_space); */
+    // Extract and append function name (matches[1])
+    size_t match_len = (size_t)(matches[1].rm_eo - matches[1].rm_so);
+    /* printf("DEBUG: Function name length: %zu\n", match_len); */
+
+    if(match_len >= remaining_space) {
+      /* printf("D  EBUG: Buffer overflow for function name\n"); */
+      regfree(&regex);
+      free(output);
+      free(matches);
+      return NULL;
+    }
+
+    strncat(output, cursor + matches[1].rm_so, match_len);
+    remaining_space -= match_len;
+    /* printf("DEBUG: After function name, output: %s\n", output); */
+
+    // Append opening parenthesis
+    if(remaining_space < 1) {
+      /* printf("D  EBUG: Buffer overflow for opening parenthesis\n"); */
+      regfree(&regex);
+      free(output);
+      free(matches);
+      return NULL;
+    }
+
+    strncat(output, "(", 2); // 1+1, increased to prevent buffer overflow
+    remaining_space -= 1;
+    /* printf("DEBUG: After opening parenthesis, output: %s\n", output); */
+
+    // Process first parameter (matches[3])
+    if(remaining_space < 2) {
+      /* printf("DEBUG: Buffer overflow for first param start\n"); */
+      regfree(&regex);
+      free(output);
+      free(matches);
+      return NULL;
+    }
+
+    strncat(output, "`", 2);
+    remaining_space -= 2;
+    /* printf("DEBUG: After first param start, output: %s\n", output); */
+    match_len = (size_t)(matches[3].rm_eo - matches[3].rm_so);
+    /* printf("DEBUG: First param length: %zu\n", match_len); */
+
+    if(match_len >= remaining_space) {
+      /* printf("D  EBUG: Buffer overflow for first param\n"); */
+      regfree(&regex);
+      free(output);
+      free(matches);
+      return NULL;
+    }
+
+    if(remaining_space < 2) {
+      /* printf("D  EBUG: Buffer overflow for first backtick\n"); */
+      regfree(&regex);
+      free(output);
+      free(matches);
+      return NULL;
+    }
+
+    strncat(output, "<", 2);
+    remaining_space -= 2;
+    /* printf("DEBUG: After first backtick, output: %s\n", output); */
+    strncat(output, cursor + matches[3].rm_so, match_len);
+    remaining_space -= match_len;
+    /* printf("DEBUG: After first param value, output: %s\n", output); */
+
+    if(remaining_space < 2) {
+      /* printf("DEBUG: Buffer overflow for first param end\n"); */
+      regfree(&regex);
+      free(output);
+      free(matches);
+      return NULL;
+    }
+
+    strncat(output, ">`", 3); // 2+1, increased to prevent buffer overflow
+    remaining_space -= 2;
+    /* printf("DEBUG: After first param end, output: %s\n", output); */
+
+    // Handle additional parameters (matches[4] and matches[5])
+    if(matches[4].rm_so != -1) {
+      /* printf("DEBUG: Second parameter found\n"); */
+      if(remaining_space < 4) {
+        /* printf("DEBUG: Buffer overflow for second param start\n"); */
+        regfree(&regex);
+        free(output);
+        free(matches);
+        return NULL;
+      }
+
+      strncat(output, ", `<", 5); // 4+1, increased to prevent buffer overflow
+      remaining_space -= 4;
+      /* printf("DEBUG: After second param start, output: %s\n", output); */
+      match_len = (size_t)(matches[5].rm_eo - matches[5].rm_so);
+      /* printf("DEBUG: Second param length: %zu\n", match_len); */
+
+      if(match_len >= remaining_space) {
+        /* printf("D  EBUG: Buffer overflow for second param\n"); */
+        regfree(&regex);
+        free(output);
+        free(matches);
+        return NULL;
+      }
+
+      strncat(output, cursor + matches[5].rm_so, match_len);
+      remaining_space -= match_len;
+      /* printf("DEBUG: After second param value, output: %s\n", output); */
+
+      if(remaining_space < 2) {
+        /* printf("DEBUG: Buffer overflow for second param end\n"); */
+        regfree(&regex);
+        free(output);
+        free(matches);
+        return NULL;
+      }
+
+      strncat(output, ">`", 3); // 2+1, increased to prevent buffer overflow
+      remaining_space -= 2;
+      /* printf("DEBUG: After second param end, output: %s\n", outpu  t); */
+    }
+
+    // Append closing parenthesis and newline
+    if(remaining_space < 2) {
+      /* printf("DEBUG: Buffer overflow for closing parenthesis\n"); */
+      regfree(&regex);
+      free(output);
+      free(matches);
+      return NULL;
+    }
+
+    strncat(output, ")\n", 3); // 2+1, increased to prevent buffer overflow
+    /* printf("DEBUG: After closing parenthesis, output: %s\n", output); */
+    // Move cursor to next line
+    cursor += matches[0].rm_eo;
+    /* printf("DEBUG: Cursor moved to position: %zu\n",
+           (size_t)(cursor - input)); */
+
+    while(*cursor != '\0' && *cursor != '\n') {
+      cursor++;
+    }
+
+    if(*cursor == '\n') {
+      cursor++;
+    }
+
+    /* printf("DEBUG: Cursor after line skip: %zu\n",
+           (size_t)(cursor - input)); */
+  }
+
+  /* printf("DEBUG: Total matches found: %d\n", match_count);
+    printf("DEBUG: Final output: %s\n", output); */
+
+  // If no matches were found, return empty string
+  if(match_count == 0) {
+    /* printf("DEBUG: No completions found, returning empty string\n"); */
+    regfree(&regex);
+    char *result = strdup("");
+    free(output);
+    free(matches);
+    /* printf("DEBUG: Function complete, returning result\n "); */
+    return result;
+  }
+
+  regfree(&regex);
+  char *result = strdup(output);
+  free(output);
+  free(matches);
+  /* printf("DEBUG: Function complete, returning result\n"); */
+  return result;
+}
+
+/*
+  Function Description:
+    ccls indexing as a tracked background job. cc_index_run runs `ccls --index <root>` for the
+    project above a directory and follows its log output; every state change is written to a
+    status file inside .ccls-cache, so any process (Vim through libcall, the daemon, the
+    executable) can poll the job with cc_index_progress while it runs.
+
+    Status file (.ccls-cache/code_connector_index.status, one line, replaced atomically):
+      <idle|running|done|failed> <done> <total> <pid> <started> <finished> <full|incremental|unchanged>
+
+    Freshness manifest (.ccls-cache/code_connector_manifest): a fingerprint of .ccls,
+    compile_flags.txt and compile_commands.json, then "<size> <mtime> <nsec> <hash> <path>" for
+    every C/C++ source and header, written after each successful run. The next run re-hashes only
+    files whose size or mtime changed, skips ccls when no translation unit is affected, and
+    otherwise limits ccls to the changed translation units plus those including a changed header
+    (through --init index.initialWhitelist).
+
+  Maintenance Notes:
+    - total is the number of translation units this run indexes (hidden directories skipped) and
+      done counts the "parse" lines ccls logs, so the fraction is an estimate; done never exceeds total.
+    - A changed configuration, a missing manifest or more than CC_INDEX_MAX_SELECTED affected
+      translation units mean a full index. The .ccls-cache entries of a removed file are deleted by
+      plan_index_job, since shards only ever add to .ccls-cache, and the includers of a removed
+      header are re-indexed. Includes are resolved next to the including file
+      first, then by path suffix among the project headers; system headers are not tracked.
+    - A "running" job whose pid no longer exists is reported as failed (crashed or killed runner).
+    - The status file is written at most every CC_INDEX_REPORT_MS, plus at start and end.
+*/
+
+#define CC_INDEX_STATUS_FILE ".ccls-cache/code_connector_index.status"
+#define CC_INDEX_REPORT_MS 200   // Minimum interval between two progress reports
+#define CC_INDEX_SCAN_DEPTH 32   // Directory levels scanned when counting sources
+#define CC_INDEX_MANIFEST_FILE ".ccls-cache/code_connector_manifest"
+#define CC_INDEX_MANIFEST_HEADER "code_connector index manifest 1"
+#define CC_INDEX_MAX_SELECTED 256  // More changed translation units than this re-index the whole project
+#define CC_INDEX_MAX_JOBS 64       // Upper bound of the job limit (concurrent ccls processes and threads)
+
+static const char *const index_state_names[] = {"idle", "running", "done", "failed"};
+static const char *const index_mode_names[] = {"full", "incremental", "unchanged"};
+
+static int run_index_job(const char *directory, int jobs, cc_index_callback on_progress, void *user);
+static void index_on_line(const char *line, void *user);
+
+// Progress of the index job run by this process
+typedef struct {
+  char root[PATH_MAX];
+  pthread_mutex_t lock;         // Guards status and last_report while shards run
+  cc_index_status status;
+  struct timespec last_report;  // CLOCK_MONOTONIC
+  cc_index_callback on_progress;
+  void *user;
+} CCIndexJob;
+
+// A C/C++ file of the project as seen by the freshness manifest
+typedef struct {
+  char *path;          // Absolute
+  long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+  unsigned long hash;  // FNV-1a of the contents
+  int is_source;       // Translation unit (otherwise a header)
+  int dirty;           // Changed since the manifest, or includes a changed file
+  int *includes;       // Indexes of the project files it #includes, filled only when a header changed
+  int include_count;
+  int removed;         // A header gone since the manifest, listed only to find its includers
+} CCIndexFile;
+
+// Files of a project sorted by path
+typedef struct {
+  CCIndexFile *files;
+  int count;
+  int capacity;
+} CCIndexFileList;
+
+// Header of a file in a basename index, for resolving #include lines
+typedef struct {
+  const char *name;
+  int index;
+} CCIndexBasename;
+
+// Function to order index files by path
+static int compare_index_files(const void *a, const void *b) {
+  return strcmp(((const CCIndexFile *)a)->path, ((const CCIndexFile *)b)->path);
+}
+
+// Function to order basename index entries by name
+static int compare_index_basenames(const void *a, const void *b) {
+  return strcmp(((const CCIndexBasename *)a)->name, ((const CCIndexBasename *)b)->name);
+}
+
+// Function to find a file in a sorted list by path, NULL when absent
+static CCIndexFile *find_index_file(const CCIndexFileList *list, const char *path) {
+  CCIndexFile key;
+  key.path = (char *)path;
+  return list->count ? (CCIndexFile *)bsearch(&key, list->files, (size_t)list->count, sizeof(CCIndexFile),
+                                              compare_index_files) : NULL;
+}
+
+// Function to append an entry (path is copied); returns the entry or NULL on allocation failure
+static CCIndexFile *append_index_file(CCIndexFileList *list, const char *path) {
+  if(list->count == list->capacity) {
+    int capacity = list->capacity ? list->capacity * 2 : 256;
+    CCIndexFile *files = (CCIndexFile *)realloc(list->files, (size_t)capacity * sizeof(CCIndexFile));
+
+    if(!files) {
+      return NULL;
+    }
+
+    list->files = files;
+    list->capacity = capacity;
+  }
+
+  CCIndexFile *file = &list->files[list->count];
+  memset(file, 0, sizeof(*file));
+  file->path = strdup(path);
+
+  if(!file->path) {
+    return NULL;
+  }
+
+  list->count++;
+  return file;
+}
 
-  Why It’s Designed This Way (For Maintainers):
-    - Cache Optimization: Leverages completion_cache for speed, critical for UNIX (per _POSIX_C_SOURCE)
-      where `clang --version` is a costly system call—used in collect_code_completion_args.
-    - UNIX Process Model: Fork/pipe/exec pattern is standard for capturing command output, robust for
-      clang’s variable-length response.
-    - Memory Safety: Allocates output_buffer dynamically (MAX_OUTPUT), avoiding stack overflows; frees
-      it on all paths. Assumes output is caller-allocated (MAX_LINE_LENGTH).
-    - Parsing: Simple "Target: " search with strstr is efficient for clang’s known output format,
-      though fragile if clang changes (e.g., multi-line targets).
-    - Error Handling: Returns 1 on any failure (fork, parse), letting callers (e.g., collect_code_completion_args)
-      retry or fallback—minimal but effective.
+// Function to release the files of a list
+static void free_index_files(CCIndexFileList *list) {
+  for(int i = 0; i < list->count; i++) {
+    free(list->files[i].path);
+    free(list->files[i].includes);
+  }
 
-  Maintenance Notes:
-    - Cache Sync: Relies on completion_cache being valid—test with clear_cache/update_cache to ensure
-      cpu_arch stays current.
-    - Buffer Size: MAX_OUTPUT must fit clang’s full output (test with verbose clang); MAX_LINE_LENGTH
-      must fit target (rarely exceeds 32 chars, but verify).
-    - Error Logging: perror on fork failure helps, but consider log_message for parsing failures
-      (e.g., "Target: not found") to debug clang output changes.
-    - Extensibility: To grab more clang info (e.g., version), expand parsing—current focus is narrow.
-    - Robustness: No timeout for clang—hung child could stall; add waitpid timeout if this occurs.
-*/
+  free(list->files);
+  memset(list, 0, sizeof(*list));
+}
 
-// Function to get clang target. Filters output from the command `clang --version`. Takes the CPU architecture from the line `Target:`.
-int get_clang_target(char *output) {
-  // Check cache first
-  if(completion_cache.is_valid && completion_cache.cpu_arch[0] != '\0') {
-    strncpy(output, completion_cache.cpu_arch, MAX_LINE_LENGTH - 1);
-    output[MAX_LINE_LENGTH - 1] = '\0';
+// Function to tell what a file name is to the indexer: 1 translation unit, 2 header, 0 neither
+// classify_source_file treats unknown extensions as C, so *.c is matched explicitly
+static int index_file_kind(const char *name) {
+  const char *extension = strrchr(name, '.');
+
+  if(!extension) {
     return 0;
   }
 
-  char *target_str = "Target: ";
-  char *output_buffer = (char *)malloc(MAX_OUTPUT * sizeof(char));
-  // Execute the command and capture the output
-  int pipe_fd[2];
-  pipe(pipe_fd);
-  pid_t pid = fork();
+  if(strcmp(extension, ".c") == 0) {
+    return 1;
+  }
 
-  if(pid == 0) {
-    dup2(pipe_fd[1], STDOUT_FILENO);
-    close(pipe_fd[0]);
-    close(pipe_fd[1]);
-    execlp("clang", "clang", "--version", (char *)NULL);
-    exit(0);
+  CCSourceKind kind = classify_source_file(name);
+  return kind == CC_SOURCE_CPP ? 1 : (kind == CC_SOURCE_C_HEADER || kind == CC_SOURCE_CPP_HEADER) ? 2 : 0;
+}
+
+// Function to collect the C/C++ sources and headers below dir, skipping hidden directories
+// Returns 0 on success, 1 on allocation failure
+static int collect_index_files(const char *dir, int depth, CCIndexFileList *list) {
+  DIR *stream = opendir(dir);
+  struct dirent *entry;
+  int failed = 0;
+
+  if(!stream) {
+    return 0;
   }
 
-  else if(pid > 0) {
-    close(pipe_fd[1]);
-    // Read the output from the child process
-    int bytes_read = (int)read(pipe_fd[0], output_buffer, MAX_OUTPUT - 1);
-    output_buffer[bytes_read] = '\0';
-    close(pipe_fd[0]);
-    wait(NULL);
-    // Find the line containing "Target: "
-    char *target_line = strstr(output_buffer, target_str);
-
-    if(target_line) {
-      char *target_value = target_line + strlen(target_str);
-      int target_length = (int)strcspn(target_value, "\n");
-      // Copy the target value to the output parameter
-      strncpy(output, target_value, (size_t)target_length);
-      output[target_length] = '\0';
-      // Cache the CPU architecture
-      strncpy(completion_cache.cpu_arch, output, MAX_LINE_LENGTH - 1);
-      completion_cache.cpu_arch[MAX_LINE_LENGTH - 1] = '\0';
-      // Free the buffer
-      free(output_buffer);
-      return 0;
+  while(!failed && (entry = readdir(stream)) != NULL) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if(entry->d_name[0] == '.') {
+      continue;
     }
 
-    else {
-      free(output_buffer);
-      return 1;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+    if(lstat(path, &st) != 0) {
+      continue;
+    }
+
+    if(S_ISDIR(st.st_mode) && depth < CC_INDEX_SCAN_DEPTH) {
+      failed = collect_index_files(path, depth + 1, list);
+    }
+
+    else if(S_ISREG(st.st_mode) && index_file_kind(entry->d_name) != 0) {
+      CCIndexFile *file = append_index_file(list, path);
+
+      if(!file) {
+        failed = 1;
+        break;
+      }
+
+      file->size = (long long)st.st_size;
+      file->mtime_sec = (long long)st.st_mtim.tv_sec;
+      file->mtime_nsec = st.st_mtim.tv_nsec;
+      file->is_source = index_file_kind(entry->d_name) == 1;
     }
   }
 
-  else {
-    perror("fork");
-    free(output_buffer);
+  closedir(stream);
+  return failed;
+}
+
+// Function to hash the contents of a file (FNV-1a, continuing from hash)
+// Returns 0 and updates *hash on success, 1 when the file cannot be read
+static int hash_file(const char *path, unsigned long *hash) {
+  unsigned char buffer[65536];
+  int fd = open(path, O_RDONLY);
+  ssize_t got;
+
+  if(fd < 0) {
     return 1;
   }
-}
 
-/*
-  Function Description:
-    Constructs a clang command string for code completion at a specific file position, using cached
-    or freshly gathered include paths and CPU architecture. This function prepares arguments for
-    clang to suggest completions (e.g., function names) at a given line and column in a source file.
+  while((got = read(fd, buffer, sizeof(buffer))) > 0) {
+    for(ssize_t i = 0; i < got; i++) {
+      *hash ^= buffer[i];
+      *hash *= 1099511628211UL;
+    }
+  }
 
-  Parameters:
-    - filename (const char *): Path to the source file (e.g., "/project/main.c"), not modified.
-    - line (int): Line number in the file where completion is requested (1-based).
-    - column (int): Column number in the file where completion is requested (1-based).
+  close(fd);
+  return got < 0;
+}
 
-  Return Value:
-    - char *: A dynamically allocated string containing the clang command (e.g., "clang -target x86_64 ..."),
-      or NULL on failure. Caller must free this string.
+// Function to fingerprint the project configuration (.ccls, compile_flags.txt, compile_commands.json)
+static unsigned long index_config_hash(const char *root) {
+  const char *names[] = {".ccls", "compile_flags.txt"};
+  char path[PATH_MAX + 32];
+  unsigned long hash = CC_HASH_SEED;
 
-  Detailed Steps:
-    1. Allocate Temporary Buffers:
-       - Calculates sizes based on filename length, allocates multiple char arrays and pointers for paths,
-         targets, and lines. Returns NULL if any allocation fails.
-    2. Validate File:
-       - Checks if filename exists with access; if not, logs and returns NULL.
-       - Resolves absolute path with realpath; if it fails, logs and returns NULL.
-    3. Initialize Cache:
-       - If not initialized (static flag), calls init_cache to set up completion_cache.
-    4. Use Cached Data (If Valid):
-       - Checks is_cache_valid with global_buffer_project_dir; if valid and data exists, builds command
-         with cached cpu_arch and header_paths, frees temps, returns command.
-    5. Find Config Files (If Cache Miss):
-       - Calls findFiles on file’s directory to locate .ccls and compile_flags.txt; if fails, logs and returns NULL.
-       - Stores result in global_buffer_project_dir.
-    6. Get CPU Target:
-       - Calls get_clang_target; if fails, logs and returns NULL. Stores in global_buffer_cpu_arc.
-    7. Build Config Paths:
-       - Constructs .ccls and compile_flags.txt paths from global_buffer_project_dir.
-    8. Process Include Paths:
-       - Initializes lines arrays, calls store_lines to read and sort paths, copies to global_buffer_header_paths.
-    9. Update Cache:
-       - Updates completion_cache with new project_dir, header_paths, and cpu_arch.
-    10. Build Command:
-        - Allocates command string, formats with clang options, target, include paths, and completion args.
-        - Frees temporary buffers (not lines[i], as they’re cached), returns command.
+  for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    snprintf(path, sizeof(path), "%s/%s", root, names[i]);
+    hash = hash_string(hash, names[i]);
+    hash_file(path, &hash);
+  }
 
-  Flow and Logic:
-    - Steps 1-2: Setup and validate inputs.
-    - Step 3-4: Try cache for speed; if good, build and return.
-    - Steps 5-9: If cache misses, gather fresh data (configs, target, paths), cache it.
-    - Step 10: Construct final command from all data.
-    - Why this order? Validation first, cache for efficiency, fallback to full process, then assemble.
+  if(find_compile_database(root, path, sizeof(path)) == 0) {
+    hash = hash_string(hash, path);
+    hash_file(path, &hash);
+  }
 
-  How It Works (For Novices):
-    - Imagine you’re asking clang for help finishing a sentence in your code (at line:column in filename),
-      and you need to give it a big instruction note (the command).
-    - collect_code_completion_args is like writing this note:
-      - Step 1: Get scratch paper (allocate buffers) to work with.
-      - Step 2: Check your codebook (filename) exists and get its full name (realpath).
-      - Step 3: Check your memo box (cache)—if it’s empty, set it up (init_cache).
-      - Step 4: If the memo has old notes (cache valid), use them to write "clang -target x86_64 ..." fast.
-      - Steps 5-6: If not, hunt for guidebooks (.ccls, compile_flags.txt) and ask clang its type (target).
-      - Steps 7-8: Write down where guidebooks are and copy their directions (include paths).
-      - Step 9: Save everything in the memo box for next time.
-      - Step 10: Write the full note (e.g., "clang -target x86_64 -I/project ... -code-completion-at=main.c:5:3").
-    - It’s like gathering tools and instructions to ask clang for a coding tip, reusing notes when possible!
+  return hash;
+}
 
-  Why It Works (For Novices):
-    - Speed: Checks the memo (cache) first to avoid slow work.
-    - Safety: Makes sure the file’s real and everything’s ready before asking clang.
-    - Smartness: Saves answers (caches) so next time’s faster.
+// Function to load the freshness manifest of a project into list (sorted) and *config
+// Returns 0 when a manifest was read, 1 when there is none or it is unreadable
+static int load_index_manifest(const char *root, CCIndexFileList *list, unsigned long *config) {
+  char path[PATH_MAX + 64];
+  char line[PATH_MAX + 128];
+  snprintf(path, sizeof(path), "%s/%s", root, CC_INDEX_MANIFEST_FILE);
+  FILE *file = fopen(path, "r");
 
-  Why It’s Designed This Way (For Maintainers):
-    - Optimization: Cache-first approach (is_cache_valid, get_cached_include_paths) speeds up repeated
-      calls (e.g., in execute_code_completion_command), vital for UNIX (per _POSIX_C_SOURCE) where
-      file ops and clang calls are slow.
-    - Modularity: Builds on findFiles, get_clang_target, store_lines, and cache functions, reusing logic
-      for a complex task—clang code completion.
-    - Memory: Allocates command dynamically, ensuring flexibility; uses global buffers (e.g.,
-      global_buffer_project_dir) for persistence, but temp buffers are freed to avoid leaks.
-    - Robustness: Extensive error checks (access, realpath, findFiles) with NULL returns and logs
-      (log_message) ensure failures don’t crash—caller handles NULL.
-    - Clang Integration: Command format (-target, -fsyntax-only, -code-completion-at) matches clang’s
-      completion API, tailored for Vim integration via processCompletionDataFromString.
+  if(!file) {
+    return 1;
+  }
 
-  Maintenance Notes:
-    - Memory Leaks: Frees temps on all paths, but lines[i] persists in cache—caller must not free command
-      prematurely. Test with valgrind for leaks.
-    - Buffer Sizes: max_path_len (+256) and command_length (512 + variables) are estimates—test with
-      long filenames/paths to avoid truncation.
-    - Error Logging: Logs failures (e.g., “File does not exist”), but could detail why (e.g., errno) for
-      better tracing.
-    - Cache Sync: Relies on global buffers matching cache—test clear_cache/update_cache interactions.
-    - Extensibility: Add more clang flags (e.g., -D) by expanding store_lines or command format if needed.
-*/
+  int valid = fgets(line, sizeof(line), file) && strcmp(line, CC_INDEX_MANIFEST_HEADER "\n") == 0 &&
+              fgets(line, sizeof(line), file) && sscanf(line, "config %lx", config) == 1;
 
-// Function to collect filename, line number, and column number
-char *collect_code_completion_args(const char *filename, int line, int column) {
-  // Calculate initial sizes based on filename length
-  size_t filename_len = strlen(filename);
-  size_t max_path_len = filename_len + 256;  // Extra space for paths and null terminator
-  // Dynamically allocate memory for all fixed-size arrays
-  char *found_at = (char *)malloc(max_path_len * sizeof(char));
-  char *target_output = (char *)malloc(max_path_len * sizeof(char));
-  char **lines = (char **)malloc(MAX_LINES * sizeof(char *));
-  char **sorted_lines = (char **)malloc(MAX_LINES * sizeof(char *));
-  char *abs_filename = (char *)malloc(max_path_len * sizeof(char));
-  char *ccls_path = (char *)malloc(max_path_len * sizeof(char));
-  char *compile_flags_path = (char *)malloc(max_path_len * sizeof(char));
-  char cpu_arch[MAX_LINE_LENGTH];
+  while(valid && fgets(line, sizeof(line), file)) {
+    long long size, mtime_sec;
+    long mtime_nsec;
+    unsigned long hash;
+    int offset = 0;
+    line[strcspn(line, "\n")] = '\0';
 
-  // Check for allocation failures
-  if(!found_at || !target_output || !lines || !sorted_lines || !abs_filename || !ccls_path || !compile_flags_path) {
-    // Handle allocation failure
-    free(found_at);
-    free(target_output);
-    free(lines);
-    free(sorted_lines);
-    free(abs_filename);
-    free(ccls_path);
-    free(compile_flags_path);
-    return NULL;
-  }
+    if(sscanf(line, "%lld %lld %ld %lx %n", &size, &mtime_sec, &mtime_nsec, &hash, &offset) != 4 ||
+       line[offset] != '/') {
+      valid = 0;
+      break;
+    }
 
-  int count = 0;
+    CCIndexFile *entry = append_index_file(list, line + offset);
 
-  // Check if the file exists
-  if(access(filename, F_OK) != 0) {
-    perror("File does not exist");
-    log_message("fn collect_code_completion_args: File does not exist\n");
-    // Free all allocated memory
-    free(found_at);
-    free(target_output);
-    free(lines);
-    free(sorted_lines);
-    free(abs_filename);
-    free(ccls_path);
-    free(compile_flags_path);
-    return NULL;
-  }
+    if(!entry) {
+      valid = 0;
+      break;
+    }
 
-  // Get the absolute path of the filename and its directory
-  if(realpath(filename, abs_filename) == NULL) {
-    perror("realpath");
-    log_message("fn collect_code_completion_args: Error getting absolute path\n");
-    // Free all allocated memory
-    free(found_at);
-    free(target_output);
-    free(lines);
-    free(sorted_lines);
-    free(abs_filename);
-    free(ccls_path);
-    free(compile_flags_path);
-    return NULL;
+    entry->size = size;
+    entry->mtime_sec = mtime_sec;
+    entry->mtime_nsec = mtime_nsec;
+    entry->hash = hash;
   }
 
-  char *dir_path = dirname(abs_filename);
-  // Initialize cache if not already done
-  static int cache_initialized = 0;
+  fclose(file);
 
-  if(!cache_initialized) {
-    init_cache();
-    cache_initialized = 1;
+  if(!valid) {
+    free_index_files(list);
+    return 1;
   }
 
-  // Find the directory where .ccls and compile_flags.txt are located
-  // Check if we can use cached values
-  if(is_cache_valid(global_buffer_project_dir) && global_buffer_project_dir[0] != '\0') {
-    char **cached_paths = get_cached_include_paths(&count);
+  qsort(list->files, (size_t)list->count, sizeof(CCIndexFile), compare_index_files);
+  return 0;
+}
 
-    if(cached_paths && count > 0 && global_buffer_cpu_arc[0] != '\0') {
-      size_t command_length = 512 + strlen(global_buffer_cpu_arc) + strlen(filename) * 2 + count * MAX_PATH_LENGTH;
-      char *command = (char *)malloc(command_length);
+// Function to replace the freshness manifest of a project
+static void save_index_manifest(const char *root, const CCIndexFileList *list, unsigned long config) {
+  char path[PATH_MAX + 64];
+  char temporary[PATH_MAX + 96];
+  snprintf(path, sizeof(path), "%s/%s", root, CC_INDEX_MANIFEST_FILE);
+  snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid());
+  FILE *file = fopen(temporary, "w");
 
-      if(!command) {
-        free(found_at);
-        free(target_output);
-        free(lines);
-        free(sorted_lines);
-        free(abs_filename);
-        free(ccls_path);
-        free(compile_flags_path);
-        return NULL;
-      }
+  if(!file) {
+    return;
+  }
 
-      int offset = snprintf(command, command_length,
-                            "clang -target %s -fsyntax-only -Xclang -code-completion-macros",
-                            global_buffer_cpu_arc);
+  fprintf(file, "%s\nconfig %lx\n", CC_INDEX_MANIFEST_HEADER, config);
 
-      for(int i = 0; i < count; i++) {
-        offset += snprintf(command + offset, command_length - offset, " %s", cached_paths[i]);
-      }
+  for(int i = 0; i < list->count; i++) {
+    const CCIndexFile *entry = &list->files[i];
 
-      snprintf(command + offset, command_length - offset,
-               " -Xclang -code-completion-at=%s:%d:%d %s", filename, line, column, filename);
-      free(found_at);
-      free(target_output);
-      free(lines);
-      free(sorted_lines);
-      free(abs_filename);
-      free(ccls_path);
-      free(compile_flags_path);
-      return command;
+    if(!entry->removed) {
+      fprintf(file, "%lld %lld %ld %lx %s\n", entry->size, entry->mtime_sec, entry->mtime_nsec, entry->hash, entry->path);
     }
   }
 
-  // Cache miss - recalculate
-  if(findFiles(dir_path, found_at) != 0) {
-    printf("Error finding .ccls and compile_flags.txt\n");
-    log_message("fn collect_code_completion_args: Error finding .ccls and compile_flags.txt\n");
-    // Free all allocated memory
-    free(found_at);
-    free(target_output);
-    free(lines);
-    free(sorted_lines);
-    free(abs_filename);
-    free(ccls_path);
-    free(compile_flags_path);
-    return NULL;
+  if(fclose(file) != 0 || rename(temporary, path) != 0) {
+    unlink(temporary);
   }
+}
 
-  // copy the value of found_at using strndup to store it into a global variable global_buffer_project_dir
-  strncpy(global_buffer_project_dir, found_at, PATH_MAX - 1);
-  global_buffer_project_dir[PATH_MAX - 1] = '\0'; // Ensure null termination
-  // print global_buffer_project_dir
-  // printf("DEBUG: fn collect_code_completion_args: global_buffer_project_dir: %s\n", global_buffer_project_dir);
-  /*
-    GLOBAL BUFFER PART HERE
-    Remember to use the global_buffer_project_dir
-    as a substitute for found_at the next time this function is called
-  */
+// Function to resolve the #include lines of a file to project files: "x.h" next to the file first,
+// otherwise any project header whose path ends with /x.h. Returns 0 on success (an unreadable file has
+// no includes), 1 on allocation failure
+static int scan_index_includes(CCIndexFileList *list, int index, const CCIndexBasename *basenames, int basename_count) {
+  CCIndexFile *file = &list->files[index];
+  FILE *stream = fopen(file->path, "r");
+  char line[MAX_LINE_LENGTH];
 
-  // Get the clang target
-  if(get_clang_target(target_output) != 0) {
-    printf("Error getting clang target\n");
-    log_message("fn collect_code_completion_args: Error getting clang target\n");
-    // Free all allocated memory
-    free(found_at);
-    free(target_output);
-    free(lines);
-    free(sorted_lines);
-    free(abs_filename);
-    free(ccls_path);
-    free(compile_flags_path);
-    return NULL;
+  if(!stream) {
+    return 0;
   }
 
-  // copy the value of target_output using strndup to store it into a global variable global_buffer_cpu_arc
-  strncpy(global_buffer_cpu_arc, target_output, MAX_OUTPUT - 1);
-  global_buffer_cpu_arc[MAX_OUTPUT - 1] = '\0'; // Ensure null termination
-  // print global_buffer_cpu_arc
-  // printf("DEBUG: fn collect_code_completion_args: global_buffer_cpu_arc: %s\n", global_buffer_cpu_arc);
-  /*
-    GLOBAL BUFFER PART HERE
-    Remember to use the global_buffer_cpu_arc
-    as a substitute for target_output the next time this function is called
-  */
-  // Construct full paths based on global_buffer_project_dir
-  snprintf(ccls_path, max_path_len, "%s/.ccls", global_buffer_project_dir);
-  snprintf(compile_flags_path, max_path_len, "%s/compile_flags.txt", global_buffer_project_dir);
-
-  // Initialize lines array
-  for(int i = 0; i < MAX_LINES; i++) {
-    lines[i] = NULL;
-    sorted_lines[i] = NULL;
-  }
-
-  // Read and process the include paths
-  store_lines(compile_flags_path, ccls_path, lines, sorted_lines, &count);
-  //
-  // Copy the value of sorted_lines into global_buffer_header_paths through a for loop
-  static size_t num_lines = 0; // Initialize the counter. It counts the number of lines copied.
-  num_lines = 0;
+  while(fgets(line, sizeof(line), stream)) {
+    char *cursor = line + strspn(line, " \t");
 
-  for(size_t i = 0; i < (size_t)count && num_lines < MAX_LINES; i++) {
-    strncpy(global_buffer_header_paths[num_lines], sorted_lines[i], MAX_PATH_LENGTH - 1);
-    global_buffer_header_paths[num_lines][MAX_PATH_LENGTH - 1] = '\0'; // Null-terminate
-    num_lines++;
-  }
+    if(*cursor != '#') {
+      continue;
+    }
+
+    cursor += 1 + strspn(cursor + 1, " \t");
+
+    if(strncmp(cursor, "include", 7) != 0) {
+      continue;
+    }
 
-  // print global_buffer_header_paths
-  //for(int i = 0; i < (int)num_lines; i++) {
-  //printf("DEBUG: fn collect_code_completion_args: global_buffer_header_paths: %s\n", global_buffer_header_paths[i]);
-  //}
-  /*
-    GLOBAL BUFFER PART HERE
+    cursor += 7 + strspn(cursor + 7, " \t");
+    char close = *cursor == '"' ? '"' : *cursor == '<' ? '>' : '\0';
+    char *end = close ? strchr(cursor + 1, close) : NULL;
 
-    Remember to use the global_buffer_header_paths
-    as a substitute for sorted_lines the next time this function is called.
-    If the function is designed to work with char **,
-    you may need to modify how you store and pass the data.
-    You can create a temporary array of pointers and populate it
-    with the addresses of the strings in your two-dimensional array.
+    if(!end || end == cursor + 1) {
+      continue;
+    }
 
-    Use it as follows:
+    *end = '\0';
+    const char *spec = cursor + 1;
+    int target = -1;
 
-    char *temp[MAX_LINES];
+    if(close == '"') {
+      char candidate[PATH_MAX * 2];
+      char resolved[PATH_MAX];
+      const char *slash = strrchr(file->path, '/');
+      snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)(slash - file->path), file->path, spec);
 
-    for(size_t i = 0; i < num_lines; i++) {
-        temp[i] = global_buffer_header_paths[i];
+      if(realpath(candidate, resolved)) {
+        CCIndexFile *found = find_index_file(list, resolved);
+        target = found ? (int)(found - list->files) : -1;
+      }
     }
 
-    // Then, pass temp to the desired function.
-  */
-  // Update cache
-  char *temp_paths[MAX_LINES];
+    if(target < 0) {
+      const char *name = strrchr(spec, '/') ? strrchr(spec, '/') + 1 : spec;
+      CCIndexBasename key = {name, 0};
+      const CCIndexBasename *match = (const CCIndexBasename *)bsearch(&key, basenames, (size_t)basename_count,
+                                     sizeof(CCIndexBasename), compare_index_basenames);
 
-  for(size_t i = 0; i < num_lines; i++) {
-    temp_paths[i] = global_buffer_header_paths[i];
-  }
+      while(match && match > basenames && strcmp((match - 1)->name, name) == 0) {
+        match--;
+      }
 
-  update_cache(global_buffer_project_dir, temp_paths, (int)num_lines, global_buffer_cpu_arc);
-  // Build command string
-  size_t command_length = 512 + strlen(global_buffer_cpu_arc) + strlen(filename) * 2 + num_lines * MAX_PATH_LENGTH;
-  char *command = (char *)malloc(command_length);
+      for(; match && match < basenames + basename_count && strcmp(match->name, name) == 0; match++) {
+        const char *path = list->files[match->index].path;
+        size_t path_length = strlen(path);
+        size_t spec_length = strlen(spec);
 
-  if(!command) {
-    log_message("In fn collect_code_completion_args: Failed to allocate memory for the result.\n");
-    // Free all allocated memory
-    free(found_at);
-    free(target_output);
-    free(lines);
-    free(sorted_lines);
-    free(abs_filename);
-    free(ccls_path);
-    free(compile_flags_path);
-    return NULL;
+        if(path_length > spec_length && path[path_length - spec_length - 1] == '/' &&
+           strcmp(path + path_length - spec_length, spec) == 0) {
+          target = match->index;
+          break;
+        }
+      }
+    }
+
+    if(target >= 0 && target != index) {
+      int *includes = (int *)realloc(file->includes, (size_t)(file->include_count + 1) * sizeof(int));
+
+      if(!includes) {
+        fclose(stream);
+        return 1;
+      }
+
+      file->includes = includes;
+      file->includes[file->include_count++] = target;
+    }
   }
 
-  // Construct the clang command
-  int offset = snprintf(command, command_length,
-                        "clang -target %s -fsyntax-only -Xclang -code-completion-macros",
-                        global_buffer_cpu_arc);
+  fclose(stream);
+  return 0;
+}
+
+// Function to mark every file that includes a dirty file (directly or through other headers) as dirty
+// Returns 0 on success, 1 on allocation failure, when the dependents are unknown
+static int mark_index_dependents(CCIndexFileList *list) {
+  CCIndexBasename *basenames = (CCIndexBasename *)malloc((size_t)(list->count + 1) * sizeof(CCIndexBasename));
+  int basename_count = 0;
 
-  for(size_t i = 0; i < num_lines; i++) {
-    offset += snprintf(command + offset, command_length - offset, " %s", global_buffer_header_paths[i]);
+  if(!basenames) {
+    log_message("fn mark_index_dependents: Failed to allocate the header index\n");
+    return 1;
   }
 
-  snprintf(command + offset, command_length - offset,
-           " -Xclang -code-completion-at=%s:%d:%d %s", filename, line, column, filename);
+  for(int i = 0; i < list->count; i++) {
+    if(!list->files[i].is_source) {
+      basenames[basename_count].name = strrchr(list->files[i].path, '/') + 1;
+      basenames[basename_count++].index = i;
+    }
+  }
 
-  // Free allocated memory
-  for(int i = 0; i < count; i++) {
-    free(lines[i]);
+  qsort(basenames, (size_t)basename_count, sizeof(CCIndexBasename), compare_index_basenames);
+
+  for(int i = 0; i < list->count; i++) {
+    if(scan_index_includes(list, i, basenames, basename_count) != 0) {
+      log_message("fn mark_index_dependents: Failed to record the includes\n");
+      free(basenames);
+      return 1;
+    }
   }
 
-  // Free all temporary allocated memory (except command, which is returned)
-  free(found_at);
-  free(target_output);
-  free(lines);
-  free(sorted_lines);
-  free(abs_filename);
-  free(ccls_path);
-  free(compile_flags_path);
-  return command;
-}
+  free(basenames);
 
-/*
-  Function Description:
-    Executes a clang code completion command for a given file position and captures the output as a string.
-    This function builds the command using collect_code_completion_args, runs it via popen, and returns
-    the completion suggestions (e.g., function names) for processing (e.g., by Vim).
+  for(int changed = 1; changed;) {
+    changed = 0;
 
-  Parameters:
-    - filename (const char *): Path to the source file (e.g., "/project/main.c"), not modified.
-    - line (int): Line number in the file for completion (1-based).
-    - column (int): Column number in the file for completion (1-based).
+    for(int i = 0; i < list->count; i++) {
+      CCIndexFile *file = &list->files[i];
 
-  Return Value:
-    - char *: A dynamically allocated string containing clang’s completion output, or NULL on failure.
-      Caller must free this string.
+      for(int j = 0; !file->dirty && j < file->include_count; j++) {
+        if(list->files[file->includes[j]].dirty) {
+          file->dirty = 1;
+          changed = 1;
+        }
+      }
+    }
+  }
 
-  Detailed Steps:
-    1. Build Command:
-       - Calls collect_code_completion_args with filename, line, and column to get the clang command.
-       - If it returns NULL (e.g., file missing), logs and returns NULL.
-    2. Open Pipe:
-       - Uses popen to run the command in read mode ("r"), capturing stdout.
-       - If popen fails (e.g., fork error), logs, frees command, and returns NULL.
-    3. Read Output:
-       - Allocates a buffer (output) of MAX_OUTPUT size.
-       - Reads from pipe into buffer with fread (up to MAX_OUTPUT - 1 bytes).
-       - Null-terminates the buffer.
-    4. Clean Up:
-       - Closes pipe with pclose; frees command string.
-       - If fread read nothing (size == 0), frees output and returns NULL.
-       - Otherwise, returns output.
+  return 0;
+}
 
-  Flow and Logic:
-    - Step 1: Get the clang command ready.
-    - Step 2: Start clang and listen for its answer.
-    - Step 3: Grab what clang says into a note.
-    - Step 4: Finish up, check the note’s not empty, and hand it over.
-    - Why this order? Build first, execute next, read then clean—standard pipe/command pattern.
+// Function to delete what ccls keeps in .ccls-cache for a project file: the copy of its text and
+// its index next to it (.blob, or .json with the json cache format)
+static void remove_index_cache_entries(const char *root, const char *path) {
+  static const char *const suffixes[] = {"", ".blob", ".json"};
+  char name[PATH_MAX * 2];
+  size_t root_length = strlen(root);
 
-  How It Works (For Novices):
-    - Imagine you’re asking clang for a list of word suggestions (completions) for your code at a
-      specific spot (filename:line:column), and you want that list as a note (the output string).
-    - execute_code_completion_command is like this:
-      - Step 1: Write a question for clang (e.g., "clang -code-completion-at=main.c:5:3") using
-        collect_code_completion_args. If you can’t write it, give up.
-      - Step 2: Shout the question through a tube (popen) so clang can answer back.
-      - Step 3: Get a blank note (allocate output), listen through the tube (fread), and write down
-        clang’s suggestions (e.g., "printf, scanf").
-      - Step 4: Close the tube (pclose), toss the question paper (free command), and if the note’s
-        empty, toss it too—otherwise, give it to you.
-    - It’s like asking a smart friend for help and taking notes on what they say!
+  if(strncmp(path, root, root_length) != 0 || path[root_length] != '/') {
+    return;
+  }
 
-  Why It Works (For Novices):
-    - Ease: Builds the question for you, so you don’t have to.
-    - Safety: Checks every step (command, pipe, read) to avoid trouble.
-    - Usefulness: Gives you clang’s ideas in a handy note you can read later.
+  int length = snprintf(name, sizeof(name), "%s/.ccls-cache/", root);
+  const char *c = root;
 
-  Why It’s Designed This Way (For Maintainers):
-    - Integration: Ties into collect_code_completion_args for modularity, feeding clang’s completion
-      output to Vim via processCompletionDataFromString—core to UNIX tooling (per _POSIX_C_SOURCE).
-    - Pipe Usage: popen simplifies running clang and capturing stdout, standard for UNIX command
-      execution, though it’s less flexible than fork/exec.
-    - Memory: Allocates output dynamically (MAX_OUTPUT), avoiding stack issues; command is freed
-      early, but output persists for caller—clean ownership.
-    - Error Handling: NULL returns on failure (command build, popen, empty output) with logs
-      (log_message) allow tracing—caller (e.g., Vim plugin) decides next steps.
-    - Simplicity: Minimal parsing—raw output is returned, leaving interpretation to processCompletionDataFromString.
+  // ccls names them <root>/<relative path>, each with "/" replaced by "@"
+  for(int part = 0; part < 2; part++, c = path + root_length + 1) {
+    for(; *c && length < (int)sizeof(name) - 8; c++) {
+      name[length++] = *c == '/' ? '@' : *c;
+    }
 
-  Maintenance Notes:
-    - Buffer Size: MAX_OUTPUT must fit clang’s completion output—test with large suggestion lists
-      (e.g., big structs) to avoid truncation.
-    - Error Detail: Logs "popen failed" but not why (e.g., errno)—add strerror for clarity if frequent.
-    - Memory Leaks: Frees command and output on all paths—verify with valgrind, especially on failure.
-    - Robustness: popen hangs if clang stalls—consider a timeout (not trivial with popen) or switch
-      to fork/pipe for control.
-    - Extensibility: To filter output here (e.g., strip errors), parse before returning—current raw
-      approach is simpler but less refined.
-*/
+    if(*c) {
+      return;
+    }
 
-// Function to execute the code completion command: `clang -fsyntax-only -Xclang -code-completion-macros -Xclang -code-completion-at=file.c:line:column file.c`
-char *execute_code_completion_command(const char *filename, int line, int column) {
-  /* printf("DEBUG: Starting code completion for file %s at line %d, column %d\n",
-         filename, line, column); */
-  char *command = collect_code_completion_args(filename, line, column);
+    name[length++] = '/';
+  }
 
-  if(!command) {
-    /* printf("DEBUG: Failed to collect code completion arguments\n"); */
-    return NULL;
+  length--;
+
+  for(size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    snprintf(name + length, sizeof(name) - (size_t)length, "%s", suffixes[i]);
+
+    if(unlink(name) != 0 && errno != ENOENT) {
+      log_message("fn remove_index_cache_entries: Failed to delete a cache entry of a removed file\n");
+    }
   }
+}
 
-  /* printf("DEBUG: Command to execute: %s\n", command); */
-  char *output = (char *)malloc(MAX_OUTPUT * sizeof(char));
+// Function to compare the project files with the manifest and mark what has to be re-indexed
+// Hashes are computed only for files whose size or mtime changed; a touched but unmodified file stays clean
+// Returns the number of translation units to re-index, or -1 when the whole project has to be indexed
+static int plan_index_job(const char *root, CCIndexFileList *files, unsigned long config) {
+  CCIndexFileList manifest = {NULL, 0, 0};
+  unsigned long manifest_config = 0;
+  int full = load_index_manifest(root, &manifest, &manifest_config) != 0 || manifest_config != config;
+  int dirty_headers = 0;
+  int dirty_sources = 0;
+  int present = 0;
+
+  for(int i = 0; i < files->count; i++) {
+    CCIndexFile *file = &files->files[i];
+    CCIndexFile *known = full ? NULL : find_index_file(&manifest, file->path);
+    present += known != NULL;
+
+    if(known && known->size == file->size && known->mtime_sec == file->mtime_sec &&
+       known->mtime_nsec == file->mtime_nsec) {
+      file->hash = known->hash;
+      continue;
+    }
 
-  if(!output) {
-    /* printf("DEBUG: Failed to allocate output buffer\n"); */
-    free(command);
-    return NULL;
+    file->hash = CC_HASH_SEED;
+    hash_file(file->path, &file->hash);
+    file->dirty = !known || known->hash != file->hash;
+    dirty_headers += file->dirty && !file->is_source;
   }
 
-  output[0] = '\0';
-  /* printf("DEBUG: Output buffer allocated, size: %d\n", MAX_OUTPUT); */
-  FILE *fp = popen(command, "r");
+  // A removed file: its entries in .ccls-cache go, and a removed header stays listed (dirty) so
+  // the files that included it are re-indexed
+  for(int i = 0; present < manifest.count && i < manifest.count; i++) {
+    const char *path = manifest.files[i].path;
+    manifest.files[i].removed = !find_index_file(files, path);
 
-  if(fp == NULL) {
-    perror("DEBUG: popen failed");
-    free(command);
-    free(output);
-    return NULL;
+    if(manifest.files[i].removed) {
+      remove_index_cache_entries(root, path);
+    }
   }
 
-  /* printf("DEBUG: Command executed successfully\n"); */
-  size_t total_length = 0;
-  char buffer[1024];
-
-  while(fgets(buffer, sizeof(buffer), fp) != NULL) {
-    size_t chunk_length = strlen(buffer);
-    /* printf("DEBUG: Read chunk of %zu bytes: %s", chunk_length, buffer); */
-
-    /* printf("DEBUG: Read chunk of %zu bytes: %s", chunk_length, buffer); */
-    // More precise buffer overflow check
-    if(total_length + chunk_length >= MAX_OUTPUT - 1) {
-      /* printf("DEBUG: Output buffer overflow, current length: %zu, chunk length: %zu\n",
-             total_length, chunk_length); */
-      pclose(fp);
-      free(command);
-      free(output);
-      return NULL;
+  // Appended only now: find_index_file needs files sorted
+  for(int i = 0; present < manifest.count && i < manifest.count; i++) {
+    if(!manifest.files[i].removed || index_file_kind(strrchr(manifest.files[i].path, '/') + 1) != 2) {
+      continue;
     }
 
-    strcat(output, buffer);
-    total_length += chunk_length;
-    /* printf("DEBUG: Current total output length: %zu\n", total_length); */
-  }
+    CCIndexFile *gone = append_index_file(files, manifest.files[i].path);
+    full |= !gone;
 
-  if(ferror(fp)) {
-    perror("DEBUG: fgets error");
-    pclose(fp);
-    free(command);
-    free(output);
-    return NULL;
+    if(gone) {
+      gone->removed = 1;
+      gone->dirty = 1;
+      dirty_headers++;
+    }
   }
 
-  int exit_status = pclose(fp);
+  free_index_files(&manifest);
+  qsort(files->files, (size_t)files->count, sizeof(CCIndexFile), compare_index_files);
 
-  if(exit_status == -1) {
-    perror("DEBUG: pclose failed");
-    free(command);
-    free(output);
-    return NULL;
+  if(full) {
+    return -1;
   }
 
-  // Check for non-zero exit status (indicating clang error)
-  if(exit_status != 0) {
-    printf("DEBUG: Command failed with exit status: %d\n", exit_status);
-    // You might want to return NULL or handle this differently
+  // Without the include graph the dependents of a changed header are unknown: index everything
+  if(dirty_headers > 0 && mark_index_dependents(files) != 0) {
+    return -1;
   }
 
-  else {
-    /* printf("DEBUG: Command completed successfully with exit status: %d\n", exit_status); */
+  for(int i = 0; i < files->count; i++) {
+    dirty_sources += files->files[i].dirty && files->files[i].is_source;
   }
 
-  if(total_length == 0) {
-    /* printf("DEBUG: No output received from command\n"); */
-    free(command);
-    free(output);
-    return strdup("");
+  return dirty_sources;
+}
+
+// A translation unit to index, with the length of its directory part for grouping
+typedef struct {
+  const char *path;
+  int directory_length;
+} CCIndexUnit;
+
+// Translation units of one directory
+typedef struct {
+  int first;  // Into the sorted unit array
+  int count;
+  int shard;
+} CCIndexGroup;
+
+#define CC_INDEX_SHARD_PREFIX "code_connector_shard."  // Private cache directories of shards inside .ccls-cache
+
+// One `ccls --index` process of a job
+typedef struct {
+  char *argument;    // --init=... restricting ccls to the shard's directories or files
+  char cache[PATH_MAX + 64];  // Private cache directory, merged into .ccls-cache when the shard succeeded
+  int units;
+  long elapsed_ms;
+  int result;        // 0 ok, 1 failed, 2 killed at the deadline
+} CCIndexShard;
+
+// State shared by the threads running the shards of a job
+typedef struct {
+  CCIndexJob *job;
+  CCIndexShard *shards;
+  int shard_count;
+  int next;          // Next shard to start, guarded by job->lock
+  const CCLaunch *launch;
+} CCIndexRun;
+
+// Function to order units by directory, then by path
+static int compare_index_units(const void *a, const void *b) {
+  const CCIndexUnit *x = (const CCIndexUnit *)a;
+  const CCIndexUnit *y = (const CCIndexUnit *)b;
+  int length = x->directory_length < y->directory_length ? x->directory_length : y->directory_length;
+  int order = strncmp(x->path, y->path, (size_t)length);
+
+  if(order == 0 && x->directory_length != y->directory_length) {
+    return x->directory_length - y->directory_length;
   }
 
-  /* printf("DEBUG: Final command output:\n%s\n", output); */
-  char *result = strdup(output);
-  free(command);
-  free(output);
+  return order ? order : strcmp(x->path, y->path);
+}
 
-  if(!result) {
-    /* printf("DEBUG: Failed to allocate result string\n"); */
-    return NULL;
+// Function to order groups by size, largest first
+static int compare_index_groups(const void *a, const void *b) {
+  return ((const CCIndexGroup *)b)->count - ((const CCIndexGroup *)a)->count;
+}
+
+// Function to write length bytes of text as an escaped regex inside a JSON string
+static char *append_json_regex(char *out, const char *text, size_t length) {
+  for(size_t i = 0; i < length; i++) {
+    if(strchr(".^$|()[]{}*+?\\", text[i])) {
+      *out++ = '\\';
+      *out++ = '\\';
+    }
+
+    else if(text[i] == '"') {
+      *out++ = '\\';
+    }
+
+    *out++ = text[i];
   }
 
-  /* printf("DEBUG: Returning result, length: %zu\n", strlen(result)); */
-  return result;
+  return out;
 }
 
 /*
   Function Description:
-    Filters clang’s code completion output to extract only the relevant completion suggestions,
-    removing extraneous lines and formatting them into a newline-separated string. This processes
-    raw clang output (from execute_code_completion_command) into a clean list for Vim.
+    Splits the translation units of a job into at most jobs shards for concurrent ccls processes.
+    Units are grouped by directory and the groups are dealt largest first to the least loaded
+    shard. A shard whitelists whole directories ("^<dir>/[^/]+$") in a full index and single files
+    in an incremental one, so the --init argument stays small even for 20k-file trees. Every shard
+    writes to a private cache directory inside cache_dir (cache.directory), merged by
+    merge_index_shards once it succeeded.
 
   Parameters:
-    - input (const char *): The raw clang output string (e.g., "COMPLETION: printf : ..."), not modified.
+    - files (const CCIndexFileList *): Project files; translation units with dirty set are indexed
+      when incremental is set, all of them otherwise.
+    - incremental (int): Index only dirty translation units.
+    - jobs (int): Maximum number of shards (>= 1).
+    - cache_dir (const char *): The project's .ccls-cache.
+    - shards (CCIndexShard **): Receives the malloc'ed shards; free with free_index_shards.
 
   Return Value:
-    - char *: A dynamically allocated string with filtered completions (e.g., "printf\nscanf\n"), or
-      NULL on failure (e.g., memory allocation). Caller must free this string.
+    - int: Number of shards (0 when there is nothing to index), -1 on allocation failure.
 
-  Detailed Steps:
-    1. Validate Input:
-       - If input is NULL or empty (input[0] == '\0'), returns NULL—no data to process.
-    2. Allocate Buffers:
-       - Allocates filtered_output (MAX_OUTPUT) for the result and line_buffer (MAX_LINE_LENGTH)
-         for parsing lines.
-       - If either allocation fails, frees both and returns NULL.
-    3. Initialize Parsing:
-       - Creates a copy of input with strdup to work with strtok; if fails, frees buffers and returns NULL.
-       - Sets initial filtered_length to 0 to track output size.
-    4. Tokenize and Filter:
-       - Uses strtok to split input_copy by newline, processing each line.
-       - For each line, checks if it starts with "COMPLETION: " (strstr).
-       - If it does, extracts the completion name (after "COMPLETION: " up to " :" or end), copies to
-         line_buffer, appends to filtered_output with a newline, updates filtered_length.
-       - Limits total length to MAX_OUTPUT - 1 to prevent overflow.
-    5. Clean Up and Return:
-       - Frees input_copy and line_buffer.
-       - If filtered_length is 0 (no completions), frees filtered_output and returns NULL.
-       - Otherwise, null-terminates filtered_output and returns it.
+  Maintenance Notes:
+    - Every shard gets index.threads = max(1, jobs / shards), so the job limit bounds the total
+      number of indexer threads. A single full shard needs no whitelist.
+*/
+static int plan_index_shards(const CCIndexFileList *files, int incremental, int jobs, const char *cache_dir,
+                             CCIndexShard **shards) {
+  CCIndexUnit *units = (CCIndexUnit *)malloc((size_t)(files->count + 1) * sizeof(CCIndexUnit));
+  CCIndexGroup *groups = (CCIndexGroup *)malloc((size_t)(files->count + 1) * sizeof(CCIndexGroup));
+  int unit_count = 0;
+  int group_count = 0;
+  *shards = NULL;
+
+  if(!units || !groups) {
+    free(units);
+    free(groups);
+    return -1;
+  }
 
-  Flow and Logic:
-    - Step 1: Quick check to skip invalid input.
-    - Steps 2-3: Set up memory and a workable input copy.
-    - Step 4: Loop through lines, grab completions, build the output.
-    - Step 5: Wrap up, ensure something was found, return result.
-    - Why this order? Validation first, setup next, filter then clean—standard string processing flow.
+  for(int i = 0; i < files->count; i++) {
+    const CCIndexFile *file = &files->files[i];
 
-  How It Works (For Novices):
-    - Imagine clang hands you a messy note (input) with lines like "COMPLETION: printf : ..." and
-      junk like "Target: x86_64", and you want a neat list of just the suggestions (e.g., "printf\nscanf").
-    - filter_clang_output is like cleaning it up:
-      - Step 1: If the note’s blank or missing, toss it (return NULL).
-      - Step 2: Get a big clean sheet (filtered_output) and a scratch pad (line_buffer).
-      - Step 3: Copy the messy note (strdup) so you can cut it up (strtok).
-      - Step 4: Cut the note into lines. If a line says "COMPLETION: ", grab the word after it (e.g.,
-        "printf"), write it on the clean sheet with a newline, keep track of space used.
-      - Step 5: Toss the scratch stuff (free input_copy, line_buffer). If the clean sheet’s empty, toss
-        it too (return NULL); otherwise, finish it and hand it over.
-    - It’s like turning a cluttered brainstorm into a tidy to-do list!
+    if(file->is_source && (!incremental || file->dirty)) {
+      units[unit_count].path = file->path;
+      units[unit_count++].directory_length = (int)(strrchr(file->path, '/') - file->path);
+    }
+  }
 
-  Why It Works (For Novices):
-    - Focus: Picks only the useful bits (completions), ignoring clutter.
-    - Safety: Checks memory and space so it doesn’t mess up.
-    - Neatness: Gives you a simple list, one suggestion per line.
+  qsort(units, (size_t)unit_count, sizeof(CCIndexUnit), compare_index_units);
 
-  Why It’s Designed This Way (For Maintainers):
-    - Purpose: Cleans clang’s verbose output (from execute_code_completion_command) for Vim via
-      processCompletionDataFromString, key for UNIX tooling (per _POSIX_C_SOURCE).
-    - String Handling: strtok splits lines efficiently; strdup protects input—standard C practices.
-    - Memory: Dynamic allocation (MAX_OUTPUT) handles variable output sizes; caller frees result,
-      consistent with execute_code_completion_command.
-    - Filtering: "COMPLETION: " check is specific to clang’s format—effective but tied to its output style.
-    - Error Handling: NULL on failure (input, memory, no completions) lets callers (e.g., Vim plugin)
-      handle gracefully, with minimal logging.
+  for(int i = 0; i < unit_count; i++) {
+    if(i == 0 || units[i].directory_length != units[i - 1].directory_length ||
+       strncmp(units[i].path, units[i - 1].path, (size_t)units[i].directory_length) != 0) {
+      groups[group_count].first = i;
+      groups[group_count++].count = 0;
+    }
 
-  Maintenance Notes:
-    - Buffer Limits: MAX_OUTPUT and MAX_LINE_LENGTH must fit clang output and longest completion—
-      test with huge structs or namespaces to avoid truncation.
-    - Clang Format: Relies on "COMPLETION: " and " :"—if clang changes (e.g., "Completion:"), adjust
-      strstr checks. Log failures (via log_message) to catch this.
-    - Memory Leaks: Frees all temps on all paths—verify with valgrind, especially on early returns.
-    - Edge Cases: Empty lines or no completions return NULL—ensure callers (e.g., processCompletionDataFromString)
-      handle this (e.g., fallback to empty list).
-    - Extensibility: To keep more data (e.g., types after " :"), expand parsing—current focus is minimal.
-*/
+    groups[group_count - 1].count++;
+  }
 
-/* Substitute the output from the command
-  clang -fsyntax-only -Xclang -code-completion-macros -Xclang -code-completion-at=file.c:line:column file.c
-  such as: PREFERRED-TYPE: double
-  COMPLETION: remainderf : [#float#]remainderf(<#float x#>, <#float y#>)
-  with    double result = remainderf(`<float x>`, `<float y>`) by matching certain patterns */
-char *filter_clang_output(const char *input) {
-  /* printf("DEBUG: Input string:\n%s\n", input); */
-  // Dynamically allocate memory for output
-  char *output = (char *)malloc(MAX_OUTPUT * sizeof(char));
+  int shard_count = group_count < jobs ? group_count : jobs;
+  CCIndexShard *result = shard_count > 0 ? (CCIndexShard *)calloc((size_t)shard_count, sizeof(CCIndexShard)) : NULL;
+  size_t *sizes = shard_count > 0 ? (size_t *)calloc((size_t)shard_count, sizeof(size_t)) : NULL;
 
-  if(!output) {
-    /* printf("DEBUG: Failed to allocate output buffer\n"); */
-    return NULL;
+  if(shard_count > 0 && (!result || !sizes)) {
+    free(units);
+    free(groups);
+    free(result);
+    free(sizes);
+    return -1;
   }
 
-  output[0] = '\0';
-  /* printf("DEBUG: Output buffer allocated, initial length: %zu\n", strlen(output)); */
-  regex_t regex;
-  regmatch_t *matches = (regmatch_t *)malloc(MAX_REGX_MATCHES * sizeof(regmatch_t));
+  qsort(groups, (size_t)group_count, sizeof(CCIndexGroup), compare_index_groups);
 
-  if(!matches) {
-    /* printf("DEBUG: Failed to allocate matches array\n"); */
-    free(output);
-    return NULL;
-  }
+  for(int i = 0; i < group_count; i++) {
+    int lightest = 0;
 
-  /* printf("DEBUG: Matches array allocated\n"); */
-  // Pattern to match "COMPLETION: function : [#type#]function(<#type#>, <#type#>)"
-  const char *pattern = "^COMPLETION: ([^ ]+) : \\[#([^#]+)#\\]\\1\\(<#([^#]+)#>(, <#([^#]+)#>)*\\)";
-  /* printf("DEBUG: Using regex pattern: %s\n", pattern); */
-  int regex_result = regcomp(&regex, pattern, REG_EXTENDED | REG_NEWLINE);
+    for(int k = 1; k < shard_count; k++) {
+      lightest = result[k].units < result[lightest].units ? k : lightest;
+    }
 
-  if(regex_result != 0) {
-    char errbuf[256];
-    regerror(regex_result, &regex, errbuf, sizeof(errbuf));
-    /* printf("DEBUG: Regex compilation failed: %s\n", errbuf); */
-    free(output);
-    free(matches);
-    return NULL;
+    groups[i].shard = lightest;
+    result[lightest].units += groups[i].count;
+
+    for(int u = groups[i].first; u < groups[i].first + (incremental ? groups[i].count : 1); u++) {
+      sizes[lightest] += strlen(units[u].path) * 3 + 16;
+    }
   }
 
-  /* printf("DEBUG: Regex compiled successfully\n"); */
-  // Check if input contains COMPLETION lines
-  const char *cursor = input;
-  int has_completion = 0;
+  int threads = jobs / (shard_count > 0 ? shard_count : 1);
+  int whitelist = incremental || shard_count > 1;
+  int failed = 0;
 
-  while(*cursor != '\0') {
-    if(strncmp(cursor, "COMPLETION:", 11) == 0) {
-      has_completion = 1;
+  for(int k = 0; k < shard_count && !failed; k++) {
+    snprintf(result[k].cache, sizeof(result[k].cache), "%s/" CC_INDEX_SHARD_PREFIX "%d", cache_dir, k);
+    char *cache = json_quote(result[k].cache, strlen(result[k].cache));
+    char *out = cache ? (char *)malloc(sizes[k] + strlen(cache) + 160) : NULL;
+    result[k].argument = out;
+
+    if(!out) {
+      free(cache);
+      failed = 1;
       break;
     }
 
-    while(*cursor != '\0' && *cursor != '\n') {
-      cursor++;
+    out += sprintf(out, "--init={\"index\":{\"threads\":%d", threads > 1 ? threads : 1);
+
+    if(whitelist) {
+      out += sprintf(out, ",\"initialBlacklist\":[\".\"],\"initialWhitelist\":[");
+      int first = 1;
+
+      for(int i = 0; i < group_count; i++) {
+        if(groups[i].shard != k) {
+          continue;
+        }
+
+        for(int u = groups[i].first; u < groups[i].first + groups[i].count; u++) {
+          out += sprintf(out, "%s\"^", first ? "" : ",");
+          first = 0;
+
+          if(incremental) {
+            out = append_json_regex(out, units[u].path, strlen(units[u].path));
+            out += sprintf(out, "$\"");
+          }
+
+          else {
+            out = append_json_regex(out, units[u].path, (size_t)units[u].directory_length);
+            out += sprintf(out, "/[^/]+$\"");
+            break;  // One pattern covers the directory
+          }
+        }
+      }
+
+      out += sprintf(out, "]");
     }
 
-    if(*cursor == '\n') {
-      cursor++;
+    sprintf(out, "},\"cache\":{\"directory\":%s}}", cache);
+    free(cache);
+  }
+
+  free(units);
+  free(groups);
+  free(sizes);
+
+  if(failed) {
+    for(int k = 0; k < shard_count; k++) {
+      free(result[k].argument);
     }
+
+    free(result);
+    return -1;
   }
 
-  /* printf("DEBUG: Input contains COMPLETION lines: %s\n",
-         has_completion ? "yes" : "no"); */
-  cursor = input;
-  size_t matches_size = MAX_REGX_MATCHES;
-  int match_count = 0;
+  *shards = result;
+  return shard_count;
+}
 
-  while(regexec(&regex, cursor, matches_size, matches, 0) == 0) {
-    match_count++;
-    /* printf("DEBUG: Found match #%d\n", match_count); */
-    /*printf("DEBUG: Match[0] (full): %.*s\n",
-           (int)(matches[0].rm_eo - matches[0].rm_so),
-           cursor + matches[0].rm_so);
-      printf("DEBUG: Match[1] (function): %.*s\n",
-           (int)(matches[1].rm_eo - matches[1].rm_so),
-           cursor + matches[1].rm_so);
-      printf("DEBUG: Match[2] (return type): %.*s\n",
-           (int)(matches[2].rm_eo - matches[2].rm_so),
-           cursor + matches[2].rm_so);
-      printf("DEBUG: Match[3] (first param): %.*s\n",
-           (int)(matches[3].rm_eo - matches[3].rm_so),
-           cursor + matches[3].rm_so); */
-    // Calculate remaining space in output buffer
-    size_t output_len = strlen(output);
-    size_t remaining_space = MAX_OUTPUT - output_len - 1;
-    /* printf("DEBUG: Output length: %zu, Remaining space: %zu\n",
-           output_len, remaining_space); */
-    // Extract and append function name (matches[1])
-    size_t match_len = (size_t)(matches[1].rm_eo - matches[1].rm_so);
-    /* printf("DEBUG: Function name length: %zu\n", match_len); */
+// Function to move every file below from to the same place below to, or to delete it when to is NULL,
+// removing the emptied directories. Returns 0 on success
+static int drain_index_directory(const char *from, const char *to) {
+  char source[PATH_MAX];
+  char target[PATH_MAX];
+  struct stat st;
+  struct dirent *entry;
+  int failed = 0;
+  DIR *dir = opendir(from);
+
+  if(!dir) {
+    return errno != ENOENT;
+  }
 
-    if(match_len >= remaining_space) {
-      /* printf("D  EBUG: Buffer overflow for function name\n"); */
-      regfree(&regex);
-      free(output);
-      free(matches);
-      return NULL;
+  if(to && mkdir(to, 0755) != 0 && errno != EEXIST) {
+    closedir(dir);
+    return 1;
+  }
+
+  while((entry = readdir(dir)) != NULL) {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
     }
 
-    strncat(output, cursor + matches[1].rm_so, match_len);
-    remaining_space -= match_len;
-    /* printf("DEBUG: After function name, output: %s\n", output); */
+    if((size_t)snprintf(source, sizeof(source), "%s/%s", from, entry->d_name) >= sizeof(source) ||
+       (to && (size_t)snprintf(target, sizeof(target), "%s/%s", to, entry->d_name) >= sizeof(target)) ||
+       lstat(source, &st) != 0) {
+      failed = 1;
+    }
 
-    // Append opening parenthesis
-    if(remaining_space < 1) {
-      /* printf("D  EBUG: Buffer overflow for opening parenthesis\n"); */
-      regfree(&regex);
-      free(output);
-      free(matches);
-      return NULL;
+    else if(S_ISDIR(st.st_mode)) {
+      failed |= drain_index_directory(source, to ? target : NULL);
     }
 
-    strncat(output, "(", 2); // 1+1, increased to prevent buffer overflow
-    remaining_space -= 1;
-    /* printf("DEBUG: After opening parenthesis, output: %s\n", output); */
+    // rename replaces an entry another shard wrote (a shared header) as a whole
+    else {
+      failed |= to ? rename(source, target) != 0 : unlink(source) != 0;
+    }
+  }
 
-    // Process first parameter (matches[3])
-    if(remaining_space < 2) {
-      /* printf("DEBUG: Buffer overflow for first param start\n"); */
-      regfree(&regex);
-      free(output);
-      free(matches);
-      return NULL;
+  closedir(dir);
+  return rmdir(from) != 0 || failed;
+}
+
+// Function to merge the private caches of the successful shards into cache_dir and to delete the
+// others (and those an interrupted earlier run left behind). Returns 0 when every merge succeeded
+static int merge_index_shards(const char *cache_dir, CCIndexShard *shards, int shard_count) {
+  char path[PATH_MAX];
+  struct dirent *entry;
+  int failed = 0;
+
+  for(int k = 0; k < shard_count; k++) {
+    if(shards[k].result == 0 && drain_index_directory(shards[k].cache, cache_dir) != 0) {
+      log_message("fn merge_index_shards: Failed to merge the cache of a shard\n");
+      shards[k].result = 1;
+      failed = 1;
+    }
+  }
+
+  DIR *dir = opendir(cache_dir);
+
+  while(dir && (entry = readdir(dir)) != NULL) {
+    if(strncmp(entry->d_name, CC_INDEX_SHARD_PREFIX, strlen(CC_INDEX_SHARD_PREFIX)) == 0 &&
+       (size_t)snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name) < sizeof(path)) {
+      drain_index_directory(path, NULL);
     }
+  }
+
+  if(dir) {
+    closedir(dir);
+  }
+
+  return failed;
+}
+
+// Function to release the shards of a job
+static void free_index_shards(CCIndexShard *shards, int shard_count) {
+  for(int k = 0; k < shard_count; k++) {
+    free(shards[k].argument);
+  }
+
+  free(shards);
+}
 
-    strncat(output, "`", 2);
-    remaining_space -= 2;
-    /* printf("DEBUG: After first param start, output: %s\n", output); */
-    match_len = (size_t)(matches[3].rm_eo - matches[3].rm_so);
-    /* printf("DEBUG: First param length: %zu\n", match_len); */
+// Function run by each index thread: starts shards one after another until none is left
+static void *run_index_shards(void *arg) {
+  CCIndexRun *run = (CCIndexRun *)arg;
 
-    if(match_len >= remaining_space) {
-      /* printf("D  EBUG: Buffer overflow for first param\n"); */
-      regfree(&regex);
-      free(output);
-      free(matches);
-      return NULL;
-    }
+  for(;;) {
+    pthread_mutex_lock(&run->job->lock);
+    int k = run->next < run->shard_count ? run->next++ : -1;
+    pthread_mutex_unlock(&run->job->lock);
 
-    if(remaining_space < 2) {
-      /* printf("D  EBUG: Buffer overflow for first backtick\n"); */
-      regfree(&regex);
-      free(output);
-      free(matches);
+    if(k < 0) {
       return NULL;
     }
 
-    strncat(output, "<", 2);
-    remaining_space -= 2;
-    /* printf("DEBUG: After first backtick, output: %s\n", output); */
-    strncat(output, cursor + matches[3].rm_so, match_len);
-    remaining_space -= match_len;
-    /* printf("DEBUG: After first param value, output: %s\n", output); */
+    CCIndexShard *shard = &run->shards[k];
+    // Run `ccls --index <dir>` directly (no shell) at background priority, under an optional deadline
+    char *const argv[] = {"ccls", "--index", run->job->root, shard->argument, NULL};
+    CCChild child;
+    int exit_status = 0;
+    shard->result = spawn_child(argv, NULL, run->launch, CC_CAPTURE_ALL, &child);
+
+    if(shard->result == 0) {
+      int timed_out = read_child_lines(&child, run->launch, index_on_line, run->job);
+      timed_out |= wait_child(&child, run->launch, &exit_status);
+      shard->elapsed_ms = elapsed_ms(&child.started);
+      shard->result = timed_out ? 2 : !WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0;
+    }
+  }
+}
 
-    if(remaining_space < 2) {
-      /* printf("DEBUG: Buffer overflow for first param end\n"); */
-      regfree(&regex);
-      free(output);
-      free(matches);
-      return NULL;
+// Function to record the timing of every shard in .ccls-cache/code_connector_index.shards and the log
+static void report_index_shards(const char *root, const CCIndexShard *shards, int shard_count) {
+  const char *results[] = {"ok", "failed", "timeout"};
+  char path[PATH_MAX + 64];
+  char message[128];
+  snprintf(path, sizeof(path), "%s/.ccls-cache/code_connector_index.shards", root);
+  FILE *file = fopen(path, "w");
+
+  for(int k = 0; k < shard_count; k++) {
+    snprintf(message, sizeof(message), "shard %d units %d ms %ld %s\n", k, shards[k].units, shards[k].elapsed_ms,
+             results[shards[k].result]);
+    log_message(message);
+
+    if(file) {
+      fputs(message, file);
     }
+  }
 
-    strncat(output, ">`", 3); // 2+1, increased to prevent buffer overflow
-    remaining_space -= 2;
-    /* printf("DEBUG: After first param end, output: %s\n", output); */
+  if(file) {
+    fclose(file);
+  }
+}
 
-    // Handle additional parameters (matches[4] and matches[5])
-    if(matches[4].rm_so != -1) {
-      /* printf("DEBUG: Second parameter found\n"); */
-      if(remaining_space < 4) {
-        /* printf("DEBUG: Buffer overflow for second param start\n"); */
-        regfree(&regex);
-        free(output);
-        free(matches);
-        return NULL;
-      }
+// Function to replace the status file of a project root with status
+static void write_index_status(const char *root, const cc_index_status *status) {
+  char path[PATH_MAX + 64];
+  char temporary[PATH_MAX + 96];
+  snprintf(path, sizeof(path), "%s/%s", root, CC_INDEX_STATUS_FILE);
+  snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid());
+  FILE *file = fopen(temporary, "w");
 
-      strncat(output, ", `<", 5); // 4+1, increased to prevent buffer overflow
-      remaining_space -= 4;
-      /* printf("DEBUG: After second param start, output: %s\n", output); */
-      match_len = (size_t)(matches[5].rm_eo - matches[5].rm_so);
-      /* printf("DEBUG: Second param length: %zu\n", match_len); */
+  if(!file) {
+    return;
+  }
 
-      if(match_len >= remaining_space) {
-        /* printf("D  EBUG: Buffer overflow for second param\n"); */
-        regfree(&regex);
-        free(output);
-        free(matches);
-        return NULL;
-      }
+  fprintf(file, "%s %d %d %ld %ld %ld %s\n", index_state_names[status->state], status->done, status->total,
+          status->pid, status->started, status->finished, index_mode_names[status->mode]);
 
-      strncat(output, cursor + matches[5].rm_so, match_len);
-      remaining_space -= match_len;
-      /* printf("DEBUG: After second param value, output: %s\n", output); */
+  if(fclose(file) != 0 || rename(temporary, path) != 0) {
+    unlink(temporary);
+  }
+}
 
-      if(remaining_space < 2) {
-        /* printf("DEBUG: Buffer overflow for second param end\n"); */
-        regfree(&regex);
-        free(output);
-        free(matches);
-        return NULL;
-      }
+// Function to publish the progress of a job (status file and callback)
+static void report_index_job(CCIndexJob *job) {
+  clock_gettime(CLOCK_MONOTONIC, &job->last_report);
+  write_index_status(job->root, &job->status);
 
-      strncat(output, ">`", 3); // 2+1, increased to prevent buffer overflow
-      remaining_space -= 2;
-      /* printf("DEBUG: After second param end, output: %s\n", outpu  t); */
-    }
+  if(job->on_progress) {
+    job->on_progress(&job->status, job->user);
+  }
+}
 
-    // Append closing parenthesis and newline
-    if(remaining_space < 2) {
-      /* printf("DEBUG: Buffer overflow for closing parenthesis\n"); */
-      regfree(&regex);
-      free(output);
-      free(matches);
-      return NULL;
-    }
+// Function to count a line of ccls output towards the progress of the job
+static void index_on_line(const char *line, void *user) {
+  CCIndexJob *job = (CCIndexJob *)user;
 
-    strncat(output, ")\n", 3); // 2+1, increased to prevent buffer overflow
-    /* printf("DEBUG: After closing parenthesis, output: %s\n", output); */
-    // Move cursor to next line
-    cursor += matches[0].rm_eo;
-    /* printf("DEBUG: Cursor moved to position: %zu\n",
-           (size_t)(cursor - input)); */
+  if(!strstr(line, "parse ")) {
+    return;
+  }
 
-    while(*cursor != '\0' && *cursor != '\n') {
-      cursor++;
-    }
+  pthread_mutex_lock(&job->lock);
+  job->status.done++;
 
-    if(*cursor == '\n') {
-      cursor++;
+  if(job->status.done > job->status.total) {
+    job->status.total = job->status.done;
+  }
+
+  if(elapsed_ms(&job->last_report) >= CC_INDEX_REPORT_MS) {
+    report_index_job(job);
+  }
+
+  pthread_mutex_unlock(&job->lock);
+}
+
+// Function to read the index job state of the project above directory into status
+// Returns 0 when a project was found (state CC_INDEX_IDLE when it was never indexed), 1 otherwise
+int cc_index_progress(const char *directory, cc_index_status *status) {
+  char root[PATH_MAX];
+  char path[PATH_MAX + 64];
+  char state[16] = "";
+  char mode[16] = "";
+  memset(status, 0, sizeof(*status));
+
+  if(!directory || findFiles(directory, root) != 0) {
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", root, CC_INDEX_STATUS_FILE);
+  FILE *file = fopen(path, "r");
+
+  if(!file) {
+    return 0;
+  }
+
+  if(fscanf(file, "%15s %d %d %ld %ld %ld %15s", state, &status->done, &status->total, &status->pid, &status->started,
+            &status->finished, mode) >= 6) {
+    for(int i = CC_INDEX_RUNNING; i <= CC_INDEX_FAILED; i++) {
+      if(strcmp(state, index_state_names[i]) == 0) {
+        status->state = (cc_index_state)i;
+      }
     }
 
-    /* printf("DEBUG: Cursor after line skip: %zu\n",
-           (size_t)(cursor - input)); */
+    for(int i = CC_INDEX_INCREMENTAL; i <= CC_INDEX_UNCHANGED; i++) {
+      if(strcmp(mode, index_mode_names[i]) == 0) {
+        status->mode = (cc_index_mode)i;
+      }
+    }
   }
 
-  /* printf("DEBUG: Total matches found: %d\n", match_count);
-    printf("DEBUG: Final output: %s\n", output); */
+  fclose(file);
 
-  // If no matches were found, return empty string
-  if(match_count == 0) {
-    /* printf("DEBUG: No completions found, returning empty string\n"); */
-    regfree(&regex);
-    char *result = strdup("");
-    free(output);
-    free(matches);
-    /* printf("DEBUG: Function complete, returning result\n "); */
-    return result;
+  if(status->state == CC_INDEX_RUNNING && kill((pid_t)status->pid, 0) != 0 && errno == ESRCH) {
+    status->state = CC_INDEX_FAILED;
   }
 
-  regfree(&regex);
-  char *result = strdup(output);
-  free(output);
-  free(matches);
-  /* printf("DEBUG: Function complete, returning result\n"); */
-  return result;
+  return 0;
 }
 
 /*
   Function Description:
-    Executes the `ccls --index` command in the specified directory to generate an index file (.ccls-cache)
-    for code navigation and completion. This function runs ccls as a child process and waits for it to finish.
+    Runs `ccls --index <root>` for the project above directory and waits for it, reporting progress
+    through the status file and, when given, on_progress (called from this thread).
 
   Parameters:
-    - directory (const char *): The directory path where ccls should run (e.g., "/project"), not modified.
+    - directory (const char *): Any directory inside the project.
+    - jobs (int): Maximum number of concurrent ccls processes (and indexer threads in total); <= 0
+      for CODE_CONNECTOR_INDEX_JOBS, or the number of online cores when that is unset.
+    - on_progress (cc_index_callback): Called at start, on progress and at the end; may be NULL.
+    - user (void *): Passed to on_progress.
 
   Return Value:
-    - int: Returns 0 on success (ccls exits with status 0); 1 on failure (e.g., fork, exec, or ccls error).
+    - int: 0 when ccls succeeded, 1 on failure or when an index job for the project is already running.
 
-  Detailed Steps:
-    1. Validate Input:
-       - If directory is NULL, logs an error and returns 1.
-    2. Fork Process:
-       - Calls fork to create a child process; if it fails (pid < 0), logs and returns 1.
-    3. Child Process:
-       - Changes working directory to directory with chdir; if it fails, logs and exits with EXIT_FAILURE.
-       - Executes "ccls" with "--index" argument via execlp; if it fails, logs and exits with EXIT_FAILURE.
-    4. Parent Process:
-       - Waits for child to finish with waitpid, storing exit status.
-       - Checks status: if WIFEXITED and exit code is 0, returns 0; otherwise, logs and returns 1.
+  Maintenance Notes:
+    - ccls runs as background children (idle priority, stopped while completions run clang) with
+      their stdout and stderr captured; CODE_CONNECTOR_INDEX_TIMEOUT_MS bounds each of them (no
+      deadline when unset).
+    - The translation units are split into shards (plan_index_shards) run by up to jobs threads, each
+      driving one ccls process. ccls writes its cache files in place, not atomically, so concurrent
+      shards would write the entries of shared headers over each other and readers (the ccls
+      sessions) could see half-written files. Every shard therefore writes to a private cache
+      directory; merge_index_shards renames the files of the shards that succeeded into .ccls-cache
+      (a header indexed by several shards keeps one shard's complete entry) and deletes the rest.
+      The timing of every shard goes to .ccls-cache/code_connector_index.shards and the log.
+*/
+int cc_index_run(const char *directory, int jobs, cc_index_callback on_progress, void *user) {
+  return run_index_job(directory, jobs, on_progress, user);
+}
 
-  Flow and Logic:
-    - Step 1: Ensure there’s a directory to work with.
-    - Step 2: Split into parent and child processes.
-    - Step 3: Child runs ccls in the directory.
-    - Step 4: Parent waits and checks if ccls succeeded.
-    - Why this order? Validation first, fork next, child execs, parent verifies—classic UNIX process pattern.
+// Function to resolve the job limit of an index run: jobs, else CODE_CONNECTOR_INDEX_JOBS, else the online cores
+static int index_job_limit(int jobs) {
+  const char *jobs_env = getenv("CODE_CONNECTOR_INDEX_JOBS");
 
-  How It Works (For Novices):
-    - Imagine you need a map (.ccls-cache) of a workshop (directory) to help find tools fast, and you
-      ask a helper (ccls) to make it with “--index.”
-    - execute_ccls_index is like this:
-      - Step 1: Check you gave a workshop address (directory)—if not, say “No way!”
-      - Step 2: Call your helper (fork) to do the job while you wait.
-      - Step 3: The helper goes to the workshop (chdir), shouts “ccls --index” (execlp), and makes the map.
-        If they can’t, they complain and quit.
-      - Step 4: You wait (waitpid) and ask, “Did it work?” If the helper says “Yes” (status 0), you’re happy (return 0);
-        if not, you’re not (return 1).
-    - It’s like sending a friend to map a room while you wait to hear if they did it!
+  if(jobs <= 0) {
+    jobs = jobs_env ? atoi(jobs_env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
 
-  Why It Works (For Novices):
-    - Safety: Checks the address first so you don’t send the helper nowhere.
-    - Teamwork: The helper does the work, you just wait—saves you effort.
-    - Clarity: Tells you if the map got made or not.
+  return jobs < 1 ? 1 : jobs > CC_INDEX_MAX_JOBS ? CC_INDEX_MAX_JOBS : jobs;
+}
 
-  Why It’s Designed This Way (For Maintainers):
-    - Purpose: Generates ccls’s index for navigation/completion, integrating with UNIX tooling (per
-      _POSIX_C_SOURCE) where ccls expects a project dir with .ccls files (e.g., from create_default_config_files).
-    - Fork/Exec: Standard UNIX pattern for running external commands—simple and robust, though it blocks
-      until ccls finishes.
-    - Error Handling: Returns 1 on any failure (NULL dir, fork, chdir, execlp, ccls error) with logs
-      (log_message), letting callers (e.g., setup routine) retry or abort.
-    - Blocking: waitpid ensures index is complete before returning, syncing with ccls’s async nature—
-      suits one-time setup but not real-time use.
-    - Minimalism: Hardcodes "ccls --index"—no extra args, assuming .ccls in directory handles rest.
+// Function behind cc_index_run; a running job recorded with this process's pid was claimed for it
+// by execute_ccls_index
+static int run_index_job(const char *directory, int jobs, cc_index_callback on_progress, void *user) {
+  CCIndexJob job;
+  cc_index_status previous;
+  memset(&job, 0, sizeof(job));
+
+  // stdout is the job channel of Vim, which only reads PROGRESS, DONE and FAILED lines
+  if(!directory || findFiles(directory, job.root) != 0) {
+    log_message("fn cc_index_run: No project root (.ccls with compile_flags.txt, or compile_commands.json) above the directory\n");
+    return 1;
+  }
+
+  if(cc_index_progress(directory, &previous) == 0 && previous.state == CC_INDEX_RUNNING && previous.pid != (long)getpid()) {
+    log_message("fn cc_index_run: An index job is already running for this project\n");
+    return 1;
+  }
+
+  char cache_dir[PATH_MAX + 16];
+  snprintf(cache_dir, sizeof(cache_dir), "%s/.ccls-cache", job.root);
+  mkdir(cache_dir, 0755);
+  job.on_progress = on_progress;
+  job.user = user;
+  job.status.state = CC_INDEX_RUNNING;
+  job.status.pid = (long)getpid();
+  job.status.started = (long)time(NULL);
+  pthread_mutex_init(&job.lock, NULL);
+  CCIndexFileList files = {NULL, 0, 0};
+  unsigned long config = index_config_hash(job.root);
+
+  if(collect_index_files(job.root, 0, &files) != 0) {
+    free_index_files(&files);
+    job.status.state = CC_INDEX_FAILED;
+    report_index_job(&job);
+    pthread_mutex_destroy(&job.lock);
+    return 1;
+  }
+
+  qsort(files.files, (size_t)files.count, sizeof(CCIndexFile), compare_index_files);
+  int selected = plan_index_job(job.root, &files, config);
+
+  if(selected == 0) {
+    // Nothing a translation unit depends on changed: only record the new mtimes
+    save_index_manifest(job.root, &files, config);
+    free_index_files(&files);
+    job.status.state = CC_INDEX_DONE;
+    job.status.mode = CC_INDEX_UNCHANGED;
+    job.status.finished = (long)time(NULL);
+    report_index_job(&job);
+    pthread_mutex_destroy(&job.lock);
+    return 0;
+  }
+
+  int incremental = selected > 0 && selected <= CC_INDEX_MAX_SELECTED;
+  CCIndexShard *shards = NULL;
+  int shard_count = plan_index_shards(&files, incremental, index_job_limit(jobs), cache_dir, &shards);
+  job.status.mode = incremental ? CC_INDEX_INCREMENTAL : CC_INDEX_FULL;
+  job.status.shards = shard_count > 0 ? shard_count : 0;
+
+  for(int k = 0; k < shard_count; k++) {
+    job.status.total += shards[k].units;
+  }
+
+  report_index_job(&job);
+  const char *timeout_env = getenv("CODE_CONNECTOR_INDEX_TIMEOUT_MS");
+  CCLaunch launch = {timeout_env ? atoi(timeout_env) : 0, 0, 0, CC_LAUNCH_BACKGROUND};
+  CCIndexRun run = {&job, shards, shard_count, 0, &launch};
+  pthread_t threads[CC_INDEX_MAX_JOBS];
+  int started = 0;
+
+  // The calling thread runs shards too; extra threads only when there is more than one shard
+  while(started + 1 < shard_count && pthread_create(&threads[started], NULL, run_index_shards, &run) == 0) {
+    started++;
+  }
+
+  run_index_shards(&run);
+
+  for(int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  int result = shard_count < 0;
+  merge_index_shards(cache_dir, shards, shard_count);
+
+  for(int k = 0; k < shard_count; k++) {
+    result |= shards[k].result != 0;
+  }
+
+  report_index_shards(job.root, shards, shard_count);
+  free_index_shards(shards, shard_count);
+  pthread_mutex_lock(&job.lock);
+  job.status.state = result == 0 ? CC_INDEX_DONE : CC_INDEX_FAILED;
+
+  // The manifest only moves forward after a successful run, so the changes of a failed one are picked up again
+  if(result == 0) {
+    job.status.done = job.status.total;
+    save_index_manifest(job.root, &files, config);
+  }
+
+  free_index_files(&files);
+  job.status.finished = (long)time(NULL);
+  report_index_job(&job);
+  pthread_mutex_unlock(&job.lock);
+  pthread_mutex_destroy(&job.lock);
+  return result;
+}
+
+/*
+  Function Description:
+    Starts indexing the project above directory and returns at once, so Vim (which calls this
+    through libcallnr) never freezes while ccls runs. The job is `code_connector_executable --index
+    <root>` from the directory of this library, run in a detached process; poll it with
+    ccls_index_progress / cc_index_progress.
+
+  Parameters:
+    - directory (const char *): Any directory inside the project.
+
+  Return Value:
+    - int: 0 when the job was started, -1 when no project was found, an index job for it is
+      already running or the process could not be started.
 
   Maintenance Notes:
-    - Robustness: No timeout—hung ccls blocks forever; add WNOHANG or timeout logic if this happens.
-    - Logging: Logs failures (e.g., “fork failed”), but could detail errno or ccls exit code for clarity.
-    - Path Issues: chdir assumes directory is valid—realpath could normalize it, but adds overhead.
-    - Extensibility: To pass more ccls args (e.g., "--log-file"), modify execlp to execvp with an array.
-    - Testing: Verify with missing ccls binary or bad dirs—ensure logs and returns align.
+    - The caller may be a multi-threaded Vim (gvim), so the detached process only runs
+      async-signal-safe calls until it execs: it sends its pid over a socket and waits for the
+      caller to close it.
+    - The job is claimed with the detached process's pid before that process execs, so an
+      immediate second call or poll already sees it running, and a job that dies before its first
+      report is seen as failed instead of running for as long as Vim lives. The exec'ed job
+      recognizes the claim by its own pid.
 */
 
 /* Intended to be called from Vim with :%p. When called, it should generate .ccls-cache in the directory passed as an argument. */
 int execute_ccls_index(const char *directory) {
-  // Calculate required buffer size for found_at and command
-  size_t dir_len = strlen(directory);
-  size_t max_path_len = dir_len + 256;  // Extra space for paths and null terminator
-  // Dynamically allocate memory for found_at and command
-  char *found_at = (char *)malloc(max_path_len * sizeof(char));
-  char *command = (char *)malloc(max_path_len * sizeof(char));
+  char root[PATH_MAX];
+  char executable[PATH_MAX];
+  cc_index_status status;
+  Dl_info library;
+  int pair[2];
+
+  if(!directory || findFiles(directory, root) != 0) {
+    log_message("fn execute_ccls_index: No project root (.ccls with compile_flags.txt, or compile_commands.json) above the directory\n");
+    return -1;
+  }
 
-  // Check for allocation failures
-  if(!found_at || !command) {
-    free(found_at);
-    free(command);
+  if(cc_index_progress(root, &status) == 0 && status.state == CC_INDEX_RUNNING) {
     return -1;
   }
 
-  if(findFiles(directory, found_at) != 0) {
-    printf("Error finding .ccls and compile_flags.txt\n");
-    free(found_at);
-    free(command);
+  // The executable is installed next to this library
+  if(dladdr((const void *)index_state_names, &library) == 0 || !library.dli_fname ||
+     (size_t)snprintf(executable, sizeof(executable), "%s", library.dli_fname) >= sizeof(executable)) {
+    log_message("fn execute_ccls_index: Cannot locate the shared library\n");
     return -1;
   }
 
-  // Construct the command string
-  snprintf(command, max_path_len, "ccls --index %s", found_at);
-  // Execute the command
-  int result = system(command);
-  // Free allocated memory
-  free(found_at);
-  free(command);
+  char *slash = strrchr(executable, '/');
+  int length = slash ? (int)(slash - executable) : 1;
+
+  if(!slash) {
+    executable[0] = '.';
+  }
+
+  if((size_t)snprintf(executable + length, sizeof(executable) - (size_t)length, "/code_connector_executable") >=
+     sizeof(executable) - (size_t)length || access(executable, X_OK) != 0 ||
+     socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+    log_message("fn execute_ccls_index: Cannot start code_connector_executable --index\n");
+    return -1;
+  }
 
-  // Check if the command was successful
-  if(result != 0) {
-    fprintf(stderr, "Failed to execute ccls --index command\n");
+  int detached = detach_process(pair[1]);
+
+  if(detached == 0) {
+    pid_t self = getpid();
+    char go;
+
+    // Run only once the caller has claimed the job with this pid
+    if(write(pair[1], &self, sizeof(self)) == (ssize_t)sizeof(self) && read(pair[1], &go, 1) == 0) {
+      execl(executable, "code_connector_executable", "--index", root, (char *)NULL);
+    }
+
+    _exit(127);
+  }
+
+  close(pair[1]);
+  pid_t job = 0;
+
+  if(detached < 0 || read(pair[0], &job, sizeof(job)) != (ssize_t)sizeof(job)) {
+    close(pair[0]);
     return -1;
   }
 
+  // Claim the job before returning, so an immediate second call or poll already sees it running
+  char cache_dir[PATH_MAX + 16];
+  snprintf(cache_dir, sizeof(cache_dir), "%s/.ccls-cache", root);
+  mkdir(cache_dir, 0755);
+  memset(&status, 0, sizeof(status));
+  status.state = CC_INDEX_RUNNING;
+  status.pid = (long)job;
+  status.started = (long)time(NULL);
+  write_index_status(root, &status);
+  close(pair[0]);
   return 0;
 }
 
+// Function for Vim's libcall: the index job state of the project above directory as
+// "<state> <done> <total>" (e.g. "running 120 2000"), or "none" outside a project
+char *ccls_index_progress(const char *directory) {
+  static char progress[64];
+  cc_index_status status;
+
+  if(cc_index_progress(directory, &status) != 0) {
+    snprintf(progress, sizeof(progress), "none");
+  }
+
+  else {
+    snprintf(progress, sizeof(progress), "%s %d %d", index_state_names[status.state], status.done, status.total);
+  }
+
+  return progress;
+}
+
 /*
   Function Description:
     Parses an input string in the format "file_path:line:column" into its components: a file path,
@@ -2480,10 +12113,11 @@ void split_input_string(const char *input, char *file_path, int *line, int *colu
     return;
   }
 
-  // Make a copy of the input string to use with strtok
+  // Make a copy of the input string to use with strtok_r (strtok's hidden state is not thread-safe)
   strcpy(input_copy, input);
+  char *save_ptr = NULL;
   // Divide input string into three parts
-  char *str = strtok(input_copy, " ");
+  char *str = strtok_r(input_copy, " ", &save_ptr);
 
   if(str == NULL) {
     fprintf(stderr, "Invalid input format\n");
@@ -2497,8 +12131,8 @@ void split_input_string(const char *input, char *file_path, int *line, int *colu
   strncpy(file_path, str, 1023);
   file_path[1023] = '\0'; // Ensure null termination
   // Parse the line and column numbers
-  char *line_str = strtok(NULL, " ");
-  char *column_str = strtok(NULL, " ");
+  char *line_str = strtok_r(NULL, " ", &save_ptr);
+  char *column_str = strtok_r(NULL, " ", &save_ptr);
 
   if(line_str == NULL || column_str == NULL) {
     fprintf(stderr, "Invalid input format\n");
@@ -2533,22 +12167,19 @@ void split_input_string(const char *input, char *file_path, int *line, int *colu
     2. Parse Input:
        - Initializes line and column to 0, calls split_input_string to extract file_path, line, and column
          from vimInputString.
-    3. Execute Completion Command:
-       - Calls execute_code_completion_command with file_path, line, and column to get raw clang output.
-       - If it returns NULL, logs, frees file_path, and returns NULL.
-    4. Filter Output:
-       - Calls filter_clang_output on the raw output to extract completion suggestions.
-       - Frees raw output regardless of filter result.
-    5. Clean Up and Return:
+    3. Run Completion:
+       - Calls cc_complete on cc_default_context(), which builds the command, runs clang and keeps the
+         first line of the filter_clang_output result.
+       - On failure, prints which stage failed and returns NULL.
+    4. Clean Up and Return:
        - Frees file_path.
-       - Returns filtered completions (or NULL if filtering failed).
+       - Returns the completion text, owned by the caller.
 
   Flow and Logic:
     - Step 1: Set up storage for parsing.
     - Step 2: Break input into usable parts.
-    - Step 3: Ask clang for suggestions.
-    - Step 4: Clean up clang’s messy response.
-    - Step 5: Wrap up and deliver the tidy list.
+    - Step 3: Ask clang for suggestions and clean up its messy response (cc_complete).
+    - Step 4: Wrap up and deliver the tidy list.
     - Why this order? Setup first, parse next, execute then filter—logical pipeline from input to output.
 
   How It Works (For Novices):
@@ -2558,10 +12189,9 @@ void split_input_string(const char *input, char *file_path, int *line, int *colu
     - processCompletionDataFromString is like this:
       - Step 1: Get a blank card (file_path) to write the file name on.
       - Step 2: Tear the note apart (split_input_string) into file ("main.c"), page (5), and spot (3).
-      - Step 3: Ask clang for ideas (execute_code_completion_command) using those pieces—get a messy
-        answer like "COMPLETION: printf : ...".
-      - Step 4: Clean the mess (filter_clang_output) into a nice list ("printf\nscanf").
-      - Step 5: Toss your scratch card (free file_path) and hand over the list (or nothing if it flopped).
+      - Step 3: Ask clang for ideas (cc_complete) using those pieces—it gets a messy answer like
+        "COMPLETION: printf : ..." and cleans it (filter_clang_output) into a nice list ("printf\nscanf").
+      - Step 4: Toss your scratch card (free file_path) and hand over the list (or nothing if it flopped).
     - It’s like being the manager who tells everyone what to do to get Vim its answer!
 
   Why It Works (For Novices):
@@ -2570,9 +12200,9 @@ void split_input_string(const char *input, char *file_path, int *line, int *colu
     - Usefulness: Turns a simple note into a helpful list for Vim.
 
   Why It’s Designed This Way (For Maintainers):
-    - Driver Role: Acts as the central coordinator, tying together split_input_string,
-      execute_code_completion_command, and filter_clang_output into a single workflow for Vim integration
-      on UNIX (per _POSIX_C_SOURCE). It’s the entry point for completion requests.
+    - Driver Role: Acts as the central coordinator, tying split_input_string and cc_complete (on the
+      default context) into a single workflow for Vim integration on UNIX (per _POSIX_C_SOURCE).
+      It’s the entry point for completion requests; threaded callers use cc_complete directly.
     - Modularity: Delegates tasks to specialized functions, keeping this high-level and maintainable—
       each step can evolve independently.
     - Memory: Allocates file_path dynamically (PATH_MAX), ensuring size safety; frees all temps (file_path,
@@ -2584,7 +12214,7 @@ void split_input_string(const char *input, char *file_path, int *line, int *colu
 
   Maintenance Notes:
     - Memory Leaks: Frees file_path and completions on all paths—test with valgrind to confirm no leaks
-      from helpers (e.g., execute_code_completion_command).
+      from helpers (e.g., cc_complete).
     - Buffer Size: PATH_MAX for file_path assumes typical paths—test with long filenames to ensure no
       overflow from split_input_string.
     - Error Tracing: Logs on NULL returns but lacks detail—add specifics (e.g., “split failed”) for
@@ -2607,84 +12237,100 @@ char *processCompletionDataFromString(const char *vimInputString) {
     return NULL;
   }
 
-  // Allocate memory for the result (return value)
-  size_t output_size = strlen(vimInputString) + 50;
-  char *output_to_return = (char *)malloc(output_size * sizeof(char));
-
-  if(output_to_return == NULL) {
-    log_message("fn processCompletionDataFromString: Failed to allocate memory for the result.\n");
-    return NULL;
-  }
-
-  // Dynamically allocate memory for file_path and log_filtered_result
   char *file_path = (char *)malloc(1024 * sizeof(char));  // Maintain original size
 
-  // Check for allocation failures
-
   if(!file_path) {
     log_message("fn processCompletionDataFromString: Failed to allocate memory for internal buffers.\n");
-    free(output_to_return);
-    free(file_path);
     return NULL;
   }
 
+  file_path[0] = '\0';
   int extracted_line = 0;
   int extracted_column = 0;
   // Call split_input_string to split the input string
   split_input_string(vimInputString, file_path, &extracted_line, &extracted_column);
-  // Call the function to execute the code completion command
-  char *result = execute_code_completion_command(file_path, extracted_line, extracted_column);
+  // Run the request on the process-wide default context
+  cc_request request = {.filename = file_path, .line = extracted_line, .column = extracted_column};
+  cc_result result = {CC_STATUS_OK, NULL};
+  cc_status status = cc_complete(cc_default_context(), &request, &result);
+  free(file_path);
+
+  if(status == CC_STATUS_OK) {
+    return result.text;  // To be freed by the caller
+  }
 
-  //printf("result: %s\n", result);
-  if(result) {
-    // Filter and transform the output
-    char *filtered_result = filter_clang_output(result);
-    // printf(" DEBUG: filtered_result: %s\n", filtered_result);
-    // Only accept the first line of the result
-    char *first_line = strtok(filtered_result, "\n");
-    // printf("DEBUG: fn processCompletionDataFromString: first_line: %s\n", first_line);
-    filtered_result = first_line;
+  if(status == CC_STATUS_NO_COMPLETION) {
+    printf("fn processCompletionDataFromString: Failed to filter code completion output.\n");
+  }
 
-    if(filtered_result) {
-      // Copy the result to output_to_return buffer
-      size_t filtered_len = strlen(filtered_result);
+  else {
+    printf("fn processCompletionDataFromString: Failed to execute code completion command.\n");
+  }
 
-      if(filtered_len < output_size) {
-        strncpy(output_to_return, filtered_result, filtered_len);
-        output_to_return[filtered_len] = '\0';  // Ensure null termination
-      }
+  cc_result_free(&result);
+  return NULL;
+}
 
-      else {
-        printf("fn processCompletionDataFromString: Filtered result too large for output buffer.\n");
-        free(result);
-        free(filtered_result);
-        free(output_to_return);
-        free(file_path);
-        return NULL;
-      }
+// Function to process the completion data of several positions of one file from the string
+// "<file> <line> <column> [<line> <column>...]", with one parse per group of positions (cc_complete_batch)
+// Returns one "<line> <column> <completion>" line per position, in the order asked, the completion
+// left out where there is none. The string is dynamically allocated and should be freed by the caller
+// Returns NULL on failure
+char *processBatchCompletionDataFromString(const char *vimInputString) {
+  char *input_copy = vimInputString ? strdup(vimInputString) : NULL;
+  char *save_ptr = NULL;
+  char *file_path = input_copy ? strtok_r(input_copy, " ", &save_ptr) : NULL;
 
-      // Free temporary memory
-      free(result);
-      free(filtered_result);
-      free(file_path);
-      return output_to_return;  // output_to_return to be freed by Vim
-    }
+  if(file_path == NULL) {
+    log_message("fn processBatchCompletionDataFromString: Input string is NULL or empty.\n");
+    free(input_copy);
+    return NULL;
+  }
 
-    else {
-      printf("fn processCompletionDataFromString: Failed to filter code completion output.\n");
-      free(result);
-      free(output_to_return);
-      free(file_path);
-      return NULL;
-    }
+  // Every remaining pair of numbers is a position
+  int count = 0;
+  cc_batch_position *positions = (cc_batch_position *)calloc(strlen(vimInputString) / 4 + 1, sizeof(cc_batch_position));
+  char *line_str = NULL;
+  char *column_str = NULL;
+
+  while(positions && (line_str = strtok_r(NULL, " ", &save_ptr)) != NULL &&
+        (column_str = strtok_r(NULL, " ", &save_ptr)) != NULL) {
+    positions[count].line = atoi(line_str);
+    positions[count].column = atoi(column_str);
+    count++;
   }
 
-  else {
-    printf("fn processCompletionDataFromString: Failed to execute code completion command.\n");
-    free(output_to_return);
-    free(file_path);
+  if(!positions || count == 0 || line_str != NULL) {
+    log_message("fn processBatchCompletionDataFromString: Invalid input format\n");
+    free(positions);
+    free(input_copy);
     return NULL;
   }
+
+  cc_status status = cc_complete_batch(cc_default_context(), file_path, NULL, positions, count);
+  size_t size = 1;
+
+  for(int i = 0; i < count; i++) {
+    size += 32 + (positions[i].result.text ? strlen(positions[i].result.text) + 1 : 0);
+  }
+
+  char *output = status == CC_STATUS_OK ? (char *)malloc(size) : NULL;
+  size_t used = 0;
+
+  for(int i = 0; output && i < count; i++) {
+    const char *text = positions[i].result.status == CC_STATUS_OK ? positions[i].result.text : NULL;
+    used += (size_t)snprintf(output + used, size - used, "%d %d%s%s\n", positions[i].line, positions[i].column,
+                             text ? " " : "", text ? text : "");
+  }
+
+  if(status == CC_STATUS_OK && !output) {
+    log_message("fn processBatchCompletionDataFromString: Failed to allocate memory for the result.\n");
+  }
+
+  cc_batch_free(positions, count);
+  free(positions);
+  free(input_copy);
+  return output;
 }
 
 // Function to write the result to a temporary file and return the file path
@@ -45,6 +45,166 @@ typedef struct {
   // int *path_allocated;  // Track which paths are allocated
 } CodeCompletionCache;
 
+#define MAX_CACHED_PROJECTS 8 // Projects whose parsed .ccls/compile_flags.txt flag sets are kept
+
+// Kind of source file a flag set is meant for. Mirrors the %c/%cpp/%h/%hpp directives of .ccls
+typedef enum {
+  CC_SOURCE_C = 0,       // *.c
+  CC_SOURCE_CPP,         // *.cpp, *.cc, *.cxx, *.C, *.ino, *.pde
+  CC_SOURCE_C_HEADER,    // *.h
+  CC_SOURCE_CPP_HEADER,  // *.hpp, *.hh, *.hxx, *.H
+  CC_SOURCE_KIND_COUNT
+} CCSourceKind;
+
+// Identity of a file on disk; two equal fingerprints mean the file was not modified in between
+typedef struct {
+  unsigned long long device;
+  unsigned long long inode;
+  long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+  int exists;
+} CCFileFingerprint;
+
+// Ordered, duplicate-free list of compiler arguments (each entry is one joined argument, e.g. "-I/usr/include")
+typedef struct {
+  char **args;
+  int count;
+  int capacity;
+} CCFlagList;
+
+// Flag sets of one project, parsed from .ccls and compile_flags.txt
+typedef struct {
+  char project_dir[PATH_MAX];                 // Canonical project root
+  CCFlagList flags[CC_SOURCE_KIND_COUNT];     // One minimal flag set per source kind
+  CCFileFingerprint ccls_fingerprint;         // State of .ccls when the flags were parsed
+  CCFileFingerprint compile_flags_fingerprint; // State of compile_flags.txt when the flags were parsed
+  unsigned long generation;                   // Bumped on every reparse
+  unsigned long last_used;                    // LRU stamp for eviction
+  int is_valid;
+} CCProjectFlags;
+
+// Opaque handle owning the flag caches, compile_commands.json indexes and settings of one client.
+// Every cc_* function taking a context is thread-safe; separate contexts share nothing
+typedef struct cc_context cc_context;
+
+// Settings fixed when the context is created
+typedef struct {
+  char clang_path[PATH_MAX];  // Compiler used for completion and target detection ("clang" when empty)
+  int debounce_ms;            // Wait before launching clang, so a newer request can supersede for free
+  int timeout_ms;             // Wall-clock deadline of a clang run, 0 for the default (10 s), < 0 for none
+  long memory_limit_mb;       // RLIMIT_AS of clang, <= 0 for none
+  int cpu_limit_sec;          // RLIMIT_CPU of clang, <= 0 for none
+  int hedge_ms;               // Wait before a second backend races the first, 0 for the first's p90 latency, < 0 never
+  int ccls_sessions;          // Persistent ccls processes answering signatures of indexed projects, 0 for none
+  int elide_bodies;           // Empty other functions' bodies before clang parses a large file: 0 off, 1 on, 2 also parse whole and compare
+  int modules;                // Load headers as implicit clang modules from a per-user cache (maps generated for project include dirs)
+} cc_settings;
+
+// Outcome of a completion request
+typedef enum {
+  CC_STATUS_OK = 0,
+  CC_STATUS_INVALID_ARGUMENT,  // NULL argument or the file does not exist
+  CC_STATUS_NO_PROJECT,        // No .ccls + compile_flags.txt or compile_commands.json above the file
+  CC_STATUS_CLANG_FAILED,      // clang could not be run or its target could not be detected
+  CC_STATUS_NO_COMPLETION,     // clang ran but offered no completion
+  CC_STATUS_OUT_OF_MEMORY,
+  CC_STATUS_CANCELLED,         // Superseded by a newer request for the same buffer
+  CC_STATUS_TIMEOUT,           // clang was killed at its deadline
+  CC_STATUS_CRASHED,           // The daemon's worker process died serving it, twice
+  CC_STATUS_COUNT
+} cc_status;
+
+// One completion request; line and column are 1-based
+typedef struct {
+  const char *filename;
+  int line;
+  int column;
+  long changedtick;  // b:changedtick of the buffer, 0 when unknown; part of the coalescing key
+  unsigned long generation;  // Per-buffer request number (latest wins), 0 to number by arrival
+  const char *unsaved;       // File holding the editor's text of filename, NULL when filename is current
+} cc_request;
+
+// Result of cc_complete, release with cc_result_free
+typedef struct {
+  cc_status status;
+  char *text;  // First filtered completion, NULL unless status is CC_STATUS_OK
+} cc_result;
+
+// One position of a cc_complete_batch request; line and column are 1-based
+typedef struct {
+  int line;
+  int column;
+  cc_result result;  // Completion at the position, release with cc_batch_free
+} cc_batch_position;
+
+#define CC_MAX_BACKENDS 4      // Completion backends a context can race against each other
+#define CC_LATENCY_BUCKETS 16  // Latency histogram buckets: 0 is < 1 ms, b is [2^(b-1), 2^b) ms, the last is open
+
+// Counters of a context
+typedef struct {
+  unsigned long requests;        // cc_complete calls
+  unsigned long clang_launches;  // clang processes started for completion
+  unsigned long coalesced;       // Requests answered from an identical in-flight request (clang launches saved)
+  unsigned long cancelled;       // Requests superseded by a newer one for the same buffer
+  unsigned long timeouts;        // clang runs killed at their deadline
+  unsigned long background_jobs; // Background children (ccls --index) running in this process
+  unsigned long preemptions;     // Times background work of the user was stopped for an interactive request (user-wide)
+  unsigned long preempted_ms;    // Total time background work of the user spent stopped (user-wide)
+  unsigned long discoveries;     // Include-path discoveries run for unconfigured checkouts
+  unsigned long shared_hits;     // Flag sets taken from the process-shared cache
+  unsigned long hedges;          // Requests for which a second backend was launched
+  unsigned long hedge_wins;      // Hedged requests answered by the second backend
+  unsigned long elisions;        // clang runs on a copy with other functions' bodies elided
+  unsigned long elided_bytes;    // Bytes those copies left out
+  unsigned long elide_checks;    // Elided parses compared with a full parse (elide_bodies 2)
+  unsigned long elide_mismatches; // Compared parses whose answers differed
+  unsigned long elide_ms;        // Time of the compared elided parses
+  unsigned long elide_full_ms;   // Time of the full parses they were compared with
+  unsigned long module_fallbacks; // Modular parses without an answer, run again without modules
+  unsigned long batches;         // cc_complete_batch calls
+  unsigned long batch_positions; // Positions asked for in them
+  unsigned long batch_parses_saved; // Repeated positions answered by the parse of the same position
+  unsigned long latency[CC_MAX_BACKENDS][CC_LATENCY_BUCKETS];  // Finished runs of each backend by duration
+} cc_stats;
+
+// Options of the completion daemon (code_connector_executable --daemon)
+typedef struct {
+  char socket_path[PATH_MAX];  // Empty for cc_daemon_socket_path()
+  int worker_count;            // Worker threads, <= 0 for one per online core
+  int idle_timeout;            // Seconds without requests before exiting, 0 for the default, < 0 never
+  int worker_processes;        // Crash-isolated completion processes, 0 for the default, < 0 to complete in the daemon
+} cc_daemon_options;
+
+// State of the ccls index job of a project
+typedef enum {
+  CC_INDEX_IDLE = 0,  // Never indexed by code_connector
+  CC_INDEX_RUNNING,
+  CC_INDEX_DONE,
+  CC_INDEX_FAILED
+} cc_index_state;
+
+// What an index job re-indexes, decided from the freshness manifest
+typedef enum {
+  CC_INDEX_FULL = 0,     // Every translation unit (first run, configuration or file set changed)
+  CC_INDEX_INCREMENTAL,  // Changed translation units and those including a changed header
+  CC_INDEX_UNCHANGED     // Nothing changed, ccls was not run
+} cc_index_mode;
+
+// Progress of an index job, as recorded in .ccls-cache/code_connector_index.status
+typedef struct {
+  cc_index_state state;
+  cc_index_mode mode;
+  int done;       // Translation units ccls reported as parsed
+  int total;      // Translation units found below the project root
+  long pid;       // Process running the job
+  long started;   // time(NULL) at start
+  long finished;  // time(NULL) at the end, 0 while running
+  int shards;     // ccls processes this run was split into
+} cc_index_status;
+
+typedef void (*cc_index_callback)(const cc_index_status *status, void *user);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -67,6 +227,42 @@ void store_lines(const char *file1, const char *file2, char **lines, char **sort
 
 int compare_strings(const void *a, const void *b);
 
+// .ccls / compile_flags.txt tokenizer and per-project flag sets
+CCSourceKind classify_source_file(const char *filename);
+int get_file_fingerprint(const char *path, CCFileFingerprint *fingerprint);
+int fingerprints_equal(const CCFileFingerprint *a, const CCFileFingerprint *b);
+int flag_list_append(CCFlagList *list, const char *arg);
+void flag_list_free(CCFlagList *list);
+int parse_project_config(const char *project_dir, CCProjectFlags *project);
+void free_project_flags(CCProjectFlags *project);
+
+// compile_commands.json: hashed per-file flag lookup
+int find_compile_database(const char *project_dir, char *json_path, size_t size);
+
+// Reentrant completion API; the legacy entry points below run on cc_default_context()
+void cc_settings_from_environment(cc_settings *settings);
+cc_context *cc_context_create(const cc_settings *settings);
+void cc_context_destroy(cc_context *ctx);
+cc_context *cc_default_context(void);
+cc_status cc_complete(cc_context *ctx, const cc_request *request, cc_result *result);
+void cc_result_free(cc_result *result);
+cc_status cc_complete_batch(cc_context *ctx, const char *filename, const char *unsaved, cc_batch_position *positions,
+                            int count);
+void cc_batch_free(cc_batch_position *positions, int count);
+const char *cc_status_name(cc_status status);
+void cc_context_stats(cc_context *ctx, cc_stats *stats);
+const char *cc_backend_name(int backend);
+int cc_latency_percentile(const unsigned long *histogram, int percent);
+
+// Completion daemon serving cc_complete over a per-user Unix socket
+int cc_daemon_socket_path(char *path, size_t size);
+int cc_daemon_run(const cc_daemon_options *options);
+int cc_daemon_complete(const cc_request *request, cc_result *result);
+int cc_daemon_spawn(const char *executable);
+
+// Language server over stdio (LSP), on the same caches as the daemon
+int cc_lsp_run(int input_fd, int output_fd);
+
 // Function to get the clang target
 int get_clang_target(char *output);
 
@@ -85,11 +281,19 @@ char *filter_clang_output_mswin(const char *input, const char *pre_paren_text, c
 
 int execute_ccls_index(const char *directory);
 
+// ccls index jobs: blocking run with progress reports, and polling from any process
+int cc_index_run(const char *directory, int jobs, cc_index_callback on_progress, void *user);
+int cc_index_progress(const char *directory, cc_index_status *status);
+char *ccls_index_progress(const char *directory);
+
 // Function to split the input string into file path, line, and column
 void split_input_string(const char *input, char *file_path, int *line, int *column);
 
 char *processCompletionDataFromString(const char *vimInputString);
 
+// Batch variant: "<file> <line> <column> [<line> <column>...]" in, one "<line> <column> <completion>" line per position out
+char *processBatchCompletionDataFromString(const char *vimInputString);
+
 // Function to write the result to a temporary file and return the file path
 char *writeResultToTempFile(const char *result);
 
@@ -171,6 +171,130 @@ call GetExecutableAndLibraryPaths()
 
 " --------------------------------------------"
 
+" Persistent language server (`code_connector_executable --lsp`): a buffer's
+" whole text is sent once, later edits as line-range deltas gathered with
+" listener_add(), so a request costs the size of the edit, not of the file.
+" Needs +job and Vim 8.2.4648 (LSP channels); let g:code_connector_lsp = 0
+" to always run the executable on a temporary file instead.
+let s:lsp_channel = v:null
+let s:lsp_buffers = {}
+
+function! s:LspAvailable()
+    if !get(g:, 'code_connector_lsp', 1) || has('win32') || has('win64') || !has('job')
+                \ || !has('patch-8.2.4648') || !exists('*listener_add')
+        return 0
+    endif
+    if s:lsp_channel isnot v:null && ch_status(s:lsp_channel) ==# 'open'
+        return 1
+    endif
+    " (Re)start the server; buffers it knew have to be sent again
+    for bufnr in keys(s:lsp_buffers)
+        call listener_remove(s:lsp_buffers[bufnr].listener)
+    endfor
+    let s:lsp_buffers = {}
+    let s:lsp_channel = v:null
+    let job = job_start([s:codeConnectorTestExecutable, '--lsp'],
+                \ {'in_mode': 'lsp', 'out_mode': 'lsp', 'err_io': 'null'})
+    if job_status(job) !=# 'run'
+        return 0
+    endif
+    let channel = job_getchannel(job)
+    let reply = ch_evalexpr(channel, {'method': 'initialize',
+                \ 'params': {'processId': getpid(), 'rootUri': v:null,
+                \ 'capabilities': {'general': {'positionEncodings': ['utf-8']}}}}, {'timeout': 5000})
+    if type(reply) != v:t_dict || !has_key(reply, 'result')
+        call job_stop(job)
+        return 0
+    endif
+    call ch_sendexpr(channel, {'method': 'initialized', 'params': {}})
+    let s:lsp_channel = channel
+    return 1
+endfunction
+
+" listener_add() callback: one delta per recorded change, in order. Each change
+" is replaced by the lines it left in the buffer, which later changes (below
+" it) have not moved; when they overlap, the whole text is sent instead.
+function! s:LspBufferChanged(bufnr, start, end, added, changes)
+    if !has_key(s:lsp_buffers, a:bufnr) || s:lsp_channel is v:null || ch_status(s:lsp_channel) !=# 'open'
+        return
+    endif
+    let state = s:lsp_buffers[a:bufnr]
+    let deltas = []
+    let below = 0
+    for change in a:changes
+        if change.lnum < below
+            let deltas = [{'text': join(getbufline(a:bufnr, 1, '$'), "\n") . "\n"}]
+            break
+        endif
+        let last = change.end - 1 + change.added
+        let lines = last >= change.lnum ? getbufline(a:bufnr, change.lnum, last) : []
+        call add(deltas, {'range': {'start': {'line': change.lnum - 1, 'character': 0},
+                    \ 'end': {'line': change.end - 1, 'character': 0}},
+                    \ 'text': empty(lines) ? '' : join(lines, "\n") . "\n"})
+        let below = last + 1
+    endfor
+    let state.version += 1
+    call ch_sendexpr(s:lsp_channel, {'method': 'textDocument/didChange',
+                \ 'params': {'textDocument': {'uri': state.uri, 'version': state.version}, 'contentChanges': deltas}})
+endfunction
+
+" Sends the whole buffer the first time, otherwise the deltas not sent yet
+function! s:LspSyncBuffer(bufnr)
+    if has_key(s:lsp_buffers, a:bufnr)
+        call listener_flush(a:bufnr)
+        return s:lsp_buffers[a:bufnr]
+    endif
+    let path = fnamemodify(bufname(a:bufnr), ':p')
+    let state = {'uri': 'file://' . substitute(path, '[^A-Za-z0-9/._~-]', '\=printf("%%%02X", char2nr(submatch(0)))', 'g'),
+                \ 'version': 1}
+    call ch_sendexpr(s:lsp_channel, {'method': 'textDocument/didOpen',
+                \ 'params': {'textDocument': {'uri': state.uri, 'languageId': &filetype ==# 'cpp' ? 'cpp' : 'c',
+                \ 'version': 1, 'text': join(getbufline(a:bufnr, 1, '$'), "\n") . "\n"}}})
+    let state.listener = listener_add(function('s:LspBufferChanged'), a:bufnr)
+    let s:lsp_buffers[a:bufnr] = state
+    return state
+endfunction
+
+function! s:LspForgetBuffer(bufnr)
+    if has_key(s:lsp_buffers, a:bufnr)
+        let state = remove(s:lsp_buffers, a:bufnr)
+        call listener_remove(state.listener)
+        if s:lsp_channel isnot v:null && ch_status(s:lsp_channel) ==# 'open'
+            call ch_sendexpr(s:lsp_channel, {'method': 'textDocument/didClose', 'params': {'textDocument': {'uri': state.uri}}})
+        endif
+    endif
+endfunction
+
+augroup CodeConnectorLsp
+    autocmd!
+    autocmd BufUnload * call s:LspForgetBuffer(str2nr(expand('<abuf>')))
+augroup END
+
+" Returns the completed cursor line as the executable prints it ([] when there
+" is no completion), or v:null when the server cannot be used
+function! s:LspComplete(line_num, col_num)
+    if !s:LspAvailable() || expand('%:p') ==# ''
+        return v:null
+    endif
+    let bufnr = bufnr('%')
+    let state = s:LspSyncBuffer(bufnr)
+    let reply = ch_evalexpr(s:lsp_channel, {'method': 'textDocument/completion',
+                \ 'params': {'textDocument': {'uri': state.uri}, 'position': {'line': a:line_num - 1, 'character': a:col_num}}},
+                \ {'timeout': 30000})
+    if type(reply) != v:t_dict || !has_key(reply, 'result')
+        " Dropped by the server (or no answer): send the whole buffer next time
+        call s:LspForgetBuffer(bufnr)
+        return v:null
+    endif
+    let items = type(reply.result) == v:t_dict ? get(reply.result, 'items', []) : []
+    if empty(items) || type(get(items[0], 'data', v:null)) != v:t_dict || type(get(items[0].data, 'line', v:null)) != v:t_string
+        return []
+    endif
+    return split(items[0].data.line, "\n")
+endfunction
+
+" --------------------------------------------"
+
 " Define the function to call the Clang-based executable
 function! CallCodeCompletionExec()
     " Define the log file path
@@ -190,14 +314,23 @@ function! CallCodeCompletionExec()
     let tmpfilename = filename . '.tmp.' . extension
     let tmpfilepath = filedir . '/' . tmpfilename  " Full path to the temporary file
 
+    " Get the current cursor position
+    let line_num = line('.')
+    let col_num = col('.') - 1    " Important adjustment
+
+    " The language server already has the buffer: no file is written
+    let processed_output = s:LspComplete(line_num, col_num)
+    if processed_output isnot v:null
+        call writefile(['Input data: ' . filepath . ' ' . line_num . ' ' . col_num . ' (lsp)'], s:logFilePath, 'a')
+        call s:InsertCompletion(processed_output)
+        return
+    endif
+
     " Write the current buffer to the temporary file
     execute 'silent write! ' . tmpfilepath
     "echom "Temporary file saved to: " . tmpfilepath
 
-    " Get the current cursor position
-    let line_num = line('.')
-    let col_num = col('.') - 1    " Important adjustment
-    let combined_input = tmpfilepath . ' ' . line_num . ' ' . col_num
+    let combined_input = tmpfilepath . ' ' . line_num . ' ' . col_num . ' ' . b:changedtick
 
     " Log the input data
     call writefile(['Input data: ' . combined_input], s:logFilePath, 'a')
@@ -228,8 +361,16 @@ function! CallCodeCompletionExec()
     let processed_output = systemlist(s:codeConnectorTestExecutable . ' ' . combined_input)
     "echom "Produced by the executable: " . join(processed_output, "\n")
 
+    call s:InsertCompletion(processed_output)
+
+    " Clean up: Delete the temporary file after logging
+    call delete(tmpfilepath)
+endfunction
+
+" Replaces the cursor line with the completed line(s)
+function! s:InsertCompletion(processed_output)
     " Convert the output to the correct encoding
-    let processed_output = map(processed_output, 'iconv(v:val, "UTF-8", "UTF-8")')
+    let processed_output = map(a:processed_output, 'iconv(v:val, "UTF-8", "UTF-8")')
 
     " Log the output data
     call writefile(['Output data: ' . join(processed_output, "\n")], s:logFilePath, 'a')
@@ -250,9 +391,6 @@ function! CallCodeCompletionExec()
         " Log the error if the output is empty
         call writefile(['Error: No output from the executable'], s:logFilePath, 'a')
     endif
-
-    " Clean up: Delete the temporary file after logging
-    call delete(tmpfilepath)
 endfunction
 
 " Bind the function to a key in insert mode
@@ -476,9 +614,55 @@ if !(has('win32') || has('win64'))
 		if curr_dir == ''
 			let curr_dir = '.'
 		endif
-		execute 'lcd ' . curr_dir
-		call libcallnr(s:codeConnectorSharedLibrary, 'execute_ccls_index', curr_dir)
-		execute 'lcd -'
+		let index_dir = fnamemodify(curr_dir, ':p')
+		" ccls runs in the background; progress is shown by CodeConnectorIndexStatus()
+		if has('job')
+			let s:ccls_index_job = job_start([s:codeConnectorTestExecutable, '--index', index_dir],
+						\ {'out_cb': function('s:CclsIndexMessage'), 'in_io': 'null', 'err_io': 'null'})
+		else
+			call libcallnr(s:codeConnectorSharedLibrary, 'execute_ccls_index', index_dir)
+			if has('timers')
+				let s:ccls_index_dir = index_dir
+				call timer_start(500, function('s:CclsIndexPoll'), {'repeat': -1})
+			endif
+		endif
+	endfunction
+
+	let g:code_connector_index_status = ''
+
+	" Channel callback: one "PROGRESS|DONE|FAILED <done> <total>" line per progress report
+	function! s:CclsIndexMessage(channel, msg)
+		call s:CclsIndexUpdate(split(a:msg))
+	endfunction
+
+	" Timer callback without +job: polls the status file through the shared library
+	function! s:CclsIndexPoll(timer)
+		let progress = split(libcall(s:codeConnectorSharedLibrary, 'ccls_index_progress', s:ccls_index_dir))
+		if len(progress) == 3
+			call s:CclsIndexUpdate([toupper(progress[0] ==# 'running' ? 'progress' : progress[0])] + progress[1:])
+		endif
+		if progress[0] !=# 'running'
+			call timer_stop(a:timer)
+		endif
+	endfunction
+
+	function! s:CclsIndexUpdate(fields)
+		if len(a:fields) != 3
+			return
+		endif
+		if a:fields[0] ==# 'PROGRESS'
+			let g:code_connector_index_status = 'ccls ' . (a:fields[2] > 0 ? a:fields[1] * 100 / a:fields[2] : 0) . '%'
+		elseif a:fields[0] ==# 'DONE'
+			let g:code_connector_index_status = 'ccls done'
+		else
+			let g:code_connector_index_status = 'ccls failed'
+		endif
+		redrawstatus!
+	endfunction
+
+	" For the status line: set statusline+=%{CodeConnectorIndexStatus()}
+	function! CodeConnectorIndexStatus()
+		return g:code_connector_index_status
 	endfunction
 endif
 